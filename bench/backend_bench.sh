@@ -0,0 +1,72 @@
+#!/bin/sh
+# Compares event loop backends and transfer engines: system calls per MB
+# (counted with ptrace by syscount) and request latency percentiles.
+#
+# usage: bench/backend_bench.sh [size_mb] [requests]
+#   SERVER    server binary (default ./server_app)
+#   BACKENDS  backends to compare (default "poll epoll uring")
+#   ENGINES   transfer engines to compare (default "copy sendfile uring mmap")
+#   PORT      first listening port, every run uses the next one so a
+#             lingering socket of the previous run never gets in the way
+#             (default 12399)
+set -e
+
+SIZE_MB=${1:-64}
+REQUESTS=${2:-20}
+SERVER=${SERVER:-./server_app}
+BACKENDS=${BACKENDS:-"poll epoll uring"}
+ENGINES=${ENGINES:-"copy sendfile uring mmap"}
+PORT=${PORT:-12399}
+CC=${CC:-gcc}
+OUT=$(mktemp -d /tmp/server_bench.XXXXXX)
+BENCH_DIR=$(dirname "$0")
+
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 -o "$OUT/syscount" "$BENCH_DIR/syscount.c"
+$CC -O2 -o "$OUT/bench_client" "$BENCH_DIR/bench_client.c"
+
+mkdir -p "$OUT/storage"
+dd if=/dev/urandom of="$OUT/storage/bench.bin" bs=1M count="$SIZE_MB" \
+  status=none
+SIZE=$((SIZE_MB * 1024 * 1024))
+
+printf "%-8s %-9s %14s %10s %10s %10s\n" backend engine syscalls/MB MB/s \
+  p50_ms p99_ms
+for backend in $BACKENDS; do
+  for engine in $ENGINES; do
+    # the uring engine posts on the ring of the uring backend, elsewhere it
+    # falls back to copy
+    if [ "$engine" = uring ] && [ "$backend" != uring ]; then
+      continue
+    fi
+    # latency and throughput, untraced
+    PORT=$((PORT + 1))
+    $SERVER -b "$backend" -e "$engine" -p $PORT -s "$OUT/storage" \
+      >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    result=$("$OUT/bench_client" -p $PORT -f bench.bin -s $SIZE -n $REQUESTS)
+    kill $pid
+    wait $pid 2>/dev/null || true
+
+    # system calls, traced from the first request to the last
+    PORT=$((PORT + 1))
+    "$OUT/syscount" $SERVER -b "$backend" -e "$engine" -p $PORT \
+      -s "$OUT/storage" >/dev/null 2>"$OUT/syscount.log" &
+    pid=$!
+    sleep 0.5
+    kill -USR1 $pid
+    "$OUT/bench_client" -p $PORT -f bench.bin -s $SIZE -n $REQUESTS >/dev/null
+    kill -TERM $pid
+    wait $pid 2>/dev/null || true
+    syscalls=$(sed -n 's/^syscalls: //p' "$OUT/syscount.log")
+
+    echo "$result" | awk -v b="$backend" -v e="$engine" -v s="$syscalls" \
+      -v mb=$((SIZE_MB * REQUESTS)) '{
+        for (i = 1; i <= NF; i++) { split($i, kv, "="); r[kv[1]] = kv[2] }
+        printf "%-8s %-9s %14.1f %10s %10s %10s\n", b, e, s / mb,
+          r["mb_per_sec"], r["p50_ms"], r["p99_ms"]
+      }'
+  done
+done
@@ -0,0 +1,157 @@
+/**
+ * @file bench_client.c
+ * @brief downloads a file repeatedly, one connection per request, and
+ * reports throughput and request latency percentiles
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_CLIENT_BUFF_SIZE (256 * 1024) // receive buffer size
+
+/**
+ * @brief returns a monotonic timestamp
+ *
+ * @return nanoseconds
+ */
+static uint64_t _now_ns(void) {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief orders latencies for the percentiles
+ */
+static int _compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief downloads a file over a new connection, the server sends the file
+ * followed by a single EOF marker byte
+ *
+ * @param[in] address server address
+ * @param[in] name requested filename
+ * @param[in] size expected file size
+ * @param[in] buffer scratch receive buffer
+ * @return 0 success, <0 error
+ */
+static int _download(const struct sockaddr_in *address, const char *name,
+                     size_t size, uint8_t *buffer) {
+  int err = 0, fd = -1;
+  uint8_t request[2 + 255] = {0x01}; // CMD_DOWNLOAD_FILE
+  size_t name_len = strlen(name), received = 0;
+  ssize_t n = 0;
+
+  do {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        connect(fd, (const struct sockaddr *)address, sizeof(*address)) < 0) {
+      err = -errno;
+      break;
+    }
+
+    request[1] = name_len;
+    memcpy(&request[2], name, name_len);
+    if (send(fd, request, 2 + name_len, 0) != 2 + name_len) {
+      err = -EIO;
+      break;
+    }
+
+    while (received < size + 1) {
+      n = recv(fd, buffer, BENCH_CLIENT_BUFF_SIZE, 0);
+      if (n <= 0) {
+        err = n < 0 ? -errno : -ECONNRESET;
+        break;
+      }
+      received += n;
+    }
+  } while (0);
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  return err;
+}
+
+int main(int argc, char **argv) {
+  int opt = 0, port = 12345, requests = 10;
+  const char *host = "127.0.0.1", *name = NULL;
+  size_t size = 0;
+  struct sockaddr_in address = {.sin_family = AF_INET};
+
+  while ((opt = getopt(argc, argv, "a:p:f:s:n:")) != -1) {
+    switch (opt) {
+    case 'a':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'f':
+      name = optarg;
+      break;
+    case 's':
+      size = strtoull(optarg, NULL, 10);
+      break;
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    default:
+      name = NULL;
+      break;
+    }
+  }
+
+  if (!name || requests <= 0) {
+    fprintf(stderr,
+            "usage: %s -f <file> -s <size> [-n requests] [-a host] [-p port]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  address.sin_port = htons(port);
+  inet_pton(AF_INET, host, &address.sin_addr);
+
+  uint8_t *buffer = malloc(BENCH_CLIENT_BUFF_SIZE);
+  uint64_t *latency = calloc(requests, sizeof(*latency));
+  uint64_t begin = _now_ns();
+
+  for (int i = 0; i < requests; i++) {
+    uint64_t start = _now_ns();
+    int err = _download(&address, name, size, buffer);
+    if (err < 0) {
+      fprintf(stderr, "request %d failed %d\n", i, err);
+      return EXIT_FAILURE;
+    }
+    latency[i] = _now_ns() - start;
+  }
+
+  double seconds = (_now_ns() - begin) / 1e9;
+  qsort(latency, requests, sizeof(*latency), _compare);
+  printf("requests=%d bytes=%zu seconds=%.3f mb_per_sec=%.1f p50_ms=%.3f "
+         "p99_ms=%.3f\n",
+         requests, size * requests, seconds,
+         size * requests / seconds / (1024 * 1024),
+         latency[requests / 2] / 1e6, latency[(requests * 99) / 100] / 1e6);
+
+  free(buffer);
+  free(latency);
+  return EXIT_SUCCESS;
+}
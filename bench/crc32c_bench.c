@@ -0,0 +1,91 @@
+/**
+ * @file crc32c_bench.c
+ * @brief measures the throughput of every CRC32C kernel the CPU runs, on one
+ * core, for a few buffer sizes, after checking them against the tables
+ *
+ * usage: gcc -O2 -D_GNU_SOURCE -Isrc -o crc32c_bench bench/crc32c_bench.c \
+ *          src/crc32c.c -pthread && ./crc32c_bench [total_mb]
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "crc32c.h"
+
+#include <time.h>
+
+#define CRC32C_BENCH_SIZE_MAX (1024 * 1024) // largest buffer measured
+
+static const size_t _sizes[] = {64, 1024, 4096, 65536, CRC32C_BENCH_SIZE_MAX};
+
+/**
+ * @brief returns the monotonic time
+ *
+ * @return time in seconds
+ */
+static double _now(void) {
+  struct timespec ts = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1024) << 20;
+  uint8_t *data = malloc(CRC32C_BENCH_SIZE_MAX + 7);
+  uint32_t crc = 0, expected = 0;
+  double start = 0, elapsed = 0;
+
+  if (!data) {
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < CRC32C_BENCH_SIZE_MAX + 7; i++) {
+    data[i] = rand();
+  }
+
+  // known answer, then every kernel against the tables at odd sizes/offsets
+  if (crc32c(0, "123456789", 9) != 0xE3069283) {
+    fprintf(stderr, "crc32c check value mismatch\n");
+    return 1;
+  }
+  for (int kernel = 0; kernel < CRC32C_KERNELS; kernel++) {
+    if (!crc32c_kernel_available(kernel)) {
+      continue;
+    }
+    for (size_t size = 0; size < 3 * CRC32C_LANE_SIZE + 40; size += 37) {
+      expected = crc32c_kernel_run(CRC32C_KERNEL_TABLE, 0, data + 3, size);
+      crc = crc32c_kernel_run(kernel, 0, data + 3, size);
+      if (crc != expected ||
+          crc32c_combine(crc32c(0, data, 3), crc, size) !=
+              crc32c(0, data, size + 3)) {
+        fprintf(stderr, "%s mismatch at %zu bytes\n",
+                crc32c_kernel_name(kernel), size);
+        return 1;
+      }
+    }
+  }
+
+  printf("%-14s %8s %10s\n", "kernel", "size", "GB/s");
+  for (int kernel = 0; kernel < CRC32C_KERNELS; kernel++) {
+    if (!crc32c_kernel_available(kernel)) {
+      printf("%-14s %8s %10s\n", crc32c_kernel_name(kernel), "-",
+             "unavailable");
+      continue;
+    }
+    for (size_t i = 0; i < sizeof(_sizes) / sizeof(_sizes[0]); i++) {
+      start = _now();
+      for (size_t done = 0; done < total; done += _sizes[i]) {
+        crc = crc32c_kernel_run(kernel, crc, data, _sizes[i]);
+      }
+      elapsed = _now() - start;
+      printf("%-14s %8zu %10.2f\n", crc32c_kernel_name(kernel), _sizes[i],
+             total / elapsed / 1e9);
+    }
+  }
+  printf("picked %s (crc %08x)\n", crc32c_kernel_name(crc32c_kernel()), crc);
+
+  free(data);
+  return 0;
+}
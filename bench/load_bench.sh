@@ -0,0 +1,53 @@
+#!/bin/sh
+# Runs the load generator scenarios against a fresh server and writes their
+# results as one JSON array, named after the commit so runs can be diffed.
+#
+# usage: bench/load_bench.sh [seconds]
+#   SERVER    server binary (default ./server_app)
+#   LOAD_GEN  load generator (default ./load_gen, built by make bench)
+#   CORPUS    corpus directory, generated once and kept (default bench_corpus)
+#   SIZES     small:medium:large file sizes (default 4096:1048576:2147483648)
+#   ARGS      extra server options, e.g. "-w 4 -e sendfile"
+#   PORT      first listening port, every scenario uses the next one
+#             (default 12499)
+set -e
+
+SECONDS_RUN=${1:-10}
+SERVER=${SERVER:-./server_app}
+LOAD_GEN=${LOAD_GEN:-./load_gen}
+CORPUS=${CORPUS:-bench_corpus}
+SIZES=${SIZES:-4096:1048576:2147483648}
+PORT=${PORT:-12499}
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=bench-$LABEL.json
+
+mkdir -p "$CORPUS"
+"$LOAD_GEN" -s "$CORPUS" -g -S "$SIZES" -m 1:1:1 -d 0.001 -c 1 -t 1 \
+  -p 1 >/dev/null
+
+# name, then the load generator options of the scenario
+run() {
+  name=$1
+  shift
+  PORT=$((PORT + 1))
+  $SERVER -p $PORT -s "$CORPUS" -m 4096 -l error $ARGS >/dev/null 2>&1 &
+  pid=$!
+  sleep 0.3
+  echo "$name" >&2
+  [ -z "$separator" ] || printf ",\n" >>"$OUT"
+  separator=1
+  "$LOAD_GEN" -p $PORT -S "$SIZES" -d "$SECONDS_RUN" -N "$name" \
+    -l "$LABEL" "$@" >>"$OUT"
+  kill $pid
+  wait $pid 2>/dev/null || true
+}
+
+separator=
+echo "[" >"$OUT"
+run small-connect -m 1:0:0 -c 1000 -k 1
+run small-keepalive -m 1:0:0 -c 1000 -k 0
+run medium -m 0:1:0 -c 64 -k 0
+run large -m 0:0:1 -c 4 -t 4 -k 0
+run mixed -m 90:9:1 -c 1000 -k 1
+echo "]" >>"$OUT"
+echo "results in $OUT" >&2
@@ -0,0 +1,747 @@
+/**
+ * @file load_gen.c
+ * @brief loopback load generator: threads holding thousands of connections
+ * download files of a generated corpus with CMD_DOWNLOAD_FILE and report
+ * throughput, connections/sec, time to first byte and latency percentiles
+ * as JSON
+ *
+ * usage: make bench && ./load_gen --corpus <dir> --generate [options]
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "commands.h"
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define LOAD_GEN_BUFF_SIZE (256 * 1024)    // receive buffer of each thread
+#define LOAD_GEN_EVENTS 256                // events handled per epoll_wait
+#define LOAD_GEN_TICK_MS 10                // epoll_wait timeout when idle
+#define LOAD_GEN_THREADS_MAX 256           // upper bound on threads
+#define LOAD_GEN_WRITE_SIZE (1024 * 1024)  // corpus bytes written at once
+#define LOAD_GEN_EOF_SIZE 1                // marker byte after a v1 reply
+
+enum load_file_t {
+  LOAD_FILE_SMALL,
+  LOAD_FILE_MEDIUM,
+  LOAD_FILE_LARGE,
+  LOAD_FILES
+};
+
+enum load_state_t {
+  LOAD_STATE_IDLE,       // closed, reopened on the next tick
+  LOAD_STATE_CONNECTING, // waiting for the handshake
+  LOAD_STATE_RECEIVING,  // request sent, reading the reply
+};
+
+// growable array of nanosecond samples
+struct load_samples_t {
+  uint64_t *values; // samples, in arrival order until sorted
+  size_t count;     // samples recorded
+  size_t capacity;  // samples that fit
+};
+
+struct load_conn_t {
+  int fd;                  // socket, -1 while idle
+  enum load_state_t state; // where the connection stands
+  enum load_file_t file;   // file being downloaded
+  size_t expected;         // bytes of the reply
+  size_t received;         // bytes of the reply received
+  unsigned int requests;   // requests issued on this connection
+  uint64_t connect_start;  // monotonic ns the connect was issued at
+  uint64_t request_start;  // monotonic ns the request was sent at
+  bool first_byte;         // part of the reply received
+};
+
+struct load_thread_t {
+  pthread_t thread;                          // runs the connections
+  int epfd;                                  // epoll set of the connections
+  struct load_conn_t *conns;                 // connections of this thread
+  size_t count;                              // number of connections
+  unsigned int seed;                         // picks the files
+  uint64_t requests;                         // replies received in full
+  uint64_t errors;                           // connections that failed
+  uint64_t connections;                      // connections established
+  uint64_t bytes;                            // file bytes received
+  struct load_samples_t connect;             // connect latency
+  struct load_samples_t ttfb[LOAD_FILES];    // time to first byte, per file
+  struct load_samples_t latency[LOAD_FILES]; // request latency, per file
+  uint8_t *buffer;                           // receive buffer, data dropped
+};
+
+static struct {
+  struct sockaddr_in address;   // server address
+  const char *corpus;           // corpus directory
+  const char *output;           // JSON output, NULL for stdout
+  const char *label;            // recorded as is, e.g. the commit
+  const char *name;             // name of the scenario
+  bool generate;                // write the corpus files that are missing
+  long threads;                 // threads of the generator
+  long connections;             // connections held at once
+  long per_connection;          // requests per connection, 0 unlimited
+  double duration;              // seconds of load
+  uint64_t requests;            // stop after this many requests, 0 none
+  unsigned int mix[LOAD_FILES]; // weights of the files
+  size_t sizes[LOAD_FILES];     // sizes of the files
+  bool stop;                    // threads wind down
+  uint64_t completed;           // requests completed by all threads
+} _load = {
+    .corpus = "bench_corpus",
+    .name = "default",
+    .label = "",
+    .threads = 4,
+    .connections = 1000,
+    .per_connection = 1,
+    .duration = 10,
+    .mix = {90, 9, 1},
+    .sizes = {4 * 1024, 1024 * 1024, 2ULL * 1024 * 1024 * 1024},
+};
+
+static const char *_names[LOAD_FILES] = {"small", "medium", "large"};
+
+/**
+ * @brief returns a monotonic timestamp
+ *
+ * @return nanoseconds
+ */
+static uint64_t _now_ns(void) {
+  struct timespec ts = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief orders samples for the percentiles
+ */
+static int _compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief appends a sample, dropped if memory runs out
+ *
+ * @param[in] samples points to the samples
+ * @param[in] value sample in nanoseconds
+ */
+static void _sample_add(struct load_samples_t *samples, uint64_t value) {
+  uint64_t *values = NULL;
+  size_t capacity = samples->capacity ? 2 * samples->capacity : 1024;
+
+  if (samples->count == samples->capacity) {
+    values = realloc(samples->values, capacity * sizeof(*values));
+    if (!values) {
+      return;
+    }
+    samples->values = values;
+    samples->capacity = capacity;
+  }
+  samples->values[samples->count++] = value;
+}
+
+/**
+ * @brief appends the samples of a thread
+ *
+ * @param[out] to samples receiving them
+ * @param[in] from samples to be appended
+ */
+static void _samples_merge(struct load_samples_t *to,
+                           const struct load_samples_t *from) {
+  for (size_t i = 0; i < from->count; i++) {
+    _sample_add(to, from->values[i]);
+  }
+}
+
+/**
+ * @brief writes the p50, p99 and p999 of sorted samples as a JSON object
+ *
+ * @param[in] out stream written to
+ * @param[in] samples points to the samples, sorted
+ */
+static void _percentiles_write(FILE *out,
+                               const struct load_samples_t *samples) {
+  const double percents[] = {0.50, 0.99, 0.999};
+  const char *names[] = {"p50", "p99", "p999"};
+  size_t index = 0;
+
+  fprintf(out, "{");
+  for (size_t i = 0; i < 3; i++) {
+    index = samples->count * percents[i];
+    index = index < samples->count ? index : samples->count - 1;
+    fprintf(out, "%s\"%s\": %.3f", i ? ", " : "", names[i],
+            samples->count ? samples->values[index] / 1e6 : 0.0);
+  }
+  fprintf(out, "}");
+}
+
+/**
+ * @brief writes a corpus file of the given size unless it is already there,
+ * the data is random so that compression and caching see real content
+ *
+ * @param[in] dir corpus directory
+ * @param[in] file file to be written
+ * @return 0 success, <0 error
+ */
+static int _corpus_generate(const char *dir, enum load_file_t file) {
+  char path[512];
+  struct stat st = {};
+  uint8_t *block = NULL;
+  size_t size = _load.sizes[file], written = 0, chunk = 0;
+  ssize_t n = 0;
+  int fd = -1, err = 0;
+
+  snprintf(path, sizeof(path), "%s/%s.bin", dir, _names[file]);
+  if (!stat(path, &st) && (size_t)st.st_size == size) {
+    return 0;
+  }
+
+  block = malloc(LOAD_GEN_WRITE_SIZE);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (!block || fd < 0) {
+    free(block);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return fd < 0 ? -errno : -ENOMEM;
+  }
+
+  srand(file + 1);
+  for (size_t i = 0; i < LOAD_GEN_WRITE_SIZE; i++) {
+    block[i] = rand();
+  }
+
+  fprintf(stderr, "writing %s, %zu bytes\n", path, size);
+  while (written < size) {
+    chunk = size - written < LOAD_GEN_WRITE_SIZE ? size - written
+                                                 : LOAD_GEN_WRITE_SIZE;
+    block[0] = written >> 20; // blocks differ, no dedup across them
+    n = write(fd, block, chunk);
+    if (n <= 0) {
+      err = n < 0 ? -errno : -EIO;
+      break;
+    }
+    written += n;
+  }
+
+  close(fd);
+  free(block);
+  return err;
+}
+
+/**
+ * @brief picks the file of the next request by the weights of the mix
+ *
+ * @param[in] thread points to the thread
+ * @return file to be requested
+ */
+static enum load_file_t _file_pick(struct load_thread_t *thread) {
+  unsigned int total = 0, pick = 0;
+
+  for (int i = 0; i < LOAD_FILES; i++) {
+    total += _load.mix[i];
+  }
+  pick = rand_r(&thread->seed) % total;
+  for (int i = 0; i < LOAD_FILES; i++) {
+    if (pick < _load.mix[i]) {
+      return i;
+    }
+    pick -= _load.mix[i];
+  }
+  return LOAD_FILE_SMALL;
+}
+
+/**
+ * @brief closes a connection, it is reopened on the next tick
+ *
+ * @param[in] thread points to the thread
+ * @param[in] conn points to the connection
+ */
+static void _conn_close(struct load_thread_t *thread,
+                        struct load_conn_t *conn) {
+  if (conn->fd >= 0) {
+    epoll_ctl(thread->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+  }
+  conn->fd = -1;
+  conn->state = LOAD_STATE_IDLE;
+}
+
+/**
+ * @brief starts a non-blocking connect to the server
+ *
+ * @param[in] thread points to the thread
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error
+ */
+static int _conn_open(struct load_thread_t *thread, struct load_conn_t *conn) {
+  struct epoll_event event = {.events = EPOLLOUT, .data.ptr = conn};
+  int err = 0;
+
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    return -errno;
+  }
+
+  conn->connect_start = _now_ns();
+  conn->requests = 0;
+  err = connect(conn->fd, (const struct sockaddr *)&_load.address,
+                sizeof(_load.address));
+  if (err < 0 && errno != EINPROGRESS) {
+    err = -errno;
+    _conn_close(thread, conn);
+    return err;
+  }
+
+  if (epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+    err = -errno;
+    _conn_close(thread, conn);
+    return err;
+  }
+  conn->state = LOAD_STATE_CONNECTING;
+  return 0;
+}
+
+/**
+ * @brief sends the next request of a connection, the request fits in the
+ * socket buffer of a fresh or drained connection
+ *
+ * @param[in] thread points to the thread
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error
+ */
+static int _conn_request(struct load_thread_t *thread,
+                         struct load_conn_t *conn) {
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+  uint8_t request[2 + 32] = {CMD_DOWNLOAD_FILE};
+  int length = 0;
+
+  conn->file = _file_pick(thread);
+  length = snprintf((char *)request + 2, sizeof(request) - 2, "%s.bin",
+                    _names[conn->file]);
+  request[1] = length;
+  conn->expected = _load.sizes[conn->file] + LOAD_GEN_EOF_SIZE;
+  conn->received = 0;
+  conn->first_byte = false;
+  conn->requests++;
+  conn->request_start = _now_ns();
+
+  if (send(conn->fd, request, 2 + length, MSG_NOSIGNAL) != 2 + length) {
+    return -EIO;
+  }
+  if (epoll_ctl(thread->epfd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+    return -errno;
+  }
+  conn->state = LOAD_STATE_RECEIVING;
+  return 0;
+}
+
+/**
+ * @brief handles the events of a connection
+ *
+ * @param[in] thread points to the thread
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error and the connection must be closed
+ */
+static int _conn_process(struct load_thread_t *thread,
+                         struct load_conn_t *conn) {
+  int err = 0;
+  socklen_t err_size = sizeof(err);
+  uint64_t now = 0;
+  ssize_t n = 0;
+
+  if (conn->state == LOAD_STATE_CONNECTING) {
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_size) < 0 ||
+        err) {
+      return -ECONNREFUSED;
+    }
+    thread->connections++;
+    _sample_add(&thread->connect, _now_ns() - conn->connect_start);
+    return _conn_request(thread, conn);
+  }
+
+  while (1) {
+    n = recv(conn->fd, thread->buffer, LOAD_GEN_BUFF_SIZE, 0);
+    if (n < 0) {
+      return errno == EAGAIN ? 0 : -errno;
+    } else if (!n || conn->received + n > conn->expected) {
+      return -ECONNRESET; // closed early, or more than the file was sent
+    }
+
+    now = _now_ns();
+    if (!conn->first_byte) {
+      conn->first_byte = true;
+      _sample_add(&thread->ttfb[conn->file], now - conn->request_start);
+    }
+
+    conn->received += n;
+    if (conn->received < conn->expected) {
+      continue;
+    }
+
+    _sample_add(&thread->latency[conn->file], now - conn->request_start);
+    thread->requests++;
+    thread->bytes += _load.sizes[conn->file];
+    if (_load.requests &&
+        __atomic_add_fetch(&_load.completed, 1, __ATOMIC_RELAXED) >=
+            _load.requests) {
+      __atomic_store_n(&_load.stop, true, __ATOMIC_RELAXED);
+    }
+
+    if (_load.per_connection && conn->requests >= _load.per_connection) {
+      _conn_close(thread, conn); // reopened on the next tick
+      return 0;
+    }
+    return _conn_request(thread, conn);
+  }
+}
+
+/**
+ * @brief runs the connections of a thread until the load stops
+ *
+ * @param[in] arg points to the thread
+ * @return NULL
+ */
+static void *_thread_run(void *arg) {
+  struct load_thread_t *thread = arg;
+  struct epoll_event events[LOAD_GEN_EVENTS];
+  struct load_conn_t *conn = NULL;
+  int count = 0;
+  bool idle = true;
+
+  while (!__atomic_load_n(&_load.stop, __ATOMIC_RELAXED)) {
+    // closed connections come back here, failed ones a tick later
+    if (idle) {
+      idle = false;
+      for (size_t i = 0; i < thread->count; i++) {
+        if (thread->conns[i].state == LOAD_STATE_IDLE &&
+            _conn_open(thread, &thread->conns[i]) < 0) {
+          thread->errors++;
+          idle = true;
+        }
+      }
+    }
+
+    count = epoll_wait(thread->epfd, events, LOAD_GEN_EVENTS,
+                       idle ? LOAD_GEN_TICK_MS : 0);
+    if (count <= 0) {
+      if (count < 0 && errno != EINTR) {
+        break;
+      }
+      idle = idle || !count;
+      continue;
+    }
+
+    for (int i = 0; i < count; i++) {
+      conn = events[i].data.ptr;
+      if (_conn_process(thread, conn) < 0) {
+        thread->errors++;
+        _conn_close(thread, conn);
+      }
+      idle = idle || conn->state == LOAD_STATE_IDLE;
+    }
+  }
+
+  for (size_t i = 0; i < thread->count; i++) {
+    _conn_close(thread, &thread->conns[i]);
+  }
+  return NULL;
+}
+
+/**
+ * @brief writes the results as a JSON object
+ *
+ * @param[in] out stream written to
+ * @param[in] threads points to the threads
+ * @param[in] seconds length of the run
+ */
+static void _results_write(FILE *out, struct load_thread_t *threads,
+                           double seconds) {
+  struct load_samples_t connect = {}, ttfb = {}, latency = {};
+  struct load_samples_t file_ttfb[LOAD_FILES] = {};
+  struct load_samples_t file_latency[LOAD_FILES] = {};
+  uint64_t requests = 0, errors = 0, connections = 0, bytes = 0;
+
+  for (long t = 0; t < _load.threads; t++) {
+    requests += threads[t].requests;
+    errors += threads[t].errors;
+    connections += threads[t].connections;
+    bytes += threads[t].bytes;
+    _samples_merge(&connect, &threads[t].connect);
+    for (int f = 0; f < LOAD_FILES; f++) {
+      _samples_merge(&ttfb, &threads[t].ttfb[f]);
+      _samples_merge(&latency, &threads[t].latency[f]);
+      _samples_merge(&file_ttfb[f], &threads[t].ttfb[f]);
+      _samples_merge(&file_latency[f], &threads[t].latency[f]);
+    }
+  }
+
+  qsort(connect.values, connect.count, sizeof(uint64_t), _compare);
+  qsort(ttfb.values, ttfb.count, sizeof(uint64_t), _compare);
+  qsort(latency.values, latency.count, sizeof(uint64_t), _compare);
+
+  fprintf(out,
+          "{\"name\": \"%s\", \"label\": \"%s\",\n \"config\": {\"port\": "
+          "%d, \"threads\": %ld, \"connections\": %ld, "
+          "\"requests_per_connection\": %ld, \"duration_s\": %.1f, "
+          "\"mix\": [%u, %u, %u], \"sizes\": [%zu, %zu, %zu]},\n",
+          _load.name, _load.label, ntohs(_load.address.sin_port),
+          _load.threads, _load.connections, _load.per_connection,
+          _load.duration, _load.mix[0], _load.mix[1], _load.mix[2],
+          _load.sizes[0], _load.sizes[1], _load.sizes[2]);
+  fprintf(out,
+          " \"seconds\": %.3f, \"requests\": %lu, \"errors\": %lu, "
+          "\"connections\": %lu, \"bytes\": %lu,\n \"throughput_mb_s\": %.1f, "
+          "\"requests_per_s\": %.1f, \"connections_per_s\": %.1f,\n",
+          seconds, requests, errors, connections, bytes,
+          bytes / seconds / (1024 * 1024), requests / seconds,
+          connections / seconds);
+  fprintf(out, " \"connect_ms\": ");
+  _percentiles_write(out, &connect);
+  fprintf(out, ", \"ttfb_ms\": ");
+  _percentiles_write(out, &ttfb);
+  fprintf(out, ", \"latency_ms\": ");
+  _percentiles_write(out, &latency);
+  fprintf(out, ",\n \"files\": {");
+  for (int f = 0; f < LOAD_FILES; f++) {
+    qsort(file_ttfb[f].values, file_ttfb[f].count, sizeof(uint64_t), _compare);
+    qsort(file_latency[f].values, file_latency[f].count, sizeof(uint64_t),
+          _compare);
+    fprintf(out, "%s\"%s\": {\"requests\": %zu, \"ttfb_ms\": ", f ? ", " : "",
+            _names[f], file_latency[f].count);
+    _percentiles_write(out, &file_ttfb[f]);
+    fprintf(out, ", \"latency_ms\": ");
+    _percentiles_write(out, &file_latency[f]);
+    fprintf(out, "}");
+  }
+  fprintf(out, "}}\n");
+
+  free(connect.values);
+  free(ttfb.values);
+  free(latency.values);
+  for (int f = 0; f < LOAD_FILES; f++) {
+    free(file_ttfb[f].values);
+    free(file_latency[f].values);
+  }
+}
+
+/**
+ * @brief prints the supported command line options
+ *
+ * @param[in] app name of the application
+ */
+static void _usage(const char *app) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -a, --address <ip>          server address (default 127.0.0.1)\n"
+          "  -p, --port <port>           server port (default %d)\n"
+          "  -s, --corpus <dir>          corpus directory, also the server "
+          "storage (default bench_corpus)\n"
+          "  -g, --generate              write the corpus files that are "
+          "missing or of another size\n"
+          "  -t, --threads <n>           threads (default 4)\n"
+          "  -c, --connections <n>       connections held at once (default "
+          "1000)\n"
+          "  -k, --per-connection <n>    requests per connection, 0 keeps "
+          "them open (default 1)\n"
+          "  -d, --duration <seconds>    length of the run (default 10)\n"
+          "  -n, --requests <n>          stop after n requests (default 0, "
+          "duration only)\n"
+          "  -m, --mix <s:m:l>           weights of the small, medium and "
+          "large files (default 90:9:1)\n"
+          "  -S, --sizes <s:m:l>         sizes of the files in bytes (default "
+          "4096:1048576:2147483648)\n"
+          "  -N, --name <name>           name of the scenario in the results\n"
+          "  -l, --label <label>         label of the results, e.g. a commit\n"
+          "  -o, --output <file>         JSON results (default stdout)\n",
+          app, SERVER_SOCKET_LISTEN_PORT_NUM);
+}
+
+/**
+ * @brief parses the command line
+ *
+ * @param[in] argc number of arguments
+ * @param[in] argv arguments
+ * @return 0 success, <0 error
+ */
+static int _options_parse(int argc, char **argv) {
+  const struct option options[] = {
+      {"address", required_argument, NULL, 'a'},
+      {"port", required_argument, NULL, 'p'},
+      {"corpus", required_argument, NULL, 's'},
+      {"generate", no_argument, NULL, 'g'},
+      {"threads", required_argument, NULL, 't'},
+      {"connections", required_argument, NULL, 'c'},
+      {"per-connection", required_argument, NULL, 'k'},
+      {"duration", required_argument, NULL, 'd'},
+      {"requests", required_argument, NULL, 'n'},
+      {"mix", required_argument, NULL, 'm'},
+      {"sizes", required_argument, NULL, 'S'},
+      {"name", required_argument, NULL, 'N'},
+      {"label", required_argument, NULL, 'l'},
+      {"output", required_argument, NULL, 'o'},
+      {NULL, 0, NULL, 0}};
+  const char *host = "127.0.0.1";
+  long port = SERVER_SOCKET_LISTEN_PORT_NUM;
+  int opt = 0, err = 0;
+
+  while (!err && (opt = getopt_long(argc, argv, "a:p:s:gt:c:k:d:n:m:S:N:l:o:",
+                                    options, NULL)) != -1) {
+    switch (opt) {
+    case 'a':
+      host = optarg;
+      break;
+    case 'p':
+      port = strtol(optarg, NULL, 10);
+      break;
+    case 's':
+      _load.corpus = optarg;
+      break;
+    case 'g':
+      _load.generate = true;
+      break;
+    case 't':
+      _load.threads = strtol(optarg, NULL, 10);
+      break;
+    case 'c':
+      _load.connections = strtol(optarg, NULL, 10);
+      break;
+    case 'k':
+      _load.per_connection = strtol(optarg, NULL, 10);
+      break;
+    case 'd':
+      _load.duration = strtod(optarg, NULL);
+      break;
+    case 'n':
+      _load.requests = strtoull(optarg, NULL, 10);
+      break;
+    case 'm':
+      err = sscanf(optarg, "%u:%u:%u", &_load.mix[0], &_load.mix[1],
+                   &_load.mix[2]) == 3
+                ? 0
+                : -EINVAL;
+      break;
+    case 'S':
+      err = sscanf(optarg, "%zu:%zu:%zu", &_load.sizes[0], &_load.sizes[1],
+                   &_load.sizes[2]) == 3
+                ? 0
+                : -EINVAL;
+      break;
+    case 'N':
+      _load.name = optarg;
+      break;
+    case 'l':
+      _load.label = optarg;
+      break;
+    case 'o':
+      _load.output = optarg;
+      break;
+    default:
+      err = -EINVAL;
+      break;
+    }
+  }
+
+  if (!err && (port <= 0 || port > UINT16_MAX || _load.threads <= 0 ||
+               _load.threads > LOAD_GEN_THREADS_MAX ||
+               _load.connections < _load.threads ||
+               _load.per_connection < 0 || _load.duration <= 0 ||
+               !(_load.mix[0] + _load.mix[1] + _load.mix[2]) ||
+               inet_pton(AF_INET, host, &_load.address.sin_addr) != 1)) {
+    err = -EINVAL;
+  }
+  _load.address.sin_family = AF_INET;
+  _load.address.sin_port = htons(port);
+  return err;
+}
+
+int main(int argc, char **argv) {
+  struct load_thread_t *threads = NULL;
+  struct rlimit limit = {};
+  FILE *out = stdout;
+  uint64_t begin = 0, end = 0;
+  size_t first = 0;
+
+  if (_options_parse(argc, argv) < 0) {
+    _usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (int f = 0; _load.generate && f < LOAD_FILES; f++) {
+    if (_load.mix[f] && _corpus_generate(_load.corpus, f) < 0) {
+      fprintf(stderr, "error writing the %s file of %s\n", _names[f],
+              _load.corpus);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // a descriptor per connection, plus a few for the rest
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if ((rlim_t)_load.connections + 16 > limit.rlim_cur) {
+    fprintf(stderr, "%ld connections exceed the limit of %lu descriptors\n",
+            _load.connections, (unsigned long)limit.rlim_cur);
+    return EXIT_FAILURE;
+  }
+
+  threads = calloc(_load.threads, sizeof(*threads));
+  if (!threads) {
+    return EXIT_FAILURE;
+  }
+
+  begin = _now_ns();
+  for (long t = 0; t < _load.threads; t++) {
+    struct load_thread_t *thread = &threads[t];
+    size_t last = (t + 1) * _load.connections / _load.threads;
+
+    thread->count = last - first;
+    thread->conns = calloc(thread->count, sizeof(*thread->conns));
+    thread->buffer = malloc(LOAD_GEN_BUFF_SIZE);
+    thread->epfd = epoll_create1(EPOLL_CLOEXEC);
+    thread->seed = t + 1;
+    first = last;
+    if (!thread->conns || !thread->buffer || thread->epfd < 0) {
+      fprintf(stderr, "error setting up thread %ld\n", t);
+      return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < thread->count; i++) {
+      thread->conns[i].fd = -1;
+    }
+    if (pthread_create(&thread->thread, NULL, _thread_run, thread)) {
+      fprintf(stderr, "error starting thread %ld\n", t);
+      return EXIT_FAILURE;
+    }
+  }
+
+  while (!__atomic_load_n(&_load.stop, __ATOMIC_RELAXED) &&
+         _now_ns() - begin < _load.duration * 1e9) {
+    usleep(LOAD_GEN_TICK_MS * 1000);
+  }
+  __atomic_store_n(&_load.stop, true, __ATOMIC_RELAXED);
+  end = _now_ns();
+  for (long t = 0; t < _load.threads; t++) {
+    pthread_join(threads[t].thread, NULL);
+  }
+
+  if (_load.output) {
+    out = fopen(_load.output, "w");
+    if (!out) {
+      fprintf(stderr, "error opening %s\n", _load.output);
+      return EXIT_FAILURE;
+    }
+  }
+  _results_write(out, threads, (end - begin) / 1e9);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/**
+ * @file syscount.c
+ * @brief counts the system calls issued by a command and all of its threads
+ * using ptrace, SIGUSR1 resets the count and SIGINT/SIGTERM stop the command
+ * and print the count
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SYSCOUNT_NR_MAX 512 // system call numbers tracked individually
+
+static volatile sig_atomic_t _reset = 0, _stop = 0;
+static uint64_t _counts[SYSCOUNT_NR_MAX] = {};
+static uint64_t _total = 0;
+
+/**
+ * @brief records the signals used to control the count
+ *
+ * @param[in] sig signal received
+ */
+static void _signal_handler(int sig) {
+  if (sig == SIGUSR1) {
+    _reset = 1;
+  } else {
+    _stop = 1;
+  }
+}
+
+/**
+ * @brief prints the total and the most frequent system calls
+ */
+static void _report(void) {
+  fprintf(stderr, "syscalls: %llu\n", (unsigned long long)_total);
+  for (int n = 0; n < 8; n++) {
+    int top = -1;
+    for (int i = 0; i < SYSCOUNT_NR_MAX; i++) {
+      if (_counts[i] && (top < 0 || _counts[i] > _counts[top])) {
+        top = i;
+      }
+    }
+    if (top < 0) {
+      break;
+    }
+    fprintf(stderr, "  nr %3d: %llu\n", top, (unsigned long long)_counts[top]);
+    _counts[top] = 0;
+  }
+}
+
+int main(int argc, char **argv) {
+  int status = 0;
+  pid_t child = -1, pid = -1;
+  struct sigaction sa = {.sa_handler = _signal_handler}; // no SA_RESTART
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <command> [args...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  child = fork();
+  if (child == 0) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    execvp(argv[1], &argv[1]);
+    perror("execvp");
+    _exit(127);
+  }
+
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  waitpid(child, &status, 0);
+  ptrace(PTRACE_SETOPTIONS, child, NULL,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+  ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+  while (true) {
+    pid = waitpid(-1, &status, __WALL);
+    if (_reset) {
+      _reset = 0;
+      _total = 0;
+      memset(_counts, 0, sizeof(_counts));
+    }
+    if (_stop) {
+      _stop = 0;
+      _report();
+      kill(child, SIGKILL);
+    }
+
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (pid == child) {
+        break;
+      }
+      continue;
+    }
+
+    int sig = 0;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info = {};
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+          info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        _total++;
+        if (info.entry.nr < SYSCOUNT_NR_MAX) {
+          _counts[info.entry.nr]++;
+        }
+      }
+    } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+      sig = WSTOPSIG(status); // deliver signals meant for the command
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file buffer_pool.c
+ * @author vinay divakar
+ * @brief pool of page aligned transfer buffers leased by connections, owned by
+ * a single worker so no locking is needed
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "buffer_pool.h"
+#include "log.h"
+
+/**
+ * @brief allocates the next slab and pushes its buffers to the free list
+ *
+ * @param[in] pool points to the buffer pool
+ * @return 0 success, <0 error
+ */
+static int _pool_grow(struct buffer_pool_t *pool) {
+  int err = 0;
+  uint8_t *slab = NULL;
+  size_t count = pool->slab_buffers;
+
+  if (pool->count >= pool->max || pool->slabs_count >= pool->slabs_size) {
+    return -ENOBUFS;
+  } else if (pool->max - pool->count < count) {
+    count = pool->max - pool->count;
+  }
+
+  err = posix_memalign((void **)&slab, BUFFER_POOL_ALIGNMENT,
+                       count * pool->buffer_size);
+  if (err) {
+    LOG_ERROR("error %d allocating %ld buffers\r\n", err, count);
+    return -err;
+  }
+
+  for (size_t i = count; i-- > 0;) {
+    void *buffer = slab + i * pool->buffer_size;
+    *(void **)buffer = pool->free;
+    pool->free = buffer;
+  }
+
+  pool->slabs[pool->slabs_count++] = slab;
+  pool->count += count;
+  return 0;
+}
+
+/**
+ * @brief creates a buffer pool and preallocates its first slab
+ *
+ * @param[out] pool points to the buffer pool
+ * @param[in] buffer_size size of each buffer, rounded up to the alignment
+ * @param[in] max maximum number of buffers
+ * @return 0 success, <0 error
+ */
+int buffer_pool_create(struct buffer_pool_t *pool, size_t buffer_size,
+                       size_t max) {
+  int err = 0;
+
+  memset(pool, 0, sizeof(*pool));
+  if (!buffer_size || !max) {
+    return -EINVAL;
+  }
+
+  pool->buffer_size = (buffer_size + BUFFER_POOL_ALIGNMENT - 1) &
+                      ~(size_t)(BUFFER_POOL_ALIGNMENT - 1);
+  pool->slab_buffers = BUFFER_POOL_SLAB_SIZE / pool->buffer_size;
+  pool->slab_buffers = pool->slab_buffers ? pool->slab_buffers : 1;
+  pool->max = max;
+  pool->slabs_size = (max + pool->slab_buffers - 1) / pool->slab_buffers;
+
+  pool->slabs = calloc(pool->slabs_size, sizeof(*pool->slabs));
+  if (!pool->slabs) {
+    return -ENOMEM;
+  }
+
+  err = _pool_grow(pool);
+  if (err < 0) {
+    buffer_pool_destroy(pool);
+  }
+  return err;
+}
+
+/**
+ * @brief releases the memory of a buffer pool, leased buffers become invalid
+ *
+ * @param[in] pool points to the buffer pool
+ */
+void buffer_pool_destroy(struct buffer_pool_t *pool) {
+  for (size_t i = 0; i < pool->slabs_count; i++) {
+    free(pool->slabs[i]);
+  }
+  free(pool->slabs);
+  memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief leases a buffer of pool->buffer_size bytes
+ *
+ * @param[in] pool points to the buffer pool
+ * @return points to the buffer, NULL if the pool is exhausted
+ */
+void *buffer_pool_lease(struct buffer_pool_t *pool) {
+  void *buffer = NULL;
+
+  if (!pool->free && _pool_grow(pool) < 0) {
+    return NULL;
+  }
+
+  buffer = pool->free;
+  pool->free = *(void **)buffer;
+  pool->leased++;
+  return buffer;
+}
+
+/**
+ * @brief returns a leased buffer to the pool
+ *
+ * @param[in] pool points to the buffer pool
+ * @param[in] buffer buffer to be returned, NULL is ignored
+ */
+void buffer_pool_release(struct buffer_pool_t *pool, void *buffer) {
+  if (!buffer) {
+    return;
+  }
+
+  *(void **)buffer = pool->free;
+  pool->free = buffer;
+  pool->leased--;
+}
@@ -0,0 +1,28 @@
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+#include "common.h"
+
+#define BUFFER_POOL_SLAB_SIZE                                                  \
+  (2 * 1024 * 1024) // memory allocated at once as the pool grows
+#define BUFFER_POOL_ALIGNMENT 4096 // buffers start on a page boundary
+
+struct buffer_pool_t {
+  uint8_t **slabs; // aligned slabs, each cut into buffers
+  size_t slabs_count;
+  size_t slabs_size;
+  void *free;          // free buffers, linked through their first bytes
+  size_t buffer_size;  // size of each buffer
+  size_t slab_buffers; // buffers cut from each slab
+  size_t count;        // buffers allocated
+  size_t max;          // upper bound on buffers allocated
+  size_t leased;       // buffers handed out
+};
+
+int buffer_pool_create(struct buffer_pool_t *pool, size_t buffer_size,
+                       size_t max);
+void buffer_pool_destroy(struct buffer_pool_t *pool);
+void *buffer_pool_lease(struct buffer_pool_t *pool);
+void buffer_pool_release(struct buffer_pool_t *pool, void *buffer);
+
+#endif // __BUFFER_POOL_H
@@ -5,8 +5,12 @@ enum commands_t {
   CMD_DOWNLOAD_FILE = 0x01,
   CMD_DOWNLOAD_FILE_EOF,
   CMD_DOWNLOAD_FILE_ERROR,
+  CMD_DOWNLOAD_FILE_DATA, // v2 only, carries a part of the file
+  CMD_HELLO,              // v2 only, negotiates the protocol version
+  CMD_DOWNLOAD_RANGE,     // v2 only, downloads a range, announces a range
+  CMD_DOWNLOAD_RANGES,    // v2 only, downloads several ranges of a file
 
   CMD_RESERVED_END = 0xFF
 };
 
-#endif // __COMMANDS_H
\ No newline at end of file
+#endif // __COMMANDS_H
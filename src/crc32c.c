@@ -0,0 +1,342 @@
+/**
+ * @file crc32c.c
+ * @author vinay divakar
+ * @brief CRC32C (Castagnoli) of frames and files. The kernel is picked once at
+ * runtime: the crc32 instruction of SSE4.2 run on three independent lanes whose
+ * results are joined with a carry-less multiply when PCLMUL is there, the crc32
+ * instruction alone otherwise, and slicing by 8 tables on any other CPU
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "crc32c.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+static struct {
+  pthread_once_t once;
+  enum crc32c_kernel_t kernel;   // fastest kernel available
+  bool available[CRC32C_KERNELS]; // kernels the CPU can run
+  uint32_t table[8][256];         // slicing by 8 tables
+  uint32_t x2n[32];               // x^(2^n) modulo the polynomial
+  uint64_t lanes[2][2];           // lane shifts, long then short lanes
+} _crc = {.once = PTHREAD_ONCE_INIT};
+
+/**
+ * @brief multiplies two polynomials modulo the CRC32C polynomial, both bit
+ * reflected like the CRC itself
+ *
+ * @param[in] a first factor
+ * @param[in] b second factor
+ * @return product modulo the polynomial
+ */
+static uint32_t _multiply(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31, p = 0;
+
+  while (a) {
+    if (a & m) {
+      p ^= b;
+      a ^= m;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/**
+ * @brief returns x^(n * 2^k) modulo the CRC32C polynomial
+ *
+ * @param[in] n exponent, scaled by 2^k
+ * @param[in] k scale of n as a power of two
+ * @return the power of x, bit reflected
+ */
+static uint32_t _x_power(uint64_t n, unsigned int k) {
+  uint32_t p = 1u << 31; // x^0
+
+  while (n) {
+    if (n & 1) {
+      p = _multiply(_crc.x2n[k & 31], p);
+    }
+    n >>= 1;
+    k++;
+  }
+  return p;
+}
+
+/**
+ * @brief fills the tables and picks the kernel, once per process
+ */
+static void _crc_setup(void) {
+  uint32_t c = 0;
+
+  for (uint32_t n = 0; n < 256; n++) {
+    c = n;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    }
+    _crc.table[0][n] = c;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    c = _crc.table[0][n];
+    for (int k = 1; k < 8; k++) {
+      c = _crc.table[0][c & 0xff] ^ (c >> 8);
+      _crc.table[k][n] = c;
+    }
+  }
+
+  _crc.x2n[0] = 1u << 30; // x^1
+  for (int n = 1; n < 32; n++) {
+    _crc.x2n[n] = _multiply(_crc.x2n[n - 1], _crc.x2n[n - 1]);
+  }
+
+  // the carry-less product comes out shifted by 33 bits, see _lane_shift
+  _crc.lanes[0][0] = _x_power(8 * CRC32C_LANE_SIZE - 33, 0);
+  _crc.lanes[0][1] = _x_power(16 * CRC32C_LANE_SIZE - 33, 0);
+  _crc.lanes[1][0] = _x_power(8 * CRC32C_LANE_SIZE_SHORT - 33, 0);
+  _crc.lanes[1][1] = _x_power(16 * CRC32C_LANE_SIZE_SHORT - 33, 0);
+
+  _crc.available[CRC32C_KERNEL_TABLE] = true;
+  _crc.kernel = CRC32C_KERNEL_TABLE;
+#if defined(__x86_64__)
+  {
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+      _crc.available[CRC32C_KERNEL_SSE42] = true;
+      _crc.kernel = CRC32C_KERNEL_SSE42;
+      if (ecx & bit_PCLMUL) {
+        _crc.available[CRC32C_KERNEL_PCLMUL] = true;
+        _crc.kernel = CRC32C_KERNEL_PCLMUL;
+      }
+    }
+  }
+#endif
+}
+
+/**
+ * @brief updates a CRC with slicing by 8 tables
+ *
+ * @param[in] crc running CRC, not inverted
+ * @param[in] p data
+ * @param[in] size bytes of data
+ * @return updated CRC, not inverted
+ */
+static uint32_t _crc_table(uint32_t crc, const uint8_t *p, size_t size) {
+  uint64_t w = 0;
+
+  while (size && ((uintptr_t)p & 7)) {
+    crc = _crc.table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    size--;
+  }
+
+  // little endian words, the tables consume the low byte first
+  while (size >= 8) {
+    memcpy(&w, p, sizeof(w));
+    w ^= crc;
+    crc = _crc.table[7][w & 0xff] ^ _crc.table[6][(w >> 8) & 0xff] ^
+          _crc.table[5][(w >> 16) & 0xff] ^ _crc.table[4][(w >> 24) & 0xff] ^
+          _crc.table[3][(w >> 32) & 0xff] ^ _crc.table[2][(w >> 40) & 0xff] ^
+          _crc.table[1][(w >> 48) & 0xff] ^ _crc.table[0][w >> 56];
+    p += 8;
+    size -= 8;
+  }
+
+  while (size--) {
+    crc = _crc.table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief updates a CRC with the crc32 instruction, 8 bytes at a time
+ *
+ * @param[in] crc running CRC, not inverted
+ * @param[in] p data
+ * @param[in] size bytes of data
+ * @return updated CRC, not inverted
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+_crc_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+  uint64_t c = crc, w = 0;
+
+  while (size && ((uintptr_t)p & 7)) {
+    c = _mm_crc32_u8(c, *p++);
+    size--;
+  }
+
+  while (size >= 8) {
+    memcpy(&w, p, sizeof(w));
+    c = _mm_crc32_u64(c, w);
+    p += 8;
+    size -= 8;
+  }
+
+  while (size--) {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  return c;
+}
+
+/**
+ * @brief moves the CRC of a lane past the bytes that follow it. The carry-less
+ * product of the CRC and x^(8n-33) reduced by the crc32 instruction is the CRC
+ * times x^(8n) modulo the polynomial
+ *
+ * @param[in] crc CRC of the lane
+ * @param[in] k x^(8n-33) modulo the polynomial, n bytes following the lane
+ * @return CRC of the lane followed by n zero bytes
+ */
+__attribute__((target("sse4.2,pclmul"))) static uint32_t
+_lane_shift(uint32_t crc, uint64_t k) {
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                         _mm_cvtsi64_si128(k), 0x00);
+
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+/**
+ * @brief updates a CRC with the crc32 instruction on three lanes at once, the
+ * instruction has a latency of three cycles and a throughput of one, so three
+ * independent streams keep it busy. The lanes are joined with _lane_shift,
+ * long lanes first, then short ones for what is left
+ *
+ * @param[in] crc running CRC, not inverted
+ * @param[in] p data
+ * @param[in] size bytes of data
+ * @return updated CRC, not inverted
+ */
+__attribute__((target("sse4.2,pclmul"))) static uint32_t
+_crc_pclmul(uint32_t crc, const uint8_t *p, size_t size) {
+  static const size_t lanes[2] = {CRC32C_LANE_SIZE, CRC32C_LANE_SIZE_SHORT};
+  uint64_t c0 = crc, c1 = 0, c2 = 0, w0 = 0, w1 = 0, w2 = 0;
+  const uint8_t *end = NULL;
+  size_t lane = 0;
+
+  while (size && ((uintptr_t)p & 7)) {
+    c0 = _mm_crc32_u8(c0, *p++);
+    size--;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    lane = lanes[i];
+    while (size >= 3 * lane) {
+      c1 = 0;
+      c2 = 0;
+      end = p + lane;
+      do {
+        memcpy(&w0, p, sizeof(w0));
+        memcpy(&w1, p + lane, sizeof(w1));
+        memcpy(&w2, p + 2 * lane, sizeof(w2));
+        c0 = _mm_crc32_u64(c0, w0);
+        c1 = _mm_crc32_u64(c1, w1);
+        c2 = _mm_crc32_u64(c2, w2);
+        p += 8;
+      } while (p < end);
+
+      c0 = _lane_shift(c0, _crc.lanes[i][1]) ^
+           _lane_shift(c1, _crc.lanes[i][0]) ^ c2;
+      p += 2 * lane;
+      size -= 3 * lane;
+    }
+  }
+  return _crc_sse42(c0, p, size);
+}
+#endif
+
+/**
+ * @brief tells whether the CPU runs a kernel
+ *
+ * @param[in] kernel kernel asked about
+ * @return true if crc32c_kernel_run may use it
+ */
+bool crc32c_kernel_available(enum crc32c_kernel_t kernel) {
+  pthread_once(&_crc.once, _crc_setup);
+  return kernel < CRC32C_KERNELS && _crc.available[kernel];
+}
+
+/**
+ * @brief returns the kernel used by crc32c, the fastest one available
+ *
+ * @return kernel picked at runtime
+ */
+enum crc32c_kernel_t crc32c_kernel(void) {
+  pthread_once(&_crc.once, _crc_setup);
+  return _crc.kernel;
+}
+
+/**
+ * @brief returns the name of a kernel
+ *
+ * @param[in] kernel kernel to be named
+ * @return name of the kernel
+ */
+const char *crc32c_kernel_name(enum crc32c_kernel_t kernel) {
+  switch (kernel) {
+  case CRC32C_KERNEL_SSE42:
+    return "sse4.2";
+  case CRC32C_KERNEL_PCLMUL:
+    return "sse4.2+pclmul";
+  default:
+    return "table";
+  }
+}
+
+/**
+ * @brief updates a CRC32C with the given kernel, falls back to the tables if
+ * the CPU cannot run it
+ *
+ * @param[in] kernel kernel to be used
+ * @param[in] crc CRC of the data before, 0 to start
+ * @param[in] data data
+ * @param[in] size bytes of data
+ * @return CRC32C of the data before followed by data
+ */
+uint32_t crc32c_kernel_run(enum crc32c_kernel_t kernel, uint32_t crc,
+                           const void *data, size_t size) {
+  pthread_once(&_crc.once, _crc_setup);
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (kernel == CRC32C_KERNEL_PCLMUL && _crc.available[kernel]) {
+    return ~_crc_pclmul(crc, data, size);
+  } else if (kernel == CRC32C_KERNEL_SSE42 && _crc.available[kernel]) {
+    return ~_crc_sse42(crc, data, size);
+  }
+#endif
+  return ~_crc_table(crc, data, size);
+}
+
+/**
+ * @brief updates a CRC32C with the fastest kernel available
+ *
+ * @param[in] crc CRC of the data before, 0 to start
+ * @param[in] data data
+ * @param[in] size bytes of data
+ * @return CRC32C of the data before followed by data
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+  return crc32c_kernel_run(crc32c_kernel(), crc, data, size);
+}
+
+/**
+ * @brief returns the CRC32C of two blocks from the CRC of each, without
+ * reading them again
+ *
+ * @param[in] crc1 CRC32C of the first block
+ * @param[in] crc2 CRC32C of the second block
+ * @param[in] size2 bytes in the second block
+ * @return CRC32C of the first block followed by the second
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t size2) {
+  pthread_once(&_crc.once, _crc_setup);
+  return _multiply(_x_power(size2, 3), crc1) ^ crc2;
+}
@@ -0,0 +1,27 @@
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include "common.h"
+
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bit reflected
+#define CRC32C_LANE_SIZE                                                       \
+  4096 // bytes per lane of the interleaved kernel, a multiple of 8
+#define CRC32C_LANE_SIZE_SHORT                                                 \
+  256 // lanes of the interleaved kernel for what is left, a multiple of 8
+
+enum crc32c_kernel_t {
+  CRC32C_KERNEL_TABLE,  // portable, slicing by 8 tables
+  CRC32C_KERNEL_SSE42,  // crc32 instruction, one stream
+  CRC32C_KERNEL_PCLMUL, // crc32 instruction on three lanes joined with pclmul
+  CRC32C_KERNELS
+};
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t size2);
+enum crc32c_kernel_t crc32c_kernel(void);
+bool crc32c_kernel_available(enum crc32c_kernel_t kernel);
+const char *crc32c_kernel_name(enum crc32c_kernel_t kernel);
+uint32_t crc32c_kernel_run(enum crc32c_kernel_t kernel, uint32_t crc,
+                           const void *data, size_t size);
+
+#endif // __CRC32C_H
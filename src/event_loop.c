@@ -0,0 +1,676 @@
+/**
+ * @file event_loop.c
+ * @author vinay divakar
+ * @brief readiness notification over poll, epoll or io_uring behind one
+ * interface, io_uring also completes the requests its users post on the ring
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "event_loop.h"
+#include "log.h"
+
+/**
+ * @brief translates poll flags into epoll flags
+ *
+ * @param[in] events poll flags, optionally with EVENT_LOOP_EDGE
+ * @return epoll flags
+ */
+static uint32_t _epoll_events_to(short events) {
+  uint32_t epoll_events = 0;
+
+  if (events & POLLIN)
+    epoll_events |= EPOLLIN;
+  if (events & POLLOUT)
+    epoll_events |= EPOLLOUT;
+  if (events & POLLPRI)
+    epoll_events |= EPOLLPRI;
+  if (events & EVENT_LOOP_EDGE)
+    epoll_events |= EPOLLET;
+
+  return epoll_events;
+}
+
+/**
+ * @brief translates epoll flags into poll flags
+ *
+ * @param[in] epoll_events epoll flags
+ * @return poll flags
+ */
+static short _epoll_events_from(uint32_t epoll_events) {
+  short events = 0;
+
+  if (epoll_events & EPOLLIN)
+    events |= POLLIN;
+  if (epoll_events & EPOLLOUT)
+    events |= POLLOUT;
+  if (epoll_events & EPOLLPRI)
+    events |= POLLPRI;
+  if (epoll_events & EPOLLERR)
+    events |= POLLERR;
+  if (epoll_events & EPOLLHUP)
+    events |= POLLHUP;
+
+  return events;
+}
+
+/**
+ * @brief grows the descriptor to entry index of the poll backend so it can
+ * hold the given descriptor
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor to be indexed
+ * @return 0 success, <0 error
+ */
+static int _poll_index_reserve(struct event_loop_t *loop, int fd) {
+  size_t size = loop->fds_index_size ? loop->fds_index_size : 64;
+
+  if (fd < loop->fds_index_size) {
+    return 0;
+  }
+
+  while (size <= fd) {
+    size *= 2;
+  }
+
+  int *index = realloc(loop->fds_index, size * sizeof(*index));
+  if (!index) {
+    return -ENOMEM;
+  }
+
+  for (size_t i = loop->fds_index_size; i < size; i++) {
+    index[i] = -1;
+  }
+  loop->fds_index = index;
+  loop->fds_index_size = size;
+  return 0;
+}
+
+/**
+ * @brief returns the entry of a descriptor in the poll backend
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor to look up
+ * @return entry index >=0 success, <0 error
+ */
+static int _poll_index_get(struct event_loop_t *loop, int fd) {
+  if (fd < 0 || fd >= loop->fds_index_size || loop->fds_index[fd] < 0) {
+    return -ENOENT;
+  }
+  return loop->fds_index[fd];
+}
+
+/**
+ * @brief grows the descriptor to entry table of the io_uring backend so it
+ * can hold the given descriptor
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor to be indexed
+ * @return 0 success, <0 error
+ */
+static int _uring_entries_reserve(struct event_loop_t *loop, int fd) {
+  size_t size = loop->uring_entries_size ? loop->uring_entries_size : 64;
+
+  if (fd < loop->uring_entries_size) {
+    return 0;
+  }
+
+  while (size <= fd) {
+    size *= 2;
+  }
+
+  struct event_loop_uring_entry_t *entries =
+      realloc(loop->uring_entries, size * sizeof(*entries));
+  if (!entries) {
+    return -ENOMEM;
+  }
+
+  memset(&entries[loop->uring_entries_size], 0,
+         (size - loop->uring_entries_size) * sizeof(*entries));
+  loop->uring_entries = entries;
+  loop->uring_entries_size = size;
+  return 0;
+}
+
+/**
+ * @brief returns a submission queue entry, submitting the queued ones first
+ * if the queue is full
+ *
+ * @param[in] loop points to the event loop
+ * @return entry to be prepared, NULL on error
+ */
+static struct io_uring_sqe *_uring_sqe_get(struct event_loop_t *loop) {
+  struct io_uring_sqe *sqe = uring_sqe_get(&loop->uring);
+  if (!sqe && uring_submit(&loop->uring, 0, 0) >= 0) {
+    sqe = uring_sqe_get(&loop->uring);
+  }
+  return sqe;
+}
+
+/**
+ * @brief queues the multishot request monitoring a descriptor, a multishot
+ * accept for listening sockets and a multishot poll for everything else
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor to be monitored
+ * @return 0 success, <0 error
+ */
+static int _uring_arm(struct event_loop_t *loop, int fd) {
+  struct event_loop_uring_entry_t *entry = &loop->uring_entries[fd];
+  struct io_uring_sqe *sqe = _uring_sqe_get(loop);
+
+  if (!sqe) {
+    return -EBUSY;
+  }
+
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t)entry->gen << 32 | (uint32_t)fd;
+  if (entry->events & EVENT_LOOP_ACCEPT) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  } else {
+    // multishot poll requests are edge triggered
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = entry->events & (POLLIN | POLLOUT | POLLPRI);
+  }
+  return 0;
+}
+
+/**
+ * @brief queues the cancellation of a request, its completion carries the
+ * target so a cancellation that raced with the request can be retried
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] opcode IORING_OP_POLL_REMOVE or IORING_OP_ASYNC_CANCEL
+ * @param[in] target user data of the request to be cancelled
+ * @return 0 success, <0 error
+ */
+static int _uring_cancel(struct event_loop_t *loop, uint8_t opcode,
+                         uint64_t target) {
+  struct io_uring_sqe *sqe = _uring_sqe_get(loop);
+
+  if (!sqe) {
+    return -EBUSY;
+  }
+
+  sqe->opcode = opcode;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = EVENT_LOOP_URING_CANCEL | target;
+  return 0;
+}
+
+/**
+ * @brief queues the cancellation of the multishot request monitoring a
+ * descriptor, its completions are dropped from here on
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor being monitored
+ * @return 0 success, <0 error
+ */
+static int _uring_disarm(struct event_loop_t *loop, int fd) {
+  struct event_loop_uring_entry_t *entry = &loop->uring_entries[fd];
+  int err = _uring_cancel(
+      loop,
+      (entry->events & EVENT_LOOP_ACCEPT) ? IORING_OP_ASYNC_CANCEL
+                                          : IORING_OP_POLL_REMOVE,
+      (uint64_t)entry->gen << 32 | (uint32_t)fd);
+
+  if (!err) {
+    entry->gen = (entry->gen + 1) & EVENT_LOOP_URING_GEN_MASK;
+  }
+  return err;
+}
+
+/**
+ * @brief waits for and collects completions of the io_uring backend
+ *
+ * @param[in] loop points to the event loop
+ * @param[out] events populated with the descriptors that have events
+ * @param[in] events_size maximum number of events to be returned
+ * @param[in] timeout milliseconds to wait, -1 to block indefinitely
+ * @return number of events >=0 success, <0 error
+ */
+static int _uring_wait(struct event_loop_t *loop,
+                       struct event_loop_event_t *events, size_t events_size,
+                       int timeout) {
+  int err = 0, count = 0;
+  struct io_uring_cqe *cqe = NULL;
+
+  // pending (re)arms, modifications and removals go out with the wait
+  err = uring_submit(&loop->uring, 1, timeout);
+  if (err < 0 && err != -ETIME && err != -EINTR) {
+    return err;
+  }
+
+  loop->uring_batch_id++;
+  while (count < events_size && (cqe = uring_cqe_peek(&loop->uring))) {
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res, fd = (uint32_t)user_data;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    uring_cqe_seen(&loop->uring);
+
+    if (user_data & EVENT_LOOP_URING_POSTED) {
+      events[count].data = (void *)(uintptr_t)(user_data &
+                                               ~EVENT_LOOP_URING_POSTED);
+      events[count].revents = EVENT_LOOP_COMPLETION;
+      events[count].fd = -1;
+      events[count].res = res;
+      count++;
+      continue;
+    } else if (user_data & EVENT_LOOP_URING_CANCEL) {
+      // a multishot request that was firing while being cancelled stays
+      // armed and pins the descriptor, cancel it again
+      if (res == -EALREADY) {
+        _uring_cancel(loop, IORING_OP_ASYNC_CANCEL,
+                      user_data & ~EVENT_LOOP_URING_CANCEL);
+      }
+      continue;
+    } else if (fd >= loop->uring_entries_size) {
+      continue;
+    }
+
+    struct event_loop_uring_entry_t *entry = &loop->uring_entries[fd];
+    if (!entry->registered || entry->gen != (uint32_t)(user_data >> 32)) {
+      continue; // completion of a request that was cancelled or replaced
+    }
+
+    if (!more) { // the multishot request terminated, re-arm it
+      _uring_arm(loop, fd);
+    }
+
+    if (entry->events & EVENT_LOOP_ACCEPT) {
+      if (res < 0) {
+        LOG_ERROR("error %d multishot accept on fd %d\r\n", res, fd);
+        continue;
+      }
+      events[count].data = entry->data;
+      events[count].revents = POLLIN;
+      events[count].fd = res;
+      count++;
+      continue;
+    }
+
+    if (res == -ECANCELED) {
+      continue;
+    }
+
+    short revents = res < 0 ? POLLERR : (short)res;
+    if (entry->batch_id == loop->uring_batch_id) {
+      // merge with the event already reported on this descriptor
+      events[entry->batch].revents |= revents;
+      continue;
+    }
+
+    entry->batch = count;
+    entry->batch_id = loop->uring_batch_id;
+    events[count].data = entry->data;
+    events[count].revents = revents;
+    events[count].fd = -1;
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * @brief creates an event loop, falling back from io_uring to epoll to poll
+ * when the kernel does not support the requested backend
+ *
+ * @param[out] loop points to the event loop to be initialized
+ * @param[in] backend readiness notification mechanism to use
+ * @param[in] size maximum number of descriptors to monitor
+ * @return 0 success, <0 error
+ */
+int event_loop_create(struct event_loop_t *loop,
+                      enum event_loop_backend_t backend, size_t size) {
+  int err = 0;
+
+  memset(loop, 0, sizeof(*loop));
+  loop->backend = backend;
+  loop->size = size;
+  loop->epoll_fd = -1;
+  loop->uring.fd = -1;
+
+  do {
+    if (backend == EVENT_LOOP_BACKEND_URING) {
+      loop->edge_triggered = true;
+      err = uring_create(&loop->uring, EVENT_LOOP_URING_ENTRIES);
+      if (err < 0) {
+        LOG_WARN("error %d io_uring setup, falling back to epoll\r\n", err);
+        backend = loop->backend = EVENT_LOOP_BACKEND_EPOLL;
+      }
+    }
+
+    if (backend == EVENT_LOOP_BACKEND_EPOLL) {
+      loop->edge_triggered = true;
+      loop->epoll_events_size = size;
+      loop->epoll_events = calloc(size, sizeof(*loop->epoll_events));
+      if (!loop->epoll_events) {
+        err = -ENOMEM;
+        break;
+      }
+
+      err = epoll_create1(EPOLL_CLOEXEC);
+      if (err < 0) {
+        LOG_WARN("error %d epoll_create1, falling back to poll\r\n", errno);
+        loop->edge_triggered = false;
+        backend = loop->backend = EVENT_LOOP_BACKEND_POLL;
+      } else {
+        loop->epoll_fd = err;
+        err = 0;
+      }
+    }
+
+    if (backend == EVENT_LOOP_BACKEND_POLL) {
+      loop->fds = calloc(size, sizeof(*loop->fds));
+      loop->fds_data = calloc(size, sizeof(*loop->fds_data));
+      if (!loop->fds || !loop->fds_data) {
+        err = -ENOMEM;
+        break;
+      }
+    }
+  } while (0);
+
+  if (err < 0) {
+    event_loop_destroy(loop);
+  }
+  return err;
+}
+
+/**
+ * @brief releases the resources held by an event loop
+ *
+ * @param[in] loop points to the event loop
+ */
+void event_loop_destroy(struct event_loop_t *loop) {
+  if (loop->uring.fd >= 0) {
+    uring_destroy(&loop->uring);
+  }
+  free(loop->uring_entries);
+  loop->uring_entries = NULL;
+  loop->uring_entries_size = 0;
+  if (loop->epoll_fd >= 0) {
+    close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+  }
+  free(loop->epoll_events);
+  free(loop->fds);
+  free(loop->fds_data);
+  free(loop->fds_index);
+  loop->epoll_events = NULL;
+  loop->fds = NULL;
+  loop->fds_data = NULL;
+  loop->fds_index = NULL;
+  loop->fds_index_size = 0;
+  loop->count = 0;
+}
+
+/**
+ * @brief starts monitoring a descriptor
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor to be monitored
+ * @param[in] events poll flags to monitor, optionally with EVENT_LOOP_EDGE and
+ * EVENT_LOOP_ACCEPT for listening sockets
+ * @param[in] data returned along with every event on this descriptor
+ * @return 0 success, <0 error
+ */
+int event_loop_add(struct event_loop_t *loop, int fd, short events,
+                   void *data) {
+  int err = 0;
+
+  if (loop->count >= loop->size) {
+    return -ENOBUFS;
+  }
+
+  if (loop->backend == EVENT_LOOP_BACKEND_URING) {
+    err = _uring_entries_reserve(loop, fd);
+    if (!err && loop->uring_entries[fd].registered) {
+      err = -EEXIST;
+    }
+
+    if (!err) {
+      struct event_loop_uring_entry_t *entry = &loop->uring_entries[fd];
+      entry->data = data;
+      entry->events = events;
+      entry->registered = true;
+      entry->gen++;
+      err = _uring_arm(loop, fd);
+      entry->registered = !err;
+    }
+  } else if (loop->backend == EVENT_LOOP_BACKEND_EPOLL) {
+    struct epoll_event event = {.events = _epoll_events_to(events),
+                                .data.ptr = data};
+    err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    err = err < 0 ? -errno : 0;
+  } else {
+    err = _poll_index_reserve(loop, fd);
+    if (!err && loop->fds_index[fd] >= 0) {
+      err = -EEXIST;
+    }
+
+    if (!err) {
+      loop->fds[loop->count].fd = fd;
+      loop->fds[loop->count].events =
+          events & ~(EVENT_LOOP_EDGE | EVENT_LOOP_ACCEPT);
+      loop->fds[loop->count].revents = 0;
+      loop->fds_data[loop->count] = data;
+      loop->fds_index[fd] = loop->count;
+    }
+  }
+
+  if (!err) {
+    loop->count++;
+  }
+  return err;
+}
+
+/**
+ * @brief changes the events monitored on a descriptor
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor being monitored
+ * @param[in] events poll flags to monitor, optionally with EVENT_LOOP_EDGE
+ * @param[in] data returned along with every event on this descriptor
+ * @return 0 success, <0 error
+ */
+int event_loop_modify(struct event_loop_t *loop, int fd, short events,
+                      void *data) {
+  int err = 0;
+
+  if (loop->backend == EVENT_LOOP_BACKEND_URING) {
+    if (fd < 0 || fd >= loop->uring_entries_size ||
+        !loop->uring_entries[fd].registered) {
+      return -ENOENT;
+    }
+
+    // replace the multishot request, it can not be updated in place
+    err = _uring_disarm(loop, fd);
+    if (!err) {
+      loop->uring_entries[fd].data = data;
+      loop->uring_entries[fd].events = events;
+      err = _uring_arm(loop, fd);
+    }
+  } else if (loop->backend == EVENT_LOOP_BACKEND_EPOLL) {
+    struct epoll_event event = {.events = _epoll_events_to(events),
+                                .data.ptr = data};
+    err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    err = err < 0 ? -errno : 0;
+  } else {
+    err = _poll_index_get(loop, fd);
+    if (err >= 0) {
+      loop->fds[err].events = events & ~(EVENT_LOOP_EDGE | EVENT_LOOP_ACCEPT);
+      loop->fds_data[err] = data;
+      err = 0;
+    }
+  }
+  return err;
+}
+
+/**
+ * @brief stops monitoring a descriptor, must be called before closing it
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] fd descriptor being monitored
+ * @return 0 success, <0 error
+ */
+int event_loop_remove(struct event_loop_t *loop, int fd) {
+  int err = 0;
+
+  if (loop->backend == EVENT_LOOP_BACKEND_URING) {
+    if (fd < 0 || fd >= loop->uring_entries_size ||
+        !loop->uring_entries[fd].registered) {
+      return -ENOENT;
+    }
+
+    err = _uring_disarm(loop, fd);
+    loop->uring_entries[fd].registered = false;
+    loop->uring_entries[fd].data = NULL;
+  } else if (loop->backend == EVENT_LOOP_BACKEND_EPOLL) {
+    err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    err = err < 0 ? -errno : 0;
+  } else {
+    err = _poll_index_get(loop, fd);
+    if (err >= 0) {
+      // keep the set dense by moving the last entry into the freed one
+      size_t last = loop->count - 1;
+      loop->fds[err] = loop->fds[last];
+      loop->fds_data[err] = loop->fds_data[last];
+      loop->fds_index[loop->fds[err].fd] = err;
+      loop->fds_index[fd] = -1;
+      err = 0;
+    }
+  }
+
+  if (!err) {
+    loop->count--;
+  }
+  return err;
+}
+
+/**
+ * @brief waits for events on the monitored descriptors
+ *
+ * @param[in] loop points to the event loop
+ * @param[out] events populated with the descriptors that have events
+ * @param[in] events_size maximum number of events to be returned
+ * @param[in] timeout milliseconds to wait, -1 to block indefinitely
+ * @return number of events >=0 success, <0 error
+ */
+int event_loop_wait(struct event_loop_t *loop,
+                    struct event_loop_event_t *events, size_t events_size,
+                    int timeout) {
+  int err = 0, count = 0;
+
+  if (loop->backend == EVENT_LOOP_BACKEND_URING) {
+    return _uring_wait(loop, events, events_size, timeout);
+  } else if (loop->backend == EVENT_LOOP_BACKEND_EPOLL) {
+    if (events_size > loop->epoll_events_size) {
+      events_size = loop->epoll_events_size;
+    }
+
+    err = epoll_wait(loop->epoll_fd, loop->epoll_events, events_size,
+                     timeout);
+    for (int i = 0; i < err; i++) {
+      events[count].data = loop->epoll_events[i].data.ptr;
+      events[count].revents = _epoll_events_from(loop->epoll_events[i].events);
+      events[count].fd = -1;
+      count++;
+    }
+  } else {
+    err = poll(loop->fds, loop->count, timeout);
+    for (size_t i = 0; err > 0 && i < loop->count && count < events_size;
+         i++) {
+      if (!loop->fds[i].revents) {
+        continue;
+      }
+      events[count].data = loop->fds_data[i];
+      events[count].revents = loop->fds[i].revents;
+      events[count].fd = -1;
+      count++;
+    }
+  }
+
+  if (err < 0) {
+    return errno == EINTR ? 0 : -errno;
+  }
+  return count;
+}
+
+/**
+ * @brief makes room on the ring of the io_uring backend for requests posted
+ * by a user of the loop, the queued ones are submitted if they are in the way
+ * so linked requests are never split across submissions
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] count number of requests to be posted
+ * @return 0 success, -EOPNOTSUPP the backend is not io_uring, <0 error
+ */
+int event_loop_post_reserve(struct event_loop_t *loop, size_t count) {
+  int err = 0;
+
+  if (loop->backend != EVENT_LOOP_BACKEND_URING) {
+    return -EOPNOTSUPP;
+  } else if (uring_sq_space(&loop->uring) >= count) {
+    return 0;
+  }
+
+  err = uring_submit(&loop->uring, 0, 0);
+  if (err < 0) {
+    return err;
+  }
+  return uring_sq_space(&loop->uring) >= count ? 0 : -EBUSY;
+}
+
+/**
+ * @brief returns a zeroed submission queue entry for a request of a user of
+ * the loop, once room has been reserved. Its completion is returned by
+ * event_loop_wait as an EVENT_LOOP_COMPLETION event carrying data and the
+ * result of the request
+ *
+ * @param[in] loop points to the event loop
+ * @param[in] data returned along with the completion, the two top bits clear
+ * @return entry to be prepared, its user_data must be left alone
+ */
+struct io_uring_sqe *event_loop_post(struct event_loop_t *loop, void *data) {
+  struct io_uring_sqe *sqe = uring_sqe_get(&loop->uring);
+
+  sqe->user_data = EVENT_LOOP_URING_POSTED | (uintptr_t)data;
+  return sqe;
+}
+
+/**
+ * @brief submits the posted requests right away without waiting for any
+ * completion, rather than along with the next wait
+ *
+ * @param[in] loop points to the event loop
+ * @return number of entries submitted >=0 success, <0 error and the requests
+ * go out with the next wait
+ */
+int event_loop_post_submit(struct event_loop_t *loop) {
+  return uring_submit(&loop->uring, 0, 0);
+}
+
+/**
+ * @brief returns the name of an event loop backend
+ *
+ * @param[in] backend event loop backend
+ * @return name of the backend
+ */
+const char *event_loop_backend_name(enum event_loop_backend_t backend) {
+  switch (backend) {
+  case EVENT_LOOP_BACKEND_POLL:
+    return "poll";
+  case EVENT_LOOP_BACKEND_EPOLL:
+    return "epoll";
+  case EVENT_LOOP_BACKEND_URING:
+    return "uring";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include "common.h"
+#include "uring.h"
+
+#define EVENT_LOOP_EDGE                                                        \
+  0x4000 // request edge-triggered notification where the backend supports it
+#define EVENT_LOOP_ACCEPT                                                      \
+  0x0800 // listening socket, the backend may accept connections on its own
+#define EVENT_LOOP_COMPLETION                                                  \
+  0x1000 // returned for a request posted on the ring of the io_uring backend
+#define EVENT_LOOP_URING_ENTRIES                                               \
+  256 // io_uring submission queue entries
+#define EVENT_LOOP_URING_CANCEL                                                \
+  (1ULL << 63) // tags the completion of a cancellation with its target
+#define EVENT_LOOP_URING_POSTED                                                \
+  (1ULL << 62) // tags the completion of a request posted by a loop user
+#define EVENT_LOOP_URING_GEN_MASK                                              \
+  0x3FFFFFFF // generations wrap before reaching the tags
+
+enum event_loop_backend_t {
+  EVENT_LOOP_BACKEND_POLL,  // poll(2) over a dense descriptor set
+  EVENT_LOOP_BACKEND_EPOLL, // epoll(7), events carry the registered data
+  EVENT_LOOP_BACKEND_URING  // io_uring multishot poll and accept, and
+                            // requests posted by the users of the loop
+};
+
+struct event_loop_event_t {
+  void *data;    // data registered along with the descriptor, or posted
+                 // along with the request
+  short revents; // returned events, expressed as poll(2) flags, or
+                 // EVENT_LOOP_COMPLETION
+  int fd;        // connection accepted by the backend, -1 if none
+  int res;       // result of the posted request, EVENT_LOOP_COMPLETION
+};
+
+struct event_loop_uring_entry_t {
+  void *data;        // data registered along with the descriptor
+  uint32_t gen;      // bumped on every change, completions of older
+                     // generations are stale and dropped
+  short events;      // events monitored, as passed to event_loop_add
+  bool registered;   // descriptor is being monitored
+  int batch;         // event slot used in the current wait
+  uint32_t batch_id; // wait the batch slot belongs to
+};
+
+struct event_loop_t {
+  enum event_loop_backend_t backend; // backend in use
+  bool edge_triggered; // backend honours EVENT_LOOP_EDGE, drain until EAGAIN
+  size_t size;         // maximum number of descriptors monitored
+  size_t count;        // number of descriptors monitored
+
+  // poll backend
+  struct pollfd *fds; // descriptor set handed to poll
+  void **fds_data;    // data registered for each entry in fds
+  int *fds_index;     // entry in fds for each descriptor, -1 if unused
+  size_t fds_index_size;
+
+  // epoll backend
+  int epoll_fd;                      // epoll instance
+  struct epoll_event *epoll_events;  // events returned by epoll_wait
+  size_t epoll_events_size;
+
+  // io_uring backend
+  struct uring_t uring;                          // ring shared by all requests
+  struct event_loop_uring_entry_t *uring_entries; // indexed by descriptor
+  size_t uring_entries_size;
+  uint32_t uring_batch_id; // incremented on every wait
+};
+
+int event_loop_create(struct event_loop_t *loop,
+                      enum event_loop_backend_t backend, size_t size);
+void event_loop_destroy(struct event_loop_t *loop);
+int event_loop_add(struct event_loop_t *loop, int fd, short events,
+                   void *data);
+int event_loop_modify(struct event_loop_t *loop, int fd, short events,
+                      void *data);
+int event_loop_remove(struct event_loop_t *loop, int fd);
+int event_loop_wait(struct event_loop_t *loop,
+                    struct event_loop_event_t *events, size_t events_size,
+                    int timeout);
+int event_loop_post_reserve(struct event_loop_t *loop, size_t count);
+struct io_uring_sqe *event_loop_post(struct event_loop_t *loop, void *data);
+int event_loop_post_submit(struct event_loop_t *loop);
+const char *event_loop_backend_name(enum event_loop_backend_t backend);
+
+#endif // __EVENT_LOOP_H
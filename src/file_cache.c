@@ -0,0 +1,421 @@
+/**
+ * @file file_cache.c
+ * @author vinay divakar
+ * @brief cache of hot files shared by all workers. Whole files are read once
+ * into immutable buffers that transfers send from by reference, eviction
+ * follows S3-FIFO: new files enter a small FIFO queue and only those hit while
+ * in it, or seen recently, reach the main queue
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "file_cache.h"
+
+#include <pthread.h>
+
+struct file_cache_queue_list_t {
+  struct file_cache_entry_t *head; // most recently inserted
+  struct file_cache_entry_t *tail; // next to be evicted
+  size_t bytes;                    // bytes held by the queue
+};
+
+static struct {
+  pthread_mutex_t lock; // guards everything below and the entries
+  size_t budget;        // upper bound on bytes cached, 0 disabled
+  size_t small_budget;  // share of the budget of the small queue
+  struct file_cache_entry_t *buckets[FILE_CACHE_BUCKETS];
+  struct file_cache_queue_list_t small;
+  struct file_cache_queue_list_t main;
+  uint64_t ghost[FILE_CACHE_GHOST_SIZE]; // hashes evicted from small
+  size_t ghost_next;                     // next ghost slot to be reused
+  struct file_cache_stats_t stats;
+} _cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief hashes a key with 64 bit FNV-1a
+ *
+ * @param[in] key null terminated key
+ * @return hash of the key
+ */
+static uint64_t _hash(const char *key) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (; *key; key++) {
+    hash ^= (uint8_t)*key;
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief returns the queue list an entry is held in
+ *
+ * @param[in] queue queue of the entry
+ * @return points to the queue list
+ */
+static struct file_cache_queue_list_t *
+_queue_list(enum file_cache_queue_t queue) {
+  return queue == FILE_CACHE_QUEUE_SMALL ? &_cache.small : &_cache.main;
+}
+
+/**
+ * @brief inserts an entry at the head of a queue
+ *
+ * @param[in] entry entry not held in any queue
+ * @param[in] queue FILE_CACHE_QUEUE_SMALL or FILE_CACHE_QUEUE_MAIN
+ */
+static void _queue_push(struct file_cache_entry_t *entry,
+                        enum file_cache_queue_t queue) {
+  struct file_cache_queue_list_t *list = _queue_list(queue);
+
+  entry->queue = queue;
+  entry->prev = NULL;
+  entry->next = list->head;
+  if (list->head) {
+    list->head->prev = entry;
+  } else {
+    list->tail = entry;
+  }
+  list->head = entry;
+  list->bytes += entry->size;
+}
+
+/**
+ * @brief removes an entry from the queue holding it
+ *
+ * @param[in] entry entry held in a queue
+ */
+static void _queue_unlink(struct file_cache_entry_t *entry) {
+  struct file_cache_queue_list_t *list = _queue_list(entry->queue);
+
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    list->head = entry->next;
+  }
+
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    list->tail = entry->prev;
+  }
+  list->bytes -= entry->size;
+  entry->queue = FILE_CACHE_QUEUE_NONE;
+  entry->prev = entry->next = NULL;
+}
+
+/**
+ * @brief drops a reference to an entry, freeing it with the last one
+ *
+ * @param[in] entry entry to be released
+ */
+static void _entry_unref(struct file_cache_entry_t *entry) {
+  if (--entry->refs) {
+    return;
+  }
+  free(entry->data);
+  free(entry);
+}
+
+/**
+ * @brief removes an entry from the cache, transfers still sending from it
+ * keep it alive until they release it
+ *
+ * @param[in] entry cached entry
+ */
+static void _entry_drop(struct file_cache_entry_t *entry) {
+  struct file_cache_entry_t **link =
+      &_cache.buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  entry->chain = NULL;
+
+  _queue_unlink(entry);
+  _cache.stats.entries--;
+  _cache.stats.bytes -= entry->size;
+  _entry_unref(entry);
+}
+
+/**
+ * @brief looks up the cached entry of a key
+ *
+ * @param[in] key null terminated key
+ * @param[in] hash hash of the key
+ * @return points to the entry, NULL if not cached
+ */
+static struct file_cache_entry_t *_entry_find(const char *key, uint64_t hash) {
+  struct file_cache_entry_t *entry =
+      _cache.buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+
+  for (; entry; entry = entry->chain) {
+    if (entry->hash == hash && !strcmp(entry->key, key)) {
+      break;
+    }
+  }
+  return entry;
+}
+
+/**
+ * @brief tells whether an entry still holds the contents of a file
+ *
+ * @param[in] entry cached entry
+ * @param[in] st status of the file
+ * @return true if the file is unchanged since it was read
+ */
+static bool _entry_valid(const struct file_cache_entry_t *entry,
+                         const struct stat *st) {
+  return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+         entry->size == (size_t)st->st_size &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief tells whether a key was evicted from the small queue recently
+ *
+ * @param[in] hash hash of the key
+ * @return true if the key is remembered
+ */
+static bool _ghost_contains(uint64_t hash) {
+  for (size_t i = 0; i < FILE_CACHE_GHOST_SIZE; i++) {
+    if (_cache.ghost[i] == hash) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief evicts the tail of the small queue, entries hit while in it move to
+ * the main queue instead
+ */
+static void _evict_small(void) {
+  struct file_cache_entry_t *entry = _cache.small.tail;
+
+  if (entry->freq > 1) {
+    entry->freq = 0;
+    _queue_unlink(entry);
+    _queue_push(entry, FILE_CACHE_QUEUE_MAIN);
+    return;
+  }
+
+  _cache.ghost[_cache.ghost_next++ & (FILE_CACHE_GHOST_SIZE - 1)] =
+      entry->hash;
+  _entry_drop(entry);
+  _cache.stats.evictions++;
+}
+
+/**
+ * @brief evicts the tail of the main queue, entries hit since they were last
+ * looked at get another lap
+ */
+static void _evict_main(void) {
+  struct file_cache_entry_t *entry = _cache.main.tail;
+
+  if (entry->freq) {
+    entry->freq--;
+    _queue_unlink(entry);
+    _queue_push(entry, FILE_CACHE_QUEUE_MAIN);
+    return;
+  }
+
+  _entry_drop(entry);
+  _cache.stats.evictions++;
+}
+
+/**
+ * @brief evicts entries until size more bytes fit in the budget
+ *
+ * @param[in] size bytes to be inserted
+ */
+static void _evict(size_t size) {
+  while (_cache.stats.bytes + size > _cache.budget &&
+         (_cache.small.tail || _cache.main.tail)) {
+    if (_cache.small.tail &&
+        (_cache.small.bytes > _cache.small_budget || !_cache.main.tail)) {
+      _evict_small();
+    } else {
+      _evict_main();
+    }
+  }
+}
+
+/**
+ * @brief reads a whole file into memory
+ *
+ * @param[in] fd file to be read
+ * @param[out] data contents of the file
+ * @param[in] size size of the file
+ * @return 0 success, <0 error
+ */
+static int _file_read_all(int fd, uint8_t *data, size_t size) {
+  ssize_t result = 0;
+
+  for (size_t offset = 0; offset < size; offset += result) {
+    result = pread(fd, data + offset, size - offset, offset);
+    if (result < 0) {
+      return -errno;
+    } else if (!result) {
+      return -EAGAIN; // the file shrank while being read
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief enables the cache, it is shared by all workers
+ *
+ * @param[in] budget upper bound on bytes cached, 0 leaves the cache disabled
+ * @return 0 success, <0 error
+ */
+int file_cache_create(size_t budget) {
+  pthread_mutex_lock(&_cache.lock);
+  _cache.budget = budget;
+  _cache.small_budget = budget / 100 * FILE_CACHE_SMALL_PERCENT;
+  _cache.stats.budget = budget;
+  pthread_mutex_unlock(&_cache.lock);
+  return 0;
+}
+
+/**
+ * @brief drops every entry and disables the cache, entries still referenced
+ * by transfers are freed when released
+ */
+void file_cache_destroy(void) {
+  pthread_mutex_lock(&_cache.lock);
+  while (_cache.small.tail) {
+    _entry_drop(_cache.small.tail);
+  }
+  while (_cache.main.tail) {
+    _entry_drop(_cache.main.tail);
+  }
+  _cache.budget = 0;
+  _cache.stats.budget = 0;
+  pthread_mutex_unlock(&_cache.lock);
+}
+
+/**
+ * @brief tells whether files are cached
+ *
+ * @return true if the cache has a budget
+ */
+bool file_cache_enabled(void) {
+  return __atomic_load_n(&_cache.budget, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * @brief looks up a file, an entry whose file changed since it was read is
+ * invalidated
+ *
+ * @param[in] key path of the file
+ * @param[in] st current status of the file
+ * @return points to the entry to be released by the caller, NULL on a miss
+ */
+struct file_cache_entry_t *file_cache_get(const char *key,
+                                          const struct stat *st) {
+  uint64_t hash = _hash(key);
+  struct file_cache_entry_t *entry = NULL;
+
+  pthread_mutex_lock(&_cache.lock);
+  entry = _entry_find(key, hash);
+  if (entry && !_entry_valid(entry, st)) {
+    _entry_drop(entry);
+    _cache.stats.invalidations++;
+    entry = NULL;
+  }
+
+  if (entry) {
+    entry->freq += entry->freq < FILE_CACHE_FREQ_MAX;
+    entry->refs++;
+    _cache.stats.hits++;
+  } else {
+    _cache.stats.misses++;
+  }
+  pthread_mutex_unlock(&_cache.lock);
+  return entry;
+}
+
+/**
+ * @brief reads an open file into the cache, files larger than the small queue
+ * are not cached
+ *
+ * @param[in] key path of the file
+ * @param[in] st status of the open file
+ * @param[in] fd open file
+ * @return points to the entry to be released by the caller, NULL if the file
+ * is not cached
+ */
+struct file_cache_entry_t *file_cache_put(const char *key,
+                                          const struct stat *st, int fd) {
+  size_t size = st->st_size, length = strlen(key) + 1;
+  struct file_cache_entry_t *entry = NULL, *cached = NULL;
+
+  if (!S_ISREG(st->st_mode) || size > _cache.small_budget) {
+    return NULL;
+  }
+
+  entry = calloc(1, sizeof(*entry) + length);
+  if (!entry) {
+    return NULL;
+  }
+
+  // read outside of the lock, other workers keep hitting the cache meanwhile
+  entry->data = malloc(size ? size : 1);
+  if (!entry->data || _file_read_all(fd, entry->data, size) < 0) {
+    free(entry->data);
+    free(entry);
+    return NULL;
+  }
+
+  entry->size = size;
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->mtime = st->st_mtim;
+  entry->hash = _hash(key);
+  entry->refs = 2; // the cache and the caller
+  memcpy(entry->key, key, length);
+
+  pthread_mutex_lock(&_cache.lock);
+  cached = _entry_find(key, entry->hash);
+  if (cached) { // another worker was faster or the file changed
+    _entry_drop(cached);
+  }
+
+  _evict(size);
+  entry->chain = _cache.buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+  _cache.buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)] = entry;
+  _queue_push(entry, _ghost_contains(entry->hash) ? FILE_CACHE_QUEUE_MAIN
+                                                   : FILE_CACHE_QUEUE_SMALL);
+  _cache.stats.entries++;
+  _cache.stats.bytes += size;
+  _cache.stats.insertions++;
+  pthread_mutex_unlock(&_cache.lock);
+  return entry;
+}
+
+/**
+ * @brief releases an entry returned by file_cache_get or file_cache_put
+ *
+ * @param[in] entry entry no longer sent from
+ */
+void file_cache_release(struct file_cache_entry_t *entry) {
+  pthread_mutex_lock(&_cache.lock);
+  _entry_unref(entry);
+  pthread_mutex_unlock(&_cache.lock);
+}
+
+/**
+ * @brief copies the cache counters
+ *
+ * @param[out] stats populated with the counters
+ */
+void file_cache_stats_get(struct file_cache_stats_t *stats) {
+  pthread_mutex_lock(&_cache.lock);
+  *stats = _cache.stats;
+  pthread_mutex_unlock(&_cache.lock);
+}
@@ -0,0 +1,57 @@
+#ifndef __FILE_CACHE_H
+#define __FILE_CACHE_H
+
+#include "common.h"
+
+#define FILE_CACHE_BUCKETS 4096 // hash buckets, a power of two
+#define FILE_CACHE_GHOST_SIZE                                                  \
+  4096 // keys evicted from the small queue remembered, a power of two
+#define FILE_CACHE_SMALL_PERCENT                                               \
+  10 // share of the budget held by the small queue, also the largest file
+#define FILE_CACHE_FREQ_MAX 3 // hits counted per entry
+
+enum file_cache_queue_t {
+  FILE_CACHE_QUEUE_NONE,  // no longer cached, freed with its last reference
+  FILE_CACHE_QUEUE_SMALL, // admitted recently, evicted unless hit again
+  FILE_CACHE_QUEUE_MAIN   // hit while in the small queue or seen before
+};
+
+// a whole file held in memory, read-only and shared by the transfers
+struct file_cache_entry_t {
+  uint8_t *data;                    // contents of the file
+  size_t size;                      // bytes in data
+  dev_t dev;                        // device the contents were read from
+  ino_t ino;                        // inode the contents were read from
+  struct timespec mtime;            // modification time when read
+  uint64_t hash;                    // hash of key
+  unsigned int refs;                // transfers sending data, +1 if cached
+  uint8_t freq;                     // hits, saturates at FILE_CACHE_FREQ_MAX
+  enum file_cache_queue_t queue;    // queue holding the entry
+  struct file_cache_entry_t *chain; // next entry in the hash bucket
+  struct file_cache_entry_t *prev;  // neighbour towards the queue head
+  struct file_cache_entry_t *next;  // neighbour towards the queue tail
+  char key[];                       // path of the file
+};
+
+struct file_cache_stats_t {
+  uint64_t hits;          // requests served from memory
+  uint64_t misses;        // requests that had to read the file
+  uint64_t insertions;    // files read into the cache
+  uint64_t evictions;     // entries evicted to stay within the budget
+  uint64_t invalidations; // entries dropped because the file changed
+  size_t entries;         // entries cached
+  size_t bytes;           // bytes cached
+  size_t budget;          // upper bound on bytes cached
+};
+
+int file_cache_create(size_t budget);
+void file_cache_destroy(void);
+bool file_cache_enabled(void);
+struct file_cache_entry_t *file_cache_get(const char *key,
+                                          const struct stat *st);
+struct file_cache_entry_t *file_cache_put(const char *key,
+                                          const struct stat *st, int fd);
+void file_cache_release(struct file_cache_entry_t *entry);
+void file_cache_stats_get(struct file_cache_stats_t *stats);
+
+#endif // __FILE_CACHE_H
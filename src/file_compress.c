@@ -0,0 +1,426 @@
+/**
+ * @file file_compress.c
+ * @author vinay divakar
+ * @brief compresses files chunk by chunk for downloads asking for an encoding.
+ * Every chunk becomes a self-contained zstd or lz4 frame, so chunks compress
+ * independently on any thread and their concatenation is a valid stream. The
+ * libraries are loaded at runtime, the server builds without their headers and
+ * sends files as stored when they are missing. The first download of a file
+ * also writes the compressed stream next to it, later downloads send that
+ * artifact as a plain file
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "file_compress.h"
+#include "file_names.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+// the few entry points used, declared here as the headers are optional
+static struct {
+  pthread_once_t once;
+  void *zstd; // libzstd handle, NULL if missing
+  void *(*zstd_cctx_create)(void);
+  size_t (*zstd_compress)(void *, void *, size_t, const void *, size_t, int);
+  size_t (*zstd_bound)(size_t);
+  unsigned (*zstd_is_error)(size_t);
+  void *lz4; // liblz4 handle, NULL if missing
+  size_t (*lz4_compress)(void *, size_t, const void *, size_t, const void *);
+  size_t (*lz4_bound)(size_t, const void *);
+  unsigned (*lz4_is_error)(size_t);
+  struct file_compress_stats_t stats;
+} _codecs = {.once = PTHREAD_ONCE_INIT};
+
+// per thread, compression runs on the workers and the file I/O threads
+static _Thread_local void *_zstd_cctx = NULL;
+static _Thread_local uint8_t *_scratch = NULL;
+static _Thread_local size_t _scratch_size = 0;
+
+/**
+ * @brief loads the compression libraries, an encoding whose library or one of
+ * its entry points is missing stays unavailable
+ */
+static void _codecs_load(void) {
+  _codecs.zstd = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (_codecs.zstd) {
+    _codecs.zstd_cctx_create = dlsym(_codecs.zstd, "ZSTD_createCCtx");
+    _codecs.zstd_compress = dlsym(_codecs.zstd, "ZSTD_compressCCtx");
+    _codecs.zstd_bound = dlsym(_codecs.zstd, "ZSTD_compressBound");
+    _codecs.zstd_is_error = dlsym(_codecs.zstd, "ZSTD_isError");
+    if (!_codecs.zstd_cctx_create || !_codecs.zstd_compress ||
+        !_codecs.zstd_bound || !_codecs.zstd_is_error) {
+      dlclose(_codecs.zstd);
+      _codecs.zstd = NULL;
+    }
+  }
+
+  _codecs.lz4 = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (_codecs.lz4) {
+    _codecs.lz4_compress = dlsym(_codecs.lz4, "LZ4F_compressFrame");
+    _codecs.lz4_bound = dlsym(_codecs.lz4, "LZ4F_compressFrameBound");
+    _codecs.lz4_is_error = dlsym(_codecs.lz4, "LZ4F_isError");
+    if (!_codecs.lz4_compress || !_codecs.lz4_bound || !_codecs.lz4_is_error) {
+      dlclose(_codecs.lz4);
+      _codecs.lz4 = NULL;
+    }
+  }
+
+  LOG_INFO("compression: zstd %s, lz4 %s\r\n",
+           _codecs.zstd ? "available" : "unavailable",
+           _codecs.lz4 ? "available" : "unavailable");
+}
+
+/**
+ * @brief tells whether files can be compressed with an encoding
+ *
+ * @param[in] encoding requested encoding
+ * @return true if its library is loaded
+ */
+bool file_compress_available(enum file_compress_encoding_t encoding) {
+  pthread_once(&_codecs.once, _codecs_load);
+
+  switch (encoding) {
+  case FILE_COMPRESS_ZSTD:
+    return _codecs.zstd != NULL;
+  case FILE_COMPRESS_LZ4:
+    return _codecs.lz4 != NULL;
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief returns the name of an encoding
+ *
+ * @param[in] encoding encoding
+ * @return name of the encoding
+ */
+const char *file_compress_name(enum file_compress_encoding_t encoding) {
+  switch (encoding) {
+  case FILE_COMPRESS_NONE:
+    return "none";
+  case FILE_COMPRESS_ZSTD:
+    return "zstd";
+  case FILE_COMPRESS_LZ4:
+    return "lz4";
+  default:
+    return "unknown";
+  }
+}
+
+/**
+ * @brief returns the largest compressed size of a chunk
+ *
+ * @param[in] encoding available encoding
+ * @param[in] size bytes in the chunk
+ * @return upper bound on the compressed size
+ */
+static size_t _bound(enum file_compress_encoding_t encoding, size_t size) {
+  return encoding == FILE_COMPRESS_ZSTD ? _codecs.zstd_bound(size)
+                                        : _codecs.lz4_bound(size, NULL);
+}
+
+/**
+ * @brief returns the largest chunk whose compressed size is guaranteed to fit
+ * in an output buffer, incompressible data grows slightly
+ *
+ * @param[in] encoding available encoding
+ * @param[in] output_size bytes available for the compressed chunk
+ * @return bytes of the file that may be read, 0 if the buffer is too small
+ */
+size_t file_compress_input_max(enum file_compress_encoding_t encoding,
+                               size_t output_size) {
+  size_t size = output_size, bound = 0;
+
+  // the bound grows linearly, a few rounds converge from above
+  for (int i = 0; i < 4 && size; i++) {
+    bound = _bound(encoding, size);
+    if (bound <= output_size) {
+      return size;
+    }
+    size = bound - output_size < size ? size - (bound - output_size) : 0;
+  }
+  return 0;
+}
+
+/**
+ * @brief reads a chunk of a file and compresses it into a self-contained
+ * frame, runs on the worker or on a file I/O thread
+ *
+ * @param[in] encoding available encoding
+ * @param[in] fd file to read from
+ * @param[in] offset file offset to read from
+ * @param[in] size bytes to read, at most file_compress_input_max
+ * @param[out] output buffer populated with the frame
+ * @param[in] output_size bytes available in output
+ * @param[out] consumed file bytes read, below size at the end of the file
+ * @return compressed bytes >0, 0 at the end of the file, <0 error
+ */
+int file_compress_read(enum file_compress_encoding_t encoding, int fd,
+                       size_t offset, size_t size, uint8_t *output,
+                       size_t output_size, size_t *consumed) {
+  ssize_t result = 0;
+  size_t compressed = 0;
+  uint8_t *scratch = _scratch;
+
+  *consumed = 0;
+  if (_scratch_size < size) {
+    scratch = realloc(_scratch, size);
+    if (!scratch) {
+      return -ENOMEM;
+    }
+    _scratch = scratch;
+    _scratch_size = size;
+  }
+
+  if (encoding == FILE_COMPRESS_ZSTD && !_zstd_cctx) {
+    _zstd_cctx = _codecs.zstd_cctx_create();
+    if (!_zstd_cctx) {
+      return -ENOMEM;
+    }
+  }
+
+  result = pread(fd, scratch, size, offset);
+  if (result <= 0) {
+    return result < 0 ? -errno : 0;
+  }
+  *consumed = result;
+
+  if (encoding == FILE_COMPRESS_ZSTD) {
+    compressed = _codecs.zstd_compress(_zstd_cctx, output, output_size,
+                                       scratch, result,
+                                       FILE_COMPRESS_ZSTD_LEVEL);
+    if (_codecs.zstd_is_error(compressed)) {
+      return -EIO;
+    }
+  } else {
+    compressed =
+        _codecs.lz4_compress(output, output_size, scratch, result, NULL);
+    if (_codecs.lz4_is_error(compressed)) {
+      return -EIO;
+    }
+  }
+
+  __atomic_add_fetch(&_codecs.stats.chunks, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&_codecs.stats.bytes_in, result, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&_codecs.stats.bytes_out, compressed, __ATOMIC_RELAXED);
+  return compressed;
+}
+
+/**
+ * @brief names the compressed artifact of a file, a hidden file next to it
+ * keyed by the inode and modification time, so a changed file never matches
+ * the artifact of its previous contents
+ *
+ * @param[in] name name of the file relative to the storage directory
+ * @param[in] st status of the file
+ * @param[in] encoding encoding of the artifact
+ * @param[out] artifact FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX bytes populated
+ * with the name
+ * @return 0 success, <0 error
+ */
+int file_compress_artifact_name(const char *name, const struct stat *st,
+                                enum file_compress_encoding_t encoding,
+                                char *artifact) {
+  const char *base = strrchr(name, '/');
+  int length = 0;
+
+  base = base ? base + 1 : name;
+  length = snprintf(
+      artifact, FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX, "%.*s.%s.%lx.%llx.%s",
+      (int)(base - name), name, base, (unsigned long)st->st_ino,
+      (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+          st->st_mtim.tv_nsec,
+      encoding == FILE_COMPRESS_ZSTD ? "zst" : "lz4");
+  return length < FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX ? 0 : -ENAMETOOLONG;
+}
+
+/**
+ * @brief strips the hex field ending a name, along with the dot ahead of it
+ *
+ * @param[in] start first character of the name
+ * @param[in,out] end end of the name, moved to the dot ahead of the field
+ * @return true if the name ended with a hex field
+ */
+static bool _hex_field_strip(const char *start, const char **end) {
+  const char *field = *end;
+
+  while (field > start && isxdigit((unsigned char)field[-1])) {
+    field--;
+  }
+  if (field == *end || field == start || field[-1] != '.') {
+    return false;
+  }
+  *end = field - 1;
+  return true;
+}
+
+/**
+ * @brief tells whether a name is the one of an artifact or of its temporary
+ * file, they are only sent in place of the file they were compressed from
+ *
+ * @param[in] name name relative to the storage directory
+ * @return true if the name follows the pattern of the artifacts
+ */
+bool file_compress_artifact_match(const char *name) {
+  const char *base = strrchr(name, '/'), *end = NULL;
+
+  base = base ? base + 1 : name;
+  end = base + strlen(base);
+  if (end - base > 4 && !strcmp(end - 4, ".tmp")) {
+    end -= 4;
+    if (!_hex_field_strip(base, &end)) {
+      return false;
+    }
+  }
+
+  if (end - base < 4 ||
+      (strncmp(end - 4, ".zst", 4) && strncmp(end - 4, ".lz4", 4))) {
+    return false;
+  }
+  end -= 4;
+  // a hidden file named after its file, followed by the inode and mtime
+  return _hex_field_strip(base, &end) && _hex_field_strip(base, &end) &&
+         base[0] == '.' && end - base > 1;
+}
+
+/**
+ * @brief starts writing an artifact to a temporary file next to it, renamed
+ * into place once the whole file has been compressed
+ *
+ * @param[in] artifact name of the artifact
+ * @return points to the artifact, NULL if it cannot be written
+ */
+struct file_compress_artifact_t *
+file_compress_artifact_create(const char *artifact) {
+  static uint64_t counter = 0;
+  struct file_compress_artifact_t *created = calloc(1, sizeof(*created));
+  int length = 0;
+
+  if (!created) {
+    return NULL;
+  }
+
+  // downloads racing for the same artifact each write their own
+  length = snprintf(created->temp, sizeof(created->temp), "%s.%lx.tmp",
+                    artifact,
+                    __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+  snprintf(created->name, sizeof(created->name), "%s", artifact);
+  created->fd = length < sizeof(created->temp)
+                    ? file_names_create_file(created->temp,
+                                             O_WRONLY | O_CREAT | O_EXCL, 0644)
+                    : -ENAMETOOLONG;
+  if (created->fd < 0) {
+    LOG_ERROR("error %d creating %s\r\n", created->fd, created->temp);
+    free(created);
+    return NULL;
+  }
+  return created;
+}
+
+/**
+ * @brief appends a compressed chunk to an artifact, a failed write discards
+ * the artifact once the download completes
+ *
+ * @param[in,out] artifact artifact being written
+ * @param[in] data compressed chunk
+ * @param[in] size bytes in the chunk
+ */
+void file_compress_artifact_write(struct file_compress_artifact_t *artifact,
+                                  const uint8_t *data, size_t size) {
+  ssize_t written = 0;
+
+  for (size_t done = 0; !artifact->failed && done < size; done += written) {
+    written = pwrite(artifact->fd, data + done, size - done,
+                     artifact->offset + done);
+    if (written <= 0) {
+      LOG_ERROR("error %d writing %s\r\n", written < 0 ? -errno : -EIO,
+                artifact->temp);
+      artifact->failed = true;
+      return;
+    }
+  }
+  artifact->offset += size;
+}
+
+/**
+ * @brief moves a complete artifact into place and releases it. An artifact
+ * no smaller than its file is emptied first, the empty artifact records that
+ * this version of the file is sent as stored
+ *
+ * @param[in] artifact artifact holding the whole compressed file
+ * @param[in] size size of the file compressed
+ */
+void file_compress_artifact_commit(struct file_compress_artifact_t *artifact,
+                                   size_t size) {
+  int err = 0;
+
+  if (!artifact->failed && artifact->offset >= size) {
+    LOG_DEBUG("%s takes %zu bytes for %zu, file kept stored\r\n",
+              artifact->name, artifact->offset, size);
+    if (ftruncate(artifact->fd, 0) < 0) {
+      LOG_ERROR("error %d emptying %s\r\n", -errno, artifact->temp);
+      artifact->failed = true;
+    }
+    artifact->offset = 0;
+  }
+
+  if (artifact->failed) {
+    file_compress_artifact_discard(artifact);
+    return;
+  }
+
+  close(artifact->fd);
+  err = file_names_rename(artifact->temp, artifact->name);
+  if (err < 0) {
+    LOG_ERROR("error %d renaming %s\r\n", err, artifact->temp);
+    file_names_unlink(artifact->temp);
+  } else if (!artifact->offset) {
+    __atomic_add_fetch(&_codecs.stats.artifacts_stored, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&_codecs.stats.artifacts_written, 1, __ATOMIC_RELAXED);
+  }
+  free(artifact);
+}
+
+/**
+ * @brief drops an artifact that was not completed and releases it
+ *
+ * @param[in] artifact artifact being written
+ */
+void file_compress_artifact_discard(struct file_compress_artifact_t *artifact) {
+  close(artifact->fd);
+  file_names_unlink(artifact->temp);
+  free(artifact);
+}
+
+/**
+ * @brief counts a download sent from an artifact
+ */
+void file_compress_artifact_served(void) {
+  __atomic_add_fetch(&_codecs.stats.artifacts_served, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief copies the compression counters
+ *
+ * @param[out] stats populated with the counters
+ */
+void file_compress_stats_get(struct file_compress_stats_t *stats) {
+  stats->chunks = __atomic_load_n(&_codecs.stats.chunks, __ATOMIC_RELAXED);
+  stats->bytes_in = __atomic_load_n(&_codecs.stats.bytes_in, __ATOMIC_RELAXED);
+  stats->bytes_out =
+      __atomic_load_n(&_codecs.stats.bytes_out, __ATOMIC_RELAXED);
+  stats->artifacts_written =
+      __atomic_load_n(&_codecs.stats.artifacts_written, __ATOMIC_RELAXED);
+  stats->artifacts_stored =
+      __atomic_load_n(&_codecs.stats.artifacts_stored, __ATOMIC_RELAXED);
+  stats->artifacts_served =
+      __atomic_load_n(&_codecs.stats.artifacts_served, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+#ifndef __FILE_COMPRESS_H
+#define __FILE_COMPRESS_H
+
+#include "common.h"
+
+#define FILE_COMPRESS_ZSTD_LEVEL 3 // zstd level, fast with a good ratio
+#define FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX                                   \
+  320 // longest name of a compressed artifact or its temporary file
+
+enum file_compress_encoding_t {
+  FILE_COMPRESS_NONE, // sent as stored
+  FILE_COMPRESS_ZSTD, // concatenated zstd frames
+  FILE_COMPRESS_LZ4,  // concatenated lz4 frames
+  FILE_COMPRESS_ENCODINGS
+};
+
+// compressed copy of a file being written next to it by its first download
+struct file_compress_artifact_t {
+  int fd;        // temporary file, renamed into place once complete
+  size_t offset; // compressed bytes written
+  bool failed;   // a write failed, the artifact is discarded
+  char temp[FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX]; // temporary file name
+  char name[FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX]; // artifact name
+};
+
+struct file_compress_stats_t {
+  uint64_t chunks;            // chunks compressed on the fly
+  uint64_t bytes_in;          // file bytes compressed
+  uint64_t bytes_out;         // compressed bytes produced
+  uint64_t artifacts_written; // artifacts renamed into place
+  uint64_t artifacts_stored;  // files left stored, compression did not pay off
+  uint64_t artifacts_served;  // downloads sent from an artifact
+};
+
+bool file_compress_available(enum file_compress_encoding_t encoding);
+const char *file_compress_name(enum file_compress_encoding_t encoding);
+size_t file_compress_input_max(enum file_compress_encoding_t encoding,
+                               size_t output_size);
+int file_compress_read(enum file_compress_encoding_t encoding, int fd,
+                       size_t offset, size_t size, uint8_t *output,
+                       size_t output_size, size_t *consumed);
+int file_compress_artifact_name(const char *name, const struct stat *st,
+                                enum file_compress_encoding_t encoding,
+                                char *artifact);
+bool file_compress_artifact_match(const char *name);
+struct file_compress_artifact_t *
+file_compress_artifact_create(const char *artifact);
+void file_compress_artifact_write(struct file_compress_artifact_t *artifact,
+                                  const uint8_t *data, size_t size);
+void file_compress_artifact_commit(struct file_compress_artifact_t *artifact,
+                                   size_t size);
+void file_compress_artifact_discard(struct file_compress_artifact_t *artifact);
+void file_compress_artifact_served(void);
+void file_compress_stats_get(struct file_compress_stats_t *stats);
+
+#endif // __FILE_COMPRESS_H
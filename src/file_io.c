@@ -0,0 +1,341 @@
+/**
+ * @file file_io.c
+ * @author vinay divakar
+ * @brief pool of threads running the blocking file operations of the workers,
+ * so a slow disk stalls a pool thread instead of an event loop. Each worker
+ * gets its completed requests back through an eventfd it monitors
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "file_io.h"
+#include "log.h"
+
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+static struct {
+  pthread_mutex_t lock;           // guards everything below
+  pthread_cond_t cond;            // signalled when a request is queued
+  struct file_io_request_t *head; // next request to be run
+  struct file_io_request_t *tail; // last request queued
+  pthread_t *threads;             // pool threads, threads_count of them
+  size_t threads_count;
+  bool stop; // threads exit once the queue is drained
+  struct file_io_stats_t stats;
+} _pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .cond = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief returns the monotonic time
+ *
+ * @return time in nanoseconds
+ */
+static uint64_t _now(void) {
+  struct timespec ts = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief returns the histogram bucket of a value
+ *
+ * @param[in] value value to be counted
+ * @return index of the smallest power of two bucket above the value
+ */
+static size_t _bucket(uint64_t value) {
+  size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+  return bucket < FILE_IO_HISTOGRAM_BUCKETS ? bucket
+                                            : FILE_IO_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * @brief runs a request and hands it back to its worker
+ *
+ * @param[in] request request to be run
+ */
+static void _request_run(struct file_io_request_t *request) {
+  struct file_io_completions_t *completions = request->completions;
+
+  request->result = request->work(request);
+
+  pthread_mutex_lock(&_pool.lock);
+  _pool.stats.completed++;
+  _pool.stats.latency[request->op]
+                     [_bucket((_now() - request->submitted) / 1000)]++;
+  pthread_mutex_unlock(&_pool.lock);
+
+  request->next = NULL;
+  pthread_mutex_lock(&completions->lock);
+  if (completions->tail) {
+    completions->tail->next = request;
+  } else {
+    completions->head = request;
+  }
+  completions->tail = request;
+  pthread_mutex_unlock(&completions->lock);
+
+  eventfd_write(completions->event_fd, 1);
+}
+
+/**
+ * @brief runs queued requests until the pool is destroyed
+ *
+ * @param[in] arg unused
+ * @return NULL
+ */
+static void *_thread_run(void *arg) {
+  struct file_io_request_t *request = NULL;
+
+  pthread_mutex_lock(&_pool.lock);
+  while (1) {
+    while (!_pool.head && !_pool.stop) {
+      pthread_cond_wait(&_pool.cond, &_pool.lock);
+    }
+    if (!_pool.head) { // stopped and drained
+      break;
+    }
+
+    request = _pool.head;
+    _pool.head = request->next;
+    if (!_pool.head) {
+      _pool.tail = NULL;
+    }
+    _pool.stats.queue_depth--;
+
+    pthread_mutex_unlock(&_pool.lock);
+    _request_run(request);
+    pthread_mutex_lock(&_pool.lock);
+  }
+  pthread_mutex_unlock(&_pool.lock);
+  return NULL;
+}
+
+/**
+ * @brief starts the pool, it is shared by all workers
+ *
+ * @param[in] threads number of pool threads
+ * @return 0 success, <0 error
+ */
+int file_io_create(size_t threads) {
+  int err = 0;
+
+  if (!threads || threads > FILE_IO_THREADS_MAX) {
+    return -EINVAL;
+  }
+
+  _pool.threads = calloc(threads, sizeof(*_pool.threads));
+  if (!_pool.threads) {
+    return -ENOMEM;
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    err = -pthread_create(&_pool.threads[i], NULL, _thread_run, NULL);
+    if (err < 0) {
+      LOG_ERROR("error %d starting file I/O thread %zu\r\n", err, i);
+      break;
+    }
+    _pool.threads_count++;
+  }
+
+  __atomic_store_n(&_pool.stats.threads, _pool.threads_count,
+                   __ATOMIC_RELEASE);
+  if (err < 0) {
+    file_io_destroy();
+  }
+  return err;
+}
+
+/**
+ * @brief stops the pool once the queued requests have run
+ */
+void file_io_destroy(void) {
+  pthread_mutex_lock(&_pool.lock);
+  _pool.stop = true;
+  pthread_cond_broadcast(&_pool.cond);
+  pthread_mutex_unlock(&_pool.lock);
+
+  for (size_t i = 0; i < _pool.threads_count; i++) {
+    pthread_join(_pool.threads[i], NULL);
+  }
+  free(_pool.threads);
+  _pool.threads = NULL;
+  _pool.threads_count = 0;
+  __atomic_store_n(&_pool.stats.threads, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief tells whether file operations are run by the pool
+ *
+ * @return true if the pool has threads
+ */
+bool file_io_enabled(void) {
+  return __atomic_load_n(&_pool.stats.threads, __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * @brief sets up the queue a worker gets its completed requests from
+ *
+ * @param[out] completions points to the queue
+ * @return 0 success, <0 error
+ */
+int file_io_completions_create(struct file_io_completions_t *completions) {
+  memset(completions, 0, sizeof(*completions));
+  pthread_mutex_init(&completions->lock, NULL);
+
+  completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (completions->event_fd < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+/**
+ * @brief releases the queue of a worker, its requests must have completed
+ *
+ * @param[in] completions points to the queue
+ */
+void file_io_completions_destroy(struct file_io_completions_t *completions) {
+  struct file_io_request_t *request = NULL;
+
+  while ((request = completions->free)) {
+    completions->free = request->next;
+    free(request);
+  }
+
+  if (completions->event_fd >= 0) {
+    close(completions->event_fd);
+    completions->event_fd = -1;
+  }
+  pthread_mutex_destroy(&completions->lock);
+}
+
+/**
+ * @brief returns a request that completes to the given queue, recycled from
+ * earlier requests of the worker when possible
+ *
+ * @param[in] completions queue of the calling worker
+ * @return points to the request, NULL if out of memory
+ */
+struct file_io_request_t *
+file_io_request_get(struct file_io_completions_t *completions) {
+  struct file_io_request_t *request = completions->free;
+
+  if (request) {
+    completions->free = request->next;
+  } else {
+    request = malloc(sizeof(*request));
+    if (!request) {
+      return NULL;
+    }
+  }
+
+  memset(request, 0, offsetof(struct file_io_request_t, path));
+  request->fd = -1;
+  request->path[0] = '\0';
+  request->completions = completions;
+  return request;
+}
+
+/**
+ * @brief recycles a completed request, called by the worker it completed to
+ *
+ * @param[in] request completed request
+ */
+void file_io_request_put(struct file_io_request_t *request) {
+  request->next = request->completions->free;
+  request->completions->free = request;
+}
+
+/**
+ * @brief queues a request for the pool, a full queue runs it on the calling
+ * thread instead. Either way it completes through the eventfd of its queue
+ *
+ * @param[in] request request whose op, work and arguments are set
+ */
+void file_io_submit(struct file_io_request_t *request) {
+  request->submitted = _now();
+  request->next = NULL;
+
+  pthread_mutex_lock(&_pool.lock);
+  _pool.stats.submitted++;
+  _pool.stats.depth[_bucket(_pool.stats.queue_depth)]++;
+  if (_pool.stats.queue_depth >= FILE_IO_QUEUE_MAX) {
+    _pool.stats.overflows++;
+    pthread_mutex_unlock(&_pool.lock);
+    _request_run(request);
+    return;
+  }
+
+  if (_pool.tail) {
+    _pool.tail->next = request;
+  } else {
+    _pool.head = request;
+  }
+  _pool.tail = request;
+  if (++_pool.stats.queue_depth > _pool.stats.queue_depth_peak) {
+    _pool.stats.queue_depth_peak = _pool.stats.queue_depth;
+  }
+  pthread_cond_signal(&_pool.cond);
+  pthread_mutex_unlock(&_pool.lock);
+}
+
+/**
+ * @brief takes the requests completed for a worker, once its eventfd is
+ * reported readable
+ *
+ * @param[in] completions queue of the calling worker
+ * @return completed requests linked through next, oldest first, NULL if none
+ */
+struct file_io_request_t *
+file_io_completions_take(struct file_io_completions_t *completions) {
+  struct file_io_request_t *requests = NULL;
+  eventfd_t count = 0;
+
+  eventfd_read(completions->event_fd, &count);
+
+  pthread_mutex_lock(&completions->lock);
+  requests = completions->head;
+  completions->head = completions->tail = NULL;
+  pthread_mutex_unlock(&completions->lock);
+  return requests;
+}
+
+/**
+ * @brief copies the pool counters
+ *
+ * @param[out] stats populated with the counters
+ */
+void file_io_stats_get(struct file_io_stats_t *stats) {
+  pthread_mutex_lock(&_pool.lock);
+  *stats = _pool.stats;
+  pthread_mutex_unlock(&_pool.lock);
+}
+
+/**
+ * @brief returns the upper bound of the bucket holding a percentile
+ *
+ * @param[in] buckets FILE_IO_HISTOGRAM_BUCKETS power of two buckets
+ * @param[in] percent percentile, 0 to 100
+ * @return every counted value up to the percentile is below this, 0 if empty
+ */
+size_t file_io_histogram_percentile(const uint64_t *buckets, double percent) {
+  uint64_t total = 0, count = 0;
+
+  for (size_t i = 0; i < FILE_IO_HISTOGRAM_BUCKETS; i++) {
+    total += buckets[i];
+  }
+
+  for (size_t i = 0; i < FILE_IO_HISTOGRAM_BUCKETS && total; i++) {
+    count += buckets[i];
+    if (count * 100.0 >= total * percent) {
+      return (size_t)1 << i;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef __FILE_IO_H
+#define __FILE_IO_H
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define FILE_IO_THREADS_MAX 64 // upper bound on pool threads
+#define FILE_IO_QUEUE_MAX                                                      \
+  4096 // requests waiting for a thread, more run on the submitting thread
+#define FILE_IO_HISTOGRAM_BUCKETS                                              \
+  24 // power of two buckets, bucket i counts values below 2^i
+#define FILE_IO_PATH_SIZE_MAX 256 // largest name opened by a request
+
+enum file_io_op_t {
+  FILE_IO_OPEN, // opens a file or finds it in the file cache
+  FILE_IO_READ, // reads a chunk of an open file
+  FILE_IO_OPS
+};
+
+struct file_io_completions_t;
+
+// a blocking file operation run by a pool thread on behalf of a worker
+struct file_io_request_t {
+  enum file_io_op_t op;                           // picks the histogram
+  int (*work)(struct file_io_request_t *request); // runs on a pool thread
+  int result;                                     // returned by work
+  void *owner;      // waits for the result, NULL once abandoned
+  int fd;           // file read, FILE_IO_READ
+  void *name;       // name entry holding fd open, or opened by FILE_IO_OPEN
+  uint8_t *data;    // read into, FILE_IO_READ
+  size_t size;      // bytes to read, or size of the file opened
+  size_t offset;    // file offset to read from, FILE_IO_READ
+  void *buffer;     // leased buffer holding data
+  void *pool;       // pool buffer is leased from
+  struct stat st;   // status of the opened file, FILE_IO_OPEN
+  void *cache;      // file cache entry found or filled, FILE_IO_OPEN
+  bool opened;      // open was called, FILE_IO_OPEN
+  bool closed;      // close was called, FILE_IO_OPEN
+  uint8_t encoding; // file_compress_encoding_t requested, then the one used
+  bool compressing; // chunks are compressed as they are read
+  size_t capacity;  // bytes data may hold, compressed chunks
+  size_t consumed;  // file bytes read into a compressed chunk
+  void *artifact;   // compressed copy written, or created by FILE_IO_OPEN
+  bool digest;      // CRC32C of the file opened or of the chunk read wanted
+  uint32_t crc;     // CRC32C of the file opened or of the chunk read
+  uint64_t submitted;                        // monotonic time queued, in ns
+  struct file_io_completions_t *completions; // worker it returns to
+  struct file_io_request_t *next;            // next request in its queue
+  char path[FILE_IO_PATH_SIZE_MAX];          // name to open, FILE_IO_OPEN
+};
+
+// requests completed for one worker, signalled through an eventfd
+struct file_io_completions_t {
+  pthread_mutex_t lock;           // guards head and tail against the pool
+  struct file_io_request_t *head; // oldest completion
+  struct file_io_request_t *tail; // newest completion
+  struct file_io_request_t *free; // recycled requests, owning worker only
+  int event_fd;                   // readable while completions are queued
+};
+
+struct file_io_stats_t {
+  size_t threads;            // pool threads
+  uint64_t submitted;        // requests handed to the pool
+  uint64_t completed;        // requests run
+  uint64_t overflows;        // run by the submitter, the queue was full
+  uint64_t queue_depth;      // requests waiting for a thread
+  uint64_t queue_depth_peak; // most requests waiting at once
+  uint64_t depth[FILE_IO_HISTOGRAM_BUCKETS]; // queue depth at submission
+  // submission to completion of each operation, in microseconds
+  uint64_t latency[FILE_IO_OPS][FILE_IO_HISTOGRAM_BUCKETS];
+};
+
+int file_io_create(size_t threads);
+void file_io_destroy(void);
+bool file_io_enabled(void);
+int file_io_completions_create(struct file_io_completions_t *completions);
+void file_io_completions_destroy(struct file_io_completions_t *completions);
+struct file_io_request_t *
+file_io_request_get(struct file_io_completions_t *completions);
+void file_io_request_put(struct file_io_request_t *request);
+void file_io_submit(struct file_io_request_t *request);
+struct file_io_request_t *
+file_io_completions_take(struct file_io_completions_t *completions);
+void file_io_stats_get(struct file_io_stats_t *stats);
+size_t file_io_histogram_percentile(const uint64_t *buckets, double percent);
+
+#endif // __FILE_IO_H
@@ -0,0 +1,520 @@
+/**
+ * @file file_names.c
+ * @author vinay divakar
+ * @brief resolves requested filenames beneath the storage directory, which is
+ * opened once, and keeps recently resolved files open so a request for a hot
+ * file costs neither a path walk nor an open. Entries are checked against the
+ * directory again once FILE_NAMES_VALID_MS old, so a replaced or changed file
+ * is picked up within that time
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "file_names.h"
+#include "crc32c.h"
+#include "log.h"
+
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+static struct {
+  pthread_mutex_t lock; // guards everything below and the entries
+  int dir_fd;           // storage directory, -1 if it could not be opened
+  int dir_error;        // why the directory could not be opened
+  struct file_names_entry_t *buckets[FILE_NAMES_BUCKETS];
+  struct file_names_entry_t *head; // most recently used
+  struct file_names_entry_t *tail; // next to be evicted
+  struct file_names_stats_t stats;
+} _names = {.lock = PTHREAD_MUTEX_INITIALIZER, .dir_fd = -1};
+
+/**
+ * @brief hashes a name with 64 bit FNV-1a
+ *
+ * @param[in] name null terminated name
+ * @return hash of the name
+ */
+static uint64_t _hash(const char *name) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (; *name; name++) {
+    hash ^= (uint8_t)*name;
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief returns the monotonic time
+ *
+ * @return time in nanoseconds
+ */
+static uint64_t _now(void) {
+  struct timespec ts = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief tells whether two statuses describe the same, unchanged file
+ *
+ * @param[in] a status of the file
+ * @param[in] b status of the file
+ * @return true if device, inode, size and modification time match
+ */
+static bool _same(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief tells whether a name stays beneath the directory it is resolved in,
+ * for kernels without openat2(2)
+ *
+ * @param[in] name null terminated name
+ * @return true if the name is relative and has no ".." component
+ */
+static bool _beneath(const char *name) {
+  const char *component = name;
+
+  if (name[0] == '/') {
+    return false;
+  }
+
+  for (const char *c = name;; c++) {
+    if (*c == '/' || *c == '\0') {
+      if (c - component == 2 && component[0] == '.' && component[1] == '.') {
+        return false;
+      }
+      if (*c == '\0') {
+        return true;
+      }
+      component = c + 1;
+    }
+  }
+}
+
+/**
+ * @brief opens a file beneath the storage directory, absolute names and
+ * names escaping it through ".." or symbolic links are refused
+ *
+ * @param[in] name name relative to the storage directory
+ * @param[in] flags open(2) flags
+ * @param[in] mode permissions of a file created by O_CREAT
+ * @return file descriptor >=0, <0 error
+ */
+static int _open_beneath(const char *name, int flags, mode_t mode) {
+  struct open_how how = {
+      .flags = flags, .mode = mode, .resolve = RESOLVE_BENEATH};
+  long err = 0;
+
+  if (_names.dir_fd < 0) {
+    return _names.dir_error;
+  }
+
+  err = syscall(SYS_openat2, _names.dir_fd, name, &how, sizeof(how));
+  if (err >= 0) {
+    return err;
+  } else if (errno != ENOSYS) {
+    return -errno;
+  }
+
+  // symbolic links are not checked without openat2
+  if (!_beneath(name)) {
+    return -EXDEV;
+  }
+  err = openat(_names.dir_fd, name, flags, mode);
+  return err < 0 ? -errno : err;
+}
+
+/**
+ * @brief moves an entry to the head of the LRU list
+ *
+ * @param[in] entry entry, linked or not
+ */
+static void _lru_push(struct file_names_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = _names.head;
+  if (_names.head) {
+    _names.head->prev = entry;
+  } else {
+    _names.tail = entry;
+  }
+  _names.head = entry;
+}
+
+/**
+ * @brief removes an entry from the LRU list
+ *
+ * @param[in] entry linked entry
+ */
+static void _lru_unlink(struct file_names_entry_t *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    _names.head = entry->next;
+  }
+
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    _names.tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+/**
+ * @brief drops a reference to an entry, its file is closed with the last one
+ *
+ * @param[in] entry entry to be released
+ * @return true if the file was closed
+ */
+static bool _entry_unref(struct file_names_entry_t *entry) {
+  if (--entry->refs) {
+    return false;
+  }
+  close(entry->fd);
+  free(entry);
+  return true;
+}
+
+/**
+ * @brief removes an entry from the cache, transfers still reading its file
+ * keep it open until they release it
+ *
+ * @param[in] entry cached entry
+ */
+static void _entry_drop(struct file_names_entry_t *entry) {
+  struct file_names_entry_t **link =
+      &_names.buckets[entry->hash & (FILE_NAMES_BUCKETS - 1)];
+
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  entry->chain = NULL;
+
+  _lru_unlink(entry);
+  entry->cached = false;
+  _names.stats.entries--;
+  _entry_unref(entry);
+}
+
+/**
+ * @brief looks up the cached entry of a name
+ *
+ * @param[in] name null terminated name
+ * @param[in] hash hash of the name
+ * @return points to the entry, NULL if not cached
+ */
+static struct file_names_entry_t *_entry_find(const char *name,
+                                              uint64_t hash) {
+  struct file_names_entry_t *entry =
+      _names.buckets[hash & (FILE_NAMES_BUCKETS - 1)];
+
+  for (; entry; entry = entry->chain) {
+    if (entry->hash == hash && !strcmp(entry->name, name)) {
+      break;
+    }
+  }
+  return entry;
+}
+
+/**
+ * @brief looks up a cached entry and checks it against the directory once it
+ * is FILE_NAMES_VALID_MS old, an entry whose file changed is dropped. Called
+ * with the lock held, released while checking
+ *
+ * @param[in] name null terminated name
+ * @param[in] hash hash of the name
+ * @return points to the entry to be released by the caller, NULL if the name
+ * has to be resolved
+ */
+static struct file_names_entry_t *_entry_get(const char *name, uint64_t hash) {
+  struct file_names_entry_t *entry = _entry_find(name, hash);
+  uint64_t now = _now();
+  struct stat st = {};
+  bool same = false;
+
+  if (!entry) {
+    return NULL;
+  }
+
+  entry->refs++;
+  if (now - entry->validated < FILE_NAMES_VALID_MS * 1000000ULL) {
+    return entry;
+  }
+
+  // resolving the name may block, others keep hitting the cache meanwhile
+  pthread_mutex_unlock(&_names.lock);
+  same = !fstatat(_names.dir_fd, name, &st, 0) && _same(&st, &entry->st);
+  pthread_mutex_lock(&_names.lock);
+
+  _names.stats.revalidations++;
+  if (same) {
+    entry->validated = now;
+    return entry;
+  }
+
+  if (entry->cached) {
+    _entry_drop(entry);
+    _names.stats.invalidations++;
+  }
+  _entry_unref(entry);
+  return NULL;
+}
+
+/**
+ * @brief opens the storage directory files are resolved beneath, an error is
+ * reported by every request until the server is restarted
+ *
+ * @param[in] storage path of the storage directory
+ * @param[in] capacity names kept open, 0 opens every file per request
+ * @return 0 success, <0 error
+ */
+int file_names_create(const char *storage, size_t capacity) {
+  int err = 0;
+
+  err = open(storage, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  pthread_mutex_lock(&_names.lock);
+  _names.dir_fd = err;
+  _names.dir_error = err < 0 ? -errno : 0;
+  _names.stats.capacity = capacity;
+  pthread_mutex_unlock(&_names.lock);
+
+  if (err < 0) {
+    LOG_ERROR("error %d opening storage %s\r\n", _names.dir_error, storage);
+    return _names.dir_error;
+  }
+  return 0;
+}
+
+/**
+ * @brief drops every entry and closes the storage directory, entries still
+ * referenced by transfers are closed when released
+ */
+void file_names_destroy(void) {
+  pthread_mutex_lock(&_names.lock);
+  while (_names.tail) {
+    _entry_drop(_names.tail);
+  }
+  if (_names.dir_fd >= 0) {
+    close(_names.dir_fd);
+    _names.dir_fd = -1;
+  }
+  _names.stats.capacity = 0;
+  pthread_mutex_unlock(&_names.lock);
+}
+
+/**
+ * @brief opens a file by name beneath the storage directory, or returns the
+ * open file of a recently resolved name
+ *
+ * @param[in] name name relative to the storage directory
+ * @param[out] entry open file and its status, to be released by the caller
+ * @return 1 the file was opened, 0 it was open already, -EISDIR a directory,
+ * -EINVAL not a regular file, <0 error
+ */
+int file_names_open(const char *name, struct file_names_entry_t **entry) {
+  int err = 0;
+  uint64_t hash = _hash(name);
+  size_t length = strlen(name) + 1;
+  struct file_names_entry_t *opened = NULL, *cached = NULL;
+
+  pthread_mutex_lock(&_names.lock);
+  *entry = _entry_get(name, hash);
+  if (*entry) {
+    _names.stats.hits++;
+  } else {
+    _names.stats.misses++;
+  }
+  pthread_mutex_unlock(&_names.lock);
+  if (*entry) {
+    return 0;
+  }
+
+  opened = calloc(1, sizeof(*opened) + length);
+  if (!opened) {
+    return -ENOMEM;
+  }
+
+  // resolved outside of the lock, other workers keep hitting the cache, a
+  // FIFO would block the open until a writer shows up
+  err = _open_beneath(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK, 0);
+  if (err < 0) {
+    free(opened);
+    return err;
+  }
+  opened->fd = err;
+
+  // only regular files are served, they are read in blocking mode
+  if (fstat(opened->fd, &opened->st) < 0) {
+    err = -errno;
+  } else if (!S_ISREG(opened->st.st_mode)) {
+    err = S_ISDIR(opened->st.st_mode) ? -EISDIR : -EINVAL;
+  } else if (fcntl(opened->fd, F_SETFL, O_RDONLY) < 0) {
+    err = -errno;
+  }
+  if (err < 0) {
+    close(opened->fd);
+    free(opened);
+    return err;
+  }
+
+  opened->validated = _now();
+  opened->hash = hash;
+  opened->refs = 1; // the caller
+  memcpy(opened->name, name, length);
+
+  pthread_mutex_lock(&_names.lock);
+  if (_names.stats.capacity) {
+    cached = _entry_find(name, hash);
+    if (cached) { // another worker was faster or the file changed
+      _entry_drop(cached);
+    } else if (_names.stats.entries >= _names.stats.capacity) {
+      _entry_drop(_names.tail);
+      _names.stats.evictions++;
+    }
+
+    opened->chain = _names.buckets[hash & (FILE_NAMES_BUCKETS - 1)];
+    _names.buckets[hash & (FILE_NAMES_BUCKETS - 1)] = opened;
+    _lru_push(opened);
+    opened->cached = true;
+    opened->refs++;
+    _names.stats.entries++;
+  }
+  pthread_mutex_unlock(&_names.lock);
+
+  *entry = opened;
+  return 1;
+}
+
+/**
+ * @brief releases an entry returned by file_names_open
+ *
+ * @param[in] entry entry whose file is no longer read
+ * @return true if its file was closed
+ */
+bool file_names_release(struct file_names_entry_t *entry) {
+  bool closed = false;
+
+  pthread_mutex_lock(&_names.lock);
+  closed = _entry_unref(entry);
+  pthread_mutex_unlock(&_names.lock);
+  return closed;
+}
+
+/**
+ * @brief copies the name cache counters
+ *
+ * @param[out] stats populated with the counters
+ */
+void file_names_stats_get(struct file_names_stats_t *stats) {
+  pthread_mutex_lock(&_names.lock);
+  *stats = _names.stats;
+  pthread_mutex_unlock(&_names.lock);
+}
+
+/**
+ * @brief returns the CRC32C of the whole file of an entry, computed on first
+ * use and kept with the entry, so it lasts until the file changes and its name
+ * is resolved again
+ *
+ * @param[in,out] entry name entry holding the file open
+ * @param[out] digest CRC32C of the file
+ * @return 0 success, <0 error
+ */
+int file_names_digest(struct file_names_entry_t *entry, uint32_t *digest) {
+  int err = 0;
+  bool digested = false;
+  uint8_t *buffer = NULL;
+  ssize_t result = 0;
+  off_t offset = 0;
+  uint32_t crc = 0;
+
+  pthread_mutex_lock(&_names.lock);
+  digested = entry->digested;
+  *digest = entry->digest;
+  pthread_mutex_unlock(&_names.lock);
+  if (digested) {
+    return 0;
+  }
+
+  buffer = malloc(FILE_NAMES_DIGEST_CHUNK_SIZE);
+  if (!buffer) {
+    return -ENOMEM;
+  }
+
+  // computed outside of the lock, racing threads compute the same value
+  while (offset < entry->st.st_size) {
+    result = pread(entry->fd, buffer, FILE_NAMES_DIGEST_CHUNK_SIZE, offset);
+    if (result < 0) {
+      err = -errno;
+      break;
+    } else if (!result) { // shrank, the digest covers what is left
+      break;
+    }
+    crc = crc32c(crc, buffer, result);
+    offset += result;
+  }
+  free(buffer);
+  if (err < 0) {
+    return err;
+  }
+
+  pthread_mutex_lock(&_names.lock);
+  entry->digest = crc;
+  entry->digested = true;
+  _names.stats.digests++;
+  pthread_mutex_unlock(&_names.lock);
+  *digest = crc;
+  return 0;
+}
+
+/**
+ * @brief opens a file beneath the storage directory without caching it, to
+ * create or write files next to the ones served
+ *
+ * @param[in] name name relative to the storage directory
+ * @param[in] flags open(2) flags
+ * @param[in] mode permissions of a file created by O_CREAT
+ * @return file descriptor >=0 to be closed by the caller, <0 error
+ */
+int file_names_create_file(const char *name, int flags, mode_t mode) {
+  if (!_beneath(name)) { // renamed and unlinked by name later on
+    return -EXDEV;
+  }
+  return _open_beneath(name, flags | O_CLOEXEC, mode);
+}
+
+/**
+ * @brief renames a file beneath the storage directory, replacing the target
+ *
+ * @param[in] from name of the file relative to the storage directory
+ * @param[in] to new name relative to the storage directory
+ * @return 0 success, <0 error
+ */
+int file_names_rename(const char *from, const char *to) {
+  if (!_beneath(from) || !_beneath(to)) {
+    return -EXDEV;
+  }
+  return renameat(_names.dir_fd, from, _names.dir_fd, to) < 0 ? -errno : 0;
+}
+
+/**
+ * @brief removes a file beneath the storage directory
+ *
+ * @param[in] name name of the file relative to the storage directory
+ * @return 0 success, <0 error
+ */
+int file_names_unlink(const char *name) {
+  if (!_beneath(name)) {
+    return -EXDEV;
+  }
+  return unlinkat(_names.dir_fd, name, 0) < 0 ? -errno : 0;
+}
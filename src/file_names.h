@@ -0,0 +1,50 @@
+#ifndef __FILE_NAMES_H
+#define __FILE_NAMES_H
+
+#include "common.h"
+
+#define FILE_NAMES_BUCKETS 1024 // hash buckets, a power of two
+#define FILE_NAMES_ENTRIES 256  // default names kept open
+#define FILE_NAMES_VALID_MS                                                    \
+  1000 // an entry is checked against the directory again after this long
+#define FILE_NAMES_DIGEST_CHUNK_SIZE                                           \
+  (256 * 1024) // bytes read at once while computing the digest of a file
+
+// a name resolved beneath the storage directory, with its file kept open
+struct file_names_entry_t {
+  int fd;                           // open file, shared by the transfers
+  struct stat st;                   // status when opened or last checked
+  uint64_t validated;               // monotonic time of the last check, ns
+  uint64_t hash;                    // hash of name
+  unsigned int refs;                // transfers reading fd, +1 if cached
+  bool cached;                      // held in the map and the LRU list
+  bool digested;                    // digest holds the CRC32C of the file
+  uint32_t digest;                  // CRC32C of the file as of st
+  struct file_names_entry_t *chain; // next entry in the hash bucket
+  struct file_names_entry_t *prev;  // neighbour towards the most recent
+  struct file_names_entry_t *next;  // neighbour towards the least recent
+  char name[];                      // name relative to the storage directory
+};
+
+struct file_names_stats_t {
+  uint64_t hits;          // names served without resolving them
+  uint64_t misses;        // names resolved and opened
+  uint64_t revalidations; // entries checked against the directory
+  uint64_t invalidations; // entries dropped because the file changed
+  uint64_t evictions;     // entries dropped to stay within the capacity
+  uint64_t digests;       // whole-file CRC32C computed
+  size_t entries;         // names cached
+  size_t capacity;        // upper bound on names cached
+};
+
+int file_names_create(const char *storage, size_t capacity);
+void file_names_destroy(void);
+int file_names_open(const char *name, struct file_names_entry_t **entry);
+bool file_names_release(struct file_names_entry_t *entry);
+int file_names_digest(struct file_names_entry_t *entry, uint32_t *digest);
+void file_names_stats_get(struct file_names_stats_t *stats);
+int file_names_create_file(const char *name, int flags, mode_t mode);
+int file_names_rename(const char *from, const char *to);
+int file_names_unlink(const char *name);
+
+#endif // __FILE_NAMES_H
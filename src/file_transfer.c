@@ -10,193 +10,2022 @@
  */
 
 #include "file_transfer.h"
+#include "log.h"
 #include "server.h"
+#include "uring.h"
 
 /**
- * @brief reads data from a file
+ * @brief registers with the ring of an io_uring event loop the sparse tables
+ * of buffers and files the io_uring engine uses, one buffer and two files per
+ * transfer slot. Called once by each worker as it picks its engine, transfers
+ * never cross threads
  *
- * @param[in] table points to directory containing the key
- * @param[in] key points to the key/filename in the table
+ * @param[in] loop event loop of the calling worker
+ * @param[in] slots_max number of transfer slots
+ * @return 0 success, -EOPNOTSUPP the loop has no ring, <0 error and the engine
+ * is unusable
+ */
+int file_transfer_uring_setup(struct event_loop_t *loop, size_t slots_max) {
+  int err = 0;
+  int *files = NULL;
+  struct uring_t *ring = &loop->uring;
+  struct io_uring_rsrc_register buffers = {
+      .nr = slots_max, .flags = IORING_RSRC_REGISTER_SPARSE};
+
+  if (loop->backend != EVENT_LOOP_BACKEND_URING) {
+    return -EOPNOTSUPP;
+  }
+
+  do {
+    if (slots_max > FILE_TRANSFER_URING_BUFFERS_MAX) {
+      err = -E2BIG;
+      break;
+    }
+
+    // filled in as transfers lease their buffers
+    err = uring_register(ring, IORING_REGISTER_BUFFERS2, &buffers,
+                         sizeof(buffers));
+    if (err < 0) {
+      break;
+    }
+
+    files = malloc(2 * slots_max * sizeof(*files));
+    if (!files) {
+      err = -ENOMEM;
+      break;
+    }
+    for (size_t i = 0; i < 2 * slots_max; i++) {
+      files[i] = -1; // sparse, filled in as transfers start
+    }
+
+    err = uring_register(ring, IORING_REGISTER_FILES, files, 2 * slots_max);
+  } while (0);
+
+  free(files);
+  if (err < 0) {
+    LOG_ERROR("error %d io_uring engine setup\r\n", err);
+  }
+  return err;
+}
+
+/**
+ * @brief updates the registered files of a transfer slot
+ *
+ * @param[in] ring ring of the event loop of the calling worker
+ * @param[in] slot first registered file of the transfer
+ * @param[in] file_fd file to be registered, -1 to unregister
+ * @param[in] client_fd socket to be registered, -1 to unregister
+ * @return 0 success, <0 error
+ */
+static int _uring_files_update(struct uring_t *ring, int slot, int file_fd,
+                               int client_fd) {
+  int fds[2] = {file_fd, client_fd};
+  struct io_uring_files_update update = {.offset = slot,
+                                         .fds = (uintptr_t)fds};
+
+  int err = uring_register(ring, IORING_REGISTER_FILES_UPDATE, &update, 2);
+  return err < 0 ? err : 0;
+}
+
+/**
+ * @brief registers the buffer leased by the transfer of a slot, requests in
+ * flight keep the buffer they were posted with
+ *
+ * @param[in] ring ring of the event loop of the calling worker
+ * @param[in] slot transfer slot, index of the registered buffer
+ * @param[in] buffer leased buffer
+ * @param[in] size size of the buffer
+ * @return 0 success, <0 error
+ */
+static int _uring_buffer_update(struct uring_t *ring, size_t slot,
+                                uint8_t *buffer, size_t size) {
+  struct iovec iov = {.iov_base = buffer, .iov_len = size};
+  struct io_uring_rsrc_update2 update = {
+      .offset = slot, .data = (uintptr_t)&iov, .nr = 1};
+
+  int err = uring_register(ring, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                           sizeof(update));
+  return err < 0 ? err : 0;
+}
+
+/**
+ * @brief releases the chain of the io_uring engine once none of its requests
+ * are in flight, along with its buffer
+ *
+ * @param[in] chain chain of the engine
+ */
+static void _uring_chain_free(struct file_transfer_uring_t *chain) {
+  if (chain->buffer) {
+    buffer_pool_release(chain->pool, chain->buffer);
+  }
+  free(chain);
+}
+
+/**
+ * @brief tells whether requests of the chain of the io_uring engine are in
+ * flight
+ *
+ * @param[in] chain chain of the engine, NULL if none
+ * @return true if completions are still to be returned
+ */
+static bool _uring_chain_inflight(const struct file_transfer_uring_t *chain) {
+  return chain && chain->count && chain->reaped < 2 * chain->count;
+}
+
+/**
+ * @brief opens a file beneath the storage directory through the name cache, a
+ * file held by the file cache is returned without its name entry and a file
+ * that fits in it is read into it and released right away. Runs on the worker
+ * or on a file I/O thread
+ *
+ * @param[in] name name of the file relative to the storage directory
+ * @param[out] entry name entry holding the open file, NULL if cached
+ * @param[out] cache cache entry of the file, NULL if not cached
+ * @param[out] st status of the file
+ * @param[out] opened the file was opened
+ * @param[out] closed the file was closed already
+ * @param[out] digest CRC32C of the file, NULL if not wanted
+ * @return 0 success, <0 error
+ */
+static int _file_name_open(const char *name, struct file_names_entry_t **entry,
+                           struct file_cache_entry_t **cache, struct stat *st,
+                           bool *opened, bool *closed, uint32_t *digest) {
+  int err = 0;
+
+  *cache = NULL;
+  *closed = false;
+
+  err = file_names_open(name, entry);
+  *opened = err > 0;
+  if (err < 0) {
+    *entry = NULL;
+    return err;
+  }
+  *st = (*entry)->st;
+
+  // kept with the name entry, computed by the first download asking for it
+  err = digest ? file_names_digest(*entry, digest) : 0;
+  if (err < 0) {
+    file_names_release(*entry);
+    *entry = NULL;
+    return err;
+  }
+
+  // the status tells whether the cached contents are still those of the file
+  if (file_cache_enabled()) {
+    *cache = file_cache_get(name, st);
+    if (!*cache) {
+      *cache = file_cache_put(name, st, (*entry)->fd);
+    }
+  }
+
+  if (*cache) {
+    *closed = file_names_release(*entry);
+    *entry = NULL;
+  }
+  return 0;
+}
+
+/**
+ * @brief opens the file of a request. A compressed download is sent from the
+ * artifact of the file if one was written for its current version, as stored
+ * if its artifact is empty as compression did not shrink it, otherwise the
+ * file is compressed as it is sent and its artifact written meanwhile.
+ * Runs on a file I/O thread, or inline on the worker without the pool
+ *
+ * @param[in,out] request FILE_IO_OPEN request holding the name and encoding
+ * @return 0 success, <0 error
+ */
+static int _file_open_work(struct file_io_request_t *request) {
+  int err = 0;
+  bool opened = false, closed = false;
+  struct file_names_entry_t *entry = NULL, *name = NULL;
+  struct file_cache_entry_t *cache = NULL;
+  struct stat st = {};
+  char artifact[FILE_COMPRESS_ARTIFACT_NAME_SIZE_MAX] = {};
+
+  if (file_compress_artifact_match(request->path)) {
+    return -ENOENT; // artifacts are only sent in place of their file
+  }
+
+  if (request->encoding && !file_compress_available(request->encoding)) {
+    request->encoding = FILE_COMPRESS_NONE; // sent as stored
+  }
+
+  if (!request->encoding) {
+    err = _file_name_open(request->path,
+                          (struct file_names_entry_t **)&request->name,
+                          (struct file_cache_entry_t **)&request->cache,
+                          &request->st, &request->opened, &request->closed,
+                          request->digest ? &request->crc : NULL);
+    if (!err) {
+      request->size = request->cache
+                          ? ((struct file_cache_entry_t *)request->cache)->size
+                          : (size_t)request->st.st_size;
+    }
+    return err;
+  }
+
+  // the artifact is named after the inode and mtime of the file
+  err = file_names_open(request->path, &entry);
+  if (err < 0) {
+    return err;
+  }
+  request->opened = err > 0;
+  request->size = entry->st.st_size;
+
+  // the digest is the one of the file, not of the compressed stream
+  err = request->digest ? file_names_digest(entry, &request->crc) : 0;
+  if (err < 0) {
+    file_names_release(entry);
+    return err;
+  }
+
+  err = file_compress_artifact_name(request->path, &entry->st,
+                                    request->encoding, artifact);
+  if (!err && !_file_name_open(artifact, &name, &cache, &st, &opened, &closed,
+                               NULL)) {
+    request->opened |= opened;
+    request->closed = closed;
+    if (st.st_size) {
+      request->name = name;
+      request->cache = cache;
+      request->st = st;
+      request->closed |= file_names_release(entry);
+      file_compress_artifact_served();
+      return 0;
+    }
+
+    // not worth compressing, the file is sent as stored
+    if (cache) {
+      file_cache_release(cache);
+    } else {
+      request->closed |= file_names_release(name);
+    }
+    request->encoding = FILE_COMPRESS_NONE;
+    request->name = entry;
+    request->st = entry->st;
+    return 0;
+  }
+
+  request->name = entry;
+  request->st = entry->st;
+  request->compressing = true;
+  request->artifact = err ? NULL : file_compress_artifact_create(artifact);
+  return 0;
+}
+
+/**
+ * @brief takes over the outcome of opening the requested file
+ *
+ * @param[in,out] ctx transfer context
+ * @param[in] request FILE_IO_OPEN request that succeeded
+ */
+static void _file_opened(struct file_transfer_t *ctx,
+                         const struct file_io_request_t *request) {
+  ctx->name = request->name;
+  ctx->file_fd = ctx->name ? ctx->name->fd : -1;
+  ctx->cache = request->cache;
+  ctx->file_size = ctx->cache ? ctx->cache->size : (size_t)request->st.st_size;
+  ctx->source_size = request->size;
+  ctx->encoded = request->encoding != FILE_COMPRESS_NONE;
+  ctx->compressing = request->compressing;
+  ctx->artifact = request->artifact;
+  ctx->file_crc = request->crc;
+  ctx->open_count += request->opened;
+  ctx->close_count += request->closed;
+
+  // compressed chunks are only produced by reading into a buffer
+  if (ctx->compressing) {
+    ctx->engine = FILE_TRANSFER_ENGINE_COPY;
+  }
+}
+
+/**
+ * @brief opens the requested file for the lifetime of a transfer on the
+ * calling thread
+ *
+ * @param[in,out] ctx transfer context holding the key/filename
+ * @return 0 success, <0 error
+ */
+static int _file_open(struct file_transfer_t *ctx) {
+  int err = 0;
+  struct file_io_request_t request = {.encoding = ctx->encoding,
+                                      .digest = ctx->crc_file};
+
+  snprintf(request.path, sizeof(request.path), "%s", ctx->filename);
+  err = _file_open_work(&request);
+  if (err < 0) {
+    return err;
+  }
+  _file_opened(ctx, &request);
+  return 0;
+}
+
+/**
+ * @brief reads the chunk of a request on a file I/O thread
+ *
+ * @param[in,out] request FILE_IO_READ request
+ * @return number of bytes read, <0 error
+ */
+static int _file_read_work(struct file_io_request_t *request) {
+  ssize_t result =
+      pread(request->fd, request->data, request->size, request->offset);
+
+  if (result > 0 && request->digest) { // off the event loop as well
+    request->crc = crc32c(0, request->data, result);
+  }
+  return result < 0 ? -errno : result;
+}
+
+/**
+ * @brief reads and compresses the chunk of a request on a file I/O thread,
+ * the compressed chunk is appended to the artifact being written
+ *
+ * @param[in,out] request FILE_IO_READ request of a compressed download
+ * @return number of compressed bytes, <0 error
+ */
+static int _file_compress_work(struct file_io_request_t *request) {
+  int result = file_compress_read(request->encoding, request->fd,
+                                  request->offset, request->size,
+                                  request->data, request->capacity,
+                                  &request->consumed);
+
+  if (result > 0 && request->artifact) {
+    file_compress_artifact_write(request->artifact, request->data, result);
+  }
+  if (result > 0 && request->digest) {
+    request->crc = crc32c(0, request->data, result);
+  }
+  return result;
+}
+
+/**
+ * @brief hands a request of a transfer to the file I/O pool, the transfer
+ * waits for it to complete
+ *
+ * @param[in,out] ctx transfer context
+ * @param[in] request request whose arguments are set
+ */
+static void _file_io_submit(struct file_transfer_t *ctx,
+                            struct file_io_request_t *request) {
+  request->owner = ctx;
+  ctx->inflight = request;
+  file_io_submit(request);
+}
+
+/**
+ * @brief opens the requested file on the file I/O pool, the transfer starts
+ * once it completes
+ *
+ * @param[in,out] ctx transfer context holding the key/filename
+ * @return 0 success, <0 error
+ */
+static int _file_open_submit(struct file_transfer_t *ctx) {
+  struct file_io_request_t *request = file_io_request_get(ctx->io);
+
+  if (!request) {
+    return -ENOMEM;
+  }
+
+  request->op = FILE_IO_OPEN;
+  request->work = _file_open_work;
+  request->encoding = ctx->encoding;
+  request->digest = ctx->crc_file;
+  snprintf(request->path, sizeof(request->path), "%s", ctx->filename);
+  _file_io_submit(ctx, request);
+  return 0;
+}
+
+/**
+ * @brief closes the file, splice pipe and registered files of a transfer
+ *
+ * @param[in,out] ctx transfer context holding the file descriptor
+ */
+static void _file_close(struct file_transfer_t *ctx) {
+  // the request completes later and releases what it opened or reads into
+  if (ctx->inflight) {
+    if (ctx->inflight->op == FILE_IO_READ) {
+      ctx->inflight->name = ctx->name;
+      ctx->name = NULL;
+      ctx->file_fd = -1;
+      ctx->prefetch = NULL;
+      ctx->artifact = NULL; // written by the read, discarded with it
+    }
+    ctx->inflight->owner = NULL;
+    ctx->inflight = NULL;
+  }
+
+  if (ctx->uring_slot >= 0) {
+    _uring_files_update(&ctx->loop->uring, ctx->uring_slot, -1, -1);
+    ctx->uring_slot = -1;
+  }
+
+  // a chain in flight is released by its last completion
+  if (_uring_chain_inflight(ctx->uring)) {
+    ctx->uring->owner = NULL;
+  } else if (ctx->uring) {
+    _uring_chain_free(ctx->uring);
+  }
+  ctx->uring = NULL;
+
+  // the file stays open while its name is cached
+  if (ctx->name) {
+    ctx->close_count += file_names_release(ctx->name);
+    ctx->name = NULL;
+  }
+  ctx->file_fd = -1;
+
+  if (ctx->cache) {
+    file_cache_release(ctx->cache);
+    ctx->cache = NULL;
+  }
+
+  // left over when the transfer did not compress the whole file
+  if (ctx->artifact) {
+    file_compress_artifact_discard(ctx->artifact);
+    ctx->artifact = NULL;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (ctx->pipe_fds[i] >= 0) {
+      close(ctx->pipe_fds[i]);
+      ctx->pipe_fds[i] = -1;
+    }
+  }
+  ctx->pipe_pending = 0;
+
+  // unmapped as soon as the transfer ends, not when the context is reused
+  if (ctx->map) {
+    munmap(ctx->map, ctx->file_size);
+    ctx->map = NULL;
+  }
+
+  if (ctx->buffer) {
+    buffer_pool_release(ctx->pool, ctx->buffer);
+    ctx->buffer = NULL;
+  }
+  ctx->buffer_offset = 0;
+  ctx->buffer_length = 0;
+
+  if (ctx->prefetch) {
+    buffer_pool_release(ctx->pool, ctx->prefetch);
+    ctx->prefetch = NULL;
+  }
+  ctx->prefetch_length = 0;
+}
+
+/**
+ * @brief reads data from an open file at the given offset
+ *
+ * @param[in] fd file descriptor to read from
  * @param[out] data buffer to be populated with read data
  * @param[in] size size of data to be read
  * @param[in] offset start offset to begin reading from
- * @param[in] fp file handler
  * @param[out] eof indicates EOF
  * @return number of bytes read >0 on success, 0 on EOF, <0 error
  */
-static int _file_read(const char *table, const char *key, void *data,
-                      size_t size, size_t offset, FILE *fp, bool *eof) {
-  int err = 0, close_err = 0;
+static int _file_read(int fd, void *data, size_t size, size_t offset,
+                      bool *eof) {
+  int err = 0;
+
+  err = pread(fd, data, size, offset);
+  if (err < 0) { // check of errors
+    err = -errno;
+    LOG_ERROR("error pread %d\r\n", errno);
+  } else if (err < size) { // a short read on a regular file means EOF
+    LOG_DEBUG("reached EOF\r\n");
+    *eof = true;
+  }
+
+  return err;
+}
+
+/**
+ * @brief resets the progress of a transfer, leaving the settings chosen by
+ * the caller untouched
+ *
+ * @param[out] ctx points to the file transfer context
+ */
+static void _file_transfer_progress_reset(struct file_transfer_t *ctx) {
+  ctx->file_fd = -1;
+  ctx->cache = NULL;
+  ctx->file_size = 0;
+  ctx->uring_slot = -1;
+  ctx->uring = NULL;
+  ctx->pipe_fds[0] = -1;
+  ctx->pipe_fds[1] = -1;
+  ctx->pipe_pending = 0;
+  ctx->map = NULL;
+  ctx->map_advised = 0;
+  ctx->map_window = FILE_TRANSFER_MMAP_WINDOW_MIN;
+  ctx->buffer = NULL;
+  ctx->buffer_offset = 0;
+  ctx->buffer_length = 0;
+  ctx->buffer_header = 0;
+  ctx->buffer_trailer = 0;
+  ctx->read_eof = false;
+  ctx->inflight = NULL;
+  ctx->io_error = 0;
+  ctx->prefetch = NULL;
+  ctx->prefetch_length = 0;
+  ctx->prefetch_header = 0;
+  ctx->io_offset = 0;
+  ctx->eof_pending = false;
+  ctx->eof_sent = false;
+  ctx->frame_offset = 0;
+  ctx->frame_length = 0;
+  ctx->frame_cmd = 0;
+  ctx->frame_remaining = 0;
+  ctx->transferred_total = 0;
+  ctx->range = 0;
+  ctx->range_start = 0;
+  ctx->range_end = 0;
+  ctx->ranges_sent = 0;
+  ctx->encoded = false;
+  ctx->compressing = false;
+  ctx->source_size = 0;
+  ctx->buffer_raw = 0;
+  ctx->prefetch_raw = 0;
+  ctx->encoded_total = 0;
+  ctx->artifact = NULL;
+  ctx->file_crc = 0;
+  ctx->frame_crc = 0;
+  ctx->frame_trailer = false;
+  ctx->open_count = 0;
+  ctx->close_count = 0;
+}
+
+/**
+ * @brief starts a v2 frame whose header, and payload if it is built by the
+ * transfer itself, is sent from ctx->frame
+ *
+ * @param[in,out] ctx points to the file transfer context
+ * @param[in] cmd command of the frame
+ * @param[in] length payload bytes announced by the header
+ * @param[in] control payload bytes the caller encodes after the header
+ */
+static void _file_transfer_frame_start(struct file_transfer_t *ctx,
+                                       uint8_t cmd, uint32_t length,
+                                       size_t control) {
+  packet_v2_header_encode(ctx->frame, cmd, ctx->request_id, length);
+  ctx->frame_cmd = cmd;
+  ctx->frame_offset = 0;
+  ctx->frame_length = PACKET_V2_HEADER_SIZE + control;
+  ctx->frame_trailer = false;
+}
+
+/**
+ * @brief completes a frame started by _file_transfer_frame_start once its
+ * payload is encoded. With CRC trailers negotiated the CRC32C of the header
+ * and payload follows the payload, DATA frames carry on the CRC with the data
+ * sent and get their trailer once it is all out
+ *
+ * @param[in,out] ctx points to the file transfer context
+ */
+static void _file_transfer_frame_seal(struct file_transfer_t *ctx) {
+  if (!ctx->crc_frames) {
+    return;
+  }
+
+  ctx->frame_crc = crc32c(0, ctx->frame, ctx->frame_length);
+  if (ctx->frame_cmd != CMD_DOWNLOAD_FILE_DATA) {
+    packet_u32_encode(ctx->frame + ctx->frame_length, ctx->frame_crc);
+    ctx->frame_length += PACKET_CRC_SIZE;
+  }
+}
+
+/**
+ * @brief appends the CRC32C trailer to a DATA frame built in a buffer, from
+ * the CRC of its payload, without reading the payload again
+ *
+ * @param[in] ctx points to the file transfer context
+ * @param[in,out] frame DATA frame whose header is encoded
+ * @param[in] length payload bytes following the header
+ * @param[in] crc CRC32C of the payload
+ * @return trailer bytes appended, 0 without CRC trailers
+ */
+static size_t _file_transfer_trailer(const struct file_transfer_t *ctx,
+                                     uint8_t *frame, size_t length,
+                                     uint32_t crc) {
+  if (!ctx->crc_frames) {
+    return 0;
+  }
+
+  crc = crc32c_combine(crc32c(0, frame, PACKET_V2_HEADER_SIZE), crc, length);
+  packet_u32_encode(frame + PACKET_V2_HEADER_SIZE + length, crc);
+  return PACKET_CRC_SIZE;
+}
+
+/**
+ * @brief resets a file transfer context to the idle state
+ *
+ * @param[out] ctx points to the file transfer context
+ */
+void file_transfer_context_reset(struct file_transfer_t *ctx) {
+  ctx->client_fd = -1;
+  ctx->pool = NULL;
+  ctx->io = NULL;
+  ctx->loop = NULL;
+  ctx->chunk_size = FILE_TRANSFER_CHUNK_SIZE;
+  ctx->chunk_adaptive = false;
+  ctx->protocol = PACKET_VERSION_1;
+  ctx->request_id = 0;
+  ctx->frame_size = FILE_TRANSFER_FRAME_SIZE_MAX;
+  ctx->filename[0] = '\0';
+  ctx->ranges_count = 0;
+  ctx->encoding = FILE_COMPRESS_NONE;
+  ctx->crc_frames = false;
+  ctx->crc_file = false;
+  _file_transfer_progress_reset(ctx);
+}
+
+/**
+ * @brief clamps the requested ranges to the size of the opened file, a range
+ * without a length or running past the end stops at the end of the file
+ *
+ * @param[in,out] ctx points to the file transfer context
+ * @return 0 success, -ERANGE if a range starts past the end of the file
+ */
+static int _file_transfer_ranges_check(struct file_transfer_t *ctx) {
+  struct file_transfer_range_t *range = NULL;
+
+  for (size_t i = 0; i < ctx->ranges_count; i++) {
+    range = &ctx->ranges[i];
+    if (range->offset > ctx->file_size) {
+      LOG_WARN("range %zu at %zu is past the %zu bytes of %s\r\n", i,
+               range->offset, ctx->file_size, ctx->filename);
+      return -ERANGE;
+    }
+
+    if (!range->length || range->length > ctx->file_size - range->offset) {
+      range->length = ctx->file_size - range->offset;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief moves a ranged transfer to its current range, announced to the
+ * client by a RANGE frame carrying the file size, offset and length
+ *
+ * @param[in,out] ctx points to the file transfer context
+ */
+static void _file_transfer_range_start(struct file_transfer_t *ctx) {
+  const struct file_transfer_range_t *range = &ctx->ranges[ctx->range];
+  uint8_t *payload = ctx->frame + PACKET_V2_HEADER_SIZE;
+
+  // every engine reads from transferred_total, reads ahead restart there
+  ctx->transferred_total = range->offset;
+  ctx->range_start = range->offset;
+  ctx->range_end = range->offset + range->length;
+  ctx->io_offset = range->offset;
+  ctx->read_eof = false;
+  ctx->map_advised = range->offset;
+  ctx->map_window = FILE_TRANSFER_MMAP_WINDOW_MIN;
+
+  _file_transfer_frame_start(ctx, CMD_DOWNLOAD_RANGE, 3 * sizeof(uint64_t),
+                             3 * sizeof(uint64_t));
+  packet_u64_encode(payload, ctx->file_size);
+  packet_u64_encode(payload + sizeof(uint64_t), range->offset);
+  packet_u64_encode(payload + 2 * sizeof(uint64_t), range->length);
+  _file_transfer_frame_seal(ctx);
+}
+
+/**
+ * @brief starts sending a transfer whose file is open, a v2 transfer starts
+ * with a frame announcing the file size, or the first of its ranges
+ *
+ * @param[in,out] ctx points to the file transfer context
+ * @return 0 success, <0 error and nothing was sent
+ */
+static int _file_transfer_start(struct file_transfer_t *ctx) {
+  int err = _file_transfer_ranges_check(ctx);
+
+  if (err < 0) {
+    return err;
+  }
+
+  // CRC trailers are computed from the data in memory, not from the kernel
+  if (ctx->crc_frames && !ctx->cache &&
+      ctx->engine != FILE_TRANSFER_ENGINE_MMAP) {
+    ctx->engine = FILE_TRANSFER_ENGINE_COPY;
+  }
+
+  if (ctx->engine == FILE_TRANSFER_ENGINE_URING && !ctx->cache) {
+    // the worker only picks the engine once the ring of its loop is set up
+    err = _uring_files_update(&ctx->loop->uring, 2 * ctx->slot, ctx->file_fd,
+                              ctx->client_fd);
+    if (err < 0) {
+      LOG_WARN("error %d registering fd %d, falling back to copy\r\n", err,
+               ctx->client_fd);
+      ctx->engine = FILE_TRANSFER_ENGINE_COPY;
+    } else {
+      ctx->uring_slot = 2 * ctx->slot;
+    }
+  }
+
+  if (ctx->protocol == PACKET_VERSION_2 && ctx->ranges_count) {
+    _file_transfer_range_start(ctx);
+  } else if (ctx->protocol == PACKET_VERSION_2 && ctx->encoding) {
+    // the size of the file, then the encoding the data is actually sent in
+    ctx->range_end = ctx->file_size;
+    _file_transfer_frame_start(ctx, CMD_DOWNLOAD_FILE, sizeof(uint64_t) + 1,
+                               sizeof(uint64_t) + 1);
+    packet_u64_encode(ctx->frame + PACKET_V2_HEADER_SIZE, ctx->source_size);
+    ctx->frame[PACKET_V2_HEADER_SIZE + sizeof(uint64_t)] =
+        ctx->encoded ? ctx->encoding : FILE_COMPRESS_NONE;
+    _file_transfer_frame_seal(ctx);
+  } else if (ctx->protocol == PACKET_VERSION_2) {
+    ctx->range_end = ctx->file_size;
+    _file_transfer_frame_start(ctx, CMD_DOWNLOAD_FILE, sizeof(uint64_t),
+                               sizeof(uint64_t));
+    packet_u64_encode(ctx->frame + PACKET_V2_HEADER_SIZE, ctx->file_size);
+    _file_transfer_frame_seal(ctx);
+  }
+  LOG_DEBUG("started transfer of %s on fd %d using %s engine%s%s\r\n",
+            ctx->filename, ctx->client_fd,
+            ctx->cache ? "cache" : file_transfer_engine_name(ctx->engine),
+            ctx->encoded ? (ctx->compressing ? ", compressing to " : ", from ")
+                         : "",
+            ctx->encoded ? file_compress_name(ctx->encoding) : "");
+  return 0;
+}
+
+/**
+ * @brief starts a transfer on a context whose client_fd, engine, filename,
+ * protocol and, for the copy engine, pool and chunk settings are set, the
+ * requested file stays open until the context is removed. With a file I/O
+ * queue set the file is opened by the pool and the transfer waits for it,
+ * errors opening it surface from file_transfer
+ *
+ * @param[in,out] ctx points to the file transfer context
+ * @param[in] slot index of the connection owning the context
+ * @param[in] slots_max number of connections, bounds slot
+ * @return 0 success, <0 error and the context is left idle
+ */
+int file_transfer_context_add(struct file_transfer_t *ctx, size_t slot,
+                              size_t slots_max) {
+  int err = 0;
+
+  if (ctx->client_fd < 0) {
+    LOG_WARN("invalid fd %d\r\n", ctx->client_fd);
+    return -EINVAL;
+  } else if (ctx->filename[0] == '\0') {
+    LOG_WARN("invalid filename\r\n");
+    ctx->client_fd = -1;
+    return -ENODATA;
+  }
+
+  _file_transfer_progress_reset(ctx);
+  ctx->slot = slot;
+  ctx->slots_max = slots_max;
+
+  err = ctx->io ? _file_open_submit(ctx) : _file_open(ctx);
+  if (!err && !ctx->inflight) {
+    err = _file_transfer_start(ctx);
+  }
+
+  if (err < 0) {
+    LOG_WARN("error %d opening %s\r\n", err, ctx->filename);
+    _file_close(ctx);
+    ctx->client_fd = -1;
+    return err;
+  }
+  return 0;
+}
+
+/**
+ * @brief turns a v2 request that could not be started into an ERROR frame, the
+ * transfer completes once the frame is sent
+ *
+ * @param[in,out] ctx points to the file transfer context
+ * @param[in] fd connection the request came from
+ * @param[in] error negative errno describing why the request failed
+ * @return 0 success, <0 error if the protocol has no error frames
+ */
+int file_transfer_context_error(struct file_transfer_t *ctx, int fd,
+                                int error) {
+  if (ctx->protocol != PACKET_VERSION_2) {
+    return error;
+  }
+
+  _file_transfer_progress_reset(ctx);
+  ctx->client_fd = fd;
+  _file_transfer_frame_start(ctx, CMD_DOWNLOAD_FILE_ERROR, sizeof(uint32_t),
+                             sizeof(uint32_t));
+  packet_u32_encode(ctx->frame + PACKET_V2_HEADER_SIZE, -error);
+  _file_transfer_frame_seal(ctx);
+  LOG_DEBUG("sending error %d for request %u on fd %d\r\n", error,
+            ctx->request_id, fd);
+  return 0;
+}
+
+/**
+ * @brief ends the transfer on a context and closes its file
+ *
+ * @param[in,out] ctx points to the file transfer context
+ */
+void file_transfer_context_remove(struct file_transfer_t *ctx) {
+  if (ctx->client_fd < 0) {
+    LOG_WARN("an error may have occurred since no transfer is active\r\n");
+    return;
+  }
+
+  _file_close(ctx);
+  LOG_DEBUG("transfer on fd %d issued %u open, %u close syscalls\r\n",
+            ctx->client_fd, ctx->open_count, ctx->close_count);
+  file_transfer_context_reset(ctx);
+}
+
+/**
+ * @brief tells whether the socket is in the middle of a frame of this
+ * transfer, frames of other transfers may only be sent in between
+ *
+ * @param[in] ctx points to the file transfer context
+ * @return true if part of a frame has yet to be sent
+ */
+bool file_transfer_frame_pending(const struct file_transfer_t *ctx) {
+  return ((ctx->frame_offset || ctx->frame_trailer) &&
+          ctx->frame_offset < ctx->frame_length) ||
+         ctx->frame_remaining || ctx->buffer_offset < ctx->buffer_length;
+}
+
+/**
+ * @brief notifies the client that the whole file has been sent
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @return 0 on success, -EAGAIN on would block, <0 error
+ */
+static int _file_transfer_eof_notify(int fd,
+                                     struct file_transfer_t *file_transfer) {
+  int err = 0;
+  // legacy marker, size of the trailing chunk the copy engine would have read
+  uint8_t marker =
+      file_transfer->transferred_total % FILE_TRANSFER_BUFF_READ_SIZE;
+
+  file_transfer->eof_pending = true;
+  err = server_write(fd, &marker, sizeof(marker));
+  if (err < 0) {
+    LOG_WARN("send error %d\r\n", err);
+  } else if (!err) {
+    err = -EAGAIN; // retry on the next POLLOUT
+  } else {
+    file_transfer->eof_pending = false;
+    err = 0;
+  }
+  return err;
+}
+
+/**
+ * @brief tells whether the pending frame is the header of an announced DATA
+ * frame whose payload is sent from memory, it then goes out with the payload
+ *
+ * @param[in] ctx points to the file transfer context
+ * @return true if the header is sent by _file_transfer_gather
+ */
+static bool _file_transfer_frame_gathered(const struct file_transfer_t *ctx) {
+  return ctx->frame_cmd == CMD_DOWNLOAD_FILE_DATA && !ctx->frame_trailer &&
+         ctx->frame_remaining &&
+         (ctx->cache || ctx->engine == FILE_TRANSFER_ENGINE_MMAP ||
+          ctx->engine == FILE_TRANSFER_ENGINE_COPY);
+}
+
+/**
+ * @brief sends data held in memory with a single system call, along with the
+ * header of the DATA frame it belongs to if not sent yet and, for v1, the EOF
+ * marker once the data reaches the end of the file. Sent with MSG_MORE unless
+ * it ends with the marker, what the transfer sends next fills the segment
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] data data to be sent
+ * @param[in] size bytes of data
+ * @param[in] last data runs up to the end of the file
+ * @param[out] sent bytes of data sent, the caller accounts for them
+ * @return number of bytes sent >0, -EAGAIN on would block, <0 error
+ */
+static int _file_transfer_gather(int fd, struct file_transfer_t *file_transfer,
+                                 const uint8_t *data, size_t size, bool last,
+                                 size_t *sent) {
+  struct iovec iov[3] = {};
+  int err = 0, count = 0;
+  size_t head = file_transfer->frame_length - file_transfer->frame_offset;
+  bool marker = last && file_transfer->protocol == PACKET_VERSION_1;
+  // legacy marker, size of the trailing chunk the copy engine would have read
+  uint8_t eof = (file_transfer->transferred_total + size) %
+                FILE_TRANSFER_BUFF_READ_SIZE;
+
+  if (head) {
+    iov[count].iov_base = file_transfer->frame + file_transfer->frame_offset;
+    iov[count++].iov_len = head;
+  }
+  iov[count].iov_base = (void *)data;
+  iov[count++].iov_len = size;
+  if (marker) {
+    iov[count].iov_base = &eof;
+    iov[count++].iov_len = sizeof(eof);
+  }
+
+  *sent = 0;
+  err = server_writev(fd, iov, count, !marker);
+  if (err < 0) {
+    LOG_WARN("send error %d\r\n", err);
+    return err;
+  } else if (!err) {
+    return -EAGAIN;
+  }
+
+  head = (size_t)err < head ? (size_t)err : head;
+  file_transfer->frame_offset += head;
+  *sent = err - head < size ? err - head : size;
+  file_transfer->eof_sent = marker && err - head > size;
+  return err;
+}
+
+/**
+ * @brief leases a buffer used by the copy engine, done on first use so
+ * transfers falling back to the copy engine get one too
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[out] buffer leased buffer
+ * @return 0 success, <0 error
+ */
+static int _file_transfer_buffer_lease(struct file_transfer_t *file_transfer,
+                                       uint8_t **buffer) {
+  if (!file_transfer->pool) {
+    LOG_ERROR("no buffer pool for fd %d\r\n", file_transfer->client_fd);
+    return -EINVAL;
+  }
+
+  *buffer = buffer_pool_lease(file_transfer->pool);
+  if (!*buffer) {
+    LOG_WARN("buffer pool exhausted, %ld buffers leased\r\n",
+             file_transfer->pool->leased);
+    return -ENOBUFS;
+  }
+
+  if (file_transfer->chunk_size < FILE_TRANSFER_CHUNK_SIZE_MIN) {
+    file_transfer->chunk_size = FILE_TRANSFER_CHUNK_SIZE_MIN;
+  } else if (file_transfer->chunk_size > file_transfer->pool->buffer_size) {
+    file_transfer->chunk_size = file_transfer->pool->buffer_size;
+  }
+  return 0;
+}
+
+/**
+ * @brief returns how much the copy engine reads into a buffer at once,
+ * outside of an announced v2 DATA frame room is left for a frame header and
+ * its CRC trailer
+ *
+ * @param[in] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be read
+ * @param[out] header frame header bytes ahead of the data
+ * @return bytes to be read
+ */
+static size_t _file_transfer_chunk_size(struct file_transfer_t *file_transfer,
+                                        size_t limit, size_t *header) {
+  size_t size = file_transfer->chunk_size, max = 0, room = 0;
+
+  *header = 0;
+  if (file_transfer->protocol == PACKET_VERSION_2 &&
+      !file_transfer->frame_remaining) {
+    *header = PACKET_V2_HEADER_SIZE;
+    size = size < file_transfer->frame_size ? size : file_transfer->frame_size;
+  }
+
+  room = file_transfer->pool->buffer_size - *header -
+         (*header && file_transfer->crc_frames ? PACKET_CRC_SIZE : 0);
+  size = size < room ? size : room;
+
+  // file bytes whose compressed frame is sure to fit the buffer
+  if (file_transfer->compressing) {
+    max = file_compress_input_max(file_transfer->encoding, room);
+    size = size < max ? size : max;
+  }
+  return size < limit ? size : limit;
+}
+
+/**
+ * @brief reads and compresses a chunk of the file on the calling thread, the
+ * compressed chunk is appended to the artifact being written
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[out] data buffer the compressed chunk is written to
+ * @param[in] capacity bytes data may hold
+ * @param[in] size file bytes to compress
+ * @return number of compressed bytes >0, 0 on EOF, <0 error
+ */
+static int _file_transfer_compress(struct file_transfer_t *file_transfer,
+                                   uint8_t *data, size_t capacity,
+                                   size_t size) {
+  int err = 0;
+
+  err = file_compress_read(file_transfer->encoding, file_transfer->file_fd,
+                           file_transfer->transferred_total, size, data,
+                           capacity, &file_transfer->buffer_raw);
+  if (err < 0) {
+    LOG_ERROR("error compressing %d\r\n", err);
+    return err;
+  } else if (file_transfer->buffer_raw < size) { // short read, EOF
+    LOG_DEBUG("reached EOF\r\n");
+    file_transfer->read_eof = true;
+  }
+
+  if (err && file_transfer->artifact) {
+    file_compress_artifact_write(file_transfer->artifact, data, err);
+  }
+  return err;
+}
+
+/**
+ * @brief refills the buffer of the copy engine on the calling thread
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be read
+ * @return number of bytes read >0, 0 on EOF, <0 error
+ */
+static int _file_transfer_fill(struct file_transfer_t *file_transfer,
+                               size_t limit) {
+  int err = 0;
+  size_t header = 0, size = 0;
+  uint32_t crc = 0;
 
-  char path[FILE_TRANSFER_PATH_NAME_SIZE_MAX] = {};
-  snprintf(path, sizeof(path), "%s/%s", table, key);
+  if (file_transfer->read_eof || !limit) {
+    return 0; // EOF
+  }
+
+  size = _file_transfer_chunk_size(file_transfer, limit, &header);
+  if (file_transfer->compressing) {
+    err = _file_transfer_compress(
+        file_transfer, file_transfer->buffer + header,
+        file_transfer->pool->buffer_size - header -
+            (header && file_transfer->crc_frames ? PACKET_CRC_SIZE : 0),
+        size);
+  } else {
+    err = _file_read(file_transfer->file_fd, file_transfer->buffer + header,
+                     size, file_transfer->transferred_total,
+                     &file_transfer->read_eof);
+    file_transfer->buffer_raw = err;
+  }
+  if (err <= 0) {
+    return err;
+  }
+
+  file_transfer->buffer_trailer = 0;
+  if (header) {
+    packet_v2_header_encode(file_transfer->buffer, CMD_DOWNLOAD_FILE_DATA,
+                            file_transfer->request_id, err);
+    crc = file_transfer->crc_frames
+              ? crc32c(0, file_transfer->buffer + header, err)
+              : 0;
+    file_transfer->buffer_trailer =
+        _file_transfer_trailer(file_transfer, file_transfer->buffer, err, crc);
+  }
+  file_transfer->buffer_offset = 0;
+  file_transfer->buffer_header = header;
+  file_transfer->buffer_length = header + err + file_transfer->buffer_trailer;
+  return err;
+}
+
+/**
+ * @brief reads the next chunk into the prefetch buffer on the file I/O pool,
+ * unless a read is in flight, a chunk is waiting or the file has been read
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] end file offset reads stop at
+ * @return 0 success, <0 error
+ */
+static int _file_transfer_prefetch(struct file_transfer_t *file_transfer,
+                                   size_t end) {
+  int err = 0;
+  size_t header = 0, size = 0;
+  struct file_io_request_t *request = NULL;
+
+  if (file_transfer->inflight || file_transfer->prefetch_length ||
+      file_transfer->read_eof) {
+    return 0;
+  } else if (file_transfer->io_offset >= end) {
+    file_transfer->read_eof = true;
+    return 0;
+  }
+
+  if (!file_transfer->prefetch) {
+    err = _file_transfer_buffer_lease(file_transfer, &file_transfer->prefetch);
+    if (err < 0) {
+      return err;
+    }
+  }
+
+  request = file_io_request_get(file_transfer->io);
+  if (!request) {
+    return -ENOMEM;
+  }
+
+  size = _file_transfer_chunk_size(file_transfer,
+                                   end - file_transfer->io_offset, &header);
+  request->op = FILE_IO_READ;
+  request->work = _file_read_work;
+  request->fd = file_transfer->file_fd;
+  request->data = file_transfer->prefetch + header;
+  request->size = size;
+  request->offset = file_transfer->io_offset;
+  request->buffer = file_transfer->prefetch;
+  request->pool = file_transfer->pool;
+  request->digest = header && file_transfer->crc_frames;
+  if (file_transfer->compressing) {
+    // the artifact is written in order, a single read is ever in flight
+    request->work = _file_compress_work;
+    request->compressing = true;
+    request->encoding = file_transfer->encoding;
+    request->capacity = file_transfer->pool->buffer_size - header -
+                        (request->digest ? PACKET_CRC_SIZE : 0);
+    request->artifact = file_transfer->artifact;
+  }
+
+  file_transfer->prefetch_header = header;
+  file_transfer->io_offset += size;
+  _file_io_submit(file_transfer, request);
+  return 0;
+}
+
+/**
+ * @brief refills the buffer of the copy engine with the chunk read ahead by
+ * the file I/O pool and reads the one after it meanwhile
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] end file offset reads stop at
+ * @return number of bytes in the buffer >0, 0 on EOF, -EINPROGRESS waiting
+ * for the pool, <0 error
+ */
+static int _file_transfer_prefetched(struct file_transfer_t *file_transfer,
+                                     size_t end) {
+  int err = 0;
+  uint8_t *buffer = file_transfer->buffer;
+
+  if (!file_transfer->prefetch_length) {
+    if (file_transfer->inflight) {
+      return -EINPROGRESS;
+    }
+    // nothing read ahead, reads resume from what was sent
+    file_transfer->io_offset = file_transfer->transferred_total;
+    err = _file_transfer_prefetch(file_transfer, end);
+    if (err < 0) {
+      return err;
+    }
+    return file_transfer->inflight ? -EINPROGRESS : 0;
+  }
+
+  file_transfer->buffer = file_transfer->prefetch;
+  file_transfer->buffer_offset = 0;
+  file_transfer->buffer_header = file_transfer->prefetch_header;
+  file_transfer->buffer_trailer =
+      file_transfer->prefetch_header && file_transfer->crc_frames
+          ? PACKET_CRC_SIZE
+          : 0;
+  file_transfer->buffer_length = file_transfer->prefetch_length;
+  file_transfer->buffer_raw = file_transfer->prefetch_raw;
+  file_transfer->prefetch = buffer;
+  file_transfer->prefetch_length = 0;
+
+  err = _file_transfer_prefetch(file_transfer, end);
+  return err < 0 ? err : file_transfer->buffer_length;
+}
+
+/**
+ * @brief tells whether a transfer has nothing to send until its file I/O or
+ * its io_uring chain completes
+ *
+ * @param[in] ctx points to the file transfer context
+ * @return true if the transfer waits for the file I/O pool or the ring
+ */
+bool file_transfer_io_waiting(const struct file_transfer_t *ctx) {
+  if (ctx->uring && ctx->uring->count) {
+    return _uring_chain_inflight(ctx->uring);
+  }
+  return ctx->inflight && !ctx->prefetch_length &&
+         ctx->frame_offset >= ctx->frame_length &&
+         ctx->buffer_offset == ctx->buffer_length;
+}
+
+/**
+ * @brief releases what an abandoned request opened or read into, its
+ * transfer ended while it was in flight
+ *
+ * @param[in] request completed request without an owner
+ */
+static void _file_io_abandoned(struct file_io_request_t *request) {
+  if (request->op == FILE_IO_READ) {
+    buffer_pool_release(request->pool, request->buffer);
+  } else if (request->cache) {
+    file_cache_release(request->cache);
+  }
 
-  // printf("path: %s\r\n", path);
+  if (request->name) {
+    file_names_release(request->name);
+  }
+
+  if (request->artifact) {
+    file_compress_artifact_discard(request->artifact);
+  }
+}
+
+/**
+ * @brief takes over the outcome of a file I/O request of a transfer, called
+ * by the worker the request completed to. An opened file starts the transfer
+ * and its first chunk is read ahead right away, a v2 request for a file that
+ * could not be opened is answered with an ERROR frame
+ *
+ * @param[in] request completed request, recycled
+ */
+void file_transfer_io_complete(struct file_io_request_t *request) {
+  struct file_transfer_t *ctx = request->owner;
+  int err = request->result;
+  size_t trailer = 0;
 
   do {
-    fp = fopen(path, "rb");
-    if (!fp) {
-      err = -errno;
-      printf("error fopen %d\r\n", errno);
+    if (!ctx) {
+      _file_io_abandoned(request);
       break;
     }
+    ctx->inflight = NULL;
 
-    err = fseek(fp, offset, SEEK_SET);
-    if (err < 0) {
-      err = -errno;
-      printf("error fseek %d %d\r\n", err, errno);
+    if (request->op == FILE_IO_OPEN && err < 0) {
+      LOG_WARN("error %d opening %s\r\n", err, ctx->filename);
+      ctx->io_error = file_transfer_context_error(ctx, ctx->client_fd, err);
+    } else if (request->op == FILE_IO_OPEN) {
+      _file_opened(ctx, request);
+      err = _file_transfer_start(ctx);
+      if (err < 0) {
+        _file_close(ctx);
+        ctx->io_error = file_transfer_context_error(ctx, ctx->client_fd, err);
+      } else if (ctx->engine == FILE_TRANSFER_ENGINE_COPY && !ctx->cache) {
+        ctx->io_error = _file_transfer_prefetch(
+            ctx, ctx->protocol == PACKET_VERSION_2 ? ctx->range_end : SIZE_MAX);
+      }
+    } else if (err < 0) {
+      LOG_ERROR("error pread %d\r\n", -err);
+      ctx->io_error = err;
+    } else {
+      // a compressed chunk holds more file bytes than it takes
+      ctx->prefetch_raw = request->compressing ? request->consumed : err;
+      if (ctx->prefetch_raw < request->size) { // a short read means EOF
+        LOG_DEBUG("reached EOF\r\n");
+        ctx->read_eof = true;
+      }
+
+      trailer = 0;
+      if (err && ctx->prefetch_header) {
+        packet_v2_header_encode(ctx->prefetch, CMD_DOWNLOAD_FILE_DATA,
+                                ctx->request_id, err);
+        trailer = _file_transfer_trailer(ctx, ctx->prefetch, err, request->crc);
+      }
+      ctx->prefetch_length = err ? ctx->prefetch_header + err + trailer : 0;
+    }
+  } while (0);
+
+  file_io_request_put(request);
+}
+
+/**
+ * @brief adapts the chunk size to how much the socket accepted, full sends
+ * double it up to the buffer size, sends under half of it halve it
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] requested bytes handed to send()
+ * @param[in] accepted bytes send() accepted
+ */
+static void _file_transfer_chunk_adapt(struct file_transfer_t *file_transfer,
+                                       size_t requested, size_t accepted) {
+  size_t size = file_transfer->chunk_size;
+
+  if (!file_transfer->chunk_adaptive) {
+    return;
+  }
+
+  if (accepted == requested && requested == size) {
+    size *= 2;
+  } else if (accepted < size / 2) {
+    size /= 2;
+  }
+
+  if (size < FILE_TRANSFER_CHUNK_SIZE_MIN) {
+    size = FILE_TRANSFER_CHUNK_SIZE_MIN;
+  } else if (size > file_transfer->pool->buffer_size) {
+    size = file_transfer->pool->buffer_size;
+  }
+  file_transfer->chunk_size = size;
+}
+
+/**
+ * @brief transfers a chunk by copying it through a leased buffer, data the
+ * socket did not accept stays in the buffer and is sent first on the next call.
+ * Outside of an announced v2 DATA frame each chunk becomes a DATA frame whose
+ * header is encoded in the buffer right ahead of the data, so both go out with
+ * a single send(). With the file I/O pool the next chunk is read into a second
+ * buffer while this one is sent
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be read
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block,
+ * -EINPROGRESS waiting for the pool, <0 error
+ */
+static int _file_transfer_copy(int fd, struct file_transfer_t *file_transfer,
+                               size_t limit) {
+  int err = 0;
+  size_t pending = 0, payload = 0, first = 0, last = 0, send_result = 0;
+  bool end_of_file = false;
+  size_t end = limit < SIZE_MAX - file_transfer->transferred_total
+                   ? file_transfer->transferred_total + limit
+                   : SIZE_MAX;
+
+  do {
+    if (!file_transfer->buffer) {
+      err = _file_transfer_buffer_lease(file_transfer, &file_transfer->buffer);
+      if (err < 0) {
+        break;
+      }
+    }
+
+    // refill the buffer once the socket took everything read before
+    if (file_transfer->buffer_offset == file_transfer->buffer_length) {
+      // reads of an announced DATA frame are bounded by it, done inline
+      err = file_transfer->io && !file_transfer->frame_remaining
+                ? _file_transfer_prefetched(file_transfer, end)
+                : _file_transfer_fill(file_transfer, limit);
+      if (err <= 0) {
+        break;
+      }
+    }
+
+    pending = file_transfer->buffer_length - file_transfer->buffer_offset;
+    end_of_file = file_transfer->read_eof && !file_transfer->prefetch_length &&
+                  !file_transfer->inflight;
+    err = _file_transfer_gather(
+        fd, file_transfer, file_transfer->buffer + file_transfer->buffer_offset,
+        pending, end_of_file, &send_result);
+    if (err <= 0) {
       break;
     }
 
-    err = fread(data, 1, size, fp);
-    if (ferror(fp)) { // check of errors
-      err = -EIO;
-      clearerr(fp);
-      printf("error fread\r\n");
-    } else if (feof(fp)) { // check for EOF
-      printf("reached EOF\r\n");
-      *eof = true;
-    } else if (err != size) {
-      printf("read lesser %d than expected size %ld\r\n", err, size);
+    // frame header and trailer bytes are not part of the file
+    first = file_transfer->buffer_offset;
+    last = first + send_result;
+    first = first > file_transfer->buffer_header ? first
+                                                 : file_transfer->buffer_header;
+    if (last > file_transfer->buffer_length - file_transfer->buffer_trailer) {
+      last = file_transfer->buffer_length - file_transfer->buffer_trailer;
     }
+    payload = last > first ? last - first : 0;
 
-    close_err = fclose(fp);
-    if (close_err) {
-      err = -errno;
-      printf("error close %d\r\n", errno);
+    file_transfer->buffer_offset += send_result;
+    if (file_transfer->compressing) {
+      // the file offset moves on once the whole compressed chunk is sent
+      file_transfer->encoded_total += payload;
+      if (file_transfer->buffer_offset == file_transfer->buffer_length) {
+        file_transfer->transferred_total += file_transfer->buffer_raw;
+      }
+    } else {
+      file_transfer->transferred_total += payload;
     }
+    _file_transfer_chunk_adapt(file_transfer, pending, send_result);
+    // enable to see whats being sent out
+    // printf("content: %.*s\r\n", send_result,
+    //        (char *)file_transfer->buffer + file_transfer->buffer_offset -
+    //            send_result);
   } while (0);
 
   return err;
 }
 
 /**
- * @brief resets the file transfer list
+ * @brief transfers a chunk straight from the page cache with sendfile(2)
  *
- * @param[in] list points to the file transfer list
- * @param[in] file_transfer_list_size size of the list
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be sent
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block, <0 error
  */
-void file_transfer_list_reset(struct file_transfer_t *list,
-                              size_t file_transfer_list_size) {
-  for (size_t i = 0; i < file_transfer_list_size; i++) {
-    list->client_fd = -1;
-    list->fp = NULL;
-    list->transferred_total = 0;
-    list->filename[0] = '\0';
+static int _file_transfer_sendfile(int fd,
+                                   struct file_transfer_t *file_transfer,
+                                   size_t limit) {
+  int err = 0;
+  off_t offset = file_transfer->transferred_total;
+
+  err = sendfile(fd, file_transfer->file_fd, &offset,
+                 limit < FILE_TRANSFER_ZERO_COPY_SIZE_MAX
+                     ? limit
+                     : FILE_TRANSFER_ZERO_COPY_SIZE_MAX);
+  if (err < 0) {
+    err = (errno == EWOULDBLOCK || errno == EAGAIN) ? -EAGAIN : -errno;
+  } else {
+    // short sends are resumed from here on the next call
+    file_transfer->transferred_total += err;
   }
+  return err;
 }
 
 /**
- * @brief adds a file transfer context to the list
+ * @brief transfers a chunk from the page cache into a pipe and from the pipe
+ * into the socket with splice(2)
  *
- * @param[in] ctx points to the file transfer context to be added
- * @param[in] list points to the file transfer list
- * @param[in] file_transfer_list_size size of the list
- * @return 0 success, <0 error
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be sent
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block, <0 error
  */
-int file_transfer_context_add(struct file_transfer_t *ctx,
-                              struct file_transfer_t *list,
-                              size_t file_transfer_list_size) {
-  int err = -ENOBUFS;
+static int _file_transfer_splice(int fd, struct file_transfer_t *file_transfer,
+                                 size_t limit) {
+  int err = 0;
+  ssize_t moved = 0;
 
-  if (ctx->client_fd < 0) {
-    printf("invalid fd %d\r\n", ctx->client_fd);
-    return -EINVAL;
-  } else if (ctx->filename[0] == '\0') {
-    printf("invalid filename\r\n");
-    return -ENODATA;
+  do {
+    if (file_transfer->pipe_fds[0] < 0) {
+      err = pipe2(file_transfer->pipe_fds, O_NONBLOCK | O_CLOEXEC);
+      if (err < 0) {
+        err = -errno;
+        LOG_ERROR("error pipe2 %d\r\n", errno);
+        break;
+      }
+    }
+
+    // refill the pipe once the socket drained what was spliced before
+    if (!file_transfer->pipe_pending) {
+      loff_t offset = file_transfer->transferred_total;
+      moved = splice(file_transfer->file_fd, &offset,
+                     file_transfer->pipe_fds[1], NULL,
+                     limit < FILE_TRANSFER_ZERO_COPY_SIZE_MAX
+                         ? limit
+                         : FILE_TRANSFER_ZERO_COPY_SIZE_MAX,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved <= 0) {
+        err = moved < 0 ? -errno : 0; // 0 on EOF
+        break;
+      }
+      file_transfer->pipe_pending = moved;
+    }
+
+    moved = splice(file_transfer->pipe_fds[0], NULL, fd, NULL,
+                   file_transfer->pipe_pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (moved < 0) {
+      err = (errno == EWOULDBLOCK || errno == EAGAIN) ? -EAGAIN : -errno;
+      break;
+    }
+
+    file_transfer->pipe_pending -= moved;
+    file_transfer->transferred_total += moved;
+    err = moved ? moved : -EAGAIN;
+  } while (0);
+
+  return err;
+}
+
+/**
+ * @brief posts up to FILE_TRANSFER_URING_DEPTH chunks on the ring of the
+ * event loop as one chain of linked requests, each chunk is read into the
+ * registered buffer of the transfer and written to the socket by the request
+ * linked to the read, all through registered files. Requests run one after
+ * the other so every chunk goes through the same buffer. The chain is
+ * submitted without waiting, the event loop returns its completions
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be sent
+ * @return -EINPROGRESS posted, 0 on EOF, <0 error
+ */
+static int _file_transfer_uring_post(struct file_transfer_t *file_transfer,
+                                     size_t limit) {
+  int err = 0;
+  struct file_transfer_uring_t *chain = file_transfer->uring;
+  struct event_loop_t *loop = file_transfer->loop;
+  size_t offset = file_transfer->transferred_total, chunk = 0;
+  size_t end = file_transfer->file_size;
+  struct io_uring_sqe *sqe = NULL;
+
+  if (offset >= end) {
+    return 0; // EOF
+  } else if (limit < end - offset) {
+    end = offset + limit;
   }
 
-  for (size_t i = 0; i < file_transfer_list_size; i++) {
-    if (list[i].client_fd >= 0) {
-      continue;
+  if (!chain) { // the buffer is leased and registered once per transfer
+    err = posix_memalign((void **)&chain, FILE_TRANSFER_URING_ALIGN,
+                         sizeof(*chain));
+    if (err) {
+      return -err;
     }
+    memset(chain, 0, sizeof(*chain));
+    chain->pool = file_transfer->pool;
 
-    err = 0;
-    // assosiate this connection to this context
-    memcpy(&list[i], ctx, sizeof(struct file_transfer_t));
-    printf("associated ctx to transfer list at idx %ld\r\n", i);
-    break;
+    err = _file_transfer_buffer_lease(file_transfer, &chain->buffer);
+    if (!err) {
+      err = _uring_buffer_update(&loop->uring, file_transfer->slot,
+                                 chain->buffer, chain->pool->buffer_size);
+    }
+    if (err < 0) {
+      _uring_chain_free(chain);
+      return err;
+    }
+    chain->owner = file_transfer;
+    file_transfer->uring = chain;
   }
-  return err;
+
+  err = event_loop_post_reserve(loop, 2 * FILE_TRANSFER_URING_DEPTH);
+  if (err < 0) {
+    LOG_ERROR("error %d reserving io_uring requests\r\n", err);
+    return err;
+  }
+
+  chunk = chain->pool->buffer_size < FILE_TRANSFER_URING_CHUNK_SIZE
+              ? chain->pool->buffer_size
+              : FILE_TRANSFER_URING_CHUNK_SIZE;
+  chain->reaped = 0;
+  for (chain->count = 0;
+       chain->count < FILE_TRANSFER_URING_DEPTH && offset < end;
+       chain->count++) {
+    size_t i = chain->count;
+    chain->len[i] = end - offset < chunk ? end - offset : chunk;
+
+    sqe = event_loop_post(loop, (uint8_t *)chain + 2 * i);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = file_transfer->uring_slot;
+    sqe->addr = (uintptr_t)chain->buffer;
+    sqe->len = chain->len[i];
+    sqe->off = offset;
+    sqe->buf_index = file_transfer->slot;
+
+    // a short or failed write severs the chain, later chunks are cancelled
+    sqe = event_loop_post(loop, (uint8_t *)chain + 2 * i + 1);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = file_transfer->uring_slot + 1;
+    sqe->addr = (uintptr_t)chain->buffer;
+    sqe->len = chain->len[i];
+    sqe->buf_index = file_transfer->slot;
+
+    offset += chain->len[i];
+  }
+  sqe->flags &= ~IOSQE_IO_LINK; // the chain ends with the last write
+
+  // the reads start now rather than once the other events are processed
+  err = event_loop_post_submit(loop);
+  if (err < 0) {
+    LOG_WARN("error %d submitting io_uring chain, left to the next wait\r\n",
+             err);
+  }
+  return -EINPROGRESS;
 }
 
 /**
- * @brief removes a file transfer context from the list
+ * @brief takes over the results of the chain of the io_uring engine once
+ * all of its completions have been returned
  *
- * @param[in] fd connection identifer whose context to be removed
- * @param[in] list points to the file transfer list
- * @param[in] file_transfer_list_size size of the list
+ * @param[in,out] file_transfer context associtated to this connection
+ * @return number of bytes sent >0, -EAGAIN on would block, <0 error
  */
-void file_transfer_context_remove(int fd, struct file_transfer_t *list,
-                                  size_t file_transfer_list_size) {
-  int err = -EINVAL;
-  for (size_t i = 0; i < file_transfer_list_size; i++) {
-    if (list[i].client_fd != fd) {
-      continue;
+static int _file_transfer_uring_reap(struct file_transfer_t *file_transfer) {
+  int err = 0;
+  struct file_transfer_uring_t *chain = file_transfer->uring;
+  size_t sent = 0;
+
+  for (size_t i = 0; i < chain->count; i++) {
+    int read = chain->res[2 * i], written = chain->res[2 * i + 1];
+
+    if (read != chain->len[i]) { // the file changed or could not be read
+      err = read < 0 ? read : -EIO;
+      break;
     }
 
-    err = 0;
-    list[i].client_fd = -1;
-    list[i].fp = NULL;
-    list[i].transferred_total = 0;
-    list[i].filename[0] = '\0';
-    printf(
-        "removed ctx association from transfer list for fd %d at idx %ld\r\n",
-        fd, i);
+    if (written > 0) {
+      sent += written;
+    }
+
+    if (written != chain->len[i]) {
+      if (written < 0 && written != -EAGAIN) {
+        err = written;
+      } else {
+        chain->blocked = sent > 0; // the rest waits for the next POLLOUT
+      }
+      break;
+    }
+  }
+  chain->count = 0;
+
+  file_transfer->transferred_total += sent;
+  if (sent) {
+    return sent;
+  }
+  return err ? err : -EAGAIN;
+}
+
+/**
+ * @brief transfers file data with chains of linked io_uring requests, one
+ * chain in flight at a time. The transfer waits for the chain it posted and
+ * takes over its results on the next call once it completed
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be sent
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block,
+ * -EINPROGRESS waiting for the chain, <0 error
+ */
+static int _file_transfer_uring(struct file_transfer_t *file_transfer,
+                                size_t limit) {
+  struct file_transfer_uring_t *chain = file_transfer->uring;
+
+  if (_uring_chain_inflight(chain)) {
+    return -EINPROGRESS;
+  } else if (chain && chain->count) {
+    return _file_transfer_uring_reap(file_transfer);
+  } else if (chain && chain->blocked) {
+    chain->blocked = false;
+    return -EAGAIN;
+  }
+  return _file_transfer_uring_post(file_transfer, limit);
+}
+
+/**
+ * @brief takes the completion of a request of an io_uring engine chain,
+ * returned by the event loop of the worker that posted it
+ *
+ * @param[in] data posted along with the request
+ * @param[in] res result of the request
+ * @return transfer to be resumed once its chain completed, NULL otherwise
+ */
+struct file_transfer_t *file_transfer_uring_complete(void *data, int res) {
+  size_t index = (uintptr_t)data & (FILE_TRANSFER_URING_ALIGN - 1);
+  struct file_transfer_uring_t *chain =
+      (struct file_transfer_uring_t *)((uint8_t *)data - index);
+
+  chain->res[index] = res;
+  if (++chain->reaped < 2 * chain->count) {
+    return NULL;
+  } else if (!chain->owner) { // the transfer ended while it was in flight
+    _uring_chain_free(chain);
+    return NULL;
+  }
+  return chain->owner;
+}
+
+/**
+ * @brief asks the kernel to read the next window ahead of the send offset
+ * once the offset gets within half a window of what was requested so far,
+ * the window doubles every time so readahead keeps up with the send rate
+ *
+ * @param[in] file_transfer context associtated to this connection
+ */
+static void _file_transfer_mmap_advise(struct file_transfer_t *file_transfer) {
+  size_t offset = file_transfer->transferred_total;
+  size_t page = sysconf(_SC_PAGESIZE), start = 0, length = 0;
+
+  if (file_transfer->map_advised >= file_transfer->file_size ||
+      file_transfer->map_advised > offset + file_transfer->map_window / 2) {
+    return;
   }
 
-  if (err) {
-    printf("an error may have occurred since fd %d does not exist in transfer "
-           "list\r\n",
-           fd);
+  start = file_transfer->map_advised > offset ? file_transfer->map_advised
+                                              : offset;
+  start &= ~(page - 1);
+  length = file_transfer->map_window;
+  if (length > file_transfer->file_size - start) {
+    length = file_transfer->file_size - start;
+  }
+
+  posix_fadvise(file_transfer->file_fd, start, length, POSIX_FADV_WILLNEED);
+  madvise(file_transfer->map + start, length, MADV_WILLNEED);
+
+  file_transfer->map_advised = start + length;
+  if (file_transfer->map_window < FILE_TRANSFER_MMAP_WINDOW_MAX) {
+    file_transfer->map_window *= 2;
   }
 }
 
 /**
- * @brief transfers the requested file to the client
+ * @brief transfers a chunk straight from a read-only mapping of the file, the
+ * file is mapped on the first call. A file truncated meanwhile fails the send
+ * with EFAULT rather than raising SIGBUS since the kernel does the copy
  *
  * @param[in] fd connection over which transfer must happen
  * @param[in] file_transfer context associtated to this connection
- * @param[out] eof indicates EOF
- * @return number of bytes read >0 on success, 0 on EOF, <0 error
+ * @param[in] limit file bytes that may be sent
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block, <0 error
  */
-int file_transfer(int fd, struct file_transfer_t *file_transfer) {
-  int err = 0, send_result = 0;
-  uint8_t buffer[FILE_TRANSFER_BUFF_READ_SIZE] = {};
-  bool eof = false;
+static int _file_transfer_mmap(int fd, struct file_transfer_t *file_transfer,
+                               size_t limit) {
+  int err = 0;
+  size_t size = file_transfer->file_size - file_transfer->transferred_total;
+  size_t sent = 0;
+
+  if (!size) {
+    return 0; // EOF, empty files are never mapped
+  }
+
+  if (!file_transfer->map) {
+    void *map = mmap(NULL, file_transfer->file_size, PROT_READ, MAP_SHARED,
+                     file_transfer->file_fd, 0);
+    if (map == MAP_FAILED) {
+      LOG_ERROR("error mmap %d\r\n", errno);
+      return -errno;
+    }
+    file_transfer->map = map;
+    madvise(map, file_transfer->file_size, MADV_SEQUENTIAL);
+    posix_fadvise(file_transfer->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  _file_transfer_mmap_advise(file_transfer);
+
+  size = size < limit ? size : limit;
+  size = size < FILE_TRANSFER_ZERO_COPY_SIZE_MAX
+             ? size
+             : FILE_TRANSFER_ZERO_COPY_SIZE_MAX;
+  err = _file_transfer_gather(
+      fd, file_transfer, file_transfer->map + file_transfer->transferred_total,
+      size, file_transfer->transferred_total + size == file_transfer->file_size,
+      &sent);
+  file_transfer->transferred_total += sent;
+  return err;
+}
+
+/**
+ * @brief transfers a chunk of a cached file straight from the shared buffer,
+ * whatever the engine of the transfer
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be sent
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block, <0 error
+ */
+static int _file_transfer_cached(int fd, struct file_transfer_t *file_transfer,
+                                 size_t limit) {
+  int err = 0;
+  size_t size = file_transfer->cache->size - file_transfer->transferred_total;
+  size_t sent = 0;
+
+  if (!size) {
+    return 0; // EOF
+  }
+
+  size = size < limit ? size : limit;
+  size = size < FILE_TRANSFER_ZERO_COPY_SIZE_MAX
+             ? size
+             : FILE_TRANSFER_ZERO_COPY_SIZE_MAX;
+  err = _file_transfer_gather(
+      fd, file_transfer,
+      file_transfer->cache->data + file_transfer->transferred_total, size,
+      file_transfer->transferred_total + size == file_transfer->cache->size,
+      &sent);
+  file_transfer->transferred_total += sent;
+  return err;
+}
+
+/**
+ * @brief returns the name of a transfer engine
+ *
+ * @param[in] engine transfer engine
+ * @return name of the engine
+ */
+const char *file_transfer_engine_name(enum file_transfer_engine_t engine) {
+  switch (engine) {
+  case FILE_TRANSFER_ENGINE_COPY:
+    return "copy";
+  case FILE_TRANSFER_ENGINE_SENDFILE:
+    return "sendfile";
+  case FILE_TRANSFER_ENGINE_SPLICE:
+    return "splice";
+  case FILE_TRANSFER_ENGINE_URING:
+    return "uring";
+  case FILE_TRANSFER_ENGINE_MMAP:
+    return "mmap";
+  default:
+    return "unknown";
+  }
+}
+
+/**
+ * @brief moves file data to the socket with the engine of the transfer,
+ * falling back to the next engine when the kernel does not support one
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @param[in] limit file bytes that may be sent
+ * @return number of bytes sent >0, 0 on EOF, -EAGAIN on would block, <0 error
+ */
+static int _file_transfer_engine(int fd, struct file_transfer_t *file_transfer,
+                                 size_t limit) {
+  int err = 0;
+
+  if (file_transfer->cache) {
+    return _file_transfer_cached(fd, file_transfer, limit);
+  }
 
   do {
-    err = _file_read(FILE_TRANSFER_TABLE, file_transfer->filename, buffer,
-                     sizeof(buffer) / sizeof(buffer[0]),
-                     file_transfer->transferred_total, file_transfer->fp, &eof);
-    if (err < 0) {
-      printf("error _file_read %d\r\n", err);
+    switch (file_transfer->engine) {
+    case FILE_TRANSFER_ENGINE_SENDFILE:
+      err = _file_transfer_sendfile(fd, file_transfer, limit);
+      if (err == -EINVAL || err == -ENOSYS) {
+        LOG_WARN("sendfile unsupported on fd %d, falling back to splice\r\n",
+                 fd);
+        file_transfer->engine = FILE_TRANSFER_ENGINE_SPLICE;
+        continue;
+      }
+      break;
+    case FILE_TRANSFER_ENGINE_SPLICE:
+      err = _file_transfer_splice(fd, file_transfer, limit);
+      if ((err == -EINVAL || err == -ENOSYS) && !file_transfer->pipe_pending) {
+        LOG_WARN("splice unsupported on fd %d, falling back to copy\r\n", fd);
+        file_transfer->engine = FILE_TRANSFER_ENGINE_COPY;
+        continue;
+      }
+      break;
+    case FILE_TRANSFER_ENGINE_URING:
+      err = _file_transfer_uring(file_transfer, limit);
+      break;
+    case FILE_TRANSFER_ENGINE_MMAP:
+      err = _file_transfer_mmap(fd, file_transfer, limit);
+      if (!file_transfer->map && err < 0) {
+        LOG_WARN("mmap unsupported on fd %d, falling back to copy\r\n", fd);
+        file_transfer->engine = FILE_TRANSFER_ENGINE_COPY;
+        continue;
+      }
       break;
+    default:
+      err = _file_transfer_copy(fd, file_transfer, limit);
+      break;
+    }
+    break;
+  } while (1);
+
+  return err;
+}
+
+/**
+ * @brief carries on the CRC32C of an announced DATA frame with the payload
+ * bytes just sent, read back from memory, and queues the trailer once the
+ * payload is complete. Transfers with CRC trailers only send DATA frame
+ * payloads from the file cache, the mapping or the copy buffer
+ *
+ * @param[in,out] file_transfer context associtated to this connection
+ * @param[in] offset file offset the bytes were sent from
+ * @param[in] size bytes sent
+ */
+static void _file_transfer_frame_crc(struct file_transfer_t *file_transfer,
+                                     size_t offset, size_t size) {
+  const uint8_t *data = NULL;
+
+  if (file_transfer->cache) {
+    data = file_transfer->cache->data + offset;
+  } else if (file_transfer->map) {
+    data = file_transfer->map + offset;
+  } else { // copy engine, a frame it did not start holds no header
+    data = file_transfer->buffer + file_transfer->buffer_offset - size;
+  }
+  file_transfer->frame_crc = crc32c(file_transfer->frame_crc, data, size);
+
+  if (!file_transfer->frame_remaining) {
+    packet_u32_encode(file_transfer->frame, file_transfer->frame_crc);
+    file_transfer->frame_offset = 0;
+    file_transfer->frame_length = PACKET_CRC_SIZE;
+    file_transfer->frame_trailer = true;
+  }
+}
+
+/**
+ * @brief transfers the next part of a v2 download. The pending frame built
+ * by the transfer goes out first, then the payload of an announced DATA frame,
+ * then the next frame is started until the EOF frame has been sent. A ranged
+ * download sends the DATA frames of each range after its RANGE frame
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @return number of bytes sent >0, 0 on completion, -EAGAIN on would block,
+ * <0 error
+ */
+static int _file_transfer_v2(int fd, struct file_transfer_t *file_transfer) {
+  int err = 0;
+  size_t total = file_transfer->transferred_total, size = 0;
+  struct iovec iov = {};
+
+  if (file_transfer->frame_offset < file_transfer->frame_length &&
+      !_file_transfer_frame_gathered(file_transfer)) {
+    // corked unless it is the last frame, the next one shares its segment
+    iov.iov_base = file_transfer->frame + file_transfer->frame_offset;
+    iov.iov_len = file_transfer->frame_length - file_transfer->frame_offset;
+    err = server_writev(fd, &iov, 1,
+                        file_transfer->frame_cmd != CMD_DOWNLOAD_FILE_EOF &&
+                            file_transfer->frame_cmd !=
+                                CMD_DOWNLOAD_FILE_ERROR);
+    if (err > 0) {
+      file_transfer->frame_offset += err;
+    }
+    return err ? err : -EAGAIN;
+  }
+
+  if (file_transfer->frame_cmd == CMD_DOWNLOAD_FILE_EOF ||
+      file_transfer->frame_cmd == CMD_DOWNLOAD_FILE_ERROR) {
+    return 0; // the last frame made it out
+  }
+
+  if (file_transfer->frame_remaining) { // payload of an announced DATA frame
+    err = _file_transfer_engine(fd, file_transfer,
+                                file_transfer->frame_remaining);
+    size = file_transfer->transferred_total - total;
+    file_transfer->frame_remaining -= size;
+    if (!err) {
+      LOG_WARN("%s shrank below the announced size\r\n",
+               file_transfer->filename);
+      err = -EIO;
+    } else if (file_transfer->crc_frames && size) {
+      _file_transfer_frame_crc(file_transfer, total, size);
     }
+    return err;
+  }
 
-    // check if we got something to be sent
+  if (file_transfer->engine == FILE_TRANSFER_ENGINE_COPY &&
+      !file_transfer->cache) {
+    // frames its own chunks, stops at the announced size
+    err = _file_transfer_engine(fd, file_transfer,
+                                file_transfer->range_end - total);
     if (err) {
-      send_result = server_write(fd, buffer, err);
+      return err;
     }
+  } else if (total < file_transfer->range_end) {
+    size = file_transfer->range_end - total;
+    size = size < file_transfer->frame_size ? size : file_transfer->frame_size;
+    _file_transfer_frame_start(file_transfer, CMD_DOWNLOAD_FILE_DATA, size, 0);
+    _file_transfer_frame_seal(file_transfer);
+    file_transfer->frame_remaining = size;
+    return _file_transfer_v2(fd, file_transfer);
+  }
+
+  // the range is done, or cut short if the file shrank
+  file_transfer->ranges_sent += total - file_transfer->range_start;
+  if (file_transfer->range + 1 < file_transfer->ranges_count) {
+    file_transfer->range++;
+    _file_transfer_range_start(file_transfer);
+    return _file_transfer_v2(fd, file_transfer);
+  }
 
-    // check if we managed to send anything
-    if (send_result >= 0) {
-      file_transfer->transferred_total += send_result;
-      // enable to see whats being sent out
-      // printf("content: %.*s\r\n", err, (char *)buffer);
+  // a file compressed as a whole becomes the artifact sent next time
+  if (file_transfer->artifact && !file_transfer->inflight) {
+    if (total == file_transfer->source_size) {
+      file_compress_artifact_commit(file_transfer->artifact,
+                                    file_transfer->source_size);
     } else {
-      err = send_result;
-      printf("send error %d\r\n", err);
-      break;
+      file_compress_artifact_discard(file_transfer->artifact);
     }
+    file_transfer->artifact = NULL;
+  }
 
-    if (!err || eof) {                                    // check for EOF
-      send_result = server_write(fd, (uint8_t *)&err, 1); // notify the client
-      err = send_result < 0 ? send_result : 0;
-      break;
+  // EOF, tell the client how much was sent in case the file shrank
+  size = sizeof(uint64_t) + (file_transfer->crc_file ? sizeof(uint32_t) : 0);
+  _file_transfer_frame_start(file_transfer, CMD_DOWNLOAD_FILE_EOF, size, size);
+  packet_u64_encode(file_transfer->frame + PACKET_V2_HEADER_SIZE,
+                    file_transfer->compressing ? file_transfer->encoded_total
+                                               : file_transfer->ranges_sent);
+  if (file_transfer->crc_file) {
+    packet_u32_encode(file_transfer->frame + PACKET_V2_HEADER_SIZE +
+                          sizeof(uint64_t),
+                      file_transfer->file_crc);
+  }
+  _file_transfer_frame_seal(file_transfer);
+  return _file_transfer_v2(fd, file_transfer);
+}
+
+/**
+ * @brief transfers the next part of the file to the client, v1 clients get
+ * the raw file followed by a one byte marker, v2 clients get frames
+ *
+ * @param[in] fd connection over which transfer must happen
+ * @param[in] file_transfer context associtated to this connection
+ * @return number of bytes sent >0, 0 on completion, -EAGAIN on would block,
+ * -EINPROGRESS waiting for the file I/O pool, <0 error
+ */
+int file_transfer(int fd, struct file_transfer_t *file_transfer) {
+  int err = 0;
+
+  if (file_transfer->io_error) {
+    err = file_transfer->io_error;
+  } else if (file_transfer->inflight &&
+             file_transfer->inflight->op == FILE_IO_OPEN) {
+    return -EINPROGRESS;
+  } else if (file_transfer->protocol == PACKET_VERSION_2) {
+    err = _file_transfer_v2(fd, file_transfer);
+  } else if (file_transfer->eof_pending) {
+    return _file_transfer_eof_notify(fd, file_transfer);
+  } else if (file_transfer->eof_sent) {
+    return 0; // the marker went out with the last data
+  } else {
+    err = _file_transfer_engine(fd, file_transfer, SIZE_MAX);
+    if (!err) { // check for EOF
+      err = _file_transfer_eof_notify(fd, file_transfer); // notify the client
     }
-  } while (0);
+  }
 
+  if (err < 0 && err != -EAGAIN && err != -EINPROGRESS) {
+    LOG_ERROR("error %s transfer %d\r\n",
+              file_transfer_engine_name(file_transfer->engine), err);
+  }
   return err;
 }
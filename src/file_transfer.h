@@ -1,31 +1,163 @@
 #ifndef __FILE_TRANSFER_H
 #define __FILE_TRANSFER_H
 
+#include "buffer_pool.h"
+#include "commands.h"
 #include "common.h"
+#include "crc32c.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "file_compress.h"
+#include "file_io.h"
+#include "file_names.h"
+#include "packet.h"
 
 #define FILE_TRANSFER_NAME_SIZE_MAX                                            \
-  32 + 1 // Maximum size supported for the requested filename
+  (255 + 1) // Maximum size supported for the requested filename
 #define FILE_TRANSFER_TABLE                                                    \
   "/home/vinay_divakar/file_storage" // files storage path
-#define FILE_TRANSFER_PATH_NAME_SIZE_MAX                                       \
-  64 // Maximum size supported for the file path
 #define FILE_TRANSFER_BUFF_READ_SIZE                                           \
-  32 //  Maximum size supported for buffer reads
+  32 // chunk size of the original protocol, the EOF marker derives from it
+#define FILE_TRANSFER_CHUNK_SIZE                                               \
+  (64 * 1024) // default size read and sent per call by the copy engine
+#define FILE_TRANSFER_CHUNK_SIZE_MIN 512 // smallest chunk size
+#define FILE_TRANSFER_CHUNK_SIZE_MAX                                           \
+  (16 * 1024 * 1024) // largest chunk size
+#define FILE_TRANSFER_CHUNK_SIZE_ADAPTIVE_MAX                                  \
+  (1024 * 1024) // adaptive chunks grow up to this size
+#define FILE_TRANSFER_ZERO_COPY_SIZE_MAX                                       \
+  (1 << 20) // Maximum size handed to sendfile/splice per call
+#define FILE_TRANSFER_FRAME_SIZE_MAX                                           \
+  (4 * 1024 * 1024) // largest v2 DATA frame sent by the zero-copy engines
+#define FILE_TRANSFER_FRAME_CONTROL_SIZE_MAX                                   \
+  24 // largest payload of the v2 frames built by the transfer itself
+#define FILE_TRANSFER_RANGES_MAX                                               \
+  PACKET_V2_RANGES_MAX // ranges of a multi-range download
+#define FILE_TRANSFER_URING_DEPTH                                              \
+  8 // chunks read and sent per chain of linked io_uring requests
+#define FILE_TRANSFER_URING_CHUNK_SIZE                                         \
+  (64 * 1024) // largest chunk read and sent by the requests of a chain
+#define FILE_TRANSFER_URING_ALIGN                                              \
+  (2 * FILE_TRANSFER_URING_DEPTH) // chains are aligned so the low bits of
+                                  // their address index their requests
+#define FILE_TRANSFER_URING_BUFFERS_MAX                                        \
+  (1 << 14) // registered buffers the kernel takes, one per transfer slot
+#define FILE_TRANSFER_MMAP_WINDOW_MIN                                          \
+  (256 * 1024) // first readahead window requested ahead of the send offset
+#define FILE_TRANSFER_MMAP_WINDOW_MAX                                          \
+  (8 * 1024 * 1024) // readahead window doubles up to this size
+
+enum file_transfer_engine_t {
+  FILE_TRANSFER_ENGINE_COPY,     // read into a user buffer, then send
+  FILE_TRANSFER_ENGINE_SENDFILE, // sendfile(2) from the page cache
+  FILE_TRANSFER_ENGINE_SPLICE,   // splice(2) through a pipe
+  FILE_TRANSFER_ENGINE_URING,    // linked io_uring reads and sends
+  FILE_TRANSFER_ENGINE_MMAP      // send from a mapping of the file
+};
+
+// part of a file requested by a ranged download
+struct file_transfer_range_t {
+  size_t offset; // first byte of the range
+  size_t length; // bytes in the range, 0 up to the end of the file
+};
+
+struct file_transfer_t;
+
+// chain of linked reads and sends posted by the uring engine on the ring of
+// the event loop, a transfer that ends while it is in flight abandons it
+struct file_transfer_uring_t {
+  struct file_transfer_t *owner; // resumed once complete, NULL if abandoned
+  struct buffer_pool_t *pool;    // pool buffer is leased from
+  uint8_t *buffer;               // registered buffer every chunk goes through
+  size_t count;                  // read and send pairs posted, 0 if idle
+  size_t reaped;                 // completions returned so far
+  bool blocked;                  // the socket refused part of the last chain
+  size_t len[FILE_TRANSFER_URING_DEPTH];  // bytes of each chunk
+  int res[2 * FILE_TRANSFER_URING_DEPTH]; // result of each request
+};
 
 struct file_transfer_t {
-  int client_fd;            // identifier for this connection
-  FILE *fp;                 // identifier for the file to be transferred
-  size_t transferred_total; // total bytes transferred/read
+  int client_fd;                      // connection handler, -1 if idle
+  int file_fd;                        // file being transferred, kept open
+  struct file_cache_entry_t *cache;   // cached contents sent instead of file_fd
+  size_t file_size;                   // size of the file when opened
+  struct file_names_entry_t *name;    // name entry holding file_fd open
+  enum file_transfer_engine_t engine; // how data is moved to the socket
+  int pipe_fds[2];                    // splice engine pipe, read/write ends
+  size_t pipe_pending;                // spliced into the pipe, not yet sent
+  uint8_t *map;                       // mmap engine mapping of the file
+  size_t map_advised;                 // readahead requested up to here
+  size_t map_window;                  // next readahead window
+  struct buffer_pool_t *pool;         // copy engine buffers are leased from
+  uint8_t *buffer;                    // leased buffer, pool->buffer_size
+  size_t buffer_offset;               // first byte in buffer not yet sent
+  size_t buffer_length;               // bytes read into buffer
+  size_t chunk_size;                  // bytes read into buffer at once
+  bool chunk_adaptive;                // grow/shrink chunk_size with send()
+  bool read_eof;                      // last read reached the end of file
+  struct file_io_completions_t *io;   // pool runs file I/O, NULL runs inline
+  struct file_io_request_t *inflight; // file I/O in flight, NULL if none
+  int io_error;                       // failure of the last file I/O
+  uint8_t *prefetch;                  // leased buffer read ahead of buffer
+  size_t prefetch_length;             // bytes read into prefetch
+  size_t prefetch_header;             // frame header bytes ahead of the data
+  size_t io_offset;                   // file offset read ahead up to
+  size_t slot;                        // index of the owning connection
+  size_t slots_max;                   // number of connections, bounds slot
+  int uring_slot;                     // registered file, socket follows
+  struct event_loop_t *loop;          // uring engine posts on its ring
+  struct file_transfer_uring_t *uring; // chain of the uring engine
+  bool eof_pending;                   // file sent, EOF marker not yet sent
+  bool eof_sent;                      // EOF marker went out with the data
+  uint8_t protocol;                   // PACKET_VERSION_1 or PACKET_VERSION_2
+  uint32_t request_id;                // v2 request echoed in every frame
+  uint8_t frame[PACKET_V2_HEADER_SIZE + FILE_TRANSFER_FRAME_CONTROL_SIZE_MAX +
+                PACKET_CRC_SIZE]; // v2 frame being sent, or a DATA trailer
+  size_t frame_offset;                // first byte in frame not yet sent
+  size_t frame_length;                // bytes encoded in frame
+  uint8_t frame_cmd;                  // command of the last frame started
+  size_t frame_remaining;             // DATA payload bytes still to be sent
+  size_t frame_size;                  // largest DATA payload per frame
+  size_t buffer_header;               // frame header bytes ahead of the data
+  size_t buffer_trailer;              // frame trailer bytes after the data
+  size_t transferred_total;           // file offset transferred/read up to
+  size_t ranges_count;                // requested ranges, 0 for the file
+  size_t range;                       // index of the range being sent
+  size_t range_start;                 // file offset the range starts at
+  size_t range_end;                   // file offset the range stops at
+  size_t ranges_sent;                 // bytes of the ranges sent before
+  uint8_t encoding;                   // file_compress_encoding_t requested
+  bool encoded;                       // data is sent in encoding
+  bool compressing;                   // encoded on the fly, copy engine only
+  size_t source_size;                 // size of the file requested
+  size_t buffer_raw;                  // file bytes compressed into buffer
+  size_t prefetch_raw;                // file bytes compressed into prefetch
+  size_t encoded_total;               // compressed DATA payload bytes sent
+  struct file_compress_artifact_t *artifact; // compressed copy being written
+  bool crc_frames;                    // frames end with a CRC32C trailer
+  bool crc_file;                      // EOF carries the CRC32C of the file
+  uint32_t file_crc;                  // CRC32C of the file, crc_file only
+  uint32_t frame_crc;                 // CRC32C of the DATA frame sent so far
+  bool frame_trailer;                 // frame holds the trailer of DATA
+  unsigned int open_count;            // open syscalls for this transfer
+  unsigned int close_count;           // close syscalls for this transfer
   char filename[FILE_TRANSFER_NAME_SIZE_MAX]; // requested filename
+  // ranges of a v2 ranged download, whole file if ranges_count is 0
+  struct file_transfer_range_t ranges[FILE_TRANSFER_RANGES_MAX];
 };
 
-void file_transfer_list_reset(struct file_transfer_t *list,
-                              size_t file_transfer_list_size);
-int file_transfer_context_add(struct file_transfer_t *ctx,
-                              struct file_transfer_t *list,
-                              size_t file_transfer_list_size);
-void file_transfer_context_remove(int fd, struct file_transfer_t *file_transfer,
-                                  size_t file_transfer_list_size);
+void file_transfer_context_reset(struct file_transfer_t *ctx);
+int file_transfer_context_add(struct file_transfer_t *ctx, size_t slot,
+                              size_t slots_max);
+int file_transfer_context_error(struct file_transfer_t *ctx, int fd,
+                                int error);
+void file_transfer_context_remove(struct file_transfer_t *ctx);
+bool file_transfer_frame_pending(const struct file_transfer_t *ctx);
+bool file_transfer_io_waiting(const struct file_transfer_t *ctx);
+void file_transfer_io_complete(struct file_io_request_t *request);
+int file_transfer_uring_setup(struct event_loop_t *loop, size_t slots_max);
+struct file_transfer_t *file_transfer_uring_complete(void *data, int res);
 int file_transfer(int fd, struct file_transfer_t *file_transfer);
+const char *file_transfer_engine_name(enum file_transfer_engine_t engine);
 
 #endif // __FILE_TRANSFER_H
\ No newline at end of file
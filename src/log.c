@@ -0,0 +1,247 @@
+/**
+ * @file log.c
+ * @author vinay divakar
+ * @brief leveled logging off the hot path: each thread formats its records
+ * into a ring of its own, without locks, and a background thread drains the
+ * rings to stdout
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+
+// records of one thread, written by it and drained by the logging thread
+struct log_ring_t {
+  uint64_t head;           // records written, by the owning thread
+  uint64_t dropped;        // records lost to a full ring
+  struct log_ring_t *next; // ring of the thread that logged before
+  // records drained by the logging thread, away from the line written above
+  uint64_t tail __attribute__((aligned(64)));
+  uint64_t reported;                            // drops already reported
+  uint16_t lengths[LOG_RING_SIZE];              // bytes of each record
+  char records[LOG_RING_SIZE][LOG_RECORD_SIZE]; // formatted records
+};
+
+static struct {
+  struct log_ring_t *rings; // every ring ever registered, never freed
+  pthread_t thread;         // thread draining the rings
+  bool running;             // records go through the rings
+  bool stop;                // the thread exits after a last drain
+} _log;
+
+static __thread struct log_ring_t *_ring; // ring of the calling thread
+
+enum log_level_t log_level = LOG_LEVEL_INFO;
+
+static const char *_names[LOG_LEVELS] = {"error", "warn", "info", "debug"};
+
+/**
+ * @brief allocates the ring of the calling thread and hands it to the
+ * logging thread
+ *
+ * @return points to the ring, NULL on error
+ */
+static struct log_ring_t *_ring_register(void) {
+  struct log_ring_t *ring = calloc(1, sizeof(*ring));
+
+  if (!ring) {
+    return NULL;
+  }
+
+  ring->next = __atomic_load_n(&_log.rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&_log.rings, &ring->next, ring, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  _ring = ring;
+  return ring;
+}
+
+/**
+ * @brief writes the records of every ring to stdout, in order per thread
+ *
+ * @return number of records written
+ */
+static size_t _log_drain(void) {
+  char buffer[LOG_FLUSH_BYTES];
+  struct log_ring_t *ring = __atomic_load_n(&_log.rings, __ATOMIC_ACQUIRE);
+  uint64_t head = 0, dropped = 0;
+  size_t used = 0, count = 0, slot = 0;
+
+  for (; ring; ring = ring->next) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (uint64_t tail = ring->tail; tail < head; tail++) {
+      slot = tail & (LOG_RING_SIZE - 1);
+      if (used + ring->lengths[slot] > sizeof(buffer)) {
+        fwrite(buffer, 1, used, stdout);
+        used = 0;
+      }
+      memcpy(buffer + used, ring->records[slot], ring->lengths[slot]);
+      used += ring->lengths[slot];
+      count++;
+    }
+    // copied out, the thread may reuse the slots
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+      fwrite(buffer, 1, used, stdout);
+      used = 0;
+      fprintf(stdout, "log: %lu records dropped, ring full\r\n",
+              dropped - ring->reported);
+      ring->reported = dropped;
+    }
+  }
+
+  if (used) {
+    fwrite(buffer, 1, used, stdout);
+  }
+  if (count) {
+    fflush(stdout);
+  }
+  return count;
+}
+
+/**
+ * @brief drains the rings until asked to stop, sleeping while they are empty
+ *
+ * @param[in] arg unused
+ * @return NULL
+ */
+static void *_log_run(void *arg) {
+  while (!__atomic_load_n(&_log.stop, __ATOMIC_ACQUIRE)) {
+    if (!_log_drain()) {
+      usleep(LOG_FLUSH_INTERVAL_US);
+    }
+  }
+  _log_drain();
+  return NULL;
+}
+
+/**
+ * @brief starts the logging thread, records written before go straight to
+ * stdout. The thread is stopped and the rings drained at exit
+ *
+ * @param[in] level most verbose level written
+ * @return 0 success, <0 error
+ */
+int log_create(enum log_level_t level) {
+  int err = 0;
+
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+  if (_log.running) {
+    return 0;
+  }
+
+  _log.stop = false;
+  err = -pthread_create(&_log.thread, NULL, _log_run, NULL);
+  if (err < 0) {
+    printf("error %d starting logging thread\r\n", err);
+    return err;
+  }
+  __atomic_store_n(&_log.running, true, __ATOMIC_RELEASE);
+  atexit(log_destroy);
+  return 0;
+}
+
+/**
+ * @brief stops the logging thread once it wrote every record, later records
+ * go straight to stdout
+ */
+void log_destroy(void) {
+  if (!__atomic_exchange_n(&_log.running, false, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  __atomic_store_n(&_log.stop, true, __ATOMIC_RELEASE);
+  pthread_join(_log.thread, NULL);
+  fflush(stdout);
+}
+
+/**
+ * @brief formats a record into the ring of the calling thread, the record is
+ * dropped and counted if the ring is full rather than waiting for it
+ *
+ * @param[in] format printf format of the record
+ * @param[in] ... arguments of the format
+ */
+void log_write(const char *format, ...) {
+  struct log_ring_t *ring = _ring;
+  uint64_t head = 0;
+  size_t slot = 0;
+  int length = 0;
+  va_list args;
+
+  va_start(args, format);
+  if (!__atomic_load_n(&_log.running, __ATOMIC_ACQUIRE) ||
+      (!ring && !(ring = _ring_register()))) {
+    vprintf(format, args);
+    va_end(args);
+    return;
+  }
+
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    va_end(args);
+    return;
+  }
+
+  slot = head & (LOG_RING_SIZE - 1);
+  length = vsnprintf(ring->records[slot], LOG_RECORD_SIZE, format, args);
+  va_end(args);
+  if (length < 0) {
+    length = 0;
+  } else if (length >= LOG_RECORD_SIZE) { // cut, still ends the line
+    length = LOG_RECORD_SIZE - 1;
+    memcpy(ring->records[slot] + length - 2, "\r\n", 2);
+  }
+  ring->lengths[slot] = length;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief looks up a level by name
+ *
+ * @param[in] name name of the level
+ * @param[out] level matching level
+ * @return 0 success, <0 error
+ */
+int log_level_parse(const char *name, enum log_level_t *level) {
+  for (int i = 0; i < LOG_LEVELS; i++) {
+    if (!strcmp(name, _names[i])) {
+      *level = i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+/**
+ * @brief returns the name of a level
+ *
+ * @param[in] level level to be named
+ * @return name of the level
+ */
+const char *log_level_name(enum log_level_t level) {
+  return level < LOG_LEVELS ? _names[level] : "unknown";
+}
+
+/**
+ * @brief returns the log statistics, summed over the threads that logged
+ *
+ * @param[out] stats statistics
+ */
+void log_stats_get(struct log_stats_t *stats) {
+  struct log_ring_t *ring = __atomic_load_n(&_log.rings, __ATOMIC_ACQUIRE);
+
+  memset(stats, 0, sizeof(*stats));
+  for (; ring; ring = ring->next) {
+    stats->records += __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    stats->threads++;
+  }
+}
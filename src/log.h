@@ -0,0 +1,61 @@
+#ifndef __LOG_H
+#define __LOG_H
+
+#include "common.h"
+
+#define LOG_RING_SIZE 256    // records buffered per thread, a power of two
+#define LOG_RECORD_SIZE 256  // bytes per record, longer messages are cut
+#define LOG_FLUSH_BYTES 8192 // bytes handed to stdout at once
+#define LOG_FLUSH_INTERVAL_US                                                  \
+  10000 // rings are drained this often when there is nothing to write
+
+enum log_level_t {
+  LOG_LEVEL_ERROR, // the server or a transfer failed
+  LOG_LEVEL_WARN,  // a client misbehaved or a fallback was taken
+  LOG_LEVEL_INFO,  // startup and configuration
+  LOG_LEVEL_DEBUG, // every connection, request and transfer
+  LOG_LEVELS
+};
+
+// levels above this one are compiled out, release builds drop the debug logs
+#ifndef LOG_LEVEL_COMPILED
+#ifdef NDEBUG
+#define LOG_LEVEL_COMPILED LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL_COMPILED LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// runtime level, read on every log call so kept out of a function call
+extern enum log_level_t log_level;
+
+#define LOG_ENABLED(level)                                                     \
+  ((level) <= LOG_LEVEL_COMPILED &&                                            \
+   (level) <= (int)__atomic_load_n(&log_level, __ATOMIC_RELAXED))
+#define LOG(level, ...)                                                        \
+  do {                                                                         \
+    if (LOG_ENABLED(level)) {                                                  \
+      log_write(__VA_ARGS__);                                                  \
+    }                                                                          \
+  } while (0)
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// log statistics, the counters are summed over the threads
+struct log_stats_t {
+  uint64_t records; // records written
+  uint64_t dropped; // records lost to a full ring
+  size_t threads;   // threads that logged
+};
+
+int log_create(enum log_level_t level);
+void log_destroy(void);
+void log_write(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+int log_level_parse(const char *name, enum log_level_t *level);
+const char *log_level_name(enum log_level_t level);
+void log_stats_get(struct log_stats_t *stats);
+
+#endif // __LOG_H
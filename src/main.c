@@ -9,11 +9,63 @@
  *
  */
 
-#include "server_state_machine.h"
+#include "file_cache.h"
+#include "file_io.h"
+#include "file_names.h"
+#include "log.h"
+#include "server_config.h"
+#include "server_metrics.h"
+#include "server_worker.h"
 
-int main(int, char **) {
-  while (1) {
-    server_state_machine_init();
+int main(int argc, char **argv) {
+  const struct server_config_t *config = NULL;
+  struct server_worker_t *workers = NULL;
+
+  if (server_config_parse(argc, argv) < 0) {
+    return EXIT_FAILURE;
+  }
+  config = server_config_get();
+
+  // from here on records are written by a thread of their own, and at exit
+  if (log_create(config->log_level) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // a client going away mid-transfer must surface as EPIPE, not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  // a storage that cannot be opened fails each request, as a missing file
+  file_names_create(config->storage, config->name_cache);
+
+  if (config->cache_size && file_cache_create(config->cache_size) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // started ahead of the workers, they pick it up as they start listening
+  if (config->io_threads && file_io_create(config->io_threads) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  workers = server_workers_start(config->workers, config->pin);
+  if (!workers) {
+    return EXIT_FAILURE;
+  }
+
+  if (config->metrics &&
+      server_metrics_start(config->metrics, workers, config->workers) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  while (config->stats_interval) {
+    sleep(config->stats_interval);
+    server_workers_stats_print(workers, config->workers);
   }
+
+  server_workers_join(workers, config->workers);
+  free(workers);
+  file_io_destroy();
+  file_cache_destroy();
+  file_names_destroy();
+  log_destroy();
   return 0;
 }
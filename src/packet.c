@@ -0,0 +1,116 @@
+/**
+ * @file packet.c
+ * @author vinay divakar
+ * @brief encodes and decodes v2 frame headers in place, straight into the
+ * buffer handed to send() or out of the one filled by recv()
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "packet.h"
+
+#include <endian.h>
+
+/**
+ * @brief encodes a 32-bit value in network byte order
+ *
+ * @param[out] buffer points to 4 bytes to be written
+ * @param[in] value value to be encoded
+ */
+void packet_u32_encode(uint8_t *buffer, uint32_t value) {
+  value = htobe32(value);
+  memcpy(buffer, &value, sizeof(value));
+}
+
+/**
+ * @brief encodes a 64-bit value in network byte order
+ *
+ * @param[out] buffer points to 8 bytes to be written
+ * @param[in] value value to be encoded
+ */
+void packet_u64_encode(uint8_t *buffer, uint64_t value) {
+  value = htobe64(value);
+  memcpy(buffer, &value, sizeof(value));
+}
+
+/**
+ * @brief decodes a 32-bit value sent in network byte order
+ *
+ * @param[in] buffer points to 4 bytes to be read
+ * @return decoded value
+ */
+uint32_t packet_u32_decode(const uint8_t *buffer) {
+  uint32_t value = 0;
+
+  memcpy(&value, buffer, sizeof(value));
+  return be32toh(value);
+}
+
+/**
+ * @brief decodes a 64-bit value sent in network byte order
+ *
+ * @param[in] buffer points to 8 bytes to be read
+ * @return decoded value
+ */
+uint64_t packet_u64_decode(const uint8_t *buffer) {
+  uint64_t value = 0;
+
+  memcpy(&value, buffer, sizeof(value));
+  return be64toh(value);
+}
+
+/**
+ * @brief encodes a v2 frame header at the start of a send buffer
+ *
+ * @param[out] buffer points to PACKET_V2_HEADER_SIZE bytes to be written
+ * @param[in] cmd command of the frame
+ * @param[in] request_id request the frame belongs to
+ * @param[in] length payload bytes following the header
+ */
+void packet_v2_header_encode(uint8_t *buffer, uint8_t cmd, uint32_t request_id,
+                             uint32_t length) {
+  buffer[0] = PACKET_V2_MAGIC;
+  buffer[1] = cmd;
+  buffer[2] = 0; // flags
+  buffer[3] = 0;
+  packet_u32_encode(buffer + 4, request_id);
+  packet_u32_encode(buffer + 8, length);
+}
+
+/**
+ * @brief sets the flags of a v2 frame header encoded with
+ * packet_v2_header_encode
+ *
+ * @param[in,out] buffer points to the encoded header
+ * @param[in] flags PACKET_V2_FLAG_* of the frame
+ */
+void packet_v2_flags_encode(uint8_t *buffer, uint16_t flags) {
+  buffer[2] = flags >> 8;
+  buffer[3] = flags & 0xFF;
+}
+
+/**
+ * @brief decodes the v2 frame header at the start of a receive buffer
+ *
+ * @param[in] buffer points to the received bytes
+ * @param[in] size number of received bytes
+ * @param[out] header decoded header
+ * @return 0 success, -EAGAIN header incomplete, -EBADMSG not a v2 frame
+ */
+int packet_v2_header_decode(const uint8_t *buffer, size_t size,
+                            struct packet_v2_header_t *header) {
+  if (size && buffer[0] != PACKET_V2_MAGIC) {
+    return -EBADMSG;
+  } else if (size < PACKET_V2_HEADER_SIZE) {
+    return -EAGAIN;
+  }
+
+  header->magic = buffer[0];
+  header->cmd = buffer[1];
+  header->flags = (uint16_t)buffer[2] << 8 | buffer[3];
+  header->request_id = packet_u32_decode(buffer + 4);
+  header->length = packet_u32_decode(buffer + 8);
+  return 0;
+}
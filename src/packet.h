@@ -5,7 +5,7 @@
 
 #define PACKET_MAX_SIZE (32 + PACKET_HEADER_SIZE + PACKET_CRC_SIZE)
 #define PACKET_HEADER_SIZE 2 // cmd and length
-#define PACKET_CRC_SIZE 0    // unused
+#define PACKET_CRC_SIZE 4    // CRC32C trailer, v2 frames once negotiated
 
 typedef union {
   uint8_t data[PACKET_MAX_SIZE];
@@ -13,8 +13,50 @@ typedef union {
     uint8_t cmd;
     uint8_t length;
     uint8_t data[PACKET_MAX_SIZE - PACKET_HEADER_SIZE - PACKET_CRC_SIZE];
-    uint8_t crc; // unused
+    uint8_t crc[PACKET_CRC_SIZE]; // CRC32C, v1 requests carry none
   } packet_struct;
 } packet_t;
 
+#define PACKET_VERSION_1 1 // raw file bytes followed by a one byte marker
+#define PACKET_VERSION_2 2 // length prefixed frames
+#define PACKET_V2_MAGIC                                                        \
+  0xF2 // first byte of every v2 frame, never a valid v1 command
+#define PACKET_V2_HEADER_SIZE 12 // magic, cmd, flags, request id, length
+#define PACKET_V2_RANGES_MAX 8 // ranges of a multi-range download
+#define PACKET_V2_RANGE_SIZE 16 // offset and length of a range
+#define PACKET_V2_REQUEST_SIZE_MAX                                             \
+  (PACKET_V2_HEADER_SIZE + 1 + PACKET_V2_RANGES_MAX * PACKET_V2_RANGE_SIZE +  \
+   255) // largest request frame accepted, a multi-range download
+#define PACKET_V2_FLAG_STREAM                                                  \
+  0x0100 // download opens a stream interleaved with the other streams
+#define PACKET_V2_FLAG_WEIGHT_MASK                                             \
+  0x00FF // weight of a stream, 0 counts as 1
+#define PACKET_V2_FLAG_ZSTD                                                    \
+  0x0200 // download the file compressed with zstd
+#define PACKET_V2_FLAG_LZ4                                                     \
+  0x0400 // download the file compressed with lz4
+#define PACKET_V2_FLAG_CRC_FRAME                                               \
+  0x0800 // hello, every frame sent afterwards ends with a CRC32C trailer
+#define PACKET_V2_FLAG_CRC_FILE                                                \
+  0x1000 // hello, EOF frames carry the CRC32C of the whole file
+
+// v2 frame header, sent in network byte order ahead of length payload bytes
+struct packet_v2_header_t {
+  uint8_t magic;       // PACKET_V2_MAGIC
+  uint8_t cmd;         // one of commands_t
+  uint16_t flags;      // PACKET_V2_FLAG_*, zero otherwise
+  uint32_t request_id; // chosen by the client, echoed in every reply frame
+  uint32_t length;     // payload bytes following the header
+};
+
+void packet_v2_header_encode(uint8_t *buffer, uint8_t cmd, uint32_t request_id,
+                             uint32_t length);
+void packet_v2_flags_encode(uint8_t *buffer, uint16_t flags);
+int packet_v2_header_decode(const uint8_t *buffer, size_t size,
+                            struct packet_v2_header_t *header);
+void packet_u32_encode(uint8_t *buffer, uint32_t value);
+void packet_u64_encode(uint8_t *buffer, uint64_t value);
+uint32_t packet_u32_decode(const uint8_t *buffer);
+uint64_t packet_u64_decode(const uint8_t *buffer);
+
 #endif // __PACKET_H
\ No newline at end of file
@@ -0,0 +1,114 @@
+/**
+ * @file ring_buffer.c
+ * @author vinay divakar
+ * @brief byte ring buffering data received on a connection until complete
+ * requests can be parsed out of it
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "ring_buffer.h"
+
+/**
+ * @brief initializes an empty ring over the given storage
+ *
+ * @param[out] ring points to the ring
+ * @param[in] data storage of the ring
+ * @param[in] size size of the storage, a power of two
+ */
+void ring_buffer_init(struct ring_buffer_t *ring, uint8_t *data, size_t size) {
+  ring->data = data;
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/**
+ * @brief drops everything buffered in the ring
+ *
+ * @param[in,out] ring points to the ring
+ */
+void ring_buffer_reset(struct ring_buffer_t *ring) {
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/**
+ * @brief returns the number of bytes buffered
+ *
+ * @param[in] ring points to the ring
+ * @return bytes buffered
+ */
+size_t ring_buffer_used(const struct ring_buffer_t *ring) {
+  return ring->tail - ring->head;
+}
+
+/**
+ * @brief returns the number of bytes that can still be buffered
+ *
+ * @param[in] ring points to the ring
+ * @return free bytes
+ */
+size_t ring_buffer_space(const struct ring_buffer_t *ring) {
+  return ring->size - ring_buffer_used(ring);
+}
+
+/**
+ * @brief returns the contiguous free space at the tail, data is written there
+ * directly and committed with ring_buffer_produce
+ *
+ * @param[in] ring points to the ring
+ * @param[out] span start of the free space
+ * @return size of the free space, 0 if the ring is full
+ */
+size_t ring_buffer_write_span(struct ring_buffer_t *ring, uint8_t **span) {
+  size_t index = ring->tail & (ring->size - 1);
+  size_t space = ring_buffer_space(ring);
+
+  *span = ring->data + index;
+  return space < ring->size - index ? space : ring->size - index;
+}
+
+/**
+ * @brief commits bytes written to the span returned by ring_buffer_write_span
+ *
+ * @param[in,out] ring points to the ring
+ * @param[in] size bytes written
+ */
+void ring_buffer_produce(struct ring_buffer_t *ring, size_t size) {
+  ring->tail += size;
+}
+
+/**
+ * @brief copies buffered bytes out of the ring without consuming them
+ *
+ * @param[in] ring points to the ring
+ * @param[out] data buffer to be populated
+ * @param[in] size size of the buffer
+ * @return bytes copied, less than size if fewer are buffered
+ */
+size_t ring_buffer_peek(const struct ring_buffer_t *ring, uint8_t *data,
+                        size_t size) {
+  size_t index = ring->head & (ring->size - 1), first = 0;
+
+  if (size > ring_buffer_used(ring)) {
+    size = ring_buffer_used(ring);
+  }
+
+  first = size < ring->size - index ? size : ring->size - index;
+  memcpy(data, ring->data + index, first);
+  memcpy(data + first, ring->data, size - first); // wrapped around
+  return size;
+}
+
+/**
+ * @brief consumes buffered bytes
+ *
+ * @param[in,out] ring points to the ring
+ * @param[in] size bytes to be consumed, at most ring_buffer_used
+ */
+void ring_buffer_consume(struct ring_buffer_t *ring, size_t size) {
+  ring->head += size;
+}
@@ -0,0 +1,24 @@
+#ifndef __RING_BUFFER_H
+#define __RING_BUFFER_H
+
+#include "common.h"
+
+// single producer, single consumer byte ring, size must be a power of two
+struct ring_buffer_t {
+  uint8_t *data; // storage provided by the owner
+  size_t size;   // capacity in bytes
+  size_t head;   // total bytes consumed, masked to index data
+  size_t tail;   // total bytes produced, masked to index data
+};
+
+void ring_buffer_init(struct ring_buffer_t *ring, uint8_t *data, size_t size);
+void ring_buffer_reset(struct ring_buffer_t *ring);
+size_t ring_buffer_used(const struct ring_buffer_t *ring);
+size_t ring_buffer_space(const struct ring_buffer_t *ring);
+size_t ring_buffer_write_span(struct ring_buffer_t *ring, uint8_t **span);
+void ring_buffer_produce(struct ring_buffer_t *ring, size_t size);
+size_t ring_buffer_peek(const struct ring_buffer_t *ring, uint8_t *data,
+                        size_t size);
+void ring_buffer_consume(struct ring_buffer_t *ring, size_t size);
+
+#endif // __RING_BUFFER_H
@@ -10,34 +10,78 @@
  */
 #include "server.h"
 
+#include <netinet/tcp.h>
+
+/**
+ * @brief applies the optional TCP settings of a listening socket, a kernel
+ * without them still gets a working listener. The send settings are copied
+ * to every connection accepted from it
+ *
+ * @param[in] fd listening socket
+ * @param[in] profile settings of the listener
+ */
+static void _listen_tune(int fd,
+                         const struct server_listen_profile_t *profile) {
+  int on = profile->nodelay;
+
+  if (profile->defer_accept &&
+      setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &profile->defer_accept,
+                 sizeof(profile->defer_accept)) < 0) {
+    LOG_WARN("error %d setsockopt TCP_DEFER_ACCEPT, ignored\r\n", errno);
+  }
+  if (profile->fastopen &&
+      setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &profile->fastopen,
+                 sizeof(profile->fastopen)) < 0) {
+    LOG_WARN("error %d setsockopt TCP_FASTOPEN, ignored\r\n", errno);
+  }
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+    LOG_WARN("error %d setsockopt TCP_NODELAY, ignored\r\n", errno);
+  }
+  if (profile->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile->sndbuf,
+                                    sizeof(profile->sndbuf)) < 0) {
+    LOG_WARN("error %d setsockopt SO_SNDBUF, ignored\r\n", errno);
+  }
+  if (profile->notsent_lowat &&
+      setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile->notsent_lowat,
+                 sizeof(profile->notsent_lowat)) < 0) {
+    LOG_WARN("error %d setsockopt TCP_NOTSENT_LOWAT, ignored\r\n", errno);
+  }
+}
+
 /**
  * @brief configures socket to listen for connections
  *
  * @param[in] port port used for listening
+ * @param[in] reuseport share the port with other listening sockets, the
+ * kernel then spreads incoming connections across them
+ * @param[in] profile settings of the listener
  * @return 0 success, <0 error
  */
-static int _listen(const uint16_t port) {
+static int _listen(const uint16_t port, bool reuseport,
+                   const struct server_listen_profile_t *profile) {
   int err = 0, fd = -1, on = 1;
 
   do {
-    err = socket(AF_INET, SOCK_STREAM, 0);
+    // non-blocking, connections are accepted until EAGAIN
+    err = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (err < 0) {
-      printf("error %d create socket\r\n", err);
+      LOG_ERROR("error %d create socket\r\n", err);
       break;
     }
     fd = err;
 
     err = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
     if (err < 0) {
-      printf("error %d setsockopt\r\n", err);
+      LOG_ERROR("error %d setsockopt\r\n", err);
       break;
     }
 
-    // configure socket to be non-blocking
-    err = ioctl(fd, FIONBIO, (char *)&on);
-    if (err < 0) {
-      printf("error %d ioctl\r\n", err);
-      break;
+    if (reuseport) {
+      err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+      if (err < 0) {
+        LOG_ERROR("error %d setsockopt SO_REUSEPORT\r\n", err);
+        break;
+      }
     }
 
     struct sockaddr_in _address = {};
@@ -49,13 +93,15 @@ static int _listen(const uint16_t port) {
 
     err = bind(fd, (struct sockaddr *)&_address, sizeof(_address));
     if (err < 0) {
-      printf("error %d bind socket\r\n", err);
+      LOG_ERROR("error %d bind socket\r\n", err);
       break;
     }
 
-    err = listen(fd, SERVER_CONNECTIONS_BACKLOG);
+    _listen_tune(fd, profile);
+
+    err = listen(fd, profile->backlog);
     if (err < 0) {
-      printf("error %d listen socket\r\n", err);
+      LOG_ERROR("error %d listen socket\r\n", err);
       break;
     }
   } while (0);
@@ -71,14 +117,18 @@ static int _listen(const uint16_t port) {
  * @brief begins listening for connections
  *
  * @param[in] port port used for listening f
+ * @param[in] reuseport share the port with the listening sockets of other
+ * workers
+ * @param[in] profile settings of the listener
  * @return 0 success, <0 error
  */
-int server_listen_begin(const uint16_t port) {
+int server_listen_begin(const uint16_t port, bool reuseport,
+                        const struct server_listen_profile_t *profile) {
   int err = 0, fd = -1;
   do {
-    err = _listen(port);
+    err = _listen(port, reuseport, profile);
     if (err < 0) {
-      printf("error %d unable to setup listen\r\n", err);
+      LOG_ERROR("error %d unable to setup listen\r\n", err);
       break;
     }
     fd = err;
@@ -88,68 +138,92 @@ int server_listen_begin(const uint16_t port) {
 }
 
 /**
- * @brief accepts incoming connections
+ * @brief accepts the queued connections, at most budget of them so a storm
+ * of connections does not starve the established ones, the listener is level
+ * triggered and reports the rest on the next wakeup. Connections come out
+ * non-blocking and close on exec without further system calls
  *
  * @param[in] fd incoming connection handler
  * @param[in] events revents to poll for this connection
+ * @param[in] budget most connections accepted, 0 for no limit
  * @param[in] client_fd_add callback to add connections to the polling list
- * @return 0 success, <0 error
+ * @param[in] ctx passed back to client_fd_add
+ * @return number of connections accepted >=0 success, <0 error
  */
-int server_connections_accept(int fd, short int events,
-                              int (*client_fd_add)(int, short int)) {
-  int err = 0, fd_new = -1;
-  struct sockaddr_in _address = {};
-  int _address_len = sizeof(_address);
+int server_connections_accept(int fd, short int events, size_t budget,
+                              int (*client_fd_add)(void *, int, short int),
+                              void *ctx) {
+  int fd_new = -1;
+  size_t count = 0;
 
-  do {
-    int fd_new =
-        accept(fd, (struct sockaddr *)&_address, (socklen_t *)&_address_len);
-    if (fd_new < 0) {
-      err = (errno == EWOULDBLOCK) ? 0 : -errno;
-      break;
+  while (!budget || count < budget) {
+    fd_new = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd_new >= 0) {
+      client_fd_add(ctx, fd_new, events);
+      count++;
+      continue;
     }
 
-    client_fd_add(fd_new, events);
+    switch (errno) {
+    case EAGAIN:
+      return count;
+    case EINTR:
+    case ECONNABORTED: // the client gave up while queued
+    case EPROTO:
+    case EPERM:
+      continue;
+    case EMFILE: // out of descriptors or memory, retried on the next wakeup
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+      LOG_WARN("error %d accepting connection, retrying\r\n", errno);
+      return count;
+    default:
+      LOG_ERROR("error %d accepting connection\r\n", errno);
+      return -errno;
+    }
+  }
+  return count;
+}
 
-  } while (fd_new != -1);
+/**
+ * @brief returns the depth of the accept queue of a listening socket, may be
+ * called from any thread
+ *
+ * @param[in] fd listening socket
+ * @param[out] depth connections waiting to be accepted
+ * @param[out] max length of the queue, connections beyond it are dropped
+ * @return 0 success, <0 error
+ */
+int server_listen_queue(int fd, uint32_t *depth, uint32_t *max) {
+  struct tcp_info info = {};
+  socklen_t size = sizeof(info);
 
-  return err;
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) < 0) {
+    return -errno;
+  }
+  // a listening socket reports its queue in these two
+  *depth = info.tcpi_unacked;
+  *max = info.tcpi_sacked;
+  return 0;
 }
 
 /**
- * @brief reads from the socket
+ * @brief reads from the socket, at most the size of the buffer
  *
  * @param[in] fd connection handler
  * @param[out] recv_buff points to the buffer to be populated with recv data
  * @param[in] recv_buff_size size of the recv buffer
- * @return number of bytes read or <0 on error
+ * @return number of bytes read >0, 0 peer closed the connection, -EAGAIN
+ * nothing to read, <0 on error
  */
 int server_read(int fd, uint8_t *recv_buff, size_t recv_buff_size) {
-  int result = 0, total_recieved = 0, received = 0;
-  size_t offset = 0;
-
-  do {
-    received = recv(fd, recv_buff + offset, recv_buff_size - offset, 0);
-    if (received == 0) {
-      result = total_recieved;
-      break;
-    } else if (received < 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        result = total_recieved;
-        break;
-      }
-      result = -errno;
-      break;
-    } else {
-      total_recieved += received;
-      offset += received;
-
-      if (offset >= recv_buff_size) {
-        offset = 0;
-      }
-    }
-  } while (true);
+  int result = 0;
 
+  result = recv(fd, recv_buff, recv_buff_size, 0);
+  if (result < 0) {
+    result = (errno == EWOULDBLOCK || errno == EAGAIN) ? -EAGAIN : -errno;
+  }
   return result;
 }
 
@@ -177,16 +251,56 @@ int server_write(int fd, uint8_t *send_buff, size_t send_buff_size) {
 }
 
 /**
- * @brief prints the received data
+ * @brief sends the parts of a message over socket connection with a single
+ * system call. With more set the kernel holds a partial segment back for the
+ * data the caller sends next, as TCP_CORK would, so headers, data and
+ * trailers sent by separate calls still leave in full segments
+ *
+ * @param[in] fd connection handler
+ * @param[in] iov parts to send, in order
+ * @param[in] iov_count number of parts
+ * @param[in] more the caller has more data to send right after these
+ * @return number of bytes on success, 0 on would block, <0 error
+ */
+int server_writev(int fd, const struct iovec *iov, int iov_count, bool more) {
+  struct msghdr msg = {.msg_iov = (struct iovec *)iov,
+                       .msg_iovlen = iov_count};
+  int err = 0;
+
+  err = sendmsg(fd, &msg, more ? MSG_MORE : 0);
+  if (err < 0) {
+    if (errno == EWOULDBLOCK || errno == EAGAIN) {
+      err = 0; // try again once client is ready to receive
+    } else {
+      err = -errno;
+    }
+  }
+  return err;
+}
+
+#if LOG_LEVEL_COMPILED >= LOG_LEVEL_DEBUG
+/**
+ * @brief logs the received data at debug level, SERVER_RECV_PRINT_BYTES bytes
+ * per record
  *
  * @param[in] buffer points to buffer to be dumped
  * @param[in] data_size  size of the data
- * @return 0 success, <0 error
  */
 void server_recv_print(uint8_t *buffer, size_t data_size) {
-  printf("recv: ");
-  for (size_t i = 0; i < data_size; i++) {
-    printf("0x%02X ", buffer[i]);
+  char line[SERVER_RECV_PRINT_BYTES * 5 + 1];
+  size_t length = 0;
+
+  if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+    return;
+  }
+
+  for (size_t i = 0; i < data_size; i += SERVER_RECV_PRINT_BYTES) {
+    length = 0;
+    for (size_t j = i; j < data_size && j < i + SERVER_RECV_PRINT_BYTES; j++) {
+      length += snprintf(line + length, sizeof(line) - length, "0x%02X ",
+                         buffer[j]);
+    }
+    LOG_DEBUG("recv: %s\r\n", line);
   }
-  printf("\r\n");
 }
+#endif
@@ -2,24 +2,60 @@
 #define __SERVER_H
 
 #include "common.h"
+#include "log.h"
 
-#define SERVER_SOCKET_LISTEN_INDEX                                             \
-  0 // listening socket index in poll fds descriptor set
 #define SERVER_SOCKET_LISTEN_PORT_NUM                                          \
   12345 // listening socket port number to which clients request connection
 #define SERVER_SOCKET_POLL_TIMEOUT                                             \
-  -1 // poll timeout set to block indefinetly if not events occur
+  -1 // poll timeout while no timer is armed, block until events occur
 #define SERVER_CONNECTIONS_BACKLOG                                             \
-  5 // maximum connections to be queued to be serviced
-#define SERVER_STATE_MACHINE_FDS_MAX                                           \
-  3 + 1 // maximum number of connections supported
+  4096 // default connections queued to be accepted, capped by somaxconn
+#define SERVER_ACCEPT_BUDGET                                                   \
+  64 // default connections accepted per wakeup of a worker
+#define SERVER_CONNECTIONS_MAX                                                 \
+  1024 // default maximum number of connections per worker
+#define SERVER_WRITE_BUDGET                                                    \
+  (1024 * 1024) // default bytes sent to a connection per wakeup
+#define SERVER_RECV_PRINT_BYTES 32 // received bytes dumped per log record
+#define SERVER_TIMER_TICK_MS 100   // resolution of the connection timeouts
+#define SERVER_IDLE_TIMEOUT 60     // default seconds a connection may idle
+#define SERVER_REQUEST_TIMEOUT                                                 \
+  10 // default seconds from the first byte of a request to the last
+#define SERVER_MIN_RATE 1024 // default bytes/sec a transfer must keep up
+#define SERVER_MIN_RATE_WINDOW_MS                                              \
+  10000 // transfers are held to the minimum rate over windows this long
+#define SERVER_SHAPING_BURST_MS                                                \
+  200 // shaped bandwidth saved up while idle, in ms of the rate
+#define SERVER_SHAPING_BURST_MIN                                               \
+  (64 * 1024) // smallest burst of a shaped connection
 
-int server_listen_begin(const uint16_t port);
-int server_connections_accept(int fd, short int events,
-                              int (*client_fd_add)(int, short int));
+// settings of a listening socket, the connections accepted from it inherit
+// the ones applying to them, so they cost no system call per connection
+struct server_listen_profile_t {
+  int backlog;       // length of the accept queue, capped by somaxconn
+  int defer_accept;  // seconds to hold connections until data, 0 off
+  int fastopen;      // length of the TCP Fast Open queue, 0 off
+  bool nodelay;      // TCP_NODELAY, sends are not held for outstanding acks
+  int sndbuf;        // SO_SNDBUF bytes, 0 leaves the kernel autotuning it
+  int notsent_lowat; // TCP_NOTSENT_LOWAT, unsent bytes below which POLLOUT
+                     // is reported, 0 kernel default
+};
+
+int server_listen_begin(const uint16_t port, bool reuseport,
+                        const struct server_listen_profile_t *profile);
+int server_connections_accept(int fd, short int events, size_t budget,
+                              int (*client_fd_add)(void *, int, short int),
+                              void *ctx);
+int server_listen_queue(int fd, uint32_t *depth, uint32_t *max);
 int server_read(int fd, uint8_t *recv_buff, size_t recv_buff_size);
 int server_write(int fd, uint8_t *send_buff, size_t send_buff_size);
+int server_writev(int fd, const struct iovec *iov, int iov_count, bool more);
 
+// a debug aid, compiled out along with the debug logs
+#if LOG_LEVEL_COMPILED >= LOG_LEVEL_DEBUG
 void server_recv_print(uint8_t *buffer, size_t data_size);
+#else
+#define server_recv_print(buffer, data_size) ((void)(buffer), (void)(data_size))
+#endif
 
 #endif //__SERVER_H
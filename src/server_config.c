@@ -0,0 +1,525 @@
+/**
+ * @file server_config.c
+ * @author vinay divakar
+ * @brief runtime configuration of the server from the command line
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "server_config.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <limits.h>
+
+static struct server_config_t _config = {
+    .transfer_engine = SERVER_CONFIG_TRANSFER_ENGINE,
+    .event_backend = SERVER_CONFIG_EVENT_BACKEND,
+    .port = SERVER_SOCKET_LISTEN_PORT_NUM,
+    .storage = FILE_TRANSFER_TABLE,
+    .workers = 0,
+    .max_connections = SERVER_CONNECTIONS_MAX,
+    .chunk_size = FILE_TRANSFER_CHUNK_SIZE,
+    .chunk_adaptive = false,
+    .write_budget = SERVER_WRITE_BUDGET,
+    .pin = false,
+    .stats_interval = 0,
+    .cache_size = 0,
+    .io_threads = 0,
+    .name_cache = FILE_NAMES_ENTRIES,
+    .metrics = NULL,
+    .log_level = SERVER_CONFIG_LOG_LEVEL,
+    .idle_timeout = SERVER_IDLE_TIMEOUT,
+    .request_timeout = SERVER_REQUEST_TIMEOUT,
+    .min_rate = SERVER_MIN_RATE,
+    .accept_budget = SERVER_ACCEPT_BUDGET,
+    .listen = {.backlog = SERVER_CONNECTIONS_BACKLOG,
+               .defer_accept = 0,
+               .fastopen = 0,
+               .nodelay = true,
+               .sndbuf = 0,
+               .notsent_lowat = 0},
+    .rate = 0,
+    .global_rate = 0,
+    .rate_rules_count = 0,
+};
+
+/**
+ * @brief prints the supported command line options
+ *
+ * @param[in] app name of the application
+ */
+static void _usage(const char *app) {
+  printf("usage: %s [options]\r\n"
+         "  -b, --backend <poll|epoll|uring>           event loop backend "
+         "(default %s)\r\n"
+         "  -e, --engine <engine>                      file transfer engine, "
+         "copy, sendfile, splice, uring or mmap (default %s)\r\n"
+         "  -p, --port <port>                          listening port "
+         "(default %d)\r\n"
+         "  -s, --storage <dir>                        files storage path "
+         "(default %s)\r\n"
+         "  -w, --workers <n>                          worker threads, 0 "
+         "for one per cpu (default 0)\r\n"
+         "  -m, --max-connections <n>                  connections per "
+         "worker (default %d)\r\n"
+         "  -k, --chunk-size <bytes>                   copy engine chunk "
+         "size (default %d)\r\n"
+         "  -a, --adaptive-chunk                       grow the chunk size "
+         "while sends are accepted in full\r\n"
+         "  -B, --write-budget <bytes>                 bytes sent to a "
+         "connection per wakeup, 0 for no limit (default %d)\r\n"
+         "  -c, --pin                                  pin each worker to "
+         "a cpu\r\n"
+         "  -i, --stats-interval <seconds>             print worker stats "
+         "periodically (default 0, off)\r\n"
+         "  -C, --cache-size <bytes>                   hot file cache "
+         "shared by the workers (default 0, off)\r\n"
+         "  -t, --io-threads <n>                       threads opening and "
+         "reading files for the workers (default 0, off)\r\n"
+         "  -n, --name-cache <n>                       filenames kept open "
+         "for the workers, 0 for none (default %d)\r\n"
+         "  -M, --metrics <path|port>                  serve Prometheus "
+         "metrics on a Unix socket or a loopback port (default off)\r\n"
+         "  -l, --log-level <error|warn|info|debug>    most verbose logs "
+         "written (default %s)\r\n"
+         "  -I, --idle-timeout <seconds>               close connections "
+         "idle this long, 0 for never (default %d)\r\n"
+         "  -T, --request-timeout <seconds>            close connections "
+         "sending a request for this long, 0 for never (default %d)\r\n"
+         "  -r, --min-rate <bytes/sec>                 close connections "
+         "reading a transfer slower, 0 for no minimum (default %d)\r\n"
+         "  -q, --backlog <n>                          connections queued "
+         "to be accepted, capped by somaxconn (default %d)\r\n"
+         "  -A, --accept-budget <n>                    connections accepted "
+         "per wakeup, 0 for no limit (default %d)\r\n"
+         "  -D, --defer-accept <seconds>               wake up for a "
+         "connection once it sent data (default 0, off)\r\n"
+         "  -F, --fastopen <n>                         TCP Fast Open queue "
+         "length (default 0, off)\r\n"
+         "  -N, --nagle                                hold small sends "
+         "until the previous ones are acked (default off, TCP_NODELAY)\r\n"
+         "  -S, --sndbuf <bytes>                       socket send buffer "
+         "size (default 0, autotuned by the kernel)\r\n"
+         "  -L, --notsent-lowat <bytes>                unsent bytes below "
+         "which a connection is writable (default 0, kernel default)\r\n"
+         "  -R, --rate <bytes/sec>                     bandwidth of each "
+         "connection, 0 for no limit (default 0)\r\n"
+         "  -G, --global-rate <bytes/sec>              bandwidth of all "
+         "connections, shared evenly by the workers (default 0, no limit)\r\n"
+         "  -u, --rate-rule <address[/prefix]=bytes/sec>  bandwidth of "
+         "each connection from an address range instead of --rate, up to "
+         "%d rules, the longest prefix applies\r\n"
+         "  -h, --help                                 print this help\r\n",
+         app, event_loop_backend_name(SERVER_CONFIG_EVENT_BACKEND),
+         file_transfer_engine_name(SERVER_CONFIG_TRANSFER_ENGINE),
+         SERVER_SOCKET_LISTEN_PORT_NUM, FILE_TRANSFER_TABLE,
+         SERVER_CONNECTIONS_MAX, FILE_TRANSFER_CHUNK_SIZE,
+         SERVER_WRITE_BUDGET, FILE_NAMES_ENTRIES,
+         log_level_name(SERVER_CONFIG_LOG_LEVEL), SERVER_IDLE_TIMEOUT,
+         SERVER_REQUEST_TIMEOUT, SERVER_MIN_RATE, SERVER_CONNECTIONS_BACKLOG,
+         SERVER_ACCEPT_BUDGET, SERVER_CONFIG_RATE_RULES_MAX);
+}
+
+/**
+ * @brief looks up a transfer engine by name
+ *
+ * @param[in] name name of the engine
+ * @param[out] engine matching engine
+ * @return 0 success, <0 error
+ */
+static int _engine_parse(const char *name,
+                         enum file_transfer_engine_t *engine) {
+  const enum file_transfer_engine_t engines[] = {
+      FILE_TRANSFER_ENGINE_COPY, FILE_TRANSFER_ENGINE_SENDFILE,
+      FILE_TRANSFER_ENGINE_SPLICE, FILE_TRANSFER_ENGINE_URING,
+      FILE_TRANSFER_ENGINE_MMAP};
+
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    if (!strcmp(name, file_transfer_engine_name(engines[i]))) {
+      *engine = engines[i];
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+/**
+ * @brief looks up an event loop backend by name
+ *
+ * @param[in] name name of the backend
+ * @param[out] backend matching backend
+ * @return 0 success, <0 error
+ */
+static int _backend_parse(const char *name,
+                          enum event_loop_backend_t *backend) {
+  const enum event_loop_backend_t backends[] = {
+      EVENT_LOOP_BACKEND_POLL, EVENT_LOOP_BACKEND_EPOLL,
+      EVENT_LOOP_BACKEND_URING};
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (!strcmp(name, event_loop_backend_name(backends[i]))) {
+      *backend = backends[i];
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+/**
+ * @brief parses the rate of an address range, given as address=rate for a
+ * single address or address/prefix=rate
+ *
+ * @param[in] text rule to be parsed
+ * @param[out] rule parsed rule
+ * @return 0 success, <0 error
+ */
+static int _rate_rule_parse(const char *text,
+                            struct server_config_rate_rule_t *rule) {
+  char address[INET_ADDRSTRLEN + 3] = {}, *slash = NULL, *end = NULL;
+  const char *equals = strchr(text, '=');
+  struct in_addr in = {};
+  long prefix = 32;
+  long long rate = 0;
+
+  if (!equals || equals - text >= (long)sizeof(address)) {
+    return -EINVAL;
+  }
+  memcpy(address, text, equals - text);
+
+  slash = strchr(address, '/');
+  if (slash) {
+    prefix = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end || prefix < 0 || prefix > 32) {
+      return -EINVAL;
+    }
+    *slash = '\0';
+  }
+  if (inet_pton(AF_INET, address, &in) != 1) {
+    return -EINVAL;
+  }
+
+  rate = strtoll(equals + 1, &end, 10);
+  if (end == equals + 1 || *end || rate < 0) {
+    return -EINVAL;
+  }
+
+  rule->mask = prefix ? ~(uint32_t)0 << (32 - prefix) : 0;
+  rule->network = ntohl(in.s_addr) & rule->mask;
+  rule->rate = rate;
+  return 0;
+}
+
+/**
+ * @brief parses the decimal number given to an option, the whole argument
+ * must be a number within the range of the option
+ *
+ * @param[in] text argument of the option
+ * @param[in] min smallest value accepted
+ * @param[in] max largest value accepted
+ * @param[out] value parsed number
+ * @return 0 success, -EINVAL if not a number or out of range
+ */
+static int _number_parse(const char *text, long min, long max, long *value) {
+  char *end = NULL;
+
+  errno = 0;
+  *value = strtol(text, &end, 10);
+  if (end == text || *end || errno || *value < min || *value > max) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * @brief parses the command line into the server configuration
+ *
+ * @param[in] argc number of arguments
+ * @param[in] argv arguments
+ * @return 0 success, <0 error
+ */
+int server_config_parse(int argc, char **argv) {
+  int err = 0, opt = 0;
+  long value = 0;
+  const struct option options[] = {
+      {"backend", required_argument, NULL, 'b'},
+      {"engine", required_argument, NULL, 'e'},
+      {"port", required_argument, NULL, 'p'},
+      {"storage", required_argument, NULL, 's'},
+      {"workers", required_argument, NULL, 'w'},
+      {"max-connections", required_argument, NULL, 'm'},
+      {"chunk-size", required_argument, NULL, 'k'},
+      {"adaptive-chunk", no_argument, NULL, 'a'},
+      {"write-budget", required_argument, NULL, 'B'},
+      {"pin", no_argument, NULL, 'c'},
+      {"stats-interval", required_argument, NULL, 'i'},
+      {"cache-size", required_argument, NULL, 'C'},
+      {"io-threads", required_argument, NULL, 't'},
+      {"name-cache", required_argument, NULL, 'n'},
+      {"metrics", required_argument, NULL, 'M'},
+      {"log-level", required_argument, NULL, 'l'},
+      {"idle-timeout", required_argument, NULL, 'I'},
+      {"request-timeout", required_argument, NULL, 'T'},
+      {"min-rate", required_argument, NULL, 'r'},
+      {"backlog", required_argument, NULL, 'q'},
+      {"accept-budget", required_argument, NULL, 'A'},
+      {"defer-accept", required_argument, NULL, 'D'},
+      {"fastopen", required_argument, NULL, 'F'},
+      {"nagle", no_argument, NULL, 'N'},
+      {"sndbuf", required_argument, NULL, 'S'},
+      {"notsent-lowat", required_argument, NULL, 'L'},
+      {"rate", required_argument, NULL, 'R'},
+      {"global-rate", required_argument, NULL, 'G'},
+      {"rate-rule", required_argument, NULL, 'u'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+
+  while (!err && (opt = getopt_long(
+                     argc, argv,
+                     "b:e:p:s:w:m:k:aB:ci:C:t:n:M:l:I:T:r:q:A:D:F:NS:L:R:G:u:h",
+                     options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      err = _backend_parse(optarg, &_config.event_backend);
+      if (err < 0) {
+        printf("unknown event loop backend %s\r\n", optarg);
+      }
+      break;
+    case 'e':
+      err = _engine_parse(optarg, &_config.transfer_engine);
+      if (err < 0) {
+        printf("unknown transfer engine %s\r\n", optarg);
+      }
+      break;
+    case 'p':
+      err = _number_parse(optarg, 1, UINT16_MAX, &value);
+      if (err < 0) {
+        printf("invalid port %s\r\n", optarg);
+      }
+      _config.port = value;
+      break;
+    case 's':
+      _config.storage = optarg;
+      break;
+    case 'w':
+      err = _number_parse(optarg, 0, SERVER_CONFIG_WORKERS_MAX, &value);
+      if (err < 0) {
+        printf("invalid number of workers %s\r\n", optarg);
+      }
+      _config.workers = value;
+      break;
+    case 'm':
+      err = _number_parse(optarg, 1, SERVER_CONFIG_CONNECTIONS_MAX, &value);
+      if (err < 0) {
+        printf("invalid maximum connections %s\r\n", optarg);
+      }
+      _config.max_connections = value;
+      break;
+    case 'k':
+      err = _number_parse(optarg, FILE_TRANSFER_CHUNK_SIZE_MIN,
+                          FILE_TRANSFER_CHUNK_SIZE_MAX, &value);
+      if (err < 0) {
+        printf("invalid chunk size %s, must be %d to %d bytes\r\n", optarg,
+               FILE_TRANSFER_CHUNK_SIZE_MIN, FILE_TRANSFER_CHUNK_SIZE_MAX);
+      }
+      _config.chunk_size = value;
+      break;
+    case 'a':
+      _config.chunk_adaptive = true;
+      break;
+    case 'B':
+      err = _number_parse(optarg, 0, LONG_MAX, &value);
+      if (err < 0) {
+        printf("invalid write budget %s\r\n", optarg);
+      }
+      _config.write_budget = value;
+      break;
+    case 'c':
+      _config.pin = true;
+      break;
+    case 'i':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid stats interval %s\r\n", optarg);
+      }
+      _config.stats_interval = value;
+      break;
+    case 'C':
+      err = _number_parse(optarg, 0, LONG_MAX, &value);
+      if (err < 0) {
+        printf("invalid cache size %s\r\n", optarg);
+      }
+      _config.cache_size = value;
+      break;
+    case 't':
+      err = _number_parse(optarg, 0, FILE_IO_THREADS_MAX, &value);
+      if (err < 0) {
+        printf("invalid number of file I/O threads %s\r\n", optarg);
+      }
+      _config.io_threads = value;
+      break;
+    case 'n':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid name cache size %s\r\n", optarg);
+      }
+      _config.name_cache = value;
+      break;
+    case 'M':
+      _config.metrics = optarg;
+      break;
+    case 'l':
+      err = log_level_parse(optarg, &_config.log_level);
+      if (err < 0) {
+        printf("unknown log level %s\r\n", optarg);
+      }
+      break;
+    case 'I':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid idle timeout %s\r\n", optarg);
+      }
+      _config.idle_timeout = value;
+      break;
+    case 'T':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid request timeout %s\r\n", optarg);
+      }
+      _config.request_timeout = value;
+      break;
+    case 'r':
+      err = _number_parse(optarg, 0, LONG_MAX, &value);
+      if (err < 0) {
+        printf("invalid minimum rate %s\r\n", optarg);
+      }
+      _config.min_rate = value;
+      break;
+    case 'q':
+      err = _number_parse(optarg, 1, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid backlog %s\r\n", optarg);
+      }
+      _config.listen.backlog = value;
+      break;
+    case 'A':
+      err = _number_parse(optarg, 0, LONG_MAX, &value);
+      if (err < 0) {
+        printf("invalid accept budget %s\r\n", optarg);
+      }
+      _config.accept_budget = value;
+      break;
+    case 'D':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid defer accept %s\r\n", optarg);
+      }
+      _config.listen.defer_accept = value;
+      break;
+    case 'F':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid fast open queue %s\r\n", optarg);
+      }
+      _config.listen.fastopen = value;
+      break;
+    case 'N':
+      _config.listen.nodelay = false;
+      break;
+    case 'S': // the kernel doubles it
+      err = _number_parse(optarg, 0, INT32_MAX / 2, &value);
+      if (err < 0) {
+        printf("invalid send buffer size %s\r\n", optarg);
+      }
+      _config.listen.sndbuf = value;
+      break;
+    case 'L':
+      err = _number_parse(optarg, 0, INT32_MAX, &value);
+      if (err < 0) {
+        printf("invalid not sent low watermark %s\r\n", optarg);
+      }
+      _config.listen.notsent_lowat = value;
+      break;
+    case 'R':
+      err = _number_parse(optarg, 0, LONG_MAX, &value);
+      if (err < 0) {
+        printf("invalid rate %s\r\n", optarg);
+      }
+      _config.rate = value;
+      break;
+    case 'G':
+      err = _number_parse(optarg, 0, LONG_MAX, &value);
+      if (err < 0) {
+        printf("invalid global rate %s\r\n", optarg);
+      }
+      _config.global_rate = value;
+      break;
+    case 'u':
+      if (_config.rate_rules_count == SERVER_CONFIG_RATE_RULES_MAX) {
+        printf("too many rate rules, at most %d\r\n",
+               SERVER_CONFIG_RATE_RULES_MAX);
+        err = -EINVAL;
+        break;
+      }
+      err = _rate_rule_parse(
+          optarg, &_config.rate_rules[_config.rate_rules_count]);
+      if (err < 0) {
+        printf("invalid rate rule %s\r\n", optarg);
+        break;
+      }
+      _config.rate_rules_count++;
+      break;
+    case 'h':
+      _usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default:
+      err = -EINVAL;
+      break;
+    }
+  }
+
+  if (err < 0) {
+    _usage(argv[0]);
+    return err;
+  }
+
+  if (!_config.workers) {
+    _config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+    _config.workers = _config.workers > 0 ? _config.workers : 1;
+    if (_config.workers > SERVER_CONFIG_WORKERS_MAX) {
+      _config.workers = SERVER_CONFIG_WORKERS_MAX;
+    }
+  }
+  return err;
+}
+
+/**
+ * @brief returns the active server configuration
+ *
+ * @return points to the configuration
+ */
+const struct server_config_t *server_config_get(void) { return &_config; }
+
+/**
+ * @brief returns the bandwidth of a connection from a client address, the
+ * rate of the longest prefix matching it or the default rate
+ *
+ * @param[in] config points to the configuration
+ * @param[in] address client address, host order
+ * @return bytes/sec, 0 unlimited
+ */
+size_t server_config_rate(const struct server_config_t *config,
+                          uint32_t address) {
+  const struct server_config_rate_rule_t *rule = NULL, *match = NULL;
+
+  for (size_t i = 0; i < config->rate_rules_count; i++) {
+    rule = &config->rate_rules[i];
+    if ((address & rule->mask) == rule->network &&
+        (!match || rule->mask > match->mask)) {
+      match = rule;
+    }
+  }
+  return match ? match->rate : config->rate;
+}
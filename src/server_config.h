@@ -0,0 +1,62 @@
+#ifndef __SERVER_CONFIG_H
+#define __SERVER_CONFIG_H
+
+#include "common.h"
+#include "event_loop.h"
+#include "file_names.h"
+#include "file_transfer.h"
+#include "log.h"
+#include "server.h"
+
+#define SERVER_CONFIG_TRANSFER_ENGINE                                          \
+  FILE_TRANSFER_ENGINE_COPY // default engine used to transfer files
+#define SERVER_CONFIG_EVENT_BACKEND                                            \
+  EVENT_LOOP_BACKEND_EPOLL // default readiness notification mechanism
+#define SERVER_CONFIG_LOG_LEVEL LOG_LEVEL_INFO // default level of the logs
+#define SERVER_CONFIG_WORKERS_MAX 256 // upper bound on worker threads
+#define SERVER_CONFIG_CONNECTIONS_MAX                                          \
+  (1 << 20) // upper bound on connections per worker
+#define SERVER_CONFIG_RATE_RULES_MAX 16 // address ranges with their own rate
+
+// bandwidth of each connection from a range of client addresses
+struct server_config_rate_rule_t {
+  uint32_t network; // first address of the range, host order
+  uint32_t mask;    // netmask of the range, host order
+  size_t rate;      // bytes/sec, 0 unlimited
+};
+
+struct server_config_t {
+  enum file_transfer_engine_t transfer_engine; // engine for new transfers
+  enum event_loop_backend_t event_backend;     // event loop backend
+  uint16_t port;                               // listening port
+  const char *storage;                         // files storage path
+  long workers;                                // worker threads, 0 per cpu
+  long max_connections;                        // connections per worker
+  size_t chunk_size;                           // copy engine chunk size
+  bool chunk_adaptive;                         // adapt chunk size to send()
+  size_t write_budget;                         // per wakeup, 0 unlimited
+  bool pin;                                    // pin workers to cpus
+  long stats_interval;                         // seconds, 0 disables stats
+  size_t cache_size;                           // file cache bytes, 0 disabled
+  long io_threads;                             // file I/O pool, 0 disabled
+  long name_cache;                             // filenames kept open
+  const char *metrics;                         // metrics endpoint, NULL off
+  enum log_level_t log_level;                  // most verbose level logged
+  long idle_timeout;                           // seconds, 0 disabled
+  long request_timeout;                        // seconds, 0 disabled
+  size_t min_rate;                             // bytes/sec, 0 disabled
+  long accept_budget;                          // per wakeup, 0 unlimited
+  struct server_listen_profile_t listen;       // listening socket settings
+  size_t rate;                                 // bytes/sec per connection
+  size_t global_rate;                          // bytes/sec for all of them
+  size_t rate_rules_count;                     // rules in rate_rules
+  // rates of address ranges, the longest matching prefix applies
+  struct server_config_rate_rule_t rate_rules[SERVER_CONFIG_RATE_RULES_MAX];
+};
+
+int server_config_parse(int argc, char **argv);
+const struct server_config_t *server_config_get(void);
+size_t server_config_rate(const struct server_config_t *config,
+                          uint32_t address);
+
+#endif // __SERVER_CONFIG_H
@@ -0,0 +1,216 @@
+/**
+ * @file server_connection.c
+ * @author vinay divakar
+ * @brief table of connections indexed by descriptor, each record joins the
+ * connection state and its file transfers
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "server_connection.h"
+#include "log.h"
+
+/**
+ * @brief allocates the next chunk of records and pushes them to the free list,
+ * records are never moved so the event loop can keep pointers to them
+ *
+ * @param[in] table points to the connection table
+ * @return 0 success, <0 error
+ */
+static int _table_grow(struct server_connection_table_t *table) {
+  size_t count = SERVER_CONNECTION_CHUNK_SIZE;
+  struct server_connection_t *chunk = NULL;
+
+  if (table->capacity >= table->max) {
+    return -ENOBUFS;
+  } else if (table->max - table->capacity < count) {
+    count = table->max - table->capacity;
+  }
+
+  chunk = calloc(count, sizeof(*chunk));
+  if (!chunk) {
+    return -ENOMEM;
+  }
+
+  // pushed in reverse so the lowest ids are handed out first
+  for (size_t i = count; i-- > 0;) {
+    chunk[i].fd = -1;
+    chunk[i].id = table->capacity + i;
+    chunk[i].next = table->free;
+    ring_buffer_init(&chunk[i].rx, chunk[i].rx_data, sizeof(chunk[i].rx_data));
+    for (size_t j = 0; j < SERVER_CONNECTION_STREAMS_MAX; j++) {
+      file_transfer_context_reset(&chunk[i].streams[j].transfer);
+    }
+    table->free = &chunk[i];
+  }
+
+  table->chunks[table->chunks_count++] = chunk;
+  table->capacity += count;
+  return 0;
+}
+
+/**
+ * @brief makes room in the descriptor index for the given descriptor
+ *
+ * @param[in] table points to the connection table
+ * @param[in] fd descriptor to be indexed
+ * @return 0 success, <0 error
+ */
+static int _by_fd_reserve(struct server_connection_table_t *table, int fd) {
+  size_t size = table->by_fd_size ? table->by_fd_size : 64;
+  struct server_connection_t **by_fd = NULL;
+
+  if (fd < table->by_fd_size) {
+    return 0;
+  }
+
+  while (size <= fd) {
+    size *= 2;
+  }
+
+  by_fd = realloc(table->by_fd, size * sizeof(*by_fd));
+  if (!by_fd) {
+    return -ENOMEM;
+  }
+  memset(&by_fd[table->by_fd_size], 0,
+         (size - table->by_fd_size) * sizeof(*by_fd));
+
+  table->by_fd = by_fd;
+  table->by_fd_size = size;
+  return 0;
+}
+
+/**
+ * @brief creates an empty connection table, records are allocated in chunks
+ * as connections arrive
+ *
+ * @param[out] table points to the connection table
+ * @param[in] max maximum number of connections held at once
+ * @return 0 success, <0 error
+ */
+int server_connection_table_create(struct server_connection_table_t *table,
+                                   size_t max) {
+  memset(table, 0, sizeof(*table));
+
+  if (!max) {
+    return -EINVAL;
+  }
+
+  table->max = max;
+  table->chunks = calloc(
+      (max + SERVER_CONNECTION_CHUNK_SIZE - 1) / SERVER_CONNECTION_CHUNK_SIZE,
+      sizeof(*table->chunks));
+  return table->chunks ? 0 : -ENOMEM;
+}
+
+/**
+ * @brief releases the memory of a connection table, the connections must
+ * have been closed by the caller
+ *
+ * @param[in] table points to the connection table
+ */
+void server_connection_table_destroy(struct server_connection_table_t *table) {
+  for (size_t i = 0; i < table->chunks_count; i++) {
+    free(table->chunks[i]);
+  }
+  free(table->chunks);
+  free(table->by_fd);
+  memset(table, 0, sizeof(*table));
+}
+
+/**
+ * @brief takes a record from the free list for a new connection
+ *
+ * @param[in] table points to the connection table
+ * @param[in] fd connection handler
+ * @param[out] conn record of the connection
+ * @return 0 success, -ENOBUFS table full, <0 error
+ */
+int server_connection_add(struct server_connection_table_t *table, int fd,
+                          struct server_connection_t **conn) {
+  int err = 0;
+
+  if (fd < 0) {
+    return -EINVAL;
+  } else if (fd < table->by_fd_size && table->by_fd[fd]) {
+    return -EEXIST;
+  }
+
+  if (!table->free) {
+    err = _table_grow(table);
+    if (err < 0) {
+      return err;
+    }
+  }
+
+  err = _by_fd_reserve(table, fd);
+  if (err < 0) {
+    return err;
+  }
+
+  *conn = table->free;
+  table->free = (*conn)->next;
+  table->by_fd[fd] = *conn;
+  table->count++;
+
+  (*conn)->fd = fd;
+  (*conn)->events = 0;
+  (*conn)->protocol = 0;
+  (*conn)->integrity = 0;
+  (*conn)->rx_closed = false;
+  ring_buffer_reset(&(*conn)->rx);
+  (*conn)->rx_skip = 0;
+  (*conn)->streams_active = 0;
+  (*conn)->stream_current = SERVER_CONNECTION_STREAMS_MAX - 1; // next is 0
+  memset(&(*conn)->stats, 0, sizeof((*conn)->stats));
+  (*conn)->timer.data = *conn;
+  (*conn)->active_ms = 0;
+  (*conn)->request_ms = 0;
+  (*conn)->rate_ms = 0;
+  (*conn)->rate_bytes = 0;
+  memset(&(*conn)->shaper, 0, sizeof((*conn)->shaper)); // unlimited
+  (*conn)->throttle_ms = 0;
+  (*conn)->next = NULL;
+  return 0;
+}
+
+/**
+ * @brief looks up the record of a connection
+ *
+ * @param[in] table points to the connection table
+ * @param[in] fd connection handler
+ * @return points to the record, NULL if fd is not in the table
+ */
+struct server_connection_t *
+server_connection_lookup(struct server_connection_table_t *table, int fd) {
+  if (fd < 0 || fd >= table->by_fd_size) {
+    return NULL;
+  }
+  return table->by_fd[fd];
+}
+
+/**
+ * @brief returns the record of a connection to the free list, its descriptor
+ * is left for the caller to close
+ *
+ * @param[in] table points to the connection table
+ * @param[in] conn record of the connection
+ */
+void server_connection_remove(struct server_connection_table_t *table,
+                              struct server_connection_t *conn) {
+  if (conn->fd < 0 || conn->fd >= table->by_fd_size ||
+      table->by_fd[conn->fd] != conn) {
+    LOG_WARN("connection %d not in the table\r\n", conn->fd);
+    return;
+  }
+
+  table->by_fd[conn->fd] = NULL;
+  table->count--;
+
+  conn->fd = -1;
+  conn->events = 0;
+  conn->next = table->free;
+  table->free = conn;
+}
@@ -0,0 +1,85 @@
+#ifndef __SERVER_CONNECTION_H
+#define __SERVER_CONNECTION_H
+
+#include "common.h"
+#include "file_transfer.h"
+#include "ring_buffer.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+
+#define SERVER_CONNECTION_CHUNK_SIZE                                           \
+  64 // records allocated at once as the table grows
+#define SERVER_CONNECTION_RX_SIZE                                              \
+  1024 // bytes of requests buffered per connection, a power of two
+#define SERVER_CONNECTION_STREAMS_MAX                                          \
+  8 // downloads served at once on a connection
+#define SERVER_STREAM_QUANTUM                                                  \
+  (64 * 1024) // bytes a stream of weight 1 sends per turn, also its frame size
+
+// a download on a connection, streams take turns in weighted round-robin
+struct server_stream_t {
+  struct file_transfer_t transfer; // download, idle while client_fd < 0
+  bool multiplexed;                // opened with PACKET_V2_FLAG_STREAM
+  uint8_t weight;                  // quanta sent per turn
+  size_t deficit;                  // bytes left in the current turn
+  size_t bytes_sent;               // bytes sent, frame headers included
+  unsigned int turns;              // turns the stream was given
+  uint64_t requested;              // monotonic ns the download was requested
+};
+
+// stream and fairness counters of a connection
+struct server_connection_stats_t {
+  size_t streams;      // streams opened
+  size_t streams_peak; // most streams active at once
+  size_t turns;        // turns handed out
+  size_t bytes_sent;   // bytes sent on all streams
+};
+
+struct server_connection_t {
+  int fd;                                 // connection handler, -1 if unused
+  short events;                           // events monitored on this connection
+  uint32_t id;                            // index in the table, never changes
+  struct server_connection_t *next;       // next free record, NULL if in use
+  struct server_connection_t *ready_next; // next paused transfer to resume
+  bool ready;                             // queued as a paused transfer
+  uint8_t protocol;                       // wire protocol, 0 until negotiated
+  uint16_t integrity;                     // PACKET_V2_FLAG_CRC_* agreed on
+  bool rx_closed;                         // peer shut down its sending side
+  struct ring_buffer_t rx;                // received, not yet served requests
+  size_t rx_skip;                         // payload of a rejected frame to drop
+  struct server_stream_t streams[SERVER_CONNECTION_STREAMS_MAX]; // downloads
+  uint8_t streams_active;                 // streams with a transfer
+  uint8_t stream_current;                 // stream whose turn it is
+  struct server_connection_stats_t stats; // stream and fairness counters
+  struct timer_wheel_timer_t timer;       // earliest deadline, armed lazily
+  uint64_t active_ms;                     // last request byte or transfer, ms
+  uint64_t request_ms;                    // partial request started, 0 none
+  uint64_t rate_ms;                       // minimum rate window started
+  size_t rate_bytes;                      // bytes_sent when it started
+  struct token_bucket_t shaper;           // bandwidth of the connection
+  uint64_t throttle_ms;                   // paused by a shaper until, 0 not
+  uint8_t rx_data[SERVER_CONNECTION_RX_SIZE]; // storage of rx
+};
+
+struct server_connection_table_t {
+  struct server_connection_t **chunks; // records, never moved once allocated
+  size_t chunks_count;
+  struct server_connection_t **by_fd; // record of each descriptor or NULL
+  size_t by_fd_size;
+  struct server_connection_t *free; // records ready to be handed out
+  size_t count;                     // records in use
+  size_t capacity;                  // records allocated
+  size_t max;                       // upper bound on records in use
+};
+
+int server_connection_table_create(struct server_connection_table_t *table,
+                                   size_t max);
+void server_connection_table_destroy(struct server_connection_table_t *table);
+int server_connection_add(struct server_connection_table_t *table, int fd,
+                          struct server_connection_t **conn);
+struct server_connection_t *
+server_connection_lookup(struct server_connection_table_t *table, int fd);
+void server_connection_remove(struct server_connection_table_t *table,
+                              struct server_connection_t *conn);
+
+#endif // __SERVER_CONNECTION_H
@@ -0,0 +1,493 @@
+/**
+ * @file server_metrics.c
+ * @author vinay divakar
+ * @brief latency histograms recorded by the workers on the hot path, and a
+ * local endpoint serving them along with the worker counters in the
+ * Prometheus text format
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "server_metrics.h"
+#include "log.h"
+#include "server_config.h"
+#include "server_worker.h"
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// worker counters exported as is, in the order of the output
+static const struct {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;
+} _counters[] = {
+    {"server_connections_accepted_total", "counter", "Connections accepted.",
+     offsetof(struct server_state_machine_stats_t, connections_accepted)},
+    {"server_connections_active", "gauge", "Connections currently open.",
+     offsetof(struct server_state_machine_stats_t, connections_active)},
+    {"server_connections_rejected_total", "counter",
+     "Connections turned away at capacity with an EBUSY error frame.",
+     offsetof(struct server_state_machine_stats_t, connections_rejected)},
+    {"server_accept_yields_total", "counter",
+     "Wakeups that accepted a whole budget of connections.",
+     offsetof(struct server_state_machine_stats_t, accept_yields)},
+    {"server_transfers_active", "gauge", "Transfers currently running.",
+     offsetof(struct server_state_machine_stats_t, transfers_active)},
+    {"server_transfers_completed_total", "counter", "Files sent in full.",
+     offsetof(struct server_state_machine_stats_t, transfers_completed)},
+    {"server_bytes_sent_total", "counter", "File bytes sent.",
+     offsetof(struct server_state_machine_stats_t, bytes_sent)},
+    {"server_sends_total", "counter", "Transfer calls that sent data.",
+     offsetof(struct server_state_machine_stats_t, sends)},
+    {"server_send_eagains_total", "counter",
+     "Transfer calls refused by a full socket.",
+     offsetof(struct server_state_machine_stats_t, send_eagains)},
+    {"server_wakeups_total", "counter", "Returns from the event loop.",
+     offsetof(struct server_state_machine_stats_t, wakeups)},
+    {"server_budget_yields_total", "counter",
+     "Transfers paused by the write budget.",
+     offsetof(struct server_state_machine_stats_t, budget_yields)},
+    {"server_evictions_idle_total", "counter",
+     "Connections closed for idling past the idle timeout.",
+     offsetof(struct server_state_machine_stats_t, evictions_idle)},
+    {"server_evictions_request_total", "counter",
+     "Connections closed for sending a request past the request timeout.",
+     offsetof(struct server_state_machine_stats_t, evictions_request)},
+    {"server_evictions_rate_total", "counter",
+     "Connections closed for reading transfers below the minimum rate.",
+     offsetof(struct server_state_machine_stats_t, evictions_rate)},
+    {"server_throttles_total", "counter",
+     "Transfers paused until their bandwidth shapers refilled.",
+     offsetof(struct server_state_machine_stats_t, throttles)},
+    {"server_connections_throttled", "gauge",
+     "Connections currently paused by a bandwidth shaper.",
+     offsetof(struct server_state_machine_stats_t, throttled)},
+};
+
+static struct {
+  int fd;                          // listening socket of the endpoint
+  pthread_t thread;                // thread serving the scrapes
+  struct server_worker_t *workers; // workers whose metrics are served
+  size_t count;                    // number of workers
+  uint64_t started;                // monotonic time the endpoint started at
+} _metrics = {.fd = -1};
+
+/**
+ * @brief returns the histogram bucket of a value, values below twice the
+ * buckets per power of two have a bucket each, larger ones share a power of
+ * two with 2^SERVER_METRICS_SUB_BITS - 1 others
+ *
+ * @param[in] value value to be counted
+ * @return index of the bucket
+ */
+static size_t _bucket(uint64_t value) {
+  unsigned int shift = 0;
+
+  if (value >> SERVER_METRICS_RANGE_BITS) {
+    value = (1ULL << SERVER_METRICS_RANGE_BITS) - 1;
+  }
+  if (value < (2u << SERVER_METRICS_SUB_BITS)) {
+    return value;
+  }
+  shift = 63 - __builtin_clzll(value) - SERVER_METRICS_SUB_BITS;
+  return ((size_t)shift << SERVER_METRICS_SUB_BITS) + (value >> shift);
+}
+
+/**
+ * @brief returns the largest value counted in a bucket
+ *
+ * @param[in] index index of the bucket
+ * @return largest value of the bucket
+ */
+static uint64_t _bucket_max(size_t index) {
+  const size_t sub = 1u << SERVER_METRICS_SUB_BITS;
+  unsigned int shift = index < sub ? 0 : (index >> SERVER_METRICS_SUB_BITS) - 1;
+  uint64_t mantissa = index < sub ? index : sub | (index & (sub - 1));
+
+  return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * @brief returns the monotonic time
+ *
+ * @return time in nanoseconds
+ */
+uint64_t server_metrics_now(void) {
+  struct timespec ts = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief counts a value, only ever called by the thread owning the histogram
+ *
+ * @param[in] histogram points to the histogram
+ * @param[in] value value to be counted
+ */
+void server_metrics_record(struct server_metrics_histogram_t *histogram,
+                           uint64_t value) {
+  uint64_t *count = &histogram->counts[_bucket(value)];
+
+  __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief adds the values of a histogram written by another thread
+ *
+ * @param[out] to histogram receiving the values
+ * @param[in] from histogram whose values are added
+ */
+void server_metrics_merge(struct server_metrics_histogram_t *to,
+                          const struct server_metrics_histogram_t *from) {
+  for (size_t i = 0; i < SERVER_METRICS_BUCKETS; i++) {
+    to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+  }
+  to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief returns an upper bound of a percentile of the values
+ *
+ * @param[in] histogram points to the histogram
+ * @param[in] percent percentile, 0 to 100
+ * @return largest value of the bucket holding the percentile, 0 if empty
+ */
+uint64_t
+server_metrics_percentile(const struct server_metrics_histogram_t *histogram,
+                          double percent) {
+  uint64_t total = 0, seen = 0;
+
+  for (size_t i = 0; i < SERVER_METRICS_BUCKETS; i++) {
+    total += histogram->counts[i];
+  }
+
+  for (size_t i = 0; i < SERVER_METRICS_BUCKETS && total; i++) {
+    seen += histogram->counts[i];
+    if (seen && seen >= total * percent / 100) {
+      return _bucket_max(i);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief writes a histogram of nanoseconds as a Prometheus histogram in
+ * seconds, with power of two bounds that fall on bucket boundaries
+ *
+ * @param[in] out stream written to
+ * @param[in] name name of the metric
+ * @param[in] help description of the metric
+ * @param[in] histogram points to the histogram
+ */
+static void
+_histogram_write(FILE *out, const char *name, const char *help,
+                 const struct server_metrics_histogram_t *histogram) {
+  uint64_t count = 0;
+  size_t index = 0;
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (int le = SERVER_METRICS_LE_MIN; le <= SERVER_METRICS_LE_MAX; le++) {
+    while (index < SERVER_METRICS_BUCKETS && _bucket_max(index) < 1ULL << le) {
+      count += histogram->counts[index++];
+    }
+    fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, (1ULL << le) / 1e9,
+            count);
+  }
+  while (index < SERVER_METRICS_BUCKETS) {
+    count += histogram->counts[index++];
+  }
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n", name,
+          count, name, histogram->sum / 1e9, name, count);
+}
+
+/**
+ * @brief writes the depth and length of the accept queue of every worker, read
+ * from its listening socket
+ *
+ * @param[in] out stream written to
+ */
+static void _accept_queue_write(FILE *out) {
+  uint32_t depth[SERVER_CONFIG_WORKERS_MAX] = {};
+  uint32_t max[SERVER_CONFIG_WORKERS_MAX] = {};
+  int fd = -1;
+
+  for (size_t i = 0; i < _metrics.count; i++) {
+    fd = __atomic_load_n(&_metrics.workers[i].sm.listener.fd, __ATOMIC_RELAXED);
+    if (fd < 0 || server_listen_queue(fd, &depth[i], &max[i]) < 0) {
+      depth[i] = max[i] = 0;
+    }
+  }
+
+  fprintf(out, "# HELP server_accept_queue_depth Connections waiting to be "
+               "accepted.\n# TYPE server_accept_queue_depth gauge\n");
+  for (size_t i = 0; i < _metrics.count; i++) {
+    fprintf(out, "server_accept_queue_depth{worker=\"%zu\"} %u\n", i,
+            depth[i]);
+  }
+  fprintf(out, "# HELP server_accept_queue_max Length of the accept queue, "
+               "connections beyond it are dropped.\n"
+               "# TYPE server_accept_queue_max gauge\n");
+  for (size_t i = 0; i < _metrics.count; i++) {
+    fprintf(out, "server_accept_queue_max{worker=\"%zu\"} %u\n", i, max[i]);
+  }
+}
+
+/**
+ * @brief writes the metrics of every worker, counters labelled by worker and
+ * histograms summed over the workers
+ *
+ * @param[in] out stream written to
+ * @return 0 success, <0 error
+ */
+static int _metrics_render(FILE *out) {
+  struct server_metrics_histogram_t *ttfb = calloc(2, sizeof(*ttfb));
+  struct server_metrics_histogram_t *send = ttfb + 1;
+  const uint8_t *stats = NULL;
+
+  if (!ttfb) {
+    return -ENOMEM;
+  }
+
+  fprintf(out,
+          "# HELP server_uptime_seconds Seconds since the server started.\n"
+          "# TYPE server_uptime_seconds gauge\nserver_uptime_seconds %.3f\n",
+          (server_metrics_now() - _metrics.started) / 1e9);
+
+  for (size_t c = 0; c < sizeof(_counters) / sizeof(_counters[0]); c++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", _counters[c].name,
+            _counters[c].help, _counters[c].name, _counters[c].type);
+    for (size_t i = 0; i < _metrics.count; i++) {
+      stats = (const uint8_t *)&_metrics.workers[i].sm.stats;
+      fprintf(out, "%s{worker=\"%zu\"} %lu\n", _counters[c].name, i,
+              __atomic_load_n((const uint64_t *)(stats + _counters[c].offset),
+                              __ATOMIC_RELAXED));
+    }
+  }
+
+  _accept_queue_write(out);
+
+  for (size_t i = 0; i < _metrics.count; i++) {
+    server_metrics_merge(ttfb, &_metrics.workers[i].sm.stats.ttfb);
+    server_metrics_merge(send, &_metrics.workers[i].sm.stats.send_latency);
+  }
+  _histogram_write(out, "server_ttfb_seconds",
+                   "Time from a download request to its first byte sent.",
+                   ttfb);
+  _histogram_write(out, "server_send_seconds",
+                   "Duration of the transfer calls that sent data.", send);
+
+  free(ttfb);
+  return 0;
+}
+
+/**
+ * @brief sends a whole buffer
+ *
+ * @param[in] fd socket written to
+ * @param[in] data data to be sent
+ * @param[in] size bytes of data
+ * @return 0 success, <0 error
+ */
+static int _send_all(int fd, const char *data, size_t size) {
+  ssize_t n = 0;
+
+  while (size) {
+    n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/**
+ * @brief answers one scrape, with an HTTP response to an HTTP request and
+ * with the bare text to a client that sends nothing
+ *
+ * @param[in] fd accepted socket
+ * @return 0 success, <0 error
+ */
+static int _metrics_serve(int fd) {
+  char request[1024], header[160];
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  struct timeval timeout = {.tv_sec = SERVER_METRICS_TIMEOUT_MS / 1000};
+  size_t received = 0, size = 0;
+  char *body = NULL;
+  FILE *out = NULL;
+  ssize_t n = 0;
+  int err = 0;
+
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // read up to the end of the request headers, the request itself is ignored
+  while (received < sizeof(request) - 1 &&
+         poll(&pfd, 1, SERVER_METRICS_TIMEOUT_MS) > 0) {
+    n = recv(fd, request + received, sizeof(request) - 1 - received, 0);
+    if (n <= 0) {
+      break;
+    }
+    received += n;
+    request[received] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+
+  out = open_memstream(&body, &size);
+  if (!out) {
+    return -ENOMEM;
+  }
+  err = _metrics_render(out);
+  fclose(out);
+
+  if (!err && received >= 4 && !memcmp(request, "GET ", 4)) {
+    n = snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                 "version=0.0.4\r\nContent-Length: %zu\r\nConnection: "
+                 "close\r\n\r\n",
+                 size);
+    err = _send_all(fd, header, n);
+  }
+  if (!err) {
+    err = _send_all(fd, body, size);
+  }
+  free(body);
+  return err;
+}
+
+/**
+ * @brief serves the scrapes one at a time, forever
+ *
+ * @param[in] arg unused
+ * @return never returns
+ */
+static void *_metrics_run(void *arg) {
+  int fd = -1;
+
+  while (1) {
+    fd = accept4(_metrics.fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        LOG_ERROR("error %d accepting a metrics scrape\r\n", -errno);
+        sleep(1);
+      }
+      continue;
+    }
+    _metrics_serve(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+/**
+ * @brief opens the listening socket of the endpoint, a Unix socket when the
+ * address is a path, a TCP port on the loopback address otherwise
+ *
+ * @param[in] address path of the Unix socket or port number
+ * @return socket, <0 error
+ */
+static int _metrics_listen(const char *address) {
+  struct sockaddr_un un = {.sun_family = AF_UNIX};
+  struct sockaddr_in in = {.sin_family = AF_INET,
+                           .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  struct sockaddr *addr = (struct sockaddr *)&in;
+  socklen_t addr_size = sizeof(in);
+  struct stat st = {};
+  long port = 0;
+  int fd = -1, err = 0, on = 1;
+
+  if (strchr(address, '/')) {
+    if (strlen(address) >= sizeof(un.sun_path)) {
+      return -ENAMETOOLONG;
+    }
+    strcpy(un.sun_path, address);
+    addr = (struct sockaddr *)&un;
+    addr_size = sizeof(un);
+    // left behind by a previous run, anything else stays untouched
+    if (!lstat(address, &st) && S_ISSOCK(st.st_mode)) {
+      unlink(address);
+    }
+  } else {
+    port = strtol(address, NULL, 10);
+    if (port <= 0 || port > UINT16_MAX) {
+      return -EINVAL;
+    }
+    in.sin_port = htons(port);
+  }
+
+  fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  do {
+    if (addr->sa_family == AF_INET) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    err = bind(fd, addr, addr_size);
+    if (err < 0) {
+      err = -errno;
+      break;
+    }
+    err = listen(fd, SERVER_METRICS_BACKLOG);
+    if (err < 0) {
+      err = -errno;
+    }
+  } while (0);
+
+  if (err < 0) {
+    close(fd);
+    return err;
+  }
+  return fd;
+}
+
+/**
+ * @brief starts the metrics endpoint on its own thread, scrapes read the
+ * counters and histograms of the workers without stopping them
+ *
+ * @param[in] address path of a Unix socket or port on the loopback address
+ * @param[in] workers points to the workers
+ * @param[in] count number of workers
+ * @return 0 success, <0 error
+ */
+int server_metrics_start(const char *address, struct server_worker_t *workers,
+                         size_t count) {
+  int err = 0;
+
+  _metrics.workers = workers;
+  _metrics.count = count;
+  _metrics.started = server_metrics_now();
+
+  _metrics.fd = _metrics_listen(address);
+  if (_metrics.fd < 0) {
+    LOG_ERROR("error %d opening metrics endpoint %s\r\n", _metrics.fd, address);
+    return _metrics.fd;
+  }
+
+  err = -pthread_create(&_metrics.thread, NULL, _metrics_run, NULL);
+  if (err < 0) {
+    LOG_ERROR("error %d starting metrics endpoint\r\n", err);
+    close(_metrics.fd);
+    _metrics.fd = -1;
+    return err;
+  }
+  LOG_INFO("metrics served on %s\r\n", address);
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __SERVER_METRICS_H
+#define __SERVER_METRICS_H
+
+#include "common.h"
+
+#define SERVER_METRICS_SUB_BITS                                                \
+  4 // log2 of the buckets per power of two, values within 1/16 of a bucket
+#define SERVER_METRICS_RANGE_BITS                                              \
+  36 // values up to 2^36 ns (about 68 s) are told apart, larger ones clamped
+#define SERVER_METRICS_BUCKETS                                                 \
+  ((SERVER_METRICS_RANGE_BITS - SERVER_METRICS_SUB_BITS + 1)                   \
+   << SERVER_METRICS_SUB_BITS)
+#define SERVER_METRICS_LE_MIN 10 // first Prometheus bucket bound, 2^10 ns
+#define SERVER_METRICS_LE_MAX 34 // last Prometheus bucket bound, 2^34 ns
+#define SERVER_METRICS_BACKLOG 16 // scrapes waiting to be accepted
+#define SERVER_METRICS_TIMEOUT_MS                                              \
+  1000 // wait for the request of a scrape, raw clients send none
+
+// log-linear histogram in the spirit of HdrHistogram, written by one thread
+// and read by others with relaxed loads
+struct server_metrics_histogram_t {
+  uint64_t counts[SERVER_METRICS_BUCKETS]; // values per bucket
+  uint64_t sum;                            // sum of the values
+};
+
+struct server_worker_t;
+
+uint64_t server_metrics_now(void);
+void server_metrics_record(struct server_metrics_histogram_t *histogram,
+                           uint64_t value);
+void server_metrics_merge(struct server_metrics_histogram_t *to,
+                          const struct server_metrics_histogram_t *from);
+uint64_t
+server_metrics_percentile(const struct server_metrics_histogram_t *histogram,
+                          double percent);
+int server_metrics_start(const char *address, struct server_worker_t *workers,
+                         size_t count);
+
+#endif // __SERVER_METRICS_H
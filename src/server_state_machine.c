@@ -10,202 +10,1236 @@
  */
 #include "server_state_machine.h"
 #include "commands.h"
+#include "event_loop.h"
 #include "file_transfer.h"
+#include "log.h"
 #include "packet.h"
 #include "server.h"
+#include "server_config.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
 
-static struct pollfd _fds[SERVER_STATE_MACHINE_FDS_MAX] = {};
-static struct file_transfer_t _file_transfer[SERVER_STATE_MACHINE_FDS_MAX] = {};
+/**
+ * @brief updates a statistics counter, only ever written by the owning worker
+ *
+ * @param[in] counter points to the counter
+ * @param[in] value value to be added, wraps around to subtract
+ */
+static inline void _stats_add(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief returns a monotonic timestamp for the connection deadlines
+ *
+ * @return milliseconds
+ */
+static inline uint64_t _now_ms(void) { return server_metrics_now() / 1000000; }
+
+/**
+ * @brief returns the size of the buffers leased by copy engine transfers
+ *
+ * @return buffer size in bytes
+ */
+static size_t _buffer_size(void) {
+  size_t size = server_config_get()->chunk_size;
+
+  if (server_config_get()->chunk_adaptive &&
+      size < FILE_TRANSFER_CHUNK_SIZE_ADAPTIVE_MAX) {
+    size = FILE_TRANSFER_CHUNK_SIZE_ADAPTIVE_MAX;
+  }
+  return size;
+}
+
+/**
+ * @brief returns the burst of a shaper, a connection throttled for a tick
+ * of the timers still makes up for it
+ *
+ * @param[in] rate bytes/sec of the shaper
+ * @return bytes saved up while idle
+ */
+static uint64_t _shaper_burst(uint64_t rate) {
+  uint64_t burst = rate * SERVER_SHAPING_BURST_MS / 1000;
+
+  return burst > SERVER_SHAPING_BURST_MIN ? burst : SERVER_SHAPING_BURST_MIN;
+}
 
 /**
- * @brief resets the descriptor set
+ * @brief releases the connection table and the event loop
+ *
+ * @param[in] sm points to the state machine
  */
-static void _reset_descriptor_set(void) {
-  for (int i = 0; i < sizeof(_fds) / sizeof(_fds[0]); i++) {
-    _fds[i].fd = -1;
-    _fds[i].events = 0;
+static void _resources_free(struct server_state_machine_t *sm) {
+  server_connection_table_destroy(&sm->connections);
+  buffer_pool_destroy(&sm->buffers);
+  if (sm->io.event_fd >= 0) {
+    file_io_completions_destroy(&sm->io);
   }
+  event_loop_destroy(&sm->loop);
+  free(sm->events);
+  sm->events = NULL;
+  sm->events_size = 0;
+  sm->events_count = 0;
+}
+
+/**
+ * @brief ends the transfers of all streams of a connection
+ *
+ * @param[in] conn points to the connection
+ */
+static void
+_client_connection_streams_remove(struct server_connection_t *conn) {
+  for (size_t i = 0; i < SERVER_CONNECTION_STREAMS_MAX; i++) {
+    if (conn->streams[i].transfer.client_fd >= 0) {
+      file_transfer_context_remove(&conn->streams[i].transfer);
+    }
+  }
+  conn->streams_active = 0;
+}
+
+/**
+ * @brief tells whether the stream whose turn it is waits for its file I/O,
+ * the connection has nothing to send until it completes
+ *
+ * @param[in] conn points to the connection
+ * @return true if the current stream keeps its turn but cannot send
+ */
+static bool
+_client_connection_stream_waiting(struct server_connection_t *conn) {
+  struct server_stream_t *stream = &conn->streams[conn->stream_current];
+
+  return stream->transfer.client_fd >= 0 && stream->deficit &&
+         file_transfer_io_waiting(&stream->transfer);
 }
 
 /**
  * @brief close all active connections & reset events
+ *
+ * @param[in] sm points to the state machine
+ */
+static void _client_connections_clean_up(struct server_state_machine_t *sm) {
+  struct server_connection_t *conn = NULL;
+
+  for (int fd = 0; fd < sm->connections.by_fd_size; fd++) {
+    conn = server_connection_lookup(&sm->connections, fd);
+    if (!conn) {
+      continue;
+    }
+
+    _stats_add(&sm->stats.transfers_active, -conn->streams_active);
+    _client_connection_streams_remove(conn);
+    close(conn->fd);
+    server_connection_remove(&sm->connections, conn);
+  }
+
+  if (sm->listener.fd >= 0) {
+    close(sm->listener.fd);
+  }
+  _resources_free(sm);
+}
+
+/**
+ * @brief changes the events monitored on a connection
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @param[in] events events to be monitored
+ * @return 0 success, <0 error
+ */
+static int _client_connection_events_set(struct server_state_machine_t *sm,
+                                         struct server_connection_t *conn,
+                                         short events) {
+  int err =
+      event_loop_modify(&sm->loop, conn->fd, events | EVENT_LOOP_EDGE, conn);
+  if (err < 0) {
+    LOG_ERROR("error %d modifying events on fd %d\r\n", err, conn->fd);
+  } else {
+    conn->events = events;
+  }
+  return err;
+}
+
+/**
+ * @brief monitors POLLIN while there is room to buffer requests and POLLOUT
+ * while a stream has something to send
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @return 0 success, -ENETRESET a half closed connection has been served in
+ * full, <0 error
+ */
+static int _client_connection_events_update(struct server_state_machine_t *sm,
+                                            struct server_connection_t *conn) {
+  short events = 0;
+
+  if (!conn->rx_closed && ring_buffer_space(&conn->rx)) {
+    events |= POLLIN;
+  }
+  if (conn->streams_active && !_client_connection_stream_waiting(conn) &&
+      !conn->throttle_ms) {
+    events |= POLLOUT;
+  }
+
+  if (!events && conn->rx_closed && !conn->streams_active) {
+    return -ENETRESET;
+  } else if (events == conn->events) {
+    return 0;
+  }
+  return _client_connection_events_set(sm, conn, events);
+}
+
+/**
+ * @brief returns the deadline a connection is held to: the end of its pause
+ * while throttled, the minimum rate while it has transfers running, the
+ * request timeout while part of a request is buffered and the idle timeout
+ * otherwise
+ *
+ * @param[in] conn points to the connection
+ * @param[out] deadline monotonic ms the connection is held to
+ * @return kind of the deadline, SERVER_TIMEOUT_NONE if none applies
+ */
+static enum server_timeout_t
+_client_connection_deadline(const struct server_connection_t *conn,
+                            uint64_t *deadline) {
+  const struct server_config_t *config = server_config_get();
+
+  if (conn->throttle_ms) {
+    *deadline = conn->throttle_ms;
+    return SERVER_TIMEOUT_THROTTLE;
+  } else if (conn->streams_active) {
+    *deadline = conn->rate_ms + SERVER_MIN_RATE_WINDOW_MS;
+    return config->min_rate ? SERVER_TIMEOUT_RATE : SERVER_TIMEOUT_NONE;
+  } else if (conn->request_ms) {
+    *deadline = conn->request_ms + config->request_timeout * 1000;
+    return config->request_timeout ? SERVER_TIMEOUT_REQUEST
+                                   : SERVER_TIMEOUT_NONE;
+  }
+  *deadline = conn->active_ms + config->idle_timeout * 1000;
+  return config->idle_timeout ? SERVER_TIMEOUT_IDLE : SERVER_TIMEOUT_NONE;
+}
+
+/**
+ * @brief keeps the timer of a connection no later than its deadline after an
+ * event changed what the connection is doing. A deadline pushed back by
+ * activity leaves the timer alone, it is checked again when the timer fires
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
  */
-static void _client_connections_clean_up(void) {
-  for (int i = 0; i < sizeof(_fds) / sizeof(_fds[0]); i++) {
-    if (_fds[i].fd >= 0)
-      close(_fds[i].fd);
-    _fds[i].events = 0;
+static void _client_connection_timer_update(struct server_state_machine_t *sm,
+                                            struct server_connection_t *conn) {
+  uint64_t deadline = 0;
+
+  // the request timeout runs from the first byte of a request to its last
+  if (conn->streams_active || !ring_buffer_used(&conn->rx)) {
+    conn->request_ms = 0;
+  } else if (!conn->request_ms) {
+    conn->request_ms = sm->now_ms;
+  }
+
+  if (!_client_connection_deadline(conn, &deadline)) {
+    timer_wheel_remove(&sm->timers, &conn->timer);
+  } else if (!timer_wheel_pending(&conn->timer) ||
+             deadline < timer_wheel_expires(&sm->timers, &conn->timer)) {
+    timer_wheel_add(&sm->timers, &conn->timer, deadline);
   }
 }
 
 /**
  * @brief close an active connection & reset events
  *
- * @param[in] fds points to socket to be closed
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to connection to be closed
  */
-static void _client_connection_close(struct pollfd *fds) {
-  if (fds->fd >= 0) {
-    printf("client %d connection closed\r\n", fds->fd);
-    close(fds->fd);
-    fds->fd = -1;
-    fds->events = 0;
+static void _client_connection_close(struct server_state_machine_t *sm,
+                                     struct server_connection_t *conn) {
+  if (conn->fd >= 0) {
+    LOG_DEBUG("client %d connection closed\r\n", conn->fd);
+    if (conn->stats.streams) {
+      LOG_DEBUG("fd %d served %zu streams, at most %zu at once, %zu bytes in "
+                "%zu turns\r\n",
+                conn->fd, conn->stats.streams, conn->stats.streams_peak,
+                conn->stats.bytes_sent, conn->stats.turns);
+    }
+    event_loop_remove(&sm->loop, conn->fd);
+    timer_wheel_remove(&sm->timers, &conn->timer);
+    if (conn->throttle_ms) {
+      _stats_add(&sm->stats.throttled, -1);
+    }
+    close(conn->fd);
+    _stats_add(&sm->stats.connections_active, -1);
+    server_connection_remove(&sm->connections, conn);
     return;
   }
-  printf("client %d connection already closed\r\n", fds->fd);
+  LOG_WARN("client %d connection already closed\r\n", conn->fd);
 }
 
 /**
- * @brief remove transfer context and close connection
+ * @brief remove the transfer contexts and close connection
  *
- * @param[in] fds points to socket to be closed
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to connection to be closed
  */
 static void
-_client_connection_resources_release(struct pollfd *fd,
-                                     struct file_transfer_t *list,
-                                     size_t file_transfer_list_size) {
-  file_transfer_context_remove(fd->fd, list, file_transfer_list_size);
-  _client_connection_close(fd);
+_client_connection_resources_release(struct server_state_machine_t *sm,
+                                     struct server_connection_t *conn) {
+  _stats_add(&sm->stats.transfers_active, -conn->streams_active);
+  _client_connection_streams_remove(conn);
+  _client_connection_close(sm, conn);
 }
 
 /**
- * @brief adds an accepted connection to the list for poll to monitor
+ * @brief turns away a connection the worker has no room for with a v2 error
+ * frame carrying EBUSY, and closes it
  *
+ * @param[in] sm points to the state machine
+ * @param[in] fd accepted connection
+ */
+static void _client_connection_reject(struct server_state_machine_t *sm,
+                                      int fd) {
+  uint8_t frame[PACKET_V2_HEADER_SIZE + sizeof(uint32_t)] = {};
+  uint8_t drain[PACKET_V2_REQUEST_SIZE_MAX];
+
+  packet_v2_header_encode(frame, CMD_DOWNLOAD_FILE_ERROR, 0, sizeof(uint32_t));
+  packet_u32_encode(frame + PACKET_V2_HEADER_SIZE, EBUSY);
+
+  // a fresh socket takes the frame whole, a failure only loses the frame
+  send(fd, frame, sizeof(frame), MSG_NOSIGNAL);
+  shutdown(fd, SHUT_WR);
+  // unread requests would turn the close into a reset dropping the frame
+  while (recv(fd, drain, sizeof(drain), 0) > 0) {
+  }
+  close(fd);
+  _stats_add(&sm->stats.connections_rejected, 1);
+}
+
+/**
+ * @brief sets up the shaper of a new connection with the rate of its client
+ * address, only looked up when rates are given to address ranges
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ */
+static void _client_connection_shaper_init(struct server_state_machine_t *sm,
+                                           struct server_connection_t *conn) {
+  const struct server_config_t *config = server_config_get();
+  struct sockaddr_in address = {};
+  socklen_t size = sizeof(address);
+  size_t rate = config->rate;
+
+  if (config->rate_rules_count &&
+      !getpeername(conn->fd, (struct sockaddr *)&address, &size) &&
+      address.sin_family == AF_INET) {
+    rate = server_config_rate(config, ntohl(address.sin_addr.s_addr));
+  }
+  token_bucket_init(&conn->shaper, rate, _shaper_burst(rate), sm->now_ms);
+}
+
+/**
+ * @brief adds an accepted connection to the table for the event loop to
+ * monitor, the connection is closed if it cannot be added and told so if the
+ * table is full
+ *
+ * @param[in] ctx points to the state machine
  * @param[in] fd points to connection to be added
  * @param[in] events events to be polled on this fd
  * @return 0 success, <0 error
  */
-static int _client_connection_add(int fd, short int events) {
-  int err = -ENOBUFS, on = 1;
+static int _client_connection_add(void *ctx, int fd, short int events) {
+  struct server_state_machine_t *sm = ctx;
+  struct server_connection_t *conn = NULL;
+  int err = 0;
 
-  for (int i = SERVER_SOCKET_LISTEN_INDEX + 1;
-       i < sizeof(_fds) / sizeof(_fds[0]); i++) {
-    if (_fds[i].fd >= 0) {
-      continue;
+  do {
+    err = server_connection_add(&sm->connections, fd, &conn);
+    if (err == -ENOBUFS) {
+      LOG_DEBUG("rejecting client fd %d, %ld of %ld connections in use\r\n",
+                fd, sm->connections.count, sm->connections.max);
+      _client_connection_reject(sm, fd);
+      break;
+    } else if (err < 0) {
+      LOG_WARN("error %d adding client fd %d\r\n", err, fd);
+      close(fd);
+      break;
     }
+    conn->events = events;
 
-    err = 0;
-    _fds[i].fd = fd;
-    _fds[i].events = events;
-
-    err = ioctl(_fds[i].fd, FIONBIO, (char *)&on);
+    err = event_loop_add(&sm->loop, fd, events | EVENT_LOOP_EDGE, conn);
     if (err < 0) {
-      printf("error %d errno %d client fd %d at idx %d ioctl\r\n", err, errno,
-             _fds[i].fd, i);
-      _client_connection_close(&_fds[i]);
-    } else {
-      printf("adding client fd %d, evt %hu at idx %d\r\n", _fds[i].fd,
-             _fds[i].events, i);
+      LOG_ERROR("error %d monitoring client fd %d\r\n", err, fd);
+      break;
     }
-    break;
+
+    conn->active_ms = sm->now_ms;
+    _client_connection_shaper_init(sm, conn);
+    _client_connection_timer_update(sm, conn);
+    _stats_add(&sm->stats.connections_accepted, 1);
+    _stats_add(&sm->stats.connections_active, 1);
+    LOG_DEBUG("adding client fd %d, evt %hu at idx %u\r\n", conn->fd,
+              conn->events, conn->id);
+  } while (0);
+
+  if (err < 0 && conn) {
+    close(conn->fd);
+    server_connection_remove(&sm->connections, conn);
   }
   return err;
 }
 
 /**
- * @brief process events on all active connections
- * @return 0 success, <0 error
+ * @brief finds an idle stream for a download, sequential downloads run alone
+ * while multiplexed ones share the connection with each other
+ *
+ * @param[in] conn points to the connection
+ * @param[in] multiplexed the download was requested with PACKET_V2_FLAG_STREAM
+ * @return points to the stream, NULL if the download has to wait
+ */
+static struct server_stream_t *
+_client_connection_stream_find(struct server_connection_t *conn,
+                               bool multiplexed) {
+  struct server_stream_t *stream = NULL;
+
+  for (size_t i = 0; i < SERVER_CONNECTION_STREAMS_MAX; i++) {
+    if (conn->streams[i].transfer.client_fd < 0) {
+      stream = stream ? stream : &conn->streams[i];
+    } else if (!multiplexed || !conn->streams[i].multiplexed) {
+      return NULL;
+    }
+  }
+  return stream;
+}
+
+/**
+ * @brief tells whether a multiplexed stream with this id is still active
+ *
+ * @param[in] conn points to the connection
+ * @param[in] request_id stream id
+ * @return true if the id is in use
+ */
+static bool _client_connection_stream_exists(struct server_connection_t *conn,
+                                             uint32_t request_id) {
+  for (size_t i = 0; i < SERVER_CONNECTION_STREAMS_MAX; i++) {
+    if (conn->streams[i].transfer.client_fd >= 0 &&
+        conn->streams[i].multiplexed &&
+        conn->streams[i].transfer.request_id == request_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief takes the ranges off the payload of a ranged download, a RANGE
+ * request carries one offset and length ahead of the filename, a RANGES
+ * request a count followed by that many
+ *
+ * @param[out] ctx transfer context populated with the ranges
+ * @param[in] cmd command of the request
+ * @param[in,out] name payload of the request, the filename on return
+ * @param[in,out] name_length length of the payload, of the filename on return
+ * @return 0 success, -EINVAL if the ranges are malformed
+ */
+static int _client_connection_ranges_parse(struct file_transfer_t *ctx,
+                                           uint8_t cmd, const uint8_t **name,
+                                           size_t *name_length) {
+  const uint8_t *payload = *name;
+  size_t length = *name_length, count = 1;
+
+  ctx->ranges_count = 0;
+  if (cmd == CMD_DOWNLOAD_FILE) {
+    return 0;
+  }
+
+  if (cmd == CMD_DOWNLOAD_RANGES) {
+    count = length ? payload[0] : 0;
+    payload += length ? 1 : 0;
+    length -= length ? 1 : 0;
+  }
+
+  if (!count || count > FILE_TRANSFER_RANGES_MAX ||
+      length < count * PACKET_V2_RANGE_SIZE) {
+    LOG_WARN("malformed ranges on fd %d\r\n", ctx->client_fd);
+    *name_length = 0;
+    return -EINVAL;
+  }
+
+  for (size_t i = 0; i < count; i++, payload += PACKET_V2_RANGE_SIZE) {
+    ctx->ranges[i].offset = packet_u64_decode(payload);
+    ctx->ranges[i].length = packet_u64_decode(payload + sizeof(uint64_t));
+  }
+  ctx->ranges_count = count;
+
+  *name = payload;
+  *name_length = length - count * PACKET_V2_RANGE_SIZE;
+  return 0;
+}
+
+/**
+ * @brief starts the download of a file, or ranges of it, on an idle stream of
+ * a connection
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @param[in] stream idle stream of the connection
+ * @param[in] cmd CMD_DOWNLOAD_FILE, or a v2 ranged download command
+ * @param[in] name requested filename, preceded by the ranges of a ranged
+ * download, not null terminated, NULL if the request was too large to be read
+ * @param[in] name_length length of the filename and ranges
+ * @param[in] request_id v2 request identifier and stream id, 0 for v1
+ * @param[in] flags v2 frame flags, 0 for v1
+ * @return 0 success, <0 error and the connection must be released
+ */
+static int _client_connection_download_start(struct server_state_machine_t *sm,
+                                             struct server_connection_t *conn,
+                                             struct server_stream_t *stream,
+                                             uint8_t cmd, const uint8_t *name,
+                                             size_t name_length,
+                                             uint32_t request_id,
+                                             uint16_t flags) {
+  int err = 0;
+  struct file_transfer_t *transfer_ctx = &stream->transfer;
+
+  stream->multiplexed = flags & PACKET_V2_FLAG_STREAM;
+  stream->weight = flags & PACKET_V2_FLAG_WEIGHT_MASK;
+  stream->weight = stream->weight ? stream->weight : 1;
+  stream->deficit = 0;
+  stream->bytes_sent = 0;
+  stream->turns = 0;
+  stream->requested = server_metrics_now();
+  if (stream->multiplexed &&
+      _client_connection_stream_exists(conn, request_id)) {
+    err = -EEXIST;
+  }
+
+  transfer_ctx->client_fd = conn->fd;
+  transfer_ctx->engine = sm->engine;
+  transfer_ctx->pool = &sm->buffers;
+  transfer_ctx->io = file_io_enabled() ? &sm->io : NULL;
+  transfer_ctx->loop = &sm->loop;
+  transfer_ctx->chunk_size = server_config_get()->chunk_size;
+  transfer_ctx->chunk_adaptive = server_config_get()->chunk_adaptive;
+  transfer_ctx->protocol = conn->protocol;
+  transfer_ctx->request_id = request_id;
+  transfer_ctx->crc_frames = conn->integrity & PACKET_V2_FLAG_CRC_FRAME;
+  transfer_ctx->crc_file = conn->integrity & PACKET_V2_FLAG_CRC_FILE;
+  // interleaved streams switch at frame boundaries, keep frames to a quantum
+  transfer_ctx->frame_size = stream->multiplexed
+                                 ? SERVER_STREAM_QUANTUM
+                                 : FILE_TRANSFER_FRAME_SIZE_MAX;
+
+  transfer_ctx->encoding = FILE_COMPRESS_NONE;
+  if (flags & PACKET_V2_FLAG_ZSTD) {
+    transfer_ctx->encoding = FILE_COMPRESS_ZSTD;
+  } else if (flags & PACKET_V2_FLAG_LZ4) {
+    transfer_ctx->encoding = FILE_COMPRESS_LZ4;
+  }
+
+  if (!name) { // the payload is dropped unread
+    err = -EMSGSIZE;
+    name_length = 0;
+  } else if (_client_connection_ranges_parse(transfer_ctx, cmd, &name,
+                                             &name_length) < 0) {
+    err = -EINVAL;
+  } else if ((flags & PACKET_V2_FLAG_ZSTD) && (flags & PACKET_V2_FLAG_LZ4)) {
+    err = -EINVAL;
+  } else if (transfer_ctx->encoding && transfer_ctx->ranges_count) {
+    // ranges address the stored file, compressed offsets mean nothing
+    err = -EINVAL;
+  } else if (name_length >= FILE_TRANSFER_NAME_SIZE_MAX) {
+    err = -ENAMETOOLONG;
+    // v1 has no way to report errors, serve the truncated name as before
+    name_length = FILE_TRANSFER_NAME_SIZE_MAX - 1;
+  }
+
+  if (name) {
+    memcpy(transfer_ctx->filename, name, name_length);
+  }
+  transfer_ctx->filename[name_length] = '\0'; // null terminate it
+
+  LOG_DEBUG("fname: %s len:%ld\r\n", transfer_ctx->filename, name_length);
+
+  if (!err || conn->protocol != PACKET_VERSION_2) {
+    // every stream of every connection has its own io_uring slot
+    err = file_transfer_context_add(
+        transfer_ctx,
+        conn->id * SERVER_CONNECTION_STREAMS_MAX + (stream - conn->streams),
+        sm->connections.max * SERVER_CONNECTION_STREAMS_MAX);
+  }
+
+  if (err < 0) { // context association successful?
+    LOG_WARN("error %d, context association for %d\r\n", err, conn->fd);
+    // v2 clients are told why, the connection stays open
+    err = file_transfer_context_error(transfer_ctx, conn->fd, err);
+  }
+
+  if (transfer_ctx->client_fd >= 0) {
+    if (!conn->streams_active) { // the minimum rate applies from here on
+      conn->rate_ms = sm->now_ms;
+      conn->rate_bytes = conn->stats.bytes_sent;
+    }
+    conn->streams_active++;
+    conn->stats.streams++;
+    _stats_add(&sm->stats.transfers_active, 1);
+    if (conn->streams_active > conn->stats.streams_peak) {
+      conn->stats.streams_peak = conn->streams_active;
+    }
+  }
+  return err;
+}
+
+/**
+ * @brief answers the v2 hello of a client with the version both support, and
+ * the integrity checks it asked for in the flags of the reply
+ *
+ * @param[in] conn points to the connection
+ * @param[in] header hello frame header
+ * @param[in] payload hello frame payload, the highest version of the client
+ * @return 0 success, <0 error and the connection must be released
+ */
+static int _client_connection_hello(struct server_connection_t *conn,
+                                    const struct packet_v2_header_t *header,
+                                    const uint8_t *payload) {
+  int err = 0;
+  uint8_t reply[PACKET_V2_HEADER_SIZE + 1] = {};
+
+  if (!header->length || payload[0] < PACKET_VERSION_2) {
+    LOG_WARN("unsupported protocol version on fd %d\r\n", conn->fd);
+    return -EPROTONOSUPPORT;
+  }
+
+  conn->protocol = PACKET_VERSION_2;
+  conn->integrity =
+      header->flags & (PACKET_V2_FLAG_CRC_FRAME | PACKET_V2_FLAG_CRC_FILE);
+  packet_v2_header_encode(reply, CMD_HELLO, header->request_id, 1);
+  packet_v2_flags_encode(reply, conn->integrity);
+  reply[PACKET_V2_HEADER_SIZE] = conn->protocol;
+
+  // the first frame on an idle socket, it always fits in the send buffer
+  err = server_write(conn->fd, reply, sizeof(reply));
+  if (err != sizeof(reply)) {
+    LOG_ERROR("error %d answering hello on fd %d\r\n", err, conn->fd);
+    return err < 0 ? err : -EIO;
+  }
+
+  LOG_DEBUG("fd %d negotiated protocol v%d, frame crc %s, file crc %s\r\n",
+            conn->fd, conn->protocol,
+            conn->integrity & PACKET_V2_FLAG_CRC_FRAME ? "on" : "off",
+            conn->integrity & PACKET_V2_FLAG_CRC_FILE ? "on" : "off");
+  return 0;
+}
+
+/**
+ * @brief drops the received part of the payload of a rejected frame
+ *
+ * @param[in] conn points to the connection
+ * @return bytes of the payload yet to be received and dropped
+ */
+static size_t _client_connection_rx_drop(struct server_connection_t *conn) {
+  size_t size = ring_buffer_used(&conn->rx);
+
+  size = size < conn->rx_skip ? size : conn->rx_skip;
+  ring_buffer_consume(&conn->rx, size);
+  conn->rx_skip -= size;
+  return conn->rx_skip;
+}
+
+/**
+ * @brief answers a v2 download request too large to be buffered with an
+ * error, its payload is dropped as it arrives and the connection stays open
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @param[in] header header of the frame, at the head of the receive ring
+ * @return 1 the frame was consumed, 0 it waits for a stream, <0 error and the
+ * connection must be released
  */
-static int _client_connection_events_process(void) {
+static int
+_client_connection_frame_reject(struct server_state_machine_t *sm,
+                                struct server_connection_t *conn,
+                                const struct packet_v2_header_t *header) {
   int err = 0;
-  packet_t packet_rx = {};
-  struct file_transfer_t transfer_ctx = {};
-  for (int i = SERVER_SOCKET_LISTEN_INDEX + 1;
-       i < sizeof(_fds) / sizeof(_fds[0]); i++) {
+  struct server_stream_t *stream = NULL;
+
+  if (conn->protocol != PACKET_VERSION_2 ||
+      (header->cmd != CMD_DOWNLOAD_FILE && header->cmd != CMD_DOWNLOAD_RANGE &&
+       header->cmd != CMD_DOWNLOAD_RANGES)) {
+    LOG_WARN("frame of %u bytes too large on fd %d\r\n", header->length,
+             conn->fd);
+    return -EMSGSIZE;
+  }
+
+  stream = _client_connection_stream_find(
+      conn, header->flags & PACKET_V2_FLAG_STREAM);
+  if (!stream) {
+    return 0; // wait for a stream to become idle
+  }
+
+  LOG_WARN("request %u of %u bytes too large on fd %d\r\n",
+           header->request_id, header->length, conn->fd);
+  ring_buffer_consume(&conn->rx, PACKET_V2_HEADER_SIZE);
+  conn->rx_skip = header->length;
+  _client_connection_rx_drop(conn);
+  err = _client_connection_download_start(sm, conn, stream, header->cmd, NULL,
+                                          0, header->request_id,
+                                          header->flags);
+  return err < 0 ? err : 1;
+}
+
+/**
+ * @brief parses the request at the head of the receive ring, either a v1
+ * download request or a v2 frame, and consumes it once complete
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @return 1 a request was consumed, 0 the request is incomplete, <0 error and
+ * the connection must be released
+ */
+static int _client_connection_frame_process(struct server_state_machine_t *sm,
+                                            struct server_connection_t *conn) {
+  int err = 0;
+  uint8_t data[PACKET_V2_REQUEST_SIZE_MAX] = {};
+  struct packet_v2_header_t header = {};
+  struct server_stream_t *stream = NULL;
+  size_t size = 0, length = 0;
+
+  if (_client_connection_rx_drop(conn)) {
+    return 0; // the payload of a rejected frame is still arriving
+  }
+
+  size = ring_buffer_peek(&conn->rx, data, sizeof(data));
+  if (!size) {
+    return 0;
+  }
+
+  // the first frame of a connection picks the protocol
+  if (!conn->protocol && data[0] != PACKET_V2_MAGIC) {
+    conn->protocol = PACKET_VERSION_1;
+  }
+
+  if (conn->protocol == PACKET_VERSION_1) {
+    if (data[0] != CMD_DOWNLOAD_FILE) {
+      // present we only support download service but can be
+      // extended to support other services in the future
+      LOG_WARN("invalid command 0x%02X on fd %d\r\n", data[0], conn->fd);
+      return -ENOMSG;
+    }
+
+    length = size < PACKET_HEADER_SIZE ? 0 : data[1];
+    if (size < PACKET_HEADER_SIZE + length) {
+      return 0; // wait for the rest of the request
+    }
+
+    // v1 replies carry no stream id, downloads run one after the other
+    stream = _client_connection_stream_find(conn, false);
+    if (!stream) {
+      return 0;
+    }
+
+    ring_buffer_consume(&conn->rx, PACKET_HEADER_SIZE + length);
+    err = _client_connection_download_start(sm, conn, stream,
+                                            CMD_DOWNLOAD_FILE,
+                                            data + PACKET_HEADER_SIZE, length,
+                                            0, 0);
+    return err < 0 ? err : 1;
+  }
+
+  err = packet_v2_header_decode(data, size, &header);
+  if (err == -EAGAIN) {
+    return 0;
+  } else if (err < 0) {
+    LOG_ERROR("error %d decoding frame on fd %d\r\n", err, conn->fd);
+    return err;
+  } else if (header.length > sizeof(data) - PACKET_V2_HEADER_SIZE) {
+    return _client_connection_frame_reject(sm, conn, &header);
+  } else if (size < PACKET_V2_HEADER_SIZE + header.length) {
+    return 0; // wait for the rest of the frame
+  }
+
+  if (header.cmd == CMD_HELLO) {
+    if (conn->streams_active) {
+      return 0; // the reply must not cut into the frame of a stream
+    }
+    ring_buffer_consume(&conn->rx, PACKET_V2_HEADER_SIZE + header.length);
+    err = _client_connection_hello(conn, &header,
+                                   data + PACKET_V2_HEADER_SIZE);
+  } else if (conn->protocol != PACKET_VERSION_2) {
+    LOG_WARN("frame 0x%02X before hello on fd %d\r\n", header.cmd, conn->fd);
+    err = -EPROTO;
+  } else if (header.cmd == CMD_DOWNLOAD_FILE ||
+             header.cmd == CMD_DOWNLOAD_RANGE ||
+             header.cmd == CMD_DOWNLOAD_RANGES) {
+    stream = _client_connection_stream_find(
+        conn, header.flags & PACKET_V2_FLAG_STREAM);
+    if (!stream) {
+      return 0; // wait for a stream to become idle
+    }
+    ring_buffer_consume(&conn->rx, PACKET_V2_HEADER_SIZE + header.length);
+    err = _client_connection_download_start(
+        sm, conn, stream, header.cmd, data + PACKET_V2_HEADER_SIZE,
+        header.length, header.request_id, header.flags);
+  } else {
+    LOG_WARN("invalid command 0x%02X on fd %d\r\n", header.cmd, conn->fd);
+    err = -ENOMSG;
+  }
+  return err < 0 ? err : 1;
+}
+
+/**
+ * @brief serves the requests queued in the receive ring in order until one
+ * of them has to wait for a stream, it is started once a stream completes
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error and the connection must be released
+ */
+static int
+_client_connection_requests_dispatch(struct server_state_machine_t *sm,
+                                     struct server_connection_t *conn) {
+  int err = 0;
+
+  do {
+    err = _client_connection_frame_process(sm, conn);
+  } while (err > 0);
+  return err;
+}
+
+/**
+ * @brief reads what the client sent into the receive ring, until the socket
+ * is drained or the ring is full
+ *
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error and the connection must be released
+ */
+static int _client_connection_receive(struct server_connection_t *conn) {
+  int err = 0;
+  uint8_t *span = NULL;
+  size_t size = 0;
+
+  while (!conn->rx_closed &&
+         (size = ring_buffer_write_span(&conn->rx, &span))) {
+    err = server_read(conn->fd, span, size);
+    if (err == -EAGAIN) {
+      return 0;
+    } else if (err < 0) {
+      LOG_WARN("error %d reading fd %d\r\n", err, conn->fd);
+      return err;
+    } else if (!err) { // serve what was queued before closing
+      LOG_DEBUG("client closed connection on fd %d\r\n", conn->fd);
+      conn->rx_closed = true;
+      return 0;
+    }
+    server_recv_print(span, err);
+    ring_buffer_produce(&conn->rx, err);
+    _client_connection_rx_drop(conn); // keeps the ring from filling up
+  }
+  return 0;
+}
+
+/**
+ * @brief reads the requests of a connection and starts serving them
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error and the connection must be released
+ */
+static int
+_client_connection_request_process(struct server_state_machine_t *sm,
+                                   struct server_connection_t *conn) {
+  int err = 0;
+
+  LOG_DEBUG("POLLIN on fd %d\r\n", conn->fd);
+
+  do {
+    err = _client_connection_receive(conn);
+    if (err < 0) {
+      break;
+    }
+    conn->active_ms = sm->now_ms;
+
+    err = _client_connection_requests_dispatch(sm, conn);
+    if (err < 0) {
+      break;
+    }
+
+    err = _client_connection_events_update(sm, conn);
+  } while (0);
+
+  return err;
+}
+
+/**
+ * @brief queues a connection to resume its transfer on the next round, an
+ * edge triggered backend reports no further POLLOUT while the socket stays
+ * writable
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ */
+static void _client_connection_ready_push(struct server_state_machine_t *sm,
+                                          struct server_connection_t *conn) {
+  if (conn->ready) { // already queued
+    return;
+  }
+  conn->ready = true;
+  conn->ready_next = sm->ready;
+  sm->ready = conn;
+}
+
+/**
+ * @brief returns the stream to be served next, the current stream keeps its
+ * turn until it has sent its share and is not in the middle of a frame, then
+ * the next active stream gets a turn of weight quanta
+ *
+ * @param[in] conn points to the connection, with at least one active stream
+ * @return points to the stream
+ */
+static struct server_stream_t *
+_client_connection_stream_next(struct server_connection_t *conn) {
+  struct server_stream_t *stream = &conn->streams[conn->stream_current];
+  size_t index = 0;
+
+  if (stream->transfer.client_fd >= 0 &&
+      (stream->deficit || file_transfer_frame_pending(&stream->transfer))) {
+    return stream;
+  }
+
+  for (size_t i = 1; i <= SERVER_CONNECTION_STREAMS_MAX; i++) {
+    index = (conn->stream_current + i) % SERVER_CONNECTION_STREAMS_MAX;
+    stream = &conn->streams[index];
+    if (stream->transfer.client_fd >= 0) {
+      break;
+    }
+  }
+
+  conn->stream_current = index;
+  stream->deficit = (size_t)stream->weight * SERVER_STREAM_QUANTUM;
+  stream->turns++;
+  conn->stats.turns++;
+  return stream;
+}
+
+/**
+ * @brief ends a stream whose transfer completed
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @param[in] stream completed stream
+ */
+static void _client_connection_stream_complete(
+    struct server_state_machine_t *sm, struct server_connection_t *conn,
+    struct server_stream_t *stream) {
+  LOG_DEBUG("stream %u on fd %d complete, %zu bytes in %u turns of weight "
+            "%u\r\n",
+            stream->transfer.request_id, conn->fd, stream->bytes_sent,
+            stream->turns, stream->weight);
+  _stats_add(&sm->stats.transfers_completed, 1);
+  _stats_add(&sm->stats.transfers_active, -1);
+  file_transfer_context_remove(&stream->transfer);
+  stream->deficit = 0;
+  if (!--conn->streams_active) { // the next streams start with the first
+    conn->stream_current = SERVER_CONNECTION_STREAMS_MAX - 1;
+    conn->active_ms = sm->now_ms;
+  }
+}
+
+/**
+ * @brief returns the bytes a connection may send before its shaper or the
+ * one of the worker runs dry
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @return bytes, SIZE_MAX if neither shaper limits the connection
+ */
+static size_t _client_connection_allowance(struct server_state_machine_t *sm,
+                                           struct server_connection_t *conn) {
+  int64_t tokens = token_bucket_refill(&conn->shaper, sm->now_ms);
+  int64_t shared = token_bucket_refill(&sm->shaper, sm->now_ms);
+
+  tokens = tokens < shared ? tokens : shared;
+  if (tokens == INT64_MAX) {
+    return SIZE_MAX;
+  }
+  return tokens > 0 ? tokens : 0;
+}
+
+/**
+ * @brief pauses the transfers of a connection that spent its allowance, it
+ * stops monitoring POLLOUT and its timer resumes it once the shapers have
+ * refilled
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ */
+static void _client_connection_throttle(struct server_state_machine_t *sm,
+                                        struct server_connection_t *conn) {
+  uint64_t delay = token_bucket_delay(&conn->shaper);
+  uint64_t shared = token_bucket_delay(&sm->shaper);
+
+  delay = delay > shared ? delay : shared;
+  conn->throttle_ms = sm->now_ms + (delay ? delay : 1);
+  _stats_add(&sm->stats.throttles, 1);
+  _stats_add(&sm->stats.throttled, 1);
+  LOG_DEBUG("throttling fd %d for %lu ms\r\n", conn->fd, delay);
+}
+
+/**
+ * @brief transfers the files of the active streams to a writable connection,
+ * interleaved in weighted round-robin, until the socket would block, the
+ * write budget of this wakeup is spent or the shapers run dry
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @return 0 success, <0 error and the connection must be released
+ */
+static int _client_connection_transfer(struct server_state_machine_t *sm,
+                                       struct server_connection_t *conn) {
+  int err = 0;
+  size_t budget = server_config_get()->write_budget, sent = 0, allowance = 0;
+  struct server_stream_t *stream = NULL;
+  uint64_t start = 0, now = 0;
+
+  if (conn->throttle_ms) { // resumed by its timer only
+    return _client_connection_events_update(sm, conn);
+  }
+  allowance = _client_connection_allowance(sm, conn);
+  budget = budget && budget < allowance ? budget : allowance;
+
+  // transfer files to this client in chunks
+  while (conn->streams_active && sent < budget) {
+    stream = _client_connection_stream_next(conn);
+    start = server_metrics_now();
+    err = file_transfer(conn->fd, &stream->transfer);
+    if (err > 0) {
+      now = server_metrics_now();
+      server_metrics_record(&sm->stats.send_latency, now - start);
+      if (!stream->bytes_sent) {
+        server_metrics_record(&sm->stats.ttfb, now - stream->requested);
+      }
+      sent += err;
+      stream->bytes_sent += err;
+      stream->deficit -= stream->deficit < err ? stream->deficit : err;
+      conn->stats.bytes_sent += err;
+      _stats_add(&sm->stats.bytes_sent, err);
+      _stats_add(&sm->stats.sends, 1);
+    } else if (err == -EAGAIN) {
+      _stats_add(&sm->stats.send_eagains, 1);
+    } else if (!err) { // transfer complete
+      _client_connection_stream_complete(sm, conn, stream);
+      // start the next requests without a round trip
+      err = _client_connection_requests_dispatch(sm, conn);
+    }
+
+    if (err < 0) {
+      break;
+    }
+  }
+  // the last send may overdraw the shapers, the debt delays the next one
+  token_bucket_consume(&conn->shaper, sent);
+  token_bucket_consume(&sm->shaper, sent);
+
+  // wait for the next POLLOUT, or for the file I/O of the stream whose turn
+  // it is, it keeps the rest of its turn meanwhile
+  if (err == -EAGAIN || err == -EINPROGRESS) {
     err = 0;
+  } else if (err < 0) {
+    LOG_WARN("error file transfer %d\r\n", err);
+    return err;
+  } else if (conn->streams_active && sent >= allowance) {
+    _client_connection_throttle(sm, conn);
+  } else if (conn->streams_active) {
+    // budget spent, give the other connections a turn
+    _stats_add(&sm->stats.budget_yields, 1);
+    if (sm->loop.edge_triggered) {
+      _client_connection_ready_push(sm, conn);
+    }
+  }
+  return _client_connection_events_update(sm, conn);
+}
+
+/**
+ * @brief process the events reported on one connection
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] conn points to the connection
+ * @param[in] revents events reported on this connection
+ * @return 0 success, <0 error
+ */
+static int _client_connection_event_process(struct server_state_machine_t *sm,
+                                            struct server_connection_t *conn,
+                                            short revents) {
+  int err = 0;
+
+  do {
     // check for errors
-    if (_fds[i].revents & POLLNVAL) { // POLLNVAL
-      printf("fd invalid, this should never happen unless theres a bug?\r\n");
-      err = -ENOENT;
-      break;
-    } else if (_fds[i].revents & POLLERR ||
-               _fds[i].revents & POLLHUP) { // an error occurred
-      printf("poll error on fd %d at idx %d evt %hu\r\n", _fds[i].fd, i,
-             _fds[i].revents);
+    if (revents & POLLNVAL) { // POLLNVAL
+      LOG_ERROR(
+          "fd invalid, this should never happen unless theres a bug?\r\n");
+      return -ENOENT;
+    } else if (revents & POLLERR || revents & POLLHUP) { // an error occurred
+      LOG_WARN("poll error on fd %d evt %hu\r\n", conn->fd, revents);
       err = -EIO;
-      goto CONNECTION_RELEASE;
-    } else if (_fds[i].revents & POLLPRI) { // POLLPRI
+      break;
+    }
+
+    if (revents & POLLPRI) { // POLLPRI
       // TBD: To be understood and handled appropriately, for now lets ignore it
-    } else if (_fds[i].revents & POLLIN) { // POLLIN
-      printf("POLLIN on fd %d at idx %d\r\n", _fds[i].fd, i);
-      // clear this event, poll will notify if we are able read again
-      _fds[i].revents &= ~POLLIN;
-
-      memset(&packet_rx, 0, sizeof(packet_rx));
-      err = server_read(_fds[i].fd, packet_rx.data, PACKET_MAX_SIZE);
-      if (err <= 0) { // an error occurred
-        err = (err == 0) ? -ENETRESET : err;
-        printf("client closed connection on fd %d, error %d\r\n", _fds[i].fd,
-               err);
-        goto CONNECTION_RELEASE;
-      }
+    }
 
-      if (packet_rx.packet_struct.cmd != CMD_DOWNLOAD_FILE) {
-        // present we only support download service but can be
-        // extended to support other services in the future
-        printf("invalid command 0x%02X on fd %d\r\n",
-               packet_rx.packet_struct.cmd, _fds[i].fd);
-        err = -ENOMSG;
-        goto CONNECTION_RELEASE;
+    if (revents & POLLIN) { // POLLIN
+      err = _client_connection_request_process(sm, conn);
+      if (err < 0) {
+        break;
       }
+    }
 
-      memset(&transfer_ctx, 0, sizeof(transfer_ctx));
+    if (revents & POLLOUT && conn->streams_active) { // POLLOUT
+      err = _client_connection_transfer(sm, conn);
+    }
+  } while (0);
 
-      transfer_ctx.client_fd = _fds[i].fd;
+  if (err < 0) { // errors on a connection only affect that connection
+    _client_connection_resources_release(sm, conn);
+  } else {
+    _client_connection_timer_update(sm, conn);
+  }
+  return 0;
+}
 
-      size_t copy_size =
-          (packet_rx.packet_struct.length < FILE_TRANSFER_NAME_SIZE_MAX)
-              ? packet_rx.packet_struct.length
-              : FILE_TRANSFER_NAME_SIZE_MAX;
+/**
+ * @brief checks the deadline of a connection whose timer fired. The timer is
+ * armed again if activity pushed the deadline back, or if the transfers kept
+ * up the minimum rate over the window, the connection is evicted otherwise
+ *
+ * @param[in] ctx points to the state machine
+ * @param[in] timer timer of the connection
+ */
+static void
+_client_connection_timer_expired(void *ctx, struct timer_wheel_timer_t *timer) {
+  struct server_state_machine_t *sm = ctx;
+  struct server_connection_t *conn = timer->data;
+  uint64_t deadline = 0, elapsed = 0, *evictions = NULL;
+  enum server_timeout_t timeout = _client_connection_deadline(conn, &deadline);
 
-      memcpy(transfer_ctx.filename, packet_rx.data + PACKET_HEADER_SIZE,
-             copy_size);
-      transfer_ctx.filename[copy_size] = '\0'; // null terminate it
+  if (!timeout) {
+    return;
+  } else if (deadline > sm->now_ms) {
+    timer_wheel_add(&sm->timers, timer, deadline);
+    return;
+  }
 
-      printf("fname: %s len:%ld\r\n", transfer_ctx.filename, copy_size);
+  switch (timeout) {
+  case SERVER_TIMEOUT_THROTTLE:
+    conn->throttle_ms = 0;
+    _stats_add(&sm->stats.throttled, -1);
+    // the pause is not held against the minimum rate of the client
+    conn->rate_ms = sm->now_ms;
+    conn->rate_bytes = conn->stats.bytes_sent;
+    _client_connection_event_process(sm, conn, POLLOUT);
+    return;
+  case SERVER_TIMEOUT_RATE:
+    elapsed = sm->now_ms - conn->rate_ms;
+    if ((conn->stats.bytes_sent - conn->rate_bytes) * 1000 >=
+        server_config_get()->min_rate * elapsed) {
+      conn->rate_ms = sm->now_ms;
+      conn->rate_bytes = conn->stats.bytes_sent;
+      timer_wheel_add(&sm->timers, timer,
+                      sm->now_ms + SERVER_MIN_RATE_WINDOW_MS);
+      return;
+    }
+    evictions = &sm->stats.evictions_rate;
+    break;
+  case SERVER_TIMEOUT_REQUEST:
+    evictions = &sm->stats.evictions_request;
+    break;
+  default:
+    evictions = &sm->stats.evictions_idle;
+    break;
+  }
 
-      err = file_transfer_context_add(&transfer_ctx, _file_transfer,
-                                      sizeof(_file_transfer) /
-                                          sizeof(_file_transfer[0]));
-      if (err < 0) { // context association successful?
-        printf("error %d, context association for %d\r\n", err, _fds[i].fd);
-        goto CONNECTION_RELEASE;
-      }
+  LOG_DEBUG("evicting fd %d, %s timeout\r\n", conn->fd,
+            timeout == SERVER_TIMEOUT_RATE      ? "minimum rate"
+            : timeout == SERVER_TIMEOUT_REQUEST ? "request"
+                                                : "idle");
+  _stats_add(evictions, 1);
+  _client_connection_resources_release(sm, conn);
+}
 
-      // enable POLLOUT so we can begin file transfer to this client
-      _fds[i].events |= POLLOUT;
+/**
+ * @brief hands the file I/O completed by the pool to the transfers waiting
+ * for it and resumes their connections
+ *
+ * @param[in] sm points to the state machine
+ */
+static void _file_io_completions_process(struct server_state_machine_t *sm) {
+  struct file_io_request_t *request = file_io_completions_take(&sm->io);
+  struct file_io_request_t *next = NULL;
+  struct file_transfer_t *transfer = NULL;
+  struct server_connection_t *conn = NULL;
 
-      // uncomment to enable for DBG
-      // server_recv_print(packet_rx.data, packet_rx.packet_struct.length);
+  for (; request; request = next) {
+    next = request->next;
+    transfer = request->owner;
+    file_transfer_io_complete(request);
+    if (!transfer) { // the connection went away meanwhile
+      continue;
+    }
 
-    CONNECTION_RELEASE:
-      if (err < 0) {
-        _client_connection_resources_release(&_fds[i], _file_transfer,
-                                             sizeof(_file_transfer) /
-                                                 sizeof(_file_transfer[0]));
-      }
-    } else if (_fds[i].revents & POLLOUT) { // POLLOUT
-      // clear this event, poll will notify if we are able write again
-      _fds[i].revents &= ~POLLOUT;
-      // transfer file to this client in chunks
-      err = file_transfer(_fds[i].fd, _file_transfer);
-      if (err < 0) {
-        printf("error file transfer %d\r\n", err);
-        _client_connection_resources_release(&_fds[i], _file_transfer,
-                                             sizeof(_file_transfer) /
-                                                 sizeof(_file_transfer[0]));
-      } else if (!err) { // transfer complete
-        printf("transfer complete\r\n");
-        // don't need send anything else until requested from client
-        _fds[i].events = POLLIN;
-      }
-      break;
-    } else if (_fds[i].revents == 0) { // no events
-      // do nothing, since no events to be processed for this fd
-    } else {
-      // somethings not right
-      printf("unexpected event %d on fd %d at idx %d\r\n", _fds[i].revents,
-             _fds[i].fd, i);
-      err = -ENOMSG;
+    conn = server_connection_lookup(&sm->connections, transfer->client_fd);
+    if (conn && conn->streams_active) {
+      _client_connection_event_process(sm, conn, POLLOUT);
+    }
+  }
+}
+
+/**
+ * @brief hands the completion of a request posted by a transfer on the ring of
+ * the event loop to the transfer, its connection resumes once the chain of
+ * the request completed
+ *
+ * @param[in] sm points to the state machine
+ * @param[in] event completion returned by the event loop
+ */
+static void
+_file_transfer_completion_process(struct server_state_machine_t *sm,
+                                  struct event_loop_event_t *event) {
+  struct file_transfer_t *transfer =
+      file_transfer_uring_complete(event->data, event->res);
+  struct server_connection_t *conn = NULL;
+
+  if (!transfer) { // more to come, or the connection went away meanwhile
+    return;
+  }
+
+  conn = server_connection_lookup(&sm->connections, transfer->client_fd);
+  if (conn && conn->streams_active) {
+    _client_connection_event_process(sm, conn, POLLOUT);
+  }
+}
+
+/**
+ * @brief process events on all connections reported by the event loop
+ *
+ * @param[in] sm points to the state machine
+ * @return 0 success, <0 error
+ */
+static int
+_client_connection_events_process(struct server_state_machine_t *sm) {
+  int err = 0;
+
+  for (int i = 0; i < sm->events_count; i++) {
+    struct server_connection_t *conn = sm->events[i].data;
+    if (sm->events[i].revents & EVENT_LOOP_COMPLETION) {
+      _file_transfer_completion_process(sm, &sm->events[i]);
+      continue;
+    } else if (sm->events[i].data == &sm->io) {
+      _file_io_completions_process(sm);
+      continue;
+    } else if (conn == &sm->listener || conn->fd < 0) {
+      continue;
+    }
+
+    err = _client_connection_event_process(sm, conn, sm->events[i].revents);
+    if (err < 0) {
       break;
     }
   } // for
@@ -213,74 +1247,217 @@ static int _client_connection_events_process(void) {
 }
 
 /**
- * @brief state machine to handle and manage transfers on active connections.
+ * @brief resumes the transfers paused by the write budget on the last round
+ *
+ * @param[in] sm points to the state machine
  */
-void server_state_machine_init(void) {
+static void
+_client_connections_ready_process(struct server_state_machine_t *sm) {
+  struct server_connection_t *conn = sm->ready, *next = NULL;
+
+  sm->ready = NULL; // transfers paused again are queued for the next round
+  for (; conn; conn = next) {
+    next = conn->ready_next;
+    conn->ready_next = NULL;
+    conn->ready = false;
+
+    // released since it was queued
+    if (conn->fd < 0 || !conn->streams_active) {
+      continue;
+    }
+    _client_connection_event_process(sm, conn, POLLOUT);
+  }
+}
+
+/**
+ * @brief accepts the connections reported on the listening socket, either
+ * already accepted by the event loop backend or still in the backlog
+ *
+ * @param[in] sm points to the state machine
+ * @return 0 success, <0 error
+ */
+static int _listener_events_process(struct server_state_machine_t *sm) {
   int err = 0;
-  static enum server_state_t state = SERVER_LISTEN_BEGIN;
 
-  switch (state) {
+  for (int i = 0; i < sm->events_count && !err; i++) {
+    if (sm->events[i].data != &sm->listener) {
+      continue;
+    }
+
+    if (sm->events[i].fd >= 0) { // accepted by a multishot accept
+      _client_connection_add(sm, sm->events[i].fd, POLLIN);
+    } else if (sm->events[i].revents & POLLIN) {
+      err = server_connections_accept(sm->listener.fd, POLLIN,
+                                      server_config_get()->accept_budget,
+                                      _client_connection_add, sm);
+      if (err > 0 && err == server_config_get()->accept_budget) {
+        _stats_add(&sm->stats.accept_yields, 1); // the rest waits its turn
+      }
+      err = err < 0 ? err : 0;
+      // revents is not POLLIN, its an unexpected result
+    } else if (sm->events[i].revents) {
+      LOG_ERROR("error %d accepting connection\r\n", err);
+      err = -EIO;
+    }
+  }
+  return err;
+}
+
+/**
+ * @brief state machine to handle and manage transfers on active connections,
+ * each worker runs its own instance
+ *
+ * @param[in] sm points to the state machine of the calling worker
+ */
+void server_state_machine_init(struct server_state_machine_t *sm) {
+  int err = 0;
+  size_t rate = 0;
+  switch (sm->state) {
   case SERVER_LISTEN_BEGIN: { // listens for incoming commings
-    _reset_descriptor_set();
-    file_transfer_list_reset(_file_transfer, sizeof(_file_transfer) /
-                                                 sizeof(_file_transfer[0]));
+    __atomic_store_n(&sm->listener.fd, -1, __ATOMIC_RELAXED);
+    sm->events_count = 0;
+    sm->ready = NULL;
+    sm->io.event_fd = -1;
+    sm->now_ms = _now_ms();
+    timer_wheel_init(&sm->timers, sm->now_ms, SERVER_TIMER_TICK_MS);
+    // each worker shapes its own share of the global rate
+    rate = (server_config_get()->global_rate +
+            server_config_get()->workers - 1) /
+           server_config_get()->workers;
+    token_bucket_init(&sm->shaper, rate, _shaper_burst(rate), sm->now_ms);
 
-    state = SERVER_POLL_FOR_EVENTS;
-    err = server_listen_begin(SERVER_SOCKET_LISTEN_PORT_NUM);
+    sm->state = SERVER_FATAL_ERROR;
+    err = server_connection_table_create(&sm->connections,
+                                         server_config_get()->max_connections);
     if (err < 0) {
-      state = SERVER_FATAL_ERROR;
-    } else {
-      _fds[SERVER_SOCKET_LISTEN_INDEX].fd = err;
-      _fds[SERVER_SOCKET_LISTEN_INDEX].events = POLLIN;
+      LOG_ERROR("error %d creating connection table\r\n", err);
+      break;
+    }
+
+    // one buffer per stream at most, two when reading ahead on the file I/O
+    // pool, adaptive chunks may grow to the cap
+    err = buffer_pool_create(&sm->buffers, _buffer_size(),
+                             server_config_get()->max_connections *
+                                 SERVER_CONNECTION_STREAMS_MAX *
+                                 (file_io_enabled() ? 2 : 1));
+    if (err < 0) {
+      LOG_ERROR("error %d creating buffer pool\r\n", err);
+      break;
+    }
+
+    // one event per connection plus the listener and the file I/O eventfd
+    sm->events_size = server_config_get()->max_connections + 2;
+    sm->events = calloc(sm->events_size, sizeof(*sm->events));
+    if (!sm->events) {
+      LOG_ERROR("error allocating %ld events\r\n", sm->events_size);
+      break;
+    }
+
+    err = event_loop_create(&sm->loop, server_config_get()->event_backend,
+                            sm->events_size);
+    if (err < 0) {
+      LOG_ERROR("error %d creating %s event loop\r\n", err,
+                event_loop_backend_name(server_config_get()->event_backend));
+      break;
+    }
+
+    // the uring engine posts on the ring of the loop, so it needs one
+    sm->engine = server_config_get()->transfer_engine;
+    if (sm->engine == FILE_TRANSFER_ENGINE_URING) {
+      err = file_transfer_uring_setup(
+          &sm->loop, sm->connections.max * SERVER_CONNECTION_STREAMS_MAX);
+      if (err < 0) {
+        LOG_WARN("worker %d io_uring engine unavailable %d with %s, falling "
+                 "back to copy\r\n",
+                 sm->id, err, event_loop_backend_name(sm->loop.backend));
+        sm->engine = FILE_TRANSFER_ENGINE_COPY;
+      }
+    }
 
-      printf("server listening on port %hd using socket fd %d \r\n",
-             SERVER_SOCKET_LISTEN_PORT_NUM,
-             _fds[SERVER_SOCKET_LISTEN_INDEX].fd);
+    err = server_listen_begin(server_config_get()->port, sm->reuseport,
+                              &server_config_get()->listen);
+    if (err < 0) {
+      break;
     }
+    // read by the stats and metrics threads for the accept queue depth
+    __atomic_store_n(&sm->listener.fd, err, __ATOMIC_RELAXED);
+    sm->listener.events = POLLIN;
+
+    // level triggered, connections left in the backlog are reported again
+    err = event_loop_add(&sm->loop, sm->listener.fd,
+                         sm->listener.events | EVENT_LOOP_ACCEPT,
+                         &sm->listener);
+    if (err < 0) {
+      LOG_ERROR("error %d monitoring listening socket\r\n", err);
+      break;
+    }
+
+    if (file_io_enabled()) {
+      err = file_io_completions_create(&sm->io);
+      if (!err) {
+        err = event_loop_add(&sm->loop, sm->io.event_fd, POLLIN, &sm->io);
+      }
+      if (err < 0) {
+        LOG_ERROR("error %d monitoring file I/O completions\r\n", err);
+        break;
+      }
+    }
+
+    sm->state = SERVER_POLL_FOR_EVENTS;
+    LOG_INFO("worker %d listening on port %hu using socket fd %d with %s\r\n",
+             sm->id, server_config_get()->port, sm->listener.fd,
+             event_loop_backend_name(sm->loop.backend));
   } break;
 
   case SERVER_POLL_FOR_EVENTS: { // polls for events on active sockets
-    state = SERVER_POLL_INCOMING_CONNECTIONS;
-    err = poll(_fds, SERVER_STATE_MACHINE_FDS_MAX, SERVER_SOCKET_POLL_TIMEOUT);
+    sm->state = SERVER_POLL_INCOMING_CONNECTIONS;
+    // don't block while paused transfers are waiting to be resumed, nor
+    // past the next deadline of a connection
+    err = timer_wheel_timeout(&sm->timers, _now_ms());
+    err = event_loop_wait(&sm->loop, sm->events, sm->events_size,
+                          sm->ready ? 0
+                          : err < 0 ? SERVER_SOCKET_POLL_TIMEOUT
+                                    : err);
+    sm->now_ms = _now_ms();
     if (err < 0) {
-      printf("error %d errno %d polling\r\n", err, errno);
-      state = SERVER_FATAL_ERROR;
+      LOG_ERROR("error %d polling\r\n", err);
+      sm->state = SERVER_FATAL_ERROR;
+    } else {
+      sm->events_count = err;
+      _stats_add(&sm->stats.wakeups, 1);
     }
   } break;
 
   case SERVER_POLL_INCOMING_CONNECTIONS: { // accepts and manages incoming
                                            // connections
-    state = SERVER_POLL_FOR_EVENTS;
-    if (_fds[SERVER_SOCKET_LISTEN_INDEX].revents & POLLIN) {
-      err = server_connections_accept(_fds[SERVER_SOCKET_LISTEN_INDEX].fd,
-                                      POLLIN, _client_connection_add);
-      // revents is not POLLIN, its an unexpected result
-    } else if (_fds[SERVER_SOCKET_LISTEN_INDEX].revents &&
-               _fds[SERVER_SOCKET_LISTEN_INDEX].revents != POLLIN) {
-      printf("error %d accepting connection\r\n", err);
-      state = SERVER_FATAL_ERROR;
-    } else {
-      state = SERVER_PROCESS_CONNECTION_EVENTS;
+    sm->state = SERVER_PROCESS_CONNECTION_EVENTS;
+    err = _listener_events_process(sm);
+    if (err < 0) {
+      sm->state = SERVER_FATAL_ERROR;
     }
   } break;
 
   case SERVER_PROCESS_CONNECTION_EVENTS: { // processes events on active
                                            // connections with client
-    state = SERVER_POLL_FOR_EVENTS;
-    err = _client_connection_events_process();
+    sm->state = SERVER_POLL_FOR_EVENTS;
+    err = _client_connection_events_process(sm);
     if (err < 0) {
-      state = SERVER_FATAL_ERROR;
+      sm->state = SERVER_FATAL_ERROR;
+      break;
     }
+    _client_connections_ready_process(sm);
+    timer_wheel_advance(&sm->timers, sm->now_ms,
+                        _client_connection_timer_expired, sm);
   } break;
 
   case SERVER_FATAL_ERROR: { // handles any unexpected errors
-    printf("fatal error %d, clean up & exit\r\n", err);
-    _client_connections_clean_up();
+    LOG_ERROR("fatal error %d, clean up & exit\r\n", err);
+    _client_connections_clean_up(sm);
     exit(EXIT_FAILURE);
   } break;
 
   default:
-    printf("should never get here, seems like a bug?\r\n");
+    LOG_ERROR("should never get here, seems like a bug?\r\n");
     break;
   }
-}
\ No newline at end of file
+}
@@ -1,7 +1,16 @@
 #ifndef __SERVER_STATE_MACHINE_H
 #define __SERVER_STATE_MACHINE_H
 
+#include "buffer_pool.h"
 #include "common.h"
+#include "event_loop.h"
+#include "file_io.h"
+#include "file_transfer.h"
+#include "server.h"
+#include "server_connection.h"
+#include "server_metrics.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
 
 enum server_state_t {
   SERVER_LISTEN_BEGIN,
@@ -11,6 +20,59 @@ enum server_state_t {
   SERVER_FATAL_ERROR
 };
 
-void server_state_machine_init(void);
+// deadline a connection is held to, it depends on what the connection is doing
+enum server_timeout_t {
+  SERVER_TIMEOUT_NONE,    // no deadline applies
+  SERVER_TIMEOUT_IDLE,    // no request and no transfer
+  SERVER_TIMEOUT_REQUEST, // part of a request received
+  SERVER_TIMEOUT_RATE,    // transfers running, held to the minimum rate
+  SERVER_TIMEOUT_THROTTLE // paused by a shaper, resumes once it refilled
+};
+
+// written by the owning worker only, read by others with relaxed loads
+struct server_state_machine_stats_t {
+  uint64_t connections_accepted; // connections accepted so far
+  uint64_t connections_active;   // connections currently open
+  uint64_t connections_rejected; // connections turned away at capacity
+  uint64_t accept_yields;        // wakeups that spent the accept budget
+  uint64_t transfers_active;     // transfers currently running
+  uint64_t transfers_completed;  // files sent in full
+  uint64_t bytes_sent;           // file bytes sent
+  uint64_t wakeups;              // returns from the event loop
+  uint64_t sends;                // file_transfer calls that sent data
+  uint64_t send_eagains;         // file_transfer calls refused by the socket
+  uint64_t budget_yields;        // transfers paused by the write budget
+  uint64_t evictions_idle;       // connections closed for idling
+  uint64_t evictions_request;    // connections too slow to send a request
+  uint64_t evictions_rate;       // connections reading below the min rate
+  uint64_t throttles;            // transfers paused by the shapers
+  uint64_t throttled;            // connections currently paused
+  // nanoseconds from a download request to its first byte sent
+  struct server_metrics_histogram_t ttfb;
+  // nanoseconds spent in the file_transfer calls that sent data
+  struct server_metrics_histogram_t send_latency;
+};
+
+struct server_state_machine_t {
+  enum server_state_t state; // current state
+  int id;                    // identifier of the worker running it
+  bool reuseport;            // listening port shared with other workers
+  struct event_loop_t loop;
+  enum file_transfer_engine_t engine; // engine of the transfers of the loop
+  struct event_loop_event_t *events; // one per monitored descriptor
+  size_t events_size;
+  int events_count;
+  struct server_connection_t listener;
+  struct server_connection_table_t connections; // connections by descriptor
+  struct buffer_pool_t buffers; // copy engine buffers leased by transfers
+  struct file_io_completions_t io; // file I/O completed by the pool
+  struct server_connection_t *ready; // transfers to resume without an event
+  struct timer_wheel_t timers; // deadlines of the connections
+  uint64_t now_ms;             // monotonic ms of the last wakeup
+  struct token_bucket_t shaper; // share of the global rate of the worker
+  struct server_state_machine_stats_t stats;
+};
+
+void server_state_machine_init(struct server_state_machine_t *sm);
 
 #endif //__SERVER_H
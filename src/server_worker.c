@@ -0,0 +1,228 @@
+/**
+ * @file server_worker.c
+ * @author vinay divakar
+ * @brief worker threads, each running its own listening socket, event loop
+ * and connection table so nothing is shared on the hot path
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "server_worker.h"
+#include "crc32c.h"
+#include "file_cache.h"
+#include "file_compress.h"
+#include "file_io.h"
+#include "file_names.h"
+#include "log.h"
+
+#include <sched.h>
+
+/**
+ * @brief runs the state machine of a worker forever
+ *
+ * @param[in] arg points to the worker
+ * @return never returns
+ */
+static void *_worker_run(void *arg) {
+  struct server_worker_t *worker = arg;
+
+  while (1) {
+    server_state_machine_init(&worker->sm);
+  }
+  return NULL;
+}
+
+/**
+ * @brief pins a worker thread to a single cpu
+ *
+ * @param[in] worker points to the worker
+ * @return 0 success, <0 error
+ */
+static int _worker_pin(struct server_worker_t *worker) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(worker->cpu, &set);
+  return -pthread_setaffinity_np(worker->thread, sizeof(set), &set);
+}
+
+/**
+ * @brief starts the worker threads, with more than one worker each listens
+ * on its own socket bound with SO_REUSEPORT
+ *
+ * @param[in] count number of workers to start
+ * @param[in] pin pin worker i to cpu i modulo the number of online cpus
+ * @return points to the workers, NULL on error
+ */
+struct server_worker_t *server_workers_start(size_t count, bool pin) {
+  int err = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct server_worker_t *workers = calloc(count, sizeof(*workers));
+
+  if (!workers) {
+    LOG_ERROR("error allocating %ld workers\r\n", count);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    workers[i].cpu = (pin && cpus > 0) ? i % cpus : -1;
+    workers[i].sm.id = i;
+    workers[i].sm.reuseport = count > 1;
+    workers[i].sm.state = SERVER_LISTEN_BEGIN;
+
+    err = -pthread_create(&workers[i].thread, NULL, _worker_run, &workers[i]);
+    if (err < 0) {
+      LOG_ERROR("error %d starting worker %ld\r\n", err, i);
+      exit(EXIT_FAILURE);
+    }
+
+    if (workers[i].cpu >= 0) {
+      err = _worker_pin(&workers[i]);
+      if (err < 0) {
+        LOG_ERROR("error %d pinning worker %ld to cpu %d\r\n", err, i,
+                  workers[i].cpu);
+      }
+    }
+  }
+  return workers;
+}
+
+/**
+ * @brief waits for the worker threads to exit
+ *
+ * @param[in] workers points to the workers
+ * @param[in] count number of workers
+ */
+void server_workers_join(struct server_worker_t *workers, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+}
+
+/**
+ * @brief prints the statistics of every worker along with its share of the
+ * accepted connections to show how evenly load is spread
+ *
+ * @param[in] workers points to the workers
+ * @param[in] count number of workers
+ */
+void server_workers_stats_print(struct server_worker_t *workers,
+                                size_t count) {
+  uint64_t accepted_total = 0;
+  struct server_metrics_histogram_t ttfb = {}, send = {};
+
+  for (size_t i = 0; i < count; i++) {
+    accepted_total += __atomic_load_n(
+        &workers[i].sm.stats.connections_accepted, __ATOMIC_RELAXED);
+    server_metrics_merge(&ttfb, &workers[i].sm.stats.ttfb);
+    server_metrics_merge(&send, &workers[i].sm.stats.send_latency);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    struct server_state_machine_stats_t *stats = &workers[i].sm.stats;
+    uint64_t accepted =
+        __atomic_load_n(&stats->connections_accepted, __ATOMIC_RELAXED);
+
+    uint64_t bytes = __atomic_load_n(&stats->bytes_sent, __ATOMIC_RELAXED);
+    uint64_t wakeups = __atomic_load_n(&stats->wakeups, __ATOMIC_RELAXED);
+    uint64_t sends = __atomic_load_n(&stats->sends, __ATOMIC_RELAXED);
+    uint32_t queue = 0, queue_max = 0;
+    int fd = __atomic_load_n(&workers[i].sm.listener.fd, __ATOMIC_RELAXED);
+
+    if (fd >= 0) {
+      server_listen_queue(fd, &queue, &queue_max);
+    }
+
+    printf("worker %ld cpu %d: accepted %lu (%.1f%%) rejected %lu accept "
+           "queue %u of %u accept yields %lu active %lu transfers "
+           "%lu (%lu running) bytes %lu wakeups %lu (%.0f bytes/wakeup) sends "
+           "%lu (%.0f bytes/send) eagains %lu budget yields %lu evictions "
+           "idle %lu request %lu rate %lu throttles %lu (%lu paused)\r\n",
+           i, workers[i].cpu, accepted,
+           accepted_total ? 100.0 * accepted / accepted_total : 0.0,
+           __atomic_load_n(&stats->connections_rejected, __ATOMIC_RELAXED),
+           queue, queue_max,
+           __atomic_load_n(&stats->accept_yields, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->connections_active, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->transfers_completed, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->transfers_active, __ATOMIC_RELAXED), bytes,
+           wakeups, wakeups ? (double)bytes / wakeups : 0.0, sends,
+           sends ? (double)bytes / sends : 0.0,
+           __atomic_load_n(&stats->send_eagains, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->budget_yields, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->evictions_idle, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->evictions_request, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->evictions_rate, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->throttles, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->throttled, __ATOMIC_RELAXED));
+  }
+
+  printf("latency: first byte p50 <%lu p99 <%lu us, send p50 <%lu p99 <%lu "
+         "max <%lu us\r\n",
+         server_metrics_percentile(&ttfb, 50) / 1000,
+         server_metrics_percentile(&ttfb, 99) / 1000,
+         server_metrics_percentile(&send, 50) / 1000,
+         server_metrics_percentile(&send, 99) / 1000,
+         server_metrics_percentile(&send, 100) / 1000);
+
+  if (file_cache_enabled()) {
+    struct file_cache_stats_t cache = {};
+    file_cache_stats_get(&cache);
+    printf("cache: %zu files %zu of %zu bytes, hits %lu (%.1f%%) misses %lu "
+           "insertions %lu evictions %lu invalidations %lu\r\n",
+           cache.entries, cache.bytes, cache.budget, cache.hits,
+           cache.hits + cache.misses
+               ? 100.0 * cache.hits / (cache.hits + cache.misses)
+               : 0.0,
+           cache.misses, cache.insertions, cache.evictions,
+           cache.invalidations);
+  }
+
+  {
+    struct file_names_stats_t names = {};
+    file_names_stats_get(&names);
+    printf("names: %zu of %zu open, hits %lu misses %lu revalidations %lu "
+           "invalidations %lu evictions %lu digests %lu (crc32c %s)\r\n",
+           names.entries, names.capacity, names.hits, names.misses,
+           names.revalidations, names.invalidations, names.evictions,
+           names.digests, crc32c_kernel_name(crc32c_kernel()));
+  }
+
+  {
+    struct file_compress_stats_t compress = {};
+    file_compress_stats_get(&compress);
+    if (compress.chunks || compress.artifacts_served) {
+      printf("compress: %lu chunks %lu to %lu bytes, artifacts %lu written "
+             "%lu stored %lu served\r\n",
+             compress.chunks, compress.bytes_in, compress.bytes_out,
+             compress.artifacts_written, compress.artifacts_stored,
+             compress.artifacts_served);
+    }
+  }
+
+  {
+    struct log_stats_t log = {};
+    log_stats_get(&log);
+    printf("log: level %s, %lu records from %zu threads, %lu dropped\r\n",
+           log_level_name(__atomic_load_n(&log_level, __ATOMIC_RELAXED)),
+           log.records, log.threads, log.dropped);
+  }
+
+  if (file_io_enabled()) {
+    struct file_io_stats_t io = {};
+    file_io_stats_get(&io);
+    printf("file io: %zu threads, %lu requests %lu overflows, queue depth %lu "
+           "peak %lu p50 <%zu p99 <%zu, open p50 <%zu p99 <%zu us, read p50 "
+           "<%zu p99 <%zu max <%zu us\r\n",
+           io.threads, io.submitted, io.overflows, io.queue_depth,
+           io.queue_depth_peak, file_io_histogram_percentile(io.depth, 50),
+           file_io_histogram_percentile(io.depth, 99),
+           file_io_histogram_percentile(io.latency[FILE_IO_OPEN], 50),
+           file_io_histogram_percentile(io.latency[FILE_IO_OPEN], 99),
+           file_io_histogram_percentile(io.latency[FILE_IO_READ], 50),
+           file_io_histogram_percentile(io.latency[FILE_IO_READ], 99),
+           file_io_histogram_percentile(io.latency[FILE_IO_READ], 100));
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef __SERVER_WORKER_H
+#define __SERVER_WORKER_H
+
+#include "common.h"
+#include "server_state_machine.h"
+
+#include <pthread.h>
+
+struct server_worker_t {
+  pthread_t thread;                 // thread running the state machine
+  int cpu;                          // cpu the thread is pinned to, -1 if none
+  struct server_state_machine_t sm; // state owned by this worker only
+};
+
+struct server_worker_t *server_workers_start(size_t count, bool pin);
+void server_workers_join(struct server_worker_t *workers, size_t count);
+void server_workers_stats_print(struct server_worker_t *workers,
+                                size_t count);
+
+#endif // __SERVER_WORKER_H
@@ -0,0 +1,247 @@
+/**
+ * @file timer_wheel.c
+ * @author vinay divakar
+ * @brief hierarchical timer wheel driving the timeouts of the event loop,
+ * timers are kept in slots of 64 ticks per wheel and cascade down a wheel
+ * each time the finer one wraps around
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "timer_wheel.h"
+
+/**
+ * @brief links a timer into the slot its tick falls in, timers beyond the
+ * range of the wheels wait in the last slot they can reach and are placed
+ * again from there
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] timer timer to be linked, not after the current tick
+ */
+static void _slot_insert(struct timer_wheel_t *wheel,
+                         struct timer_wheel_timer_t *timer) {
+  uint64_t delta = timer->expires - wheel->now, tick = timer->expires;
+  size_t level = 0, index = 0;
+  struct timer_wheel_timer_t **slot = NULL;
+
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) {
+    level++;
+  }
+  if (delta >> (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) {
+    tick = wheel->now +
+           ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+
+  index = (tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+  slot = &wheel->slots[level][index];
+  timer->next = *slot;
+  if (timer->next) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = slot;
+  *slot = timer;
+  wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+/**
+ * @brief unlinks a timer from its slot
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] timer linked timer
+ */
+static void _slot_unlink(struct timer_wheel_t *wheel,
+                         struct timer_wheel_timer_t *timer) {
+  struct timer_wheel_timer_t **pprev = timer->pprev;
+
+  *pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+
+  // the slot is the head of its list once empty, clear its bit
+  for (size_t level = 0; !*pprev && level < TIMER_WHEEL_LEVELS; level++) {
+    if (pprev >= &wheel->slots[level][0] &&
+        pprev < &wheel->slots[level][TIMER_WHEEL_SLOTS]) {
+      wheel->occupied[level] &=
+          ~((uint64_t)1 << (pprev - &wheel->slots[level][0]));
+    }
+  }
+}
+
+/**
+ * @brief moves the timers of a slot down to the finer wheels, called as the
+ * slot comes up
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] level wheel of the slot
+ * @param[in] index slot within the wheel
+ */
+static void _slot_cascade(struct timer_wheel_t *wheel, size_t level,
+                          size_t index) {
+  struct timer_wheel_timer_t *timer = wheel->slots[level][index], *next = NULL;
+
+  wheel->slots[level][index] = NULL;
+  wheel->occupied[level] &= ~((uint64_t)1 << index);
+  for (; timer; timer = next) {
+    next = timer->next;
+    _slot_insert(wheel, timer);
+  }
+}
+
+/**
+ * @brief starts an empty timer wheel
+ *
+ * @param[out] wheel points to the timer wheel
+ * @param[in] now_ms current monotonic time in milliseconds
+ * @param[in] tick_ms milliseconds per tick, the resolution of the timers
+ */
+void timer_wheel_init(struct timer_wheel_t *wheel, uint64_t now_ms,
+                      uint64_t tick_ms) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->tick_ms = tick_ms ? tick_ms : 1;
+  wheel->now = now_ms / wheel->tick_ms;
+}
+
+/**
+ * @brief arms a timer, or moves it if already armed. It fires on the first
+ * tick at or after the given time, and never on the tick being processed
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] timer timer to be armed
+ * @param[in] expires_ms monotonic time in milliseconds it expires at
+ */
+void timer_wheel_add(struct timer_wheel_t *wheel,
+                     struct timer_wheel_timer_t *timer, uint64_t expires_ms) {
+  uint64_t tick = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+
+  tick = tick > wheel->now ? tick : wheel->now + 1;
+  if (timer->pprev && timer->expires == tick) {
+    return; // already in place
+  }
+  timer_wheel_remove(wheel, timer);
+  timer->expires = tick;
+  _slot_insert(wheel, timer);
+  wheel->count++;
+}
+
+/**
+ * @brief disarms a timer, nothing happens if it is not armed
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] timer timer to be disarmed
+ */
+void timer_wheel_remove(struct timer_wheel_t *wheel,
+                        struct timer_wheel_timer_t *timer) {
+  if (timer->pprev) {
+    _slot_unlink(wheel, timer);
+    wheel->count--;
+  }
+}
+
+/**
+ * @brief tells whether a timer is armed
+ *
+ * @param[in] timer timer to be checked
+ * @return true if armed
+ */
+bool timer_wheel_pending(const struct timer_wheel_timer_t *timer) {
+  return timer->pprev;
+}
+
+/**
+ * @brief returns the time an armed timer fires at
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] timer armed timer
+ * @return monotonic time in milliseconds, rounded up to a tick
+ */
+uint64_t timer_wheel_expires(const struct timer_wheel_t *wheel,
+                             const struct timer_wheel_timer_t *timer) {
+  return timer->expires * wheel->tick_ms;
+}
+
+/**
+ * @brief returns how long the event loop may wait before the wheel has to be
+ * advanced, either for the next slot of the finest wheel holding timers or
+ * for the next cascade from the coarser ones
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] now_ms current monotonic time in milliseconds
+ * @return milliseconds to wait, -1 if no timer is armed
+ */
+int timer_wheel_timeout(const struct timer_wheel_t *wheel, uint64_t now_ms) {
+  uint64_t bits = wheel->occupied[0], rotated = 0, ticks = 0, next_ms = 0;
+  size_t first = (wheel->now + 1) & TIMER_WHEEL_SLOT_MASK;
+
+  if (!wheel->count) {
+    return -1;
+  }
+
+  // ticks until the finest wheel wraps and the next one cascades
+  ticks = TIMER_WHEEL_SLOTS - (wheel->now & TIMER_WHEEL_SLOT_MASK);
+  if (bits) {
+    rotated = bits >> first | (first ? bits << (TIMER_WHEEL_SLOTS - first) : 0);
+    if ((uint64_t)__builtin_ctzll(rotated) + 1 < ticks) {
+      ticks = __builtin_ctzll(rotated) + 1;
+    }
+  }
+
+  next_ms = (wheel->now + ticks) * wheel->tick_ms;
+  if (next_ms <= now_ms) {
+    return 0;
+  }
+  return next_ms - now_ms < INT32_MAX ? (int)(next_ms - now_ms) : INT32_MAX;
+}
+
+/**
+ * @brief processes the ticks up to the given time, cascading the coarser
+ * wheels as the finer ones wrap and calling back every timer that expires.
+ * Timers are disarmed before their callback, which may arm them again
+ *
+ * @param[in] wheel points to the timer wheel
+ * @param[in] now_ms current monotonic time in milliseconds
+ * @param[in] expired called with ctx for each expired timer
+ * @param[in] ctx handed to expired
+ */
+void timer_wheel_advance(struct timer_wheel_t *wheel, uint64_t now_ms,
+                         void (*expired)(void *, struct timer_wheel_timer_t *),
+                         void *ctx) {
+  uint64_t target = now_ms / wheel->tick_ms;
+  struct timer_wheel_timer_t **slot = NULL, *timer = NULL;
+
+  while (wheel->now < target) {
+    if (!wheel->count) {
+      wheel->now = target;
+      break;
+    } else if (!wheel->occupied[0]) {
+      // nothing fires before the finest wheel wraps, skip to it
+      wheel->now |= TIMER_WHEEL_SLOT_MASK;
+      if (wheel->now >= target) {
+        wheel->now = target;
+        break;
+      }
+    }
+
+    wheel->now++;
+    for (size_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if (wheel->now & (((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) {
+        break;
+      }
+      _slot_cascade(wheel, level,
+                    (wheel->now >> (TIMER_WHEEL_SLOT_BITS * level)) &
+                        TIMER_WHEEL_SLOT_MASK);
+    }
+
+    slot = &wheel->slots[0][wheel->now & TIMER_WHEEL_SLOT_MASK];
+    while ((timer = *slot)) {
+      _slot_unlink(wheel, timer);
+      wheel->count--;
+      expired(ctx, timer);
+    }
+  }
+}
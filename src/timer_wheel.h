@@ -0,0 +1,43 @@
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include "common.h"
+
+#define TIMER_WHEEL_LEVELS 4    // wheels, each 64 times coarser than the last
+#define TIMER_WHEEL_SLOT_BITS 6 // log2 of the slots per wheel
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// a timer, embedded in the record it times out
+struct timer_wheel_timer_t {
+  struct timer_wheel_timer_t *next;   // next timer in the slot
+  struct timer_wheel_timer_t **pprev; // link pointing to this one, NULL idle
+  uint64_t expires;                   // tick the timer fires at
+  void *data;                         // handed to the expiry callback
+};
+
+// hierarchical timer wheel, adding, removing and finding the next timeout are
+// constant time, timers move down a level as their tick gets close
+struct timer_wheel_t {
+  uint64_t now;     // last tick processed
+  uint64_t tick_ms; // milliseconds per tick
+  size_t count;     // timers pending
+  uint64_t occupied[TIMER_WHEEL_LEVELS]; // slots holding timers, one bit each
+  struct timer_wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel_t *wheel, uint64_t now_ms,
+                      uint64_t tick_ms);
+void timer_wheel_add(struct timer_wheel_t *wheel,
+                     struct timer_wheel_timer_t *timer, uint64_t expires_ms);
+void timer_wheel_remove(struct timer_wheel_t *wheel,
+                        struct timer_wheel_timer_t *timer);
+bool timer_wheel_pending(const struct timer_wheel_timer_t *timer);
+uint64_t timer_wheel_expires(const struct timer_wheel_t *wheel,
+                             const struct timer_wheel_timer_t *timer);
+int timer_wheel_timeout(const struct timer_wheel_t *wheel, uint64_t now_ms);
+void timer_wheel_advance(struct timer_wheel_t *wheel, uint64_t now_ms,
+                         void (*expired)(void *, struct timer_wheel_timer_t *),
+                         void *ctx);
+
+#endif // __TIMER_WHEEL_H
@@ -0,0 +1,80 @@
+/**
+ * @file token_bucket.c
+ * @author vinay divakar
+ * @brief token buckets shaping the bandwidth of the transfers, refilled from
+ * the time elapsed whenever they are looked at rather than by a timer
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "token_bucket.h"
+
+/**
+ * @brief starts a full token bucket
+ *
+ * @param[out] bucket points to the token bucket
+ * @param[in] rate bytes/sec the bucket refills at, 0 unlimited
+ * @param[in] burst most bytes saved up while idle, at least one
+ * @param[in] now_ms current monotonic time in milliseconds
+ */
+void token_bucket_init(struct token_bucket_t *bucket, uint64_t rate,
+                       uint64_t burst, uint64_t now_ms) {
+  bucket->rate = rate;
+  bucket->burst = burst ? burst : 1;
+  bucket->tokens = bucket->burst * 1000;
+  bucket->stamp_ms = now_ms;
+}
+
+/**
+ * @brief adds the tokens earned since the last refill, up to the burst
+ *
+ * @param[in,out] bucket points to the token bucket
+ * @param[in] now_ms current monotonic time in milliseconds
+ * @return bytes that may be sent, <=0 while in debt, INT64_MAX if unlimited
+ */
+int64_t token_bucket_refill(struct token_bucket_t *bucket, uint64_t now_ms) {
+  int64_t full = bucket->burst * 1000;
+  uint64_t elapsed = now_ms - bucket->stamp_ms;
+
+  if (!bucket->rate) {
+    return INT64_MAX;
+  } else if (now_ms <= bucket->stamp_ms) {
+    return bucket->tokens / 1000;
+  }
+
+  bucket->stamp_ms = now_ms;
+  // compared before multiplying, a long idle bucket would overflow
+  if (elapsed >= (uint64_t)(full - bucket->tokens) / bucket->rate) {
+    bucket->tokens = full;
+  } else {
+    bucket->tokens += bucket->rate * elapsed; // thousandths per ms
+  }
+  return bucket->tokens / 1000;
+}
+
+/**
+ * @brief takes the tokens of bytes that were sent
+ *
+ * @param[in,out] bucket points to the token bucket
+ * @param[in] bytes bytes sent
+ */
+void token_bucket_consume(struct token_bucket_t *bucket, size_t bytes) {
+  if (bucket->rate) {
+    bucket->tokens -= (int64_t)bytes * 1000;
+  }
+}
+
+/**
+ * @brief returns how long until the bucket holds a byte worth of tokens
+ *
+ * @param[in] bucket points to the refilled token bucket
+ * @return milliseconds, 0 if a byte may be sent now
+ */
+uint64_t token_bucket_delay(const struct token_bucket_t *bucket) {
+  if (!bucket->rate || bucket->tokens >= 1000) {
+    return 0;
+  }
+  return (1000 - bucket->tokens + bucket->rate - 1) / bucket->rate;
+}
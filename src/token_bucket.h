@@ -0,0 +1,21 @@
+#ifndef __TOKEN_BUCKET_H
+#define __TOKEN_BUCKET_H
+
+#include "common.h"
+
+// token bucket holding a byte worth of tokens per byte that may be sent, a
+// send may overdraw it and the debt is paid back before the next one
+struct token_bucket_t {
+  uint64_t rate;     // bytes/sec refilled, 0 unlimited
+  uint64_t burst;    // most bytes saved up while idle
+  int64_t tokens;    // thousandths of a byte, negative while in debt
+  uint64_t stamp_ms; // monotonic time of the last refill
+};
+
+void token_bucket_init(struct token_bucket_t *bucket, uint64_t rate,
+                       uint64_t burst, uint64_t now_ms);
+int64_t token_bucket_refill(struct token_bucket_t *bucket, uint64_t now_ms);
+void token_bucket_consume(struct token_bucket_t *bucket, size_t bytes);
+uint64_t token_bucket_delay(const struct token_bucket_t *bucket);
+
+#endif // __TOKEN_BUCKET_H
@@ -0,0 +1,211 @@
+/**
+ * @file uring.c
+ * @author vinay divakar
+ * @brief minimal io_uring ring management on top of the raw system calls
+ * @version 0.1
+ * @date 2024-05-18
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/**
+ * @brief sets up an io_uring instance and maps its rings
+ *
+ * @param[out] ring points to the ring to be initialized
+ * @param[in] entries number of submission queue entries
+ * @return 0 success, <0 error e.g. -ENOSYS if io_uring is not supported
+ */
+int uring_create(struct uring_t *ring, unsigned int entries) {
+  int err = 0;
+  struct io_uring_params params = {};
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  do {
+    err = syscall(__NR_io_uring_setup, entries, &params);
+    if (err < 0) {
+      err = -errno;
+      break;
+    }
+    ring->fd = err;
+    err = 0;
+
+    // waits with a timeout rely on the extended enter arguments
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+      err = -ENOSYS;
+      break;
+    }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        ring->sqes == MAP_FAILED) {
+      err = -errno;
+      break;
+    }
+
+    ring->sq_head = ring->sq_ring + params.sq_off.head;
+    ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+    ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+    ring->sq_array = ring->sq_ring + params.sq_off.array;
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = ring->cq_ring + params.cq_off.head;
+    ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+    ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+    ring->cqes = ring->cq_ring + params.cq_off.cqes;
+  } while (0);
+
+  if (err < 0) {
+    uring_destroy(ring);
+  }
+  return err;
+}
+
+/**
+ * @brief unmaps the rings and closes the io_uring instance
+ *
+ * @param[in] ring points to the ring
+ */
+void uring_destroy(struct uring_t *ring) {
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/**
+ * @brief returns the next free submission queue entry, zeroed
+ *
+ * @param[in] ring points to the ring
+ * @return entry to be prepared, NULL if the queue is full
+ */
+struct io_uring_sqe *uring_sqe_get(struct uring_t *ring) {
+  unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *ring->sq_tail + ring->sq_pending;
+
+  if (tail - head >= ring->sq_entries) {
+    return NULL;
+  }
+
+  unsigned int idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  ring->sq_pending++;
+  return sqe;
+}
+
+/**
+ * @brief returns how many submission queue entries are free
+ *
+ * @param[in] ring points to the ring
+ * @return number of entries uring_sqe_get() can still return
+ */
+unsigned int uring_sq_space(struct uring_t *ring) {
+  unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  return ring->sq_entries - (*ring->sq_tail + ring->sq_pending - head);
+}
+
+/**
+ * @brief submits the prepared entries and optionally waits for completions,
+ * both in a single system call
+ *
+ * @param[in] ring points to the ring
+ * @param[in] wait_nr number of completions to wait for, 0 to not wait
+ * @param[in] timeout milliseconds to wait, -1 to block indefinitely
+ * @return number of entries submitted >=0 success, -ETIME on timeout, <0 error
+ */
+int uring_submit(struct uring_t *ring, unsigned int wait_nr, int timeout) {
+  int err = 0;
+  unsigned int flags = 0, submit = 0;
+  struct __kernel_timespec ts = {.tv_sec = timeout / 1000,
+                                 .tv_nsec = (timeout % 1000) * 1000000L};
+  struct io_uring_getevents_arg arg = {};
+
+  // publish the prepared entries to the kernel, along with the ones a failed
+  // submission left behind
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending,
+                   __ATOMIC_RELEASE);
+  ring->sq_pending = 0;
+  submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (wait_nr) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    arg.ts = timeout >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+  }
+
+  do {
+    err = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr, flags,
+                  wait_nr ? &arg : NULL, sizeof(arg));
+  } while (err < 0 && errno == EINTR && !wait_nr);
+
+  return err < 0 ? -errno : err;
+}
+
+/**
+ * @brief returns the oldest completion without consuming it
+ *
+ * @param[in] ring points to the ring
+ * @return completion, NULL if none are available
+ */
+struct io_uring_cqe *uring_cqe_peek(struct uring_t *ring) {
+  unsigned int head = *ring->cq_head;
+  unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    return NULL;
+  }
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * @brief consumes the completion returned by uring_cqe_peek()
+ *
+ * @param[in] ring points to the ring
+ */
+void uring_cqe_seen(struct uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief registers resources such as files or buffers with the ring
+ *
+ * @param[in] ring points to the ring
+ * @param[in] opcode IORING_REGISTER_* operation
+ * @param[in] arg operation specific argument
+ * @param[in] nr_args number of entries in arg
+ * @return >=0 success, <0 error
+ */
+int uring_register(struct uring_t *ring, unsigned int opcode, const void *arg,
+                   unsigned int nr_args) {
+  int err = syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args);
+  return err < 0 ? -errno : err;
+}
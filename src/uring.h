@@ -0,0 +1,43 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include "common.h"
+
+#include <linux/io_uring.h>
+
+struct uring_t {
+  int fd; // io_uring instance, -1 if not set up
+
+  // submission queue
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int sq_entries;
+  unsigned int sq_pending; // prepared but not yet submitted
+
+  // completion queue
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring; // mappings released on destroy
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+int uring_create(struct uring_t *ring, unsigned int entries);
+void uring_destroy(struct uring_t *ring);
+struct io_uring_sqe *uring_sqe_get(struct uring_t *ring);
+unsigned int uring_sq_space(struct uring_t *ring);
+int uring_submit(struct uring_t *ring, unsigned int wait_nr, int timeout);
+struct io_uring_cqe *uring_cqe_peek(struct uring_t *ring);
+void uring_cqe_seen(struct uring_t *ring);
+int uring_register(struct uring_t *ring, unsigned int opcode, const void *arg,
+                   unsigned int nr_args);
+
+#endif // __URING_H